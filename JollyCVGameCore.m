@@ -29,6 +29,7 @@
 #include "jcv.h"
 #include "jcv_memio.h"
 #include "jcv_mixer.h"
+#include "jcv_stateio.h"
 #include "jcv_vdp.h"
 #include "jcv_z80.h"
 
@@ -41,24 +42,29 @@
 #define CHANNELS 1
 #define NUMINPUTS 2
 
+static void jcv_audio_out(void *udata, size_t samples);
+static void jcv_state_written(void *udata, int ok);
+
 @interface JollyCVGameCore () <OEColecoVisionSystemResponderClient>
 {
-    NSData *_romData;
     uint8_t _padData[NUMINPUTS][OEColecoVisionButtonCount];
+    uint16_t _padState[NUMINPUTS];
     int16_t *_soundBuffer;
+    jcv_ctx_t *_jcv;
+    jcv_stateio_t *_stateio;
 }
 @end
 
 @implementation JollyCVGameCore
 
-static __weak JollyCVGameCore *_current;
-
 - (id)init
 {
 	if ((self = [super init]))
 	{
-        _current = self;
         _soundBuffer = (int16_t*)calloc(6400, sizeof(int16_t));
+        _jcv = jcv_ctx_create();
+        jcv_ctx_set_userdata(_jcv, (__bridge void *)self);
+        _stateio = jcv_stateio_create();
 	}
 
 	return self;
@@ -66,7 +72,9 @@ static __weak JollyCVGameCore *_current;
 
 - (void)dealloc
 {
-    jcv_deinit();
+    jcv_stateio_destroy(_stateio); // Finishes writing any queued states
+    jcv_deinit(_jcv);
+    jcv_ctx_destroy(_jcv);
     free(_soundBuffer);
 }
 
@@ -75,28 +83,25 @@ static __weak JollyCVGameCore *_current;
 - (BOOL)loadFileAtPath:(NSString *)path error:(NSError **)error
 {
     memset(_padData, 0, sizeof(_padData));
+    _padState[0] = _padState[1] = CV_INPUT_IDLE;
 
     // Set up JollyCV. yes, yes... jolly good!
-    jcv_input_set_callback(&jcv_input_poll);
-    jcv_mixer_set_callback(&jcv_audio_out);
-    jcv_mixer_set_rate(SAMPLERATE);
-    jcv_mixer_set_buffer(_soundBuffer);
-    jcv_mixer_set_rsqual(3);
-    jcv_vdp_set_palette(0); // 0 = TeaTime, 1 = SYoung
-    jcv_set_region(REGION_NTSC);
-    jcv_init();
+    jcv_input_set_mode(_jcv, INPUT_LATCHED);
+    jcv_mixer_set_callback(_jcv, &jcv_audio_out);
+    jcv_mixer_set_rate(_jcv, SAMPLERATE);
+    jcv_mixer_set_buffer(_jcv, _soundBuffer);
+    jcv_mixer_set_rsqual(_jcv, 3);
+    jcv_vdp_set_palette(_jcv, 0); // 0 = TeaTime, 1 = SYoung
+    jcv_set_region(_jcv, REGION_NTSC);
+    jcv_init(_jcv);
 
     // Load BIOS
     NSString *biosPath = [self.biosDirectoryPath stringByAppendingPathComponent:@"coleco.rom"];
-    if (!jcv_bios_load_file(biosPath.fileSystemRepresentation))
+    if (!jcv_bios_load_file(_jcv, biosPath.fileSystemRepresentation))
         return NO;
 
-    // Load ROM
-    _romData = [[NSData dataWithContentsOfFile:path] copy];
-    if (_romData == nil)
-        return NO;
-
-    if (!jcv_rom_load((void *)_romData.bytes, _romData.length)) {
+    // Load ROM - mapped read-only and shared with other instances
+    if (!jcv_rom_load_file(_jcv, path.fileSystemRepresentation)) {
         if (error) {
             *error = [NSError errorWithDomain:OEGameCoreErrorDomain code:OEGameCoreCouldNotLoadROMError userInfo:nil];
         }
@@ -108,12 +113,15 @@ static __weak JollyCVGameCore *_current;
 
 - (void)executeFrame
 {
-    jcv_exec();
+    // Input is pushed once per frame rather than polled on every strobe
+    for (int i = 0; i < NUMINPUTS; ++i)
+        jcv_input_set_state(_jcv, i, _padState[i]);
+    jcv_exec(_jcv);
 }
 
 - (void)resetEmulation
 {
-    jcv_reset(0);
+    jcv_reset(_jcv, 0);
 }
 
 #pragma mark - Video
@@ -137,7 +145,7 @@ static __weak JollyCVGameCore *_current;
 
 - (const void *)getVideoBufferWithHint:(void *)hint
 {
-    jcv_vdp_set_buffer((uint32_t *)hint);
+    jcv_vdp_set_buffer(_jcv, (uint32_t *)hint);
     return hint;
 }
 
@@ -172,11 +180,10 @@ static __weak JollyCVGameCore *_current;
 
 - (NSData *)serializeStateWithError:(NSError **)outError
 {
-    const void *bytes = jcv_state_save_raw();
-    size_t length = jcv_state_size();
+    NSMutableData *data = [NSMutableData dataWithLength:jcv_state_size()];
 
-    if(length)
-        return [NSData dataWithBytes:bytes length:length];
+    if(data && jcv_state_save_mem(_jcv, data.mutableBytes, data.length))
+        return data;
 
     if(outError) {
         *outError = [NSError errorWithDomain:OEGameCoreErrorDomain code:OEGameCoreCouldNotSaveStateError  userInfo:@{
@@ -193,11 +200,9 @@ static __weak JollyCVGameCore *_current;
     const void *bytes = state.bytes;
     size_t length = state.length;
 
-    jcv_state_load_raw(bytes);
-
     size_t serialSize = jcv_state_size();
 
-    if(serialSize != length)
+    if(!jcv_state_load_mem(_jcv, bytes, length))
     {
         if (outError) {
             *outError = [NSError errorWithDomain:OEGameCoreErrorDomain code:OEGameCoreStateHasWrongSizeError  userInfo:@{
@@ -213,12 +218,31 @@ static __weak JollyCVGameCore *_current;
 
 - (void)saveStateToFileAtPath:(NSString *)fileName completionHandler:(void (^)(BOOL, NSError *))block
 {
-    block(jcv_state_save(fileName.fileSystemRepresentation) ? YES : NO, nil);
+    // Snapshot now, and write the file and call the block on the writer thread
+    void *udata = (__bridge_retained void *)[block copy];
+    if (_stateio && jcv_stateio_save(_stateio, _jcv, fileName.fileSystemRepresentation, &jcv_state_written, udata))
+        return;
+
+    /* Both state buffers are still queued, so save synchronously once they
+       have been written, as they may be going to the same file
+    */
+    (void)(__bridge_transfer id)udata;
+    if (_stateio)
+        jcv_stateio_wait(_stateio);
+    block(jcv_state_save(_jcv, fileName.fileSystemRepresentation) ? YES : NO, nil);
 }
 
 - (void)loadStateFromFileAtPath:(NSString *)fileName completionHandler:(void (^)(BOOL, NSError *))block
 {
-    block(jcv_state_load(fileName.fileSystemRepresentation) ? YES : NO, nil);
+    const char *path = fileName.fileSystemRepresentation;
+    int ok = _stateio ? jcv_stateio_load(_stateio, _jcv, path) : jcv_state_load(_jcv, path);
+    block(ok ? YES : NO, nil);
+}
+
+static void jcv_state_written(void *udata, int ok)
+{
+    void (^block)(BOOL, NSError *) = (__bridge_transfer void (^)(BOOL, NSError *))udata;
+    block(ok ? YES : NO, nil);
 }
 
 #pragma mark - Input
@@ -230,34 +254,36 @@ static uint16_t cv_input_map[] = {
     CV_INPUT_7, CV_INPUT_8, CV_INPUT_9, CV_INPUT_0, CV_INPUT_STR, CV_INPUT_PND
 };
 
+// Pack the buttons held on a port into the state pushed to the core
+- (void)updatePadState:(NSUInteger)port
+{
+    uint16_t b = CV_INPUT_IDLE; // Always preset bit 7 for both segments
+
+    for (int i = 0; i < OEColecoVisionButtonCount; ++i)
+        if (_padData[port][i]) b |= cv_input_map[i];
+
+    _padState[port] = b;
+}
+
 - (oneway void)didPushColecoVisionButton:(OEColecoVisionButton)button forPlayer:(NSUInteger)player;
 {
     _padData[player-1][button] = 1;
+    [self updatePadState:player-1];
 }
 
 - (oneway void)didReleaseColecoVisionButton:(OEColecoVisionButton)button forPlayer:(NSUInteger)player;
 {
     _padData[player-1][button] = 0;
+    [self updatePadState:player-1];
 }
 
 #pragma mark - JollyCV callbacks
 
-void jcv_audio_out(size_t samples)
+static void jcv_audio_out(void *udata, size_t samples)
 {
-    GET_CURRENT_OR_RETURN();
+    JollyCVGameCore *current = (__bridge JollyCVGameCore *)udata;
     id<OEAudioBuffer> buf = [current audioBufferAtIndex:0];
     [buf write:current->_soundBuffer maxLength:samples * sizeof(int16_t)];
 }
 
-uint16_t jcv_input_poll(int port)
-{
-    uint16_t b = 0x8080; // Always preset bit 7 for both segments
-
-    GET_CURRENT_OR_RETURN(b);
-    for (int i = 0; i < OEColecoVisionButtonCount; ++i)
-        if (current->_padData[port][i]) b |= cv_input_map[i];
-
-    return b;
-}
-
 @end
@@ -0,0 +1,95 @@
+#!/bin/sh
+# Run the benchmark ROMs and compare the results against recorded ones.
+#
+# Usage: compare.sh [-u|-h] <hashes> <speed> <frames> <runs> <tol> <bios> rom...
+#
+# Each ROM is run the given number of times and the fastest run is kept. A ROM
+# fails if its output hashes differ from those recorded in <hashes> for the
+# same number of frames (behaviour changed). Speed depends on the machine, so
+# it is only compared if a <speed> baseline recorded on this machine exists,
+# and a ROM then also fails if it is more than <tol> percent slower. With -u
+# the speed baseline is written instead, and with -h the hashes are.
+
+mode=compare
+if [ "$1" = "-u" ]; then
+    mode=baseline
+    shift
+elif [ "$1" = "-h" ]; then
+    mode=hashes
+    shift
+fi
+
+if [ $# -lt 7 ]; then
+    sed -n '4p' "$0" | sed 's/^# //' >&2
+    exit 1
+fi
+
+hashes=$1 baseline=$2 frames=$3 runs=$4 tolerance=$5 bios=$6
+shift 6
+
+bench=$(dirname "$0")/jcv_bench
+results=$(mktemp)
+trap 'rm -f "$results"' EXIT
+
+for rom in "$@"; do
+    i=0
+    while [ $i -lt "$runs" ]; do
+        "$bench" -b "$bios" -f "$frames" "$rom" | grep -v '^#' || exit 1
+        i=$((i + 1))
+    done | sort -k3 -n -r | head -n 1 >> "$results"
+done
+
+if [ $mode = baseline ]; then
+    cp "$results" "$baseline"
+    cat "$baseline"
+    echo "Baseline written to $baseline"
+    exit 0
+fi
+
+if [ $mode = hashes ]; then
+    awk '{ print $1, $2, $5, $6 }' "$results" > "$hashes"
+    cat "$hashes"
+    echo "Hashes written to $hashes"
+    exit 0
+fi
+
+# A missing recording is compared against nothing rather than failing
+hashfile=$hashes basefile=$baseline
+if [ ! -f "$hashes" ]; then
+    echo "No output hashes recorded in $hashes"
+    hashfile=/dev/null
+fi
+if [ ! -f "$baseline" ]; then
+    echo "No speed baseline recorded in $baseline, only comparing hashes"
+    basefile=/dev/null
+fi
+
+awk -v tol="$tolerance" '
+    FILENAME == ARGV[1] { video[$1, $2] = $3; audio[$1, $2] = $4; next }
+    FILENAME == ARGV[2] { fps[$1, $2] = $3; next }
+    {
+        key = $1 SUBSEP $2
+        status = "ok"
+        if (!(key in video)) {
+            status = "(no hashes)"
+        }
+        else if ($5 != video[key] || $6 != audio[key]) {
+            status = "CHANGED"
+            fail = 1
+        }
+
+        if (!(key in fps)) {
+            printf "%-12s %10.1f fps  %28s  %s\n", $1, $3, "", status
+            next
+        }
+
+        delta = 100.0 * ($3 - fps[key]) / fps[key]
+        if (status != "CHANGED" && delta < -tol) {
+            status = "SLOWER"
+            fail = 1
+        }
+        printf "%-12s %10.1f fps  baseline %10.1f  %+6.1f%%  %s\n",
+            $1, $3, fps[key], delta, status
+    }
+    END { exit fail }
+' "$hashfile" "$basefile" "$results"
@@ -0,0 +1,358 @@
+/*
+Copyright (c) 2020-2022 Rupert Carmichael
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Headless Benchmark Driver
+   Loads a BIOS and one or more ROMs, runs each for a number of frames with
+   scripted input and no frontend, and reports the throughput. A hash of the
+   final frame and of all audio output is printed alongside, so compare.sh can
+   tell a speed regression from a change in behaviour. When the core is built
+   with JCV_STATS, the time per frame is also broken down by subsystem.
+
+   Input scripts hold one line per change of input state: a frame number
+   followed by the state of each controller port, in hexadecimal as returned
+   by an input callback (8080 is no buttons pressed). Lines starting with # are
+   ignored. The state in effect holds until the next line.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "jcv.h"
+#include "jcv_memio.h"
+#include "jcv_mixer.h"
+#include "jcv_stats.h"
+#include "jcv_vdp.h"
+
+#define SIZE_SCRIPT 4096 // Maximum number of lines in an input script
+#define FNV_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+typedef struct _bench_input_t {
+    unsigned long frame; // Frame at which this state takes effect
+    uint16_t port[2]; // Input state for each port
+} bench_input_t;
+
+static bench_input_t script[SIZE_SCRIPT];
+static size_t scriptlen = 0;
+static size_t scriptpos = 0;
+static unsigned long frame = 0;
+
+static uint32_t vbuf[CV_VDP_WIDTH_OVERSCAN * CV_VDP_HEIGHT_OVERSCAN];
+static int16_t abuf[4096];
+static uint64_t ahash = FNV_BASIS;
+static size_t asamps = 0;
+
+static const char *unitnames[STATS_UNITS] = {
+    "z80", "vdp", "psg", "sgmpsg", "mixer"
+};
+
+static const char *regionnames[STATS_MEM_REGIONS] = {
+    "bios", "ram", "sgm", "cart", "open"
+};
+
+static uint64_t bench_fnv(uint64_t h, const void *data, size_t len) {
+    const uint8_t *b = (const uint8_t*)data;
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ b[i]) * FNV_PRIME;
+    return h;
+}
+
+static uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_audio(void *udata, size_t samps) {
+    (void)udata;
+    ahash = bench_fnv(ahash, abuf, samps * sizeof(int16_t));
+    asamps += samps;
+}
+
+static uint16_t bench_input(void *udata, int port) {
+    (void)udata;
+    while (scriptpos + 1 < scriptlen && script[scriptpos + 1].frame <= frame)
+        ++scriptpos;
+
+    if (scriptlen == 0 || script[scriptpos].frame > frame)
+        return 0x8080;
+
+    return script[scriptpos].port[port];
+}
+
+static int bench_load_script(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return 0;
+
+    char line[256];
+    while (fgets(line, sizeof(line), file) && scriptlen < SIZE_SCRIPT) {
+        unsigned long f;
+        unsigned p0, p1;
+        if (line[0] == '#' || sscanf(line, "%lu %x %x", &f, &p0, &p1) != 3)
+            continue;
+
+        script[scriptlen].frame = f;
+        script[scriptlen].port[0] = p0;
+        script[scriptlen].port[1] = p1;
+        ++scriptlen;
+    }
+
+    fclose(file);
+    return 1;
+}
+
+static void* bench_load_file(const char *path, size_t *size) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+
+    fseek(file, 0, SEEK_END);
+    long len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    void *data = len > 0 ? malloc(len) : NULL;
+    if (data == NULL || fread(data, len, 1, file) != 1) {
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+
+    fclose(file);
+    *size = len;
+    return data;
+}
+
+// Print the statistics gathered by the core, as averages per frame
+static void bench_stats(jcv_ctx_t *ctx) {
+    static cv_stats_t stats;
+    jcv_stats_get(ctx, &stats);
+
+    if (stats.frames == 0)
+        return;
+
+    double frames = stats.frames;
+    uint64_t total = 0;
+    for (size_t i = 0; i < STATS_UNITS; ++i)
+        total += stats.time[i];
+
+    for (size_t i = 0; i < STATS_UNITS; ++i) {
+        printf("#   %-8s %10.0f ns/frame %5.1f%%\n", unitnames[i],
+            stats.time[i] / frames,
+            total ? 100.0 * stats.time[i] / total : 0.0);
+    }
+
+    printf("#   insns    %10.0f /frame\n", stats.insns / frames);
+    printf("#   cycles   %10.1f /line (%u-%u)\n",
+        stats.lines ? (double)stats.linecycs / stats.lines : 0.0,
+        stats.linecycs_min, stats.linecycs_max);
+
+    printf("#   reads   ");
+    for (size_t i = 0; i < STATS_MEM_REGIONS; ++i)
+        printf(" %s %.0f", regionnames[i], stats.memrd[i] / frames);
+    printf(" /frame\n");
+
+    printf("#   vram     %10.0f writes/frame\n", stats.vramwr / frames);
+
+    printf("#   ports   ");
+    for (size_t i = 0; i < 256; ++i) {
+        if (stats.iord[i])
+            printf(" in %02zx %.1f", i, stats.iord[i] / frames);
+        if (stats.iowr[i])
+            printf(" out %02zx %.1f", i, stats.iowr[i] / frames);
+    }
+    printf(" /frame\n");
+}
+
+/* Check that querying the state hash leaves the last raw snapshot intact, and
+   that loading the snapshot back reproduces the same hash
+*/
+static int bench_check_state(jcv_ctx_t *ctx) {
+    static uint8_t snap[SIZE_STATE];
+    const void *raw = jcv_state_save_raw(ctx);
+    memcpy(snap, raw, SIZE_STATE);
+
+    uint64_t h = jcv_state_hash(ctx);
+    if (memcmp(raw, snap, SIZE_STATE)) {
+        fprintf(stderr, "State hash modified the raw snapshot\n");
+        return 0;
+    }
+
+    if (!jcv_state_load_mem(ctx, snap, SIZE_STATE) ||
+        jcv_state_hash(ctx) != h) {
+        fprintf(stderr, "State did not survive a save and load\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+static void bench_usage(void) {
+    fprintf(stderr,
+        "Usage: jcv_bench [options] rom...\n"
+        "  -b file   BIOS (default: roms/bios.rom)\n"
+        "  -f n      Frames to run (default: 3600)\n"
+        "  -w n      Frames to run before timing starts (default: 60)\n"
+        "  -i file   Input script\n"
+        "  -p        PAL\n"
+        "  -a n      Resampler: 0 Speex, 1 box, 2 band-limited steps\n"
+        "  -s        Skip drawing (jcv_exec_noframe)\n"
+        "  -v n      Video format: 0 ARGB8888, 1 RGB565, 2 INDEX8, 3 INDEX4\n"
+        "  -t        Draw on a worker thread\n");
+}
+
+static int bench_run(const char *rompath, const void *bios, size_t biossize,
+    unsigned long frames, unsigned long warmup, int region, int resampler,
+    int noframe, int fmt, int threaded) {
+    size_t romsize = 0;
+    void *rom = bench_load_file(rompath, &romsize);
+    if (rom == NULL) {
+        fprintf(stderr, "Failed to load ROM: %s\n", rompath);
+        return 0;
+    }
+
+    jcv_ctx_t *ctx = jcv_ctx_create();
+    jcv_input_set_callback(ctx, bench_input);
+    jcv_mixer_set_callback(ctx, bench_audio);
+    jcv_mixer_set_buffer(ctx, abuf);
+    jcv_mixer_set_resampler(ctx, resampler);
+    jcv_set_region(ctx, region);
+    jcv_set_seed(ctx, 0); // Runs must be reproducible to compare hashes
+    jcv_init(ctx);
+    jcv_vdp_set_buffer(ctx, vbuf);
+    jcv_vdp_set_format(ctx, fmt);
+    jcv_vdp_set_threaded(ctx, threaded);
+    jcv_bios_load(ctx, (void*)bios, biossize);
+
+    if (!jcv_rom_load(ctx, rom, romsize)) {
+        fprintf(stderr, "Failed to load ROM: %s\n", rompath);
+        jcv_deinit(ctx);
+        jcv_ctx_destroy(ctx);
+        free(rom);
+        return 0;
+    }
+
+    memset(vbuf, 0, sizeof(vbuf));
+    ahash = FNV_BASIS;
+    asamps = 0;
+    scriptpos = 0;
+
+    for (frame = 0; frame < warmup; ++frame)
+        noframe ? jcv_exec_noframe(ctx) : jcv_exec(ctx);
+
+    jcv_stats_reset(ctx);
+    uint64_t start = bench_now();
+
+    for (; frame < warmup + frames; ++frame)
+        noframe ? jcv_exec_noframe(ctx) : jcv_exec(ctx);
+
+    uint64_t elapsed = bench_now() - start;
+    double nsframe = (double)elapsed / frames;
+
+    const char *name = strrchr(rompath, '/');
+    name = name ? name + 1 : rompath;
+
+    printf("%-12s %8lu %10.1f %10.0f %016llx %016llx\n", name, frames,
+        1e9 / nsframe, nsframe,
+        (unsigned long long)bench_fnv(FNV_BASIS, vbuf,
+            jcv_vdp_get_pitch(ctx) * CV_VDP_HEIGHT_OVERSCAN),
+        (unsigned long long)ahash);
+
+    bench_stats(ctx);
+    int ok = bench_check_state(ctx);
+
+    jcv_deinit(ctx);
+    jcv_ctx_destroy(ctx);
+    free(rom);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    const char *biospath = "roms/bios.rom";
+    unsigned long frames = 3600;
+    unsigned long warmup = 60;
+    int region = REGION_NTSC;
+    int resampler = RESAMPLER_SPEEX;
+    int noframe = 0;
+    int fmt = CV_VDP_FMT_ARGB8888;
+    int threaded = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:f:w:i:pa:sv:th")) != -1) {
+        switch (opt) {
+            case 'b': biospath = optarg; break;
+            case 'f': frames = strtoul(optarg, NULL, 0); break;
+            case 'w': warmup = strtoul(optarg, NULL, 0); break;
+            case 'i': {
+                if (!bench_load_script(optarg)) {
+                    fprintf(stderr, "Failed to load script: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 'p': region = REGION_PAL; break;
+            case 'a': resampler = atoi(optarg); break;
+            case 's': noframe = 1; break;
+            case 'v': fmt = atoi(optarg); break;
+            case 't': threaded = 1; break;
+            default: bench_usage(); return 1;
+        }
+    }
+
+    if (optind >= argc || frames == 0) {
+        bench_usage();
+        return 1;
+    }
+
+    size_t biossize = 0;
+    void *bios = bench_load_file(biospath, &biossize);
+    if (bios == NULL) {
+        fprintf(stderr, "Failed to load BIOS: %s\n", biospath);
+        return 1;
+    }
+
+    printf("# %-10s %8s %10s %10s %-16s %-16s\n", "rom", "frames", "fps",
+        "ns/frame", "video", "audio");
+
+    int ret = 0;
+    for (int i = optind; i < argc; ++i) {
+        if (!bench_run(argv[i], bios, biossize, frames, warmup, region,
+            resampler, noframe, fmt, threaded)) {
+            ret = 1;
+        }
+    }
+
+    free(bios);
+    return ret;
+}
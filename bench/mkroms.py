@@ -0,0 +1,327 @@
+#!/usr/bin/env python3
+"""Generate the benchmark ROMs and a stub BIOS.
+
+The test programs are assembled here by hand, so no assembler is needed and
+no copyrighted software is involved. They are released into the public
+domain. Each one runs off the VDP interrupt and, every frame, cycles through
+the four screen modes, moves 32 sprites, rewrites part of the name table and
+updates both the SN76489 and the AY-3-8910 (including a burst of fast volume
+writes, as used for PCM playback). In between, the main loop polls the
+controllers and then spins in a busy-wait, as many real games do.
+
+  sgm.rom   32K cartridge which enables the Super Game Module RAM
+  mega.rom  128K Mega Cart which reads a different bank every frame
+  vram.rom  As sgm.rom, with extra VRAM traffic and table moves per frame
+  bios.rom  Stub BIOS: starts the cartridge and forwards the NMI to it
+
+Usage: mkroms.py <output directory>
+"""
+
+import os
+import struct
+import sys
+
+class Asm:
+    def __init__(self, org):
+        self.org = org
+        self.b = bytearray()
+        self.labels = {}
+        self.fixups = []
+
+    def pc(self):
+        return self.org + len(self.b)
+
+    def label(self, name):
+        self.labels[name] = self.pc()
+
+    def emit(self, *bs):
+        self.b.extend(bs)
+
+    def word(self, v):
+        self.b.extend(struct.pack('<H', v))
+
+    # Instruction with a 16-bit label operand
+    def ref16(self, op, name):
+        self.emit(*op)
+        self.fixups.append((len(self.b), name, 'abs'))
+        self.word(0)
+
+    # Relative jump to a label
+    def jr(self, op, name):
+        self.emit(op)
+        self.fixups.append((len(self.b), name, 'rel'))
+        self.emit(0)
+
+    def assemble(self):
+        for off, name, kind in self.fixups:
+            target = self.labels[name]
+            if kind == 'abs':
+                self.b[off:off + 2] = struct.pack('<H', target)
+            else:
+                d = target - (self.org + off + 1)
+                assert -128 <= d < 128, (name, d)
+                self.b[off] = d & 0xff
+        return bytes(self.b)
+
+def vdpreg(a, r, v):  # ld a,v; out (0xbf),a; ld a,0x80|r; out (0xbf),a
+    a.emit(0x3e, v, 0xd3, 0xbf, 0x3e, 0x80 | r, 0xd3, 0xbf)
+
+def vdpaddr_w(a, addr):  # Set the VRAM write address
+    a.emit(0x3e, addr & 0xff, 0xd3, 0xbf, 0x3e, 0x40 | (addr >> 8), 0xd3, 0xbf)
+
+def psg(a, v):  # ld a,v; out (0xff),a
+    a.emit(0x3e, v, 0xd3, 0xff)
+
+def ay(a, r, v):  # Select AY register r and write v
+    a.emit(0x3e, r, 0xd3, 0x50, 0x3e, v, 0xd3, 0x51)
+
+FC = 0x7000  # Frame counter and scratch variables (in SGM RAM)
+
+def program(mega, vram):
+    a = Asm(0x8000)
+
+    # Cartridge header: test pattern, start address, RST and NMI vectors
+    a.emit(0x55, 0xaa)
+    a.b.extend(b'\0' * 8)
+    a.ref16((), 'init')
+    for i in range(7):
+        a.emit(0xc9, 0x00, 0x00)  # RST 8-38: ret
+    a.ref16((0xc3,), 'nmi')
+
+    a.label('init')
+    a.emit(0x3e, 0x0f, 0xd3, 0x7f)  # SGM lower RAM off
+    a.emit(0xd3, 0x53)  # SGM upper RAM on
+    a.emit(0xaf, 0x32)  # Clear the frame counter
+    a.word(FC)
+    for r, v in [(0, 0x02), (1, 0x82), (2, 0x0e), (3, 0xff), (4, 0x03),
+        (5, 0x76), (6, 0x03), (7, 0xf4)]:
+        vdpreg(a, r, v)
+
+    # Fill all 16K of VRAM with pseudo-random data
+    vdpaddr_w(a, 0)
+    a.emit(0x21, 0x00, 0x40)  # ld hl,0x4000
+    a.emit(0x3e, 0x11)  # ld a,0x11
+    a.label('fill')
+    a.emit(0x47, 0x87, 0x87, 0x80, 0xc6, 0x3b)  # a = a * 5 + 0x3b
+    a.emit(0x4f, 0xad)  # ld c,a; xor l
+    a.emit(0xd3, 0xbe)  # out (0xbe),a
+    a.emit(0x79)  # ld a,c
+    a.emit(0x2b, 0x5f, 0x7c, 0xb5, 0x7b)  # dec hl; test hl for zero
+    a.jr(0x20, 'fill')
+
+    # Initial sound chip state
+    for v in [0x8e, 0x0f, 0x90, 0xa5, 0x0a, 0xb2, 0xcf, 0x3f, 0xd4, 0xe5,
+        0xf6]:
+        psg(a, v)
+    for r, v in [(0, 0x40), (1, 0x01), (2, 0x90), (3, 0x00), (4, 0x33),
+        (5, 0x02), (6, 0x0f), (7, 0x38), (8, 0x0c), (9, 0x10), (10, 0x08),
+        (11, 0x40), (12, 0x00), (13, 0x0e)]:
+        ay(a, r, v)
+
+    # Map SGM RAM over the BIOS, and point its NMI vector at the handler
+    a.emit(0x3e, 0x0d, 0xd3, 0x7f)
+    a.emit(0x3e, 0xc3, 0x32, 0x66, 0x00)
+    a.ref16((0x21,), 'nmi')
+    a.emit(0x22, 0x67, 0x00)
+    vdpreg(a, 1, 0xe2)  # Enable the VDP interrupt
+
+    a.label('main')
+    a.emit(0x76)  # halt
+    a.emit(0x3a)  # Every fourth loop, fall through to the busy section
+    a.word(FC + 1)
+    a.emit(0x3c, 0x32)
+    a.word(FC + 1)
+    a.emit(0xe6, 0x03)
+    a.jr(0x20, 'main')
+
+    # Poll the controllers and the AY for a while
+    a.emit(0x06, 0x40)  # ld b,0x40
+    a.label('poll')
+    a.emit(0xd3, 0x80, 0xdb, 0xfc, 0x32)
+    a.word(FC + 2)
+    a.emit(0xd3, 0xc0, 0xdb, 0xff, 0x32)
+    a.word(FC + 3)
+    a.emit(0xdb, 0x52, 0x32)
+    a.word(FC + 4)
+    a.jr(0x10, 'poll')  # djnz
+
+    # Busy-wait until the frame counter changes
+    a.emit(0x3a)
+    a.word(FC)
+    a.emit(0x4f)  # ld c,a
+    a.label('spin')
+    a.emit(0x3a)
+    a.word(FC)
+    a.emit(0xb9)  # cp c
+    a.jr(0x28, 'spin')
+    a.ref16((0xc3,), 'main')
+
+    # NMI handler, run once per frame
+    a.label('nmi')
+    a.emit(0xf5, 0xc5, 0xd5, 0xe5)  # Save registers
+    a.emit(0xdb, 0xbf, 0x32)  # Read the VDP status
+    a.word(FC + 5)
+    a.emit(0x3a)  # Increment the frame counter, keeping it in d
+    a.word(FC)
+    a.emit(0x3c, 0x32)
+    a.word(FC)
+    a.emit(0x57)
+
+    # Select the screen mode from bits 6 and 7 of the frame counter
+    a.emit(0x07, 0x07, 0xe6, 0x03, 0x5f)
+    a.emit(0xfe, 0x00)
+    a.jr(0x20, 'm1')
+    vdpreg(a, 0, 0x02)  # Graphics II
+    a.emit(0x7a, 0xe6, 0x03, 0xf6, 0xe0, 0xd3, 0xbf, 0x3e, 0x81, 0xd3, 0xbf)
+    a.ref16((0xc3,), 'mdone')
+    a.label('m1')
+    a.emit(0xfe, 0x01)
+    a.jr(0x20, 'm2')
+    vdpreg(a, 0, 0x00)  # Graphics I
+    vdpreg(a, 1, 0xe1)
+    vdpreg(a, 3, 0x80)
+    vdpreg(a, 4, 0x00)
+    a.ref16((0xc3,), 'mdone')
+    a.label('m2')
+    a.emit(0xfe, 0x02)
+    a.jr(0x20, 'm3')
+    vdpreg(a, 0, 0x00)  # Text
+    vdpreg(a, 1, 0xf0)
+    a.ref16((0xc3,), 'mdone')
+    a.label('m3')
+    vdpreg(a, 0, 0x00)  # Multicolour
+    vdpreg(a, 1, 0xeb)
+    a.label('mdone')
+
+    # Restore (or move) the Graphics II tables
+    a.emit(0x7b, 0xb7)
+    a.jr(0x20, 'notg2')
+    if vram:
+        a.emit(0x7a, 0xf6, 0x9f, 0xd3, 0xbf, 0x3e, 0x83, 0xd3, 0xbf)
+        a.emit(0x7a, 0x0f, 0x0f, 0x0f, 0xe6, 0x07, 0xd3, 0xbf, 0x3e, 0x84,
+            0xd3, 0xbf)
+    else:
+        vdpreg(a, 3, 0xff)
+        vdpreg(a, 4, 0x03)
+    a.label('notg2')
+
+    # Blank the display for two frames out of every 64
+    a.emit(0x7a, 0xe6, 0x3e, 0xfe, 0x20)
+    a.jr(0x20, 'noblank')
+    vdpreg(a, 1, 0xa2)
+    a.label('noblank')
+
+    # Change the backdrop colour
+    a.emit(0x7a, 0x0f, 0x0f, 0xe6, 0x0f, 0xf6, 0xf0, 0xd3, 0xbf, 0x3e, 0x87,
+        0xd3, 0xbf)
+
+    # Move 32 sprites, some with the early clock bit set
+    vdpaddr_w(a, 0x3b00)
+    a.emit(0x06, 0x20)  # ld b,32
+    a.emit(0x4a)  # ld c,d
+    a.label('sat')
+    a.emit(0x79, 0x80, 0xc6, 0x05, 0x4f)  # c = c + b + 5
+    a.emit(0xfe, 0xd0)  # Avoid the terminator (208)
+    a.jr(0x20, 'y_ok')
+    a.emit(0x3c)
+    a.label('y_ok')
+    a.emit(0xfe, 0xc0)  # Keep most sprites on screen
+    a.jr(0x38, 'y_ok2')
+    a.emit(0xe6, 0x7f)
+    a.label('y_ok2')
+    a.emit(0xd3, 0xbe)  # Y
+    a.emit(0x78, 0x87, 0x87, 0x82, 0xd3, 0xbe)  # X = b * 4 + d
+    a.emit(0x78, 0x87, 0x87, 0xd3, 0xbe)  # Name
+    a.emit(0x78, 0xe6, 0x0f)  # Colour
+    a.emit(0xcb, 0x40)  # bit 0,b
+    a.jr(0x28, 'noec')
+    a.emit(0xf6, 0x80)
+    a.label('noec')
+    a.emit(0xd3, 0xbe)
+    a.jr(0x10, 'sat')
+
+    # Rewrite 256 bytes of the name table
+    a.emit(0x7a, 0xe6, 0x01, 0xf6, 0x78, 0x47)
+    a.emit(0x3e, 0x00, 0xd3, 0xbf, 0x78, 0xd3, 0xbf)
+    a.emit(0x06, 0x00, 0x7a)
+    a.label('nt')
+    a.emit(0xd3, 0xbe, 0x3c)
+    a.jr(0x10, 'nt')
+    if vram:  # Write 64 more bytes to a different area each frame
+        a.emit(0x7a, 0xd3, 0xbf, 0x7a, 0x0f, 0xe6, 0x3f, 0xf6, 0x40, 0xd3,
+            0xbf)
+        a.emit(0x06, 0x40)
+        a.label('vw')
+        a.emit(0x7a, 0xa8, 0xd3, 0xbe)
+        a.jr(0x10, 'vw')
+
+    # SN76489: tone, volume and noise changes
+    a.emit(0x7a, 0xe6, 0x0f, 0xf6, 0x80, 0xd3, 0xff)
+    a.emit(0x7a, 0x0f, 0x0f, 0xe6, 0x3f, 0xd3, 0xff)
+    a.emit(0x7a, 0xe6, 0x0f, 0xf6, 0xb0, 0xd3, 0xff)
+    a.emit(0x7a, 0xe6, 0x07)
+    a.jr(0x20, 'nonoise')
+    a.emit(0x7a, 0x0f, 0x0f, 0x0f, 0xe6, 0x07, 0xf6, 0xe0, 0xd3, 0xff)
+    a.label('nonoise')
+
+    # SN76489: PCM style playback through fast volume changes
+    psg(a, 0xc1)
+    psg(a, 0x00)
+    a.emit(0x06, 0x10)
+    a.label('pcm')
+    a.emit(0x78, 0xe6, 0x0f, 0xf6, 0xd0, 0xd3, 0xff)
+    a.jr(0x10, 'pcm')
+    psg(a, 0xdf)
+
+    # AY-3-8910: tone, mixer and envelope changes
+    a.emit(0x3e, 0x00, 0xd3, 0x50, 0x7a, 0xd3, 0x51)
+    a.emit(0x3e, 0x07, 0xd3, 0x50, 0x7a, 0x0f, 0x0f, 0xd3, 0x51)
+    a.emit(0x3e, 0x02, 0xd3, 0x50, 0x7a, 0x2f, 0xd3, 0x51)
+    a.emit(0x7a, 0xe6, 0x0f)
+    a.jr(0x20, 'noenv')
+    a.emit(0x3e, 0x0d, 0xd3, 0x50, 0x7a, 0x0f, 0x0f, 0x0f, 0x0f, 0xd3, 0x51)
+    a.label('noenv')
+
+    if mega:  # Switch banks through the 0xffc0 hotspots
+        a.emit(0x7a, 0xe6, 0x03, 0x6f, 0x26, 0xff, 0x2e, 0xc0, 0xb5, 0x6f,
+            0x7e)
+    a.emit(0x2a, 0x00, 0xc0, 0x22)  # Read banked data
+    a.word(FC + 6)
+
+    a.emit(0xe1, 0xd1, 0xc1, 0xf1)  # Restore registers
+    a.emit(0xed, 0x45)  # retn
+    return a.assemble()
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit('Usage: mkroms.py <output directory>')
+
+    out = sys.argv[1]
+    os.makedirs(out, exist_ok=True)
+
+    def write(name, data):
+        with open(os.path.join(out, name), 'wb') as f:
+            f.write(data)
+
+    # di; ld sp,0x7400; ld hl,(0x800a); jp (hl) - and NMI to 0x8021
+    bios = bytearray(0x2000)
+    bios[0:8] = bytes([0xf3, 0x31, 0x00, 0x74, 0x2a, 0x0a, 0x80, 0xe9])
+    bios[0x66:0x69] = bytes([0xc3, 0x21, 0x80])
+    write('bios.rom', bios)
+
+    # Unused ROM space is filled with patterns for the banked reads
+    for name, mega, vram in [('sgm.rom', False, False),
+        ('vram.rom', False, True)]:
+        code = program(mega, vram)
+        rom = bytearray((i * 7 + i // 256) & 0xff for i in range(0x8000))
+        rom[:len(code)] = code
+        write(name, rom)
+
+    # The last 16K bank of a Mega Cart is fixed at 0x8000
+    code = program(True, False)
+    rom = bytearray(((i >> 14) * 37 + i) & 0xff for i in range(0x20000))
+    rom[0x1c000:0x1c000 + len(code)] = code
+    write('mega.rom', rom)
+
+if __name__ == '__main__':
+    main()
@@ -30,14 +30,20 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
 
 #include "jcv.h"
 #include "jcv_memio.h"
 #include "jcv_mixer.h"
+#include "jcv_movie.h"
 #include "jcv_psg.h"
+#include "jcv_rewind.h"
 #include "jcv_sgmpsg.h"
+#include "jcv_stats.h"
 #include "jcv_vdp.h"
 #include "jcv_z80.h"
+#include "jcv_ctx.h"
 
 /* NTSC Timing
 Z80 cycles per audio sample at 48000Hz (16 CPU cycles per PSG cycle):
@@ -58,90 +64,148 @@ PSG cycles per frame:
     59735.66667 / 16 = 3733.4792 (~224KHz)
 */
 
-#define DIV_PSG 16 // PSG Clock Divider
 #define Z80_CYC_LINE 228 // Z80 CPU cycles per scanline (227.99873)
 
-static size_t numscanlines = CV_VDP_SCANLINES;
-static size_t psgcycs = 0;
-static size_t psgsamps = 0;
-static size_t sgmpsgsamps = 0;
+// Create a new Emulator Context with default settings
+jcv_ctx_t* jcv_ctx_create(void) {
+    jcv_ctx_t *ctx = (jcv_ctx_t*)calloc(1, sizeof(jcv_ctx_t));
+    if (ctx == NULL)
+        return NULL;
+
+    jcv_mixer_set_rate(ctx, 48000);
+    jcv_mixer_set_rsqual(ctx, 3);
+    jcv_vdp_set_palette(ctx, 0);
+    jcv_vdp_set_render(ctx, 1);
+    jcv_set_region(ctx, REGION_NTSC);
+    jcv_set_seed(ctx, time(NULL)); // Indeterminate unless set by the frontend
+    jcv_input_set_state(ctx, 0, CV_INPUT_IDLE);
+    jcv_input_set_state(ctx, 1, CV_INPUT_IDLE);
+    jcv_stats_reset(ctx);
+
+    return ctx;
+}
+
+// Free an Emulator Context - jcv_deinit should be called first if initialized
+void jcv_ctx_destroy(jcv_ctx_t *ctx) {
+    free(ctx);
+}
+
+// Set the frontend data passed back through callbacks
+void jcv_ctx_set_userdata(jcv_ctx_t *ctx, void *udata) {
+    ctx->udata = udata;
+}
+
+// Retrieve the frontend data passed back through callbacks
+void* jcv_ctx_get_userdata(jcv_ctx_t *ctx) {
+    return ctx->udata;
+}
 
 // Set the region
-void jcv_set_region(uint8_t region) {
+void jcv_set_region(jcv_ctx_t *ctx, uint8_t region) {
     // 313 scanlines for PAL, 262 scanlines for NTSC (192 visible for both)
-    numscanlines = region ? CV_VDP_SCANLINES_PAL : CV_VDP_SCANLINES;
-    jcv_mixer_set_region(region);
-    jcv_vdp_set_region(region);
+    ctx->numscanlines = region ? CV_VDP_SCANLINES_PAL : CV_VDP_SCANLINES;
+    jcv_mixer_set_region(ctx, region);
+    jcv_vdp_set_region(ctx, region);
+}
+
+/* Set the seed for the garbage RAM holds at power on. Two contexts with the
+   same seed run identically given the same input, including across resets.
+   Takes effect on the next jcv_init or jcv_reset.
+*/
+void jcv_set_seed(jcv_ctx_t *ctx, uint64_t seed) {
+    ctx->seed = seed;
 }
 
 // Initialize
-void jcv_init(void) {
-    jcv_memio_init();
-    jcv_psg_init();
-    jcv_sgmpsg_init();
-    jcv_mixer_init();
-    jcv_vdp_init();
-    jcv_z80_init();
+void jcv_init(jcv_ctx_t *ctx) {
+    jcv_memio_init(ctx);
+    jcv_psg_init(ctx);
+    jcv_sgmpsg_init(ctx);
+    jcv_mixer_init(ctx);
+    jcv_vdp_init(ctx);
+    jcv_z80_init(ctx);
 }
 
 // Deinitialize
-void jcv_deinit(void) {
-    jcv_memio_deinit();
-    jcv_mixer_deinit();
+void jcv_deinit(jcv_ctx_t *ctx) {
+    jcv_memio_deinit(ctx);
+    jcv_mixer_deinit(ctx);
+    jcv_vdp_deinit(ctx);
+    jcv_movie_stop(ctx);
+    jcv_rewind_deinit(ctx);
 }
 
 // Reset the system
-void jcv_reset(int hard) {
+void jcv_reset(jcv_ctx_t *ctx, int hard) {
     if (hard) { } // Currently unused
-    jcv_memio_init(); // Init does the same thing reset needs to do
-    jcv_psg_init();
-    jcv_sgmpsg_init();
-    jcv_vdp_init();
-    jcv_z80_reset();
+    jcv_memio_init(ctx); // Init does the same thing reset needs to do
+    jcv_psg_init(ctx);
+    jcv_sgmpsg_init(ctx);
+    jcv_vdp_init(ctx);
+    jcv_z80_reset(ctx);
 }
 
 // Run emulation for one frame
-void jcv_exec(void) {
-    // Keep track of the number of samples generated this frame
-    psgsamps = 0;
-    sgmpsgsamps = 0;
+void jcv_exec(jcv_ctx_t *ctx) {
+    JCV_STATS_ENTER(ctx, STATS_Z80);
+
+    // Sample input for the frame if it is latched
+    jcv_input_frame(ctx);
 
     // Restore the leftover cycle count
-    uint32_t extcycs = jcv_z80_cyc_restore();
+    uint32_t extcycs = jcv_z80_cyc_restore(ctx);
 
     // Run scanline-based iterations of emulation until a frame is complete
-    for (size_t i = 0; i < numscanlines; ++i) {
+    for (size_t i = 0; i < ctx->numscanlines; ++i) {
         // Set the number of cycles required to complete this scanline
         size_t reqcycs = Z80_CYC_LINE - extcycs;
 
-        // Count cycles for an iteration (usually one instruction)
-        size_t itercycs = 0;
-
         // Count the total cycles run in a scanline
         size_t linecycs = 0;
 
-        // Run CPU instructions until enough have been run for one scanline
-        while (linecycs < reqcycs) {
-            itercycs = jcv_z80_exec(); // Run a single CPU instruction
-            linecycs += itercycs; // Add the number of cycles to the total
+        JCV_STATS_SWITCH(ctx, STATS_Z80);
 
-            for (size_t s = 0; s < itercycs; ++s) { // Catch PSGs up to the CPU
-                if (++psgcycs % DIV_PSG == 0) {
-                    psgsamps += jcv_psg_exec();
-                    sgmpsgsamps += jcv_sgmpsg_exec();
-                    psgcycs = 0;
-                }
-            }
-        }
+        /* Run the CPU to the end of the scanline. A run may return early if a
+           device shortened its deadline, in which case continue from there.
+        */
+        while (linecycs < reqcycs)
+            linecycs += jcv_z80_run(ctx, reqcycs - linecycs);
 
         extcycs = linecycs - reqcycs; // Store extra cycle count
+        JCV_STATS_LINE(ctx, linecycs);
+
+        JCV_STATS_SWITCH(ctx, STATS_VDP);
+        jcv_vdp_exec(ctx); // Draw a scanline of pixel data
 
-        jcv_vdp_exec(); // Draw a scanline of pixel data
+        JCV_STATS_SWITCH(ctx, STATS_MIXER);
+        jcv_mixer_scanline(ctx); // Push audio early if streaming
     }
 
+    // Catch the PSGs up to the end of the frame
+    jcv_mixer_sync(ctx);
+
     // Resample audio and push to the frontend
-    jcv_mixer_resamp(psgsamps, sgmpsgsamps);
+    jcv_mixer_resamp(ctx, ctx->psg.bufpos, ctx->sgmpsg.bufpos);
+
+    // Start counting cycles for the next frame, keeping the PSGs' leftovers
+    ctx->cycs -= ctx->psgcycs;
+    ctx->psgcycs = 0;
 
     // Store the leftover cycle count
-    jcv_z80_cyc_store(extcycs);
+    jcv_z80_cyc_store(ctx, extcycs);
+
+    // Advance the movie being recorded or replayed
+    if (ctx->movie.mode)
+        jcv_movie_frame(ctx);
+
+    JCV_STATS_INC(ctx, frames);
+    JCV_STATS_LEAVE(ctx);
+}
+
+// Run emulation for one frame without drawing to the video output buffer
+void jcv_exec_noframe(jcv_ctx_t *ctx) {
+    uint8_t render = ctx->vdp.render;
+    jcv_vdp_set_render(ctx, 0);
+    jcv_exec(ctx);
+    jcv_vdp_set_render(ctx, render);
 }
@@ -38,10 +38,20 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define VERSION "1.0.1"
 
-void jcv_set_region(uint8_t);
-void jcv_init(void);
-void jcv_deinit(void);
-void jcv_reset(int);
-void jcv_exec(void);
+typedef struct _jcv_ctx_t jcv_ctx_t; // Emulator Context (one per machine)
+typedef struct _jcv_serial_t jcv_serial_t; // Serialization cursor
+
+jcv_ctx_t* jcv_ctx_create(void);
+void jcv_ctx_destroy(jcv_ctx_t*);
+void jcv_ctx_set_userdata(jcv_ctx_t*, void*);
+void* jcv_ctx_get_userdata(jcv_ctx_t*);
+
+void jcv_set_region(jcv_ctx_t*, uint8_t);
+void jcv_set_seed(jcv_ctx_t*, uint64_t);
+void jcv_init(jcv_ctx_t*);
+void jcv_deinit(jcv_ctx_t*);
+void jcv_reset(jcv_ctx_t*, int);
+void jcv_exec(jcv_ctx_t*);
+void jcv_exec_noframe(jcv_ctx_t*);
 
 #endif
@@ -0,0 +1,415 @@
+/*
+Copyright (c) 2020-2022 Rupert Carmichael
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Batch Runner
+   Runs many independent Emulator Contexts for a number of frames each, spread
+   across a pool of worker threads. This is intended for frontends running
+   large numbers of machines at once, such as test farms or training
+   environments, where the cost of a process per machine adds up.
+
+   Each run gives every worker a queue made of a contiguous block of the
+   contexts. A worker runs the contexts in its own queue first and then claims
+   contexts from the queues of other workers, so the load stays balanced when
+   some machines take longer than others. As the blocks only change when the
+   number of contexts does, a context is normally run by the same worker every
+   time. Workers are pinned to a CPU where the platform allows, keeping each
+   machine's state in the caches of one core between runs.
+
+   A context is run for all of its frames in one go. While it runs, the batch
+   takes over its input and audio callbacks and its output buffers: input is
+   taken from the array passed in (or the frontend's input callback if none
+   is given), audio from every frame is collected into a per-context buffer,
+   and the final frame is drawn into a per-context framebuffer. Earlier frames
+   are run without drawing. The frontend's settings are restored afterwards.
+*/
+
+#if defined(__linux__)
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#endif
+
+#include "jcv.h"
+#include "jcv_batch.h"
+#include "jcv_memio.h"
+#include "jcv_mixer.h"
+#include "jcv_movie.h"
+#include "jcv_psg.h"
+#include "jcv_rewind.h"
+#include "jcv_sgmpsg.h"
+#include "jcv_stats.h"
+#include "jcv_vdp.h"
+#include "jcv_ctx.h"
+
+#define BATCH_ALIGN 64 // Cache line size, keeping data used by workers apart
+
+#define SIZE_BATCH_VBUF (CV_VDP_WIDTH_OVERSCAN * CV_VDP_HEIGHT_OVERSCAN)
+
+typedef struct _cv_batch_slot_t {
+    jcv_ctx_t *ctx; // Context being run
+    const uint16_t *inputs; // Input state of both ports per frame, or NULL
+    size_t frame; // Frame currently being run
+    uint32_t *vbuf; // Video output of the final frame
+    int16_t *abuf; // Audio output of every frame
+    size_t asamps; // Number of audio samples output
+    size_t acap; // Size of the audio buffer in samples
+    uint8_t err; // Output buffers could not be allocated
+    void *udata; // Frontend data, restored after the run
+    uint16_t (*input_cb)(void*, int); // Frontend input callback
+} __attribute__((aligned(BATCH_ALIGN))) cv_batch_slot_t;
+
+typedef struct _cv_batch_worker_t {
+    size_t next; // Next context in this worker's queue (claimed atomically)
+    size_t end; // End of this worker's queue
+    size_t id; // Index of the worker
+    pthread_t thread; // Thread running the worker
+    jcv_batch_t *batch; // Batch the worker belongs to
+} __attribute__((aligned(BATCH_ALIGN))) cv_batch_worker_t;
+
+struct _jcv_batch_t {
+    cv_batch_worker_t *worker; // Workers
+    size_t threads; // Number of workers
+    cv_batch_slot_t *slot; // Per-context run data and output buffers
+    size_t slots; // Number of slots allocated
+    size_t frames; // Number of frames to run each context for
+    pthread_mutex_t mtx; // Protects everything below
+    pthread_cond_t start; // Signalled when a run starts or the pool closes
+    pthread_cond_t done; // Signalled when the last worker finishes a run
+    uint64_t gen; // Incremented for each run
+    size_t finished; // Number of workers finished with the current run
+    uint8_t quit; // Workers should exit
+};
+
+// Pin the calling thread to a CPU, or give it an affinity hint on macOS
+static void jcv_batch_pin(size_t id) {
+#if defined(__linux__)
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(id % cpus, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(__APPLE__)
+    // Threads with different tags are scheduled on cores not sharing a cache
+    thread_affinity_policy_data_t policy = { (integer_t)id + 1 };
+    thread_policy_set(pthread_mach_thread_np(pthread_self()),
+        THREAD_AFFINITY_POLICY, (thread_policy_t)&policy,
+        THREAD_AFFINITY_POLICY_COUNT);
+#else
+    (void)id;
+#endif
+}
+
+// Input callback used while running - udata is the slot
+static uint16_t jcv_batch_input(void *udata, int port) {
+    cv_batch_slot_t *slot = (cv_batch_slot_t*)udata;
+
+    if (slot->inputs)
+        return slot->inputs[slot->frame * 2 + port];
+
+    return slot->input_cb ? slot->input_cb(slot->udata, port) : 0;
+}
+
+// Audio callback used while running - move the output past the new samples
+static void jcv_batch_audio(void *udata, size_t samps) {
+    cv_batch_slot_t *slot = (cv_batch_slot_t*)udata;
+    slot->asamps += samps;
+    slot->ctx->mixer.abuf = slot->abuf + slot->asamps;
+}
+
+// Run one context for every frame of the current run
+static void jcv_batch_slot_run(jcv_batch_t *batch, cv_batch_slot_t *slot) {
+    jcv_ctx_t *ctx = slot->ctx;
+    size_t frames = batch->frames;
+
+    slot->asamps = 0;
+
+    /* Allow for the rounding of each push to produce an extra sample, and for
+       a full frame of room when the final frame begins. Buffers are allocated
+       by the first worker to run the slot, which is normally its owner.
+    */
+    size_t fsamps = ctx->mixer.samplerate / ctx->mixer.framerate + 2;
+    size_t acap = (frames + 1) * fsamps;
+
+    if (slot->acap < acap) {
+        int16_t *abuf = (int16_t*)realloc(slot->abuf, acap * sizeof(int16_t));
+        if (abuf == NULL) {
+            slot->err = 1;
+            return;
+        }
+        slot->abuf = abuf;
+        slot->acap = acap;
+    }
+
+    if (slot->vbuf == NULL) {
+        slot->vbuf = (uint32_t*)calloc(SIZE_BATCH_VBUF, sizeof(uint32_t));
+        if (slot->vbuf == NULL) {
+            slot->err = 1;
+            return;
+        }
+    }
+
+    // Take over the callbacks and output buffers
+    void (*audio_cb)(void*, size_t) = ctx->mixer.cb;
+    int16_t *abuf = ctx->mixer.abuf;
+    uint32_t *vbuf = ctx->vdp.vbuf;
+
+    slot->udata = ctx->udata;
+    slot->input_cb = ctx->cvsys.input_cb;
+
+    ctx->udata = slot;
+    ctx->cvsys.input_cb = jcv_batch_input;
+    ctx->mixer.cb = jcv_batch_audio;
+    jcv_vdp_set_buffer(ctx, slot->vbuf);
+
+    // Only the final frame is returned, so there is no need to draw the rest
+    for (slot->frame = 0; slot->frame < frames; ++slot->frame) {
+        ctx->mixer.abuf = slot->abuf + slot->asamps;
+
+        if (slot->frame + 1 < frames)
+            jcv_exec_noframe(ctx);
+        else
+            jcv_exec(ctx);
+    }
+
+    ctx->udata = slot->udata;
+    ctx->cvsys.input_cb = slot->input_cb;
+    ctx->mixer.cb = audio_cb;
+    ctx->mixer.abuf = abuf;
+    jcv_vdp_set_buffer(ctx, vbuf);
+}
+
+// Worker thread - run contexts from this worker's queue, then from the others
+static void* jcv_batch_worker(void *arg) {
+    cv_batch_worker_t *w = (cv_batch_worker_t*)arg;
+    jcv_batch_t *batch = w->batch;
+    uint64_t gen = 0;
+
+    jcv_batch_pin(w->id);
+
+    while (1) {
+        pthread_mutex_lock(&batch->mtx);
+        while (batch->gen == gen && !batch->quit)
+            pthread_cond_wait(&batch->start, &batch->mtx);
+
+        if (batch->quit) {
+            pthread_mutex_unlock(&batch->mtx);
+            break;
+        }
+
+        gen = batch->gen;
+        pthread_mutex_unlock(&batch->mtx);
+
+        for (size_t v = 0; v < batch->threads; ++v) {
+            cv_batch_worker_t *q =
+                &batch->worker[(w->id + v) % batch->threads];
+            size_t i;
+
+            while ((i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) <
+                q->end) {
+                jcv_batch_slot_run(batch, &batch->slot[i]);
+            }
+        }
+
+        pthread_mutex_lock(&batch->mtx);
+        if (++batch->finished == batch->threads)
+            pthread_cond_signal(&batch->done);
+        pthread_mutex_unlock(&batch->mtx);
+    }
+
+    return NULL;
+}
+
+// Create a pool of worker threads - 0 uses one thread per online CPU
+jcv_batch_t* jcv_batch_create(size_t threads) {
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (size_t)cpus : 1;
+    }
+
+    jcv_batch_t *batch = (jcv_batch_t*)calloc(1, sizeof(jcv_batch_t));
+    if (batch == NULL)
+        return NULL;
+
+    void *worker = NULL;
+    if (posix_memalign(&worker, BATCH_ALIGN,
+        threads * sizeof(cv_batch_worker_t))) {
+        free(batch);
+        return NULL;
+    }
+
+    batch->worker = (cv_batch_worker_t*)worker;
+    memset(batch->worker, 0, threads * sizeof(cv_batch_worker_t));
+
+    pthread_mutex_init(&batch->mtx, NULL);
+    pthread_cond_init(&batch->start, NULL);
+    pthread_cond_init(&batch->done, NULL);
+
+    // Keep however many threads could be started
+    for (size_t i = 0; i < threads; ++i) {
+        cv_batch_worker_t *w = &batch->worker[i];
+        w->id = i;
+        w->batch = batch;
+
+        if (pthread_create(&w->thread, NULL, jcv_batch_worker, w))
+            break;
+
+        ++batch->threads;
+    }
+
+    if (batch->threads == 0) {
+        jcv_batch_destroy(batch);
+        return NULL;
+    }
+
+    return batch;
+}
+
+// Stop the worker threads and free the pool along with its output buffers
+void jcv_batch_destroy(jcv_batch_t *batch) {
+    if (batch == NULL)
+        return;
+
+    pthread_mutex_lock(&batch->mtx);
+    batch->quit = 1;
+    pthread_cond_broadcast(&batch->start);
+    pthread_mutex_unlock(&batch->mtx);
+
+    for (size_t i = 0; i < batch->threads; ++i)
+        pthread_join(batch->worker[i].thread, NULL);
+
+    for (size_t i = 0; i < batch->slots; ++i) {
+        free(batch->slot[i].vbuf);
+        free(batch->slot[i].abuf);
+    }
+
+    pthread_cond_destroy(&batch->done);
+    pthread_cond_destroy(&batch->start);
+    pthread_mutex_destroy(&batch->mtx);
+
+    free(batch->slot);
+    free(batch->worker);
+    free(batch);
+}
+
+// Grow the slot array, keeping the output buffers already allocated
+static int jcv_batch_grow(jcv_batch_t *batch, size_t n) {
+    if (n <= batch->slots)
+        return 1;
+
+    void *slot = NULL;
+    if (posix_memalign(&slot, BATCH_ALIGN, n * sizeof(cv_batch_slot_t)))
+        return 0;
+
+    memset(slot, 0, n * sizeof(cv_batch_slot_t));
+
+    if (batch->slot) {
+        memcpy(slot, batch->slot, batch->slots * sizeof(cv_batch_slot_t));
+        free(batch->slot);
+    }
+
+    batch->slot = (cv_batch_slot_t*)slot;
+    batch->slots = n;
+    return 1;
+}
+
+/* Run n contexts for the given number of frames each, returning when all of
+   them are done. Each context must be initialized with its ROM loaded, and
+   may appear only once. If inputs is not NULL, it holds the state of both
+   controller ports for every frame of every context, in the order
+   inputs[(context * frames + frame) * 2 + port], in the format returned by an
+   input callback. Otherwise each frontend's input callback is used. Returns 0
+   if the output buffers for any context could not be allocated, in which case
+   that context has not been run.
+*/
+int jcv_batch_run(jcv_batch_t *batch, jcv_ctx_t **ctxs, size_t n,
+    size_t frames, const uint16_t *inputs) {
+    if (!jcv_batch_grow(batch, n))
+        return 0;
+
+    for (size_t i = 0; i < n; ++i) {
+        cv_batch_slot_t *slot = &batch->slot[i];
+        slot->ctx = ctxs[i];
+        slot->inputs = inputs ? inputs + i * frames * 2 : NULL;
+        slot->err = 0;
+    }
+
+    // Give each worker a contiguous block of the contexts
+    for (size_t i = 0; i < batch->threads; ++i) {
+        batch->worker[i].next = n * i / batch->threads;
+        batch->worker[i].end = n * (i + 1) / batch->threads;
+    }
+
+    pthread_mutex_lock(&batch->mtx);
+    batch->frames = frames;
+    batch->finished = 0;
+    ++batch->gen;
+    pthread_cond_broadcast(&batch->start);
+
+    while (batch->finished < batch->threads)
+        pthread_cond_wait(&batch->done, &batch->mtx);
+    pthread_mutex_unlock(&batch->mtx);
+
+    for (size_t i = 0; i < n; ++i) {
+        if (batch->slot[i].err)
+            return 0;
+    }
+
+    return 1;
+}
+
+// Retrieve the final frame drawn for the context at index i of the last run
+const uint32_t* jcv_batch_get_video(jcv_batch_t *batch, size_t i) {
+    return i < batch->slots ? batch->slot[i].vbuf : NULL;
+}
+
+// Retrieve the audio output for the context at index i of the last run
+const int16_t* jcv_batch_get_audio(jcv_batch_t *batch, size_t i,
+    size_t *samps) {
+    if (i >= batch->slots) {
+        *samps = 0;
+        return NULL;
+    }
+
+    *samps = batch->slot[i].asamps;
+    return batch->slot[i].abuf;
+}
@@ -0,0 +1,160 @@
+/*
+Copyright (c) 2020-2022 Rupert Carmichael
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Band-limited Step Synthesis
+   The sound chips' output is a series of flat levels joined by instantaneous
+   steps. Rather than generating every sample at the chips' own rate and then
+   resampling, each change in level is recorded where it falls in time as a
+   band-limited step spread over a few output samples, and the output at the
+   host rate is the running sum of those steps. Only changes in level cost
+   anything, and nothing is generated at the intermediate rate.
+
+   The buffer holds the difference between each output sample and the one
+   before it. A step is added as a windowed sinc impulse chosen from a table
+   by the step's position between two output samples, and reading integrates
+   the impulses back into levels. The integrator slowly leaks towards zero,
+   which removes the DC offset from the chips' positive-only output.
+*/
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jcv_blip.h"
+
+#define BLIP_UNIT 14 // Fixed-point precision of the step kernel
+#define BLIP_LEAK 9 // Integrator leak shift (highpass around 15Hz at 48KHz)
+#define BLIP_CUTOFF 0.9 // Cutoff as a fraction of the output Nyquist rate
+
+#ifndef M_PI
+    #define M_PI 3.14159265358979323846
+#endif
+
+// Build the table of impulses for each sub-sample phase
+static void jcv_blip_kernel(cv_blip_t *blip) {
+    for (int p = 0; p < BLIP_PHASES; ++p) {
+        double taps[BLIP_WIDTH];
+        double sum = 0.0;
+
+        for (int k = 0; k < BLIP_WIDTH; ++k) {
+            // Distance from the centre of the impulse, which lies between taps
+            double x = k - (BLIP_WIDTH / 2 - 1) - (double)p / BLIP_PHASES;
+            double w = 0.42 + 0.5 * cos(M_PI * x / (BLIP_WIDTH / 2)) +
+                0.08 * cos(2.0 * M_PI * x / (BLIP_WIDTH / 2));
+            double s = x == 0.0 ? 1.0 :
+                sin(M_PI * BLIP_CUTOFF * x) / (M_PI * BLIP_CUTOFF * x);
+            taps[k] = s * w;
+            sum += taps[k];
+        }
+
+        // Normalize so each impulse adds up to exactly one unit step
+        int total = 0;
+        for (int k = 0; k < BLIP_WIDTH; ++k) {
+            blip->kernel[p][k] = lrint(taps[k] / sum * (1 << BLIP_UNIT));
+            total += blip->kernel[p][k];
+        }
+        blip->kernel[p][BLIP_WIDTH / 2] += (1 << BLIP_UNIT) - total;
+    }
+}
+
+/* Create a buffer converting from an input clock rate to an output sample
+   rate, able to hold blocks of up to a given number of input clocks
+*/
+cv_blip_t* jcv_blip_create(size_t inrate, size_t outrate, size_t maxclocks) {
+    cv_blip_t *blip = (cv_blip_t*)calloc(1, sizeof(cv_blip_t));
+    if (blip == NULL)
+        return NULL;
+
+    blip->factor = ((uint64_t)outrate << 32) / inrate;
+    blip->size = ((maxclocks * blip->factor) >> 32) + 1 + BLIP_WIDTH;
+    blip->buf = (int32_t*)calloc(blip->size, sizeof(int32_t));
+
+    if (blip->buf == NULL) {
+        free(blip);
+        return NULL;
+    }
+
+    jcv_blip_kernel(blip);
+    return blip;
+}
+
+// Free a buffer
+void jcv_blip_destroy(cv_blip_t *blip) {
+    if (blip == NULL)
+        return;
+    free(blip->buf);
+    free(blip);
+}
+
+// Add a change in level at a time in input clocks since the start of the block
+void jcv_blip_delta(cv_blip_t *blip, size_t clock, int32_t delta) {
+    uint64_t pos = blip->offset + clock * blip->factor;
+    const int16_t *k = blip->kernel[(pos >> (32 - BLIP_PHASE_BITS)) &
+        (BLIP_PHASES - 1)];
+    int32_t *buf = blip->buf + (pos >> 32);
+
+    for (int i = 0; i < BLIP_WIDTH; ++i)
+        buf[i] += delta * k[i];
+}
+
+/* End a block of a number of input clocks and read out the samples completed
+   by it, up to a maximum. Returns the number of samples read.
+*/
+size_t jcv_blip_read(cv_blip_t *blip, size_t clocks, int16_t *out,
+    size_t maxout) {
+    uint64_t end = blip->offset + clocks * blip->factor;
+    size_t avail = end >> 32;
+    size_t count = avail < maxout ? avail : maxout;
+    int32_t sum = blip->integrator;
+
+    for (size_t i = 0; i < count; ++i) {
+        sum += blip->buf[i];
+        int32_t s = sum >> BLIP_UNIT;
+        out[i] = s > INT16_MAX ? INT16_MAX : s < INT16_MIN ? INT16_MIN : s;
+        sum -= sum >> BLIP_LEAK;
+    }
+
+    // Samples which did not fit are dropped, keeping the steps in time
+    for (size_t i = count; i < avail; ++i) {
+        sum += blip->buf[i];
+        sum -= sum >> BLIP_LEAK;
+    }
+
+    blip->integrator = sum;
+    blip->offset = end - ((uint64_t)avail << 32);
+
+    // Move the steps reaching into the next block to the start of the buffer
+    memmove(blip->buf, blip->buf + avail, BLIP_WIDTH * sizeof(int32_t));
+    memset(blip->buf + BLIP_WIDTH, 0, avail * sizeof(int32_t));
+
+    return count;
+}
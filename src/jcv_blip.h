@@ -0,0 +1,52 @@
+/*
+Copyright (c) 2020-2022 Rupert Carmichael
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JCV_BLIP_H
+#define JCV_BLIP_H
+
+#define BLIP_PHASE_BITS 5
+#define BLIP_PHASES (1 << BLIP_PHASE_BITS) // Sub-sample positions for a step
+#define BLIP_WIDTH 16 // Output samples each step is spread across
+
+typedef struct _cv_blip_t {
+    int32_t *buf; // Band-limited steps, not yet integrated into samples
+    size_t size; // Size of the buffer in samples
+    uint64_t factor; // Output samples per input clock (32.32 fixed-point)
+    uint64_t offset; // Position of the start of the current block (32.32)
+    int32_t integrator; // Running sum of the steps read out so far
+    int16_t kernel[BLIP_PHASES][BLIP_WIDTH]; // Step kernel for each phase
+} cv_blip_t;
+
+cv_blip_t* jcv_blip_create(size_t, size_t, size_t);
+void jcv_blip_destroy(cv_blip_t*);
+void jcv_blip_delta(cv_blip_t*, size_t, int32_t);
+size_t jcv_blip_read(cv_blip_t*, size_t, int16_t*, size_t);
+
+#endif
@@ -0,0 +1,70 @@
+/*
+Copyright (c) 2020-2022 Rupert Carmichael
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* The Emulator Context holds every piece of mutable state for one emulated
+   ColecoVision. No state is shared between contexts, so any number of them
+   may exist in a process, and each may be run on its own thread. Files which
+   need access to the members must include the headers for every subsystem
+   before this one.
+*/
+
+#ifndef JCV_CTX_H
+#define JCV_CTX_H
+
+#include "z80.h"
+
+struct _jcv_ctx_t {
+    cv_sys_t cvsys; // ColecoVision System Context
+    cv_vdp_t vdp; // VDP Context
+    cv_psg_t psg; // PSG Context
+    cv_sgmpsg_t sgmpsg; // SGM PSG Context
+    cv_mixer_t mixer; // Audio Mixer Context
+    cv_rewind_t rewind; // Snapshot Ring for rewind and rollback
+    cv_movie_t movie; // Input Movie being recorded or replayed
+
+    z80 z80ctx; // Z80 Context
+    uint32_t extracycs; // Z80 cycles run beyond the end of the last frame
+    uint32_t cycs; // Z80 cycles run this frame, up to the current instruction
+    uint32_t deadline; // Value of cycs at which the current run returns
+
+    size_t numscanlines; // Number of scanlines per frame for this region
+    uint64_t seed; // Seed for the garbage RAM holds at power on
+    uint32_t psgcycs; // Value of cycs the PSGs have caught up to
+
+    uint8_t state[SIZE_STATE]; // Raw state data
+
+    cv_stats_t stats; // Statistics gathered when built with JCV_STATS
+    uint64_t statsmark; // Clock reading when the current unit started
+    uint8_t statsunit; // Unit currently being timed
+
+    void *udata; // Frontend data passed to callbacks
+};
+
+#endif
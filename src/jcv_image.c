@@ -0,0 +1,209 @@
+/*
+Copyright (c) 2020-2022 Rupert Carmichael
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Shared Images
+   BIOS and ROM files loaded by path are mapped into memory read-only rather
+   than copied, and every context in the process loading the same file shares
+   one mapping, so a host running many machines holds a single copy of each
+   image no matter how many machines use it. Loading a file which is already
+   open is a lookup, and opening one is left to the operating system's page
+   cache rather than reading the whole file up front.
+
+   Images are counted by reference and unmapped when the last context using
+   one lets go of it. Files are identified by device and inode, so different
+   paths to the same file share an image. Platforms without mmap read the file
+   into memory once instead, identified by its path. An image must not be
+   modified or truncated while it is mapped.
+*/
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include "jcv_image.h"
+
+struct _jcv_image_t {
+    const uint8_t *data; // Contents of the file
+    size_t size; // Size of the file in bytes
+#if defined(_WIN32)
+    char *path; // Path the file was read from
+#else
+    dev_t dev; // Device holding the file
+    ino_t ino; // Inode of the file
+#endif
+    size_t refs; // Number of times the image is open
+    jcv_image_t *next; // Next open image
+};
+
+static jcv_image_t *images = NULL; // Images open in this process
+static pthread_mutex_t imagelock = PTHREAD_MUTEX_INITIALIZER;
+
+#if defined(_WIN32)
+// Read a file into memory, as there is no portable way to map it
+static jcv_image_t* jcv_image_read(const char *path) {
+    for (jcv_image_t *img = images; img; img = img->next) {
+        if (!strcmp(img->path, path))
+            return img;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+
+    jcv_image_t *img = (jcv_image_t*)calloc(1, sizeof(jcv_image_t));
+    uint8_t *data = NULL;
+    long size = 0;
+
+    if (img && !fseek(file, 0, SEEK_END) && (size = ftell(file)) > 0) {
+        fseek(file, 0, SEEK_SET);
+        data = (uint8_t*)malloc(size);
+        img->path = (char*)malloc(strlen(path) + 1);
+    }
+
+    if (!data || !img->path || fread(data, size, 1, file) != 1) {
+        fclose(file);
+        if (img)
+            free(img->path);
+        free(data);
+        free(img);
+        return NULL;
+    }
+
+    fclose(file);
+    strcpy(img->path, path);
+    img->data = data;
+    img->size = size;
+    return img;
+}
+#else
+// Map a file into memory read-only
+static jcv_image_t* jcv_image_map(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+
+    for (jcv_image_t *img = images; img; img = img->next) {
+        if (img->dev == st.st_dev && img->ino == st.st_ino) {
+            close(fd);
+            return img;
+        }
+    }
+
+    jcv_image_t *img = (jcv_image_t*)calloc(1, sizeof(jcv_image_t));
+    void *data = MAP_FAILED;
+
+    if (img)
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd); // The mapping holds its own reference to the file
+
+    if (data == MAP_FAILED) {
+        free(img);
+        return NULL;
+    }
+
+    img->data = (const uint8_t*)data;
+    img->size = st.st_size;
+    img->dev = st.st_dev;
+    img->ino = st.st_ino;
+    return img;
+}
+#endif
+
+/* Open a file as a shared image, returning a handle to close it with, or NULL
+   if it could not be opened or is empty. The contents and size of the file
+   are returned through the last two arguments.
+*/
+jcv_image_t* jcv_image_open(const char *path, const uint8_t **data,
+    size_t *size) {
+    pthread_mutex_lock(&imagelock);
+
+#if defined(_WIN32)
+    jcv_image_t *img = jcv_image_read(path);
+#else
+    jcv_image_t *img = jcv_image_map(path);
+#endif
+
+    if (img) {
+        if (img->refs++ == 0) { // Newly opened
+            img->next = images;
+            images = img;
+        }
+        *data = img->data;
+        *size = img->size;
+    }
+
+    pthread_mutex_unlock(&imagelock);
+    return img;
+}
+
+// Close a shared image, releasing it if nothing else has it open
+void jcv_image_close(jcv_image_t *img) {
+    if (img == NULL)
+        return;
+
+    pthread_mutex_lock(&imagelock);
+
+    if (--img->refs == 0) {
+        for (jcv_image_t **link = &images; *link; link = &(*link)->next) {
+            if (*link == img) {
+                *link = img->next;
+                break;
+            }
+        }
+
+#if defined(_WIN32)
+        free((void*)img->data);
+        free(img->path);
+#else
+        munmap((void*)img->data, img->size);
+#endif
+        free(img);
+    }
+
+    pthread_mutex_unlock(&imagelock);
+}
@@ -32,67 +32,101 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
-#include <time.h>
 
 #include "jcv.h"
+#include "jcv_image.h"
 #include "jcv_memio.h"
+#include "jcv_mixer.h"
+#include "jcv_movie.h"
 #include "jcv_psg.h"
+#include "jcv_rewind.h"
 #include "jcv_serial.h"
 #include "jcv_sgmpsg.h"
+#include "jcv_stats.h"
 #include "jcv_vdp.h"
 #include "jcv_z80.h"
+#include "jcv_ctx.h"
 
-#define SIZE_STATE 50392
-static uint8_t state[SIZE_STATE];
+static void jcv_mem_remap(jcv_ctx_t*);
 
-static uint16_t (*jcv_input_cb)(int); // Input poll callback
+void jcv_input_set_callback(jcv_ctx_t *ctx, uint16_t (*cb)(void*, int)) {
+    ctx->cvsys.input_cb = cb;
+}
+
+/* Set the input mode. Games strobe the controller ports many times per frame,
+   and by default the frontend is polled on every strobe. In Latched mode, the
+   input state is instead sampled once at the start of each frame, either by
+   polling the callback if one is set, or by the frontend pushing it with
+   jcv_input_set_state, and strobes read the latched state.
+*/
+void jcv_input_set_mode(jcv_ctx_t *ctx, uint8_t mode) {
+    if (mode <= INPUT_LATCHED)
+        ctx->cvsys.inmode = mode;
+}
+
+// Push the input state of a port for Latched mode
+void jcv_input_set_state(jcv_ctx_t *ctx, int port, uint16_t state) {
+    ctx->cvsys.inlatch[port & 0x01] = state;
+}
+
+// Latch the input state for the frame about to run
+void jcv_input_frame(jcv_ctx_t *ctx) {
+    cv_sys_t *cvsys = &ctx->cvsys;
 
-static uint8_t *cvbios = NULL; // BIOS ROM
-static uint8_t bios_internal = 0; // BIOS loaded internally
-static uint8_t *romdata = NULL; // Game ROM
-static size_t romsize = 0; // Size of the ROM in bytes
-static uint8_t rompages = 0; // Number of 8K ROM pages
-static uint32_t rompage[4]; // Offsets to the start of 8K ROM pages
+    if (cvsys->inmode != INPUT_LATCHED || cvsys->input_cb == NULL)
+        return;
 
-static uint8_t megacart = 0; // Mark whether the cart is a Mega Cart or not
-static uint8_t sgm_upper = 0; // Enable upper 24K SGM RAM
-static uint8_t sgm_lower = 0; // Enable lower 8K SGM RAM - replaces BIOS mapping
+    cvsys->inlatch[0] = cvsys->input_cb(ctx->udata, 0);
+    cvsys->inlatch[1] = cvsys->input_cb(ctx->udata, 1);
+}
 
-static cv_sys_t cvsys; // ColecoVision System Context
+// Read the input state of a port from the frontend or the latch
+uint16_t jcv_input_rd(jcv_ctx_t *ctx, int port) {
+    cv_sys_t *cvsys = &ctx->cvsys;
 
-void jcv_input_set_callback(uint16_t (*cb)(int)) {
-    jcv_input_cb = cb;
+    if (cvsys->inmode == INPUT_LATCHED)
+        return cvsys->inlatch[port];
+
+    return cvsys->input_cb(ctx->udata, port);
 }
 
 // Read a byte of data from an I/O port
-uint8_t jcv_io_rd(uint8_t port) {
+uint8_t jcv_io_rd(jcv_ctx_t *ctx, uint8_t port) {
+    cv_sys_t *cvsys = &ctx->cvsys;
+    JCV_STATS_INC(ctx, iord[port]);
+
     /* ColecoVision I/O Read Map
        0xa0 - 0xbf: VDP Reads (Port Odd: Status, Port Even: VRAM)
        0xe0 - 0xff: Control Port Strobe (0xfc, 0xff)
     */
     switch (port & 0xe0) {
         case 0xa0: { // Video
-            return port & 0x01 ? jcv_vdp_rd_stat() : jcv_vdp_rd_data();
+            return port & 0x01 ? jcv_vdp_rd_stat(ctx) : jcv_vdp_rd_data(ctx);
         }
         case 0xe0: { // Strobe controller ports for input state
             uint8_t p = (port & 0x02) >> 1; // Port variable for convenience
-            cvsys.ctrl[p] = jcv_input_cb(p); // Call frontend for input state
+            // Read the input state, unless a movie supplies it
+            cvsys->ctrl[p] = ctx->movie.mode ? jcv_movie_input(ctx, p) :
+                jcv_input_rd(ctx, p);
 
             // Return the complement of the value
-            return cvsys.cseg ? // Two strobes are done for two sets of buttons
-                ~((uint8_t)(cvsys.ctrl[p] >> 8)) : // Joystick, FireL
-                ~((uint8_t)(cvsys.ctrl[p] & 0xff)); // Numpad, FireR
+            return cvsys->cseg ? // Two strobes are done for two sets of buttons
+                ~((uint8_t)(cvsys->ctrl[p] >> 8)) : // Joystick, FireL
+                ~((uint8_t)(cvsys->ctrl[p] & 0xff)); // Numpad, FireR
         }
         default: {
             if (port == 0x52) // SGM PSG Read
-                return jcv_sgmpsg_rd();
+                return jcv_sgmpsg_rd(ctx);
             return 0xff;
         }
     }
 }
 
 // Write a byte of data to an I/O port
-void jcv_io_wr(uint8_t port, uint8_t data) {
+void jcv_io_wr(jcv_ctx_t *ctx, uint8_t port, uint8_t data) {
+    cv_sys_t *cvsys = &ctx->cvsys;
+    JCV_STATS_INC(ctx, iowr[port]);
+
     /* ColecoVision I/O Write Map
        0x80 - 0x9f: Set Controller Strobe Segment to Numpad/FireR
        0xa0 - 0xbf: VDP Writes (Port Odd: Registers, Port Even: VRAM)
@@ -102,15 +136,16 @@ void jcv_io_wr(uint8_t port, uint8_t data) {
     switch(port & 0xe0) {
         // Data is irrelevant for cases 0x80 and 0xc0: just toggle a flip-flop
         case 0x80: { // Set Controller Strobe Segment to Numpad/FireR
-            cvsys.cseg = 0;
+            cvsys->cseg = 0;
             break;
         }
         case 0xa0: { // Write to VDP Control Registers or VRAM
-            port & 0x01 ? jcv_vdp_wr_ctrl(data) : jcv_vdp_wr_data(data);
+            port & 0x01 ?
+                jcv_vdp_wr_ctrl(ctx, data) : jcv_vdp_wr_data(ctx, data);
             break;
         }
         case 0xc0: { // Set Controller Strobe Segment to Joystick/FireL
-            cvsys.cseg = 1;
+            cvsys->cseg = 1;
             break;
         }
         case 0xe0: { // Write to the PSG Control Registers
@@ -118,19 +153,26 @@ void jcv_io_wr(uint8_t port, uint8_t data) {
                according to the datasheet. It could be more like 54, but there
                does not seem to be any definitive data on this.
             */
-            jcv_z80_delay(48); // PCM sample pitch will be high without a delay
-            jcv_psg_wr(data);
+            jcv_mixer_sync(ctx); // Output up to now uses the old register state
+            jcv_z80_delay(ctx, 48); // PCM sample pitch is high without a delay
+            jcv_psg_wr(ctx, data);
             break;
         }
         default: {
             if (port == 0x50) // Set the SGM PSG's active register
-                jcv_sgmpsg_set_reg(data & 0x0f);
-            else if (port == 0x51) // Write to the SGM PSG's selected register
-                jcv_sgmpsg_wr(data);
-            else if (port == 0x53)
-                sgm_upper = 1;
-            else if (port == 0x7f)
-                sgm_lower = ~data & 0x02;
+                jcv_sgmpsg_set_reg(ctx, data & 0x0f);
+            else if (port == 0x51) { // Write to the SGM PSG's selected register
+                jcv_mixer_sync(ctx);
+                jcv_sgmpsg_wr(ctx, data);
+            }
+            else if (port == 0x53) {
+                cvsys->sgm_upper = 1;
+                jcv_mem_remap(ctx);
+            }
+            else if (port == 0x7f) {
+                cvsys->sgm_lower = ~data & 0x02;
+                jcv_mem_remap(ctx);
+            }
             break;
         }
     }
@@ -144,118 +186,197 @@ void jcv_io_wr(uint8_t port, uint8_t data) {
    0x8000 - 0xffff: Cartridge ROM (8K pages every 0x2000)
 */
 
-// Read a byte of memory
-uint8_t jcv_mem_rd(uint16_t addr) {
-    if (sgm_lower && (addr < 0x2000)) {
-        return cvsys.sgmram[addr];
+/* Rebuild the page tables
+   Memory is accessed through tables of pointers to each 1K page, so that the
+   common case is a single table lookup. The tables only need to be rebuilt
+   when the mapping changes: SGM RAM being enabled or disabled, a Mega Cart
+   bank switch, or new BIOS/ROM data. Read pages which cannot be handled with
+   a simple pointer are left NULL and are handled by jcv_mem_rd_slow: ROM pages
+   only partially backed by ROM data, and the Mega Cart bank switch page.
+*/
+static void jcv_mem_remap(jcv_ctx_t *ctx) {
+    cv_sys_t *cvsys = &ctx->cvsys;
+
+    for (size_t p = 0; p < SIZE_MEMMAP; ++p) {
+        size_t addr = p << 10;
+        const uint8_t *rd;
+        uint8_t *wr;
+        uint8_t *dirty = cvsys->sinkdirty;
+        uint8_t region;
+
+        if (cvsys->sgm_lower && (addr < 0x2000)) {
+            rd = wr = cvsys->sgmram + addr;
+            dirty = cvsys->sgmramdirty + (addr / SIZE_DIRTYPG);
+            region = STATS_MEM_SGM;
+        }
+        else if (addr < 0x2000) { // BIOS from 0x0000 to 0x1fff
+            rd = cvsys->cvbios ? cvsys->cvbios + addr : NULL;
+            wr = cvsys->wrsink;
+            region = STATS_MEM_BIOS;
+        }
+        else if (cvsys->sgm_upper && (addr < 0x8000)) {
+            rd = wr = cvsys->sgmram + addr;
+            dirty = cvsys->sgmramdirty + (addr / SIZE_DIRTYPG);
+            region = STATS_MEM_SGM;
+        }
+        else if (addr < 0x6000) { // Expansion port, nothing plugged in
+            rd = cvsys->unmapped;
+            wr = cvsys->wrsink;
+            region = STATS_MEM_OPEN;
+        }
+        else if (addr < 0x8000) { // 1K RAM mirrored every 1K for 8K
+            rd = wr = cvsys->ram;
+            dirty = cvsys->ramdirty;
+            region = STATS_MEM_RAM;
+        }
+        else { // Cartridge ROM from 0x8000 to 0xffff
+            wr = cvsys->wrsink;
+            region = STATS_MEM_CART;
+
+            if (cvsys->megacart && addr == 0xfc00) // Bank switch page
+                rd = NULL;
+            else if (addr >= (cvsys->romsize + SIZE_32K)) // Padding
+                rd = cvsys->unmapped;
+            else if (addr + SIZE_1K > (cvsys->romsize + SIZE_32K))
+                rd = NULL; // Partially padded
+            else if (cvsys->romdata == NULL)
+                rd = NULL;
+            else
+                rd = cvsys->romdata + cvsys->rompage[(addr >> 13) - 4] +
+                    (addr & 0x1fff);
+        }
+
+        cvsys->rdmap[p] = rd;
+        cvsys->wrmap[p] = wr;
+        cvsys->dirtymap[p] = dirty;
+        cvsys->rdregion[p] = region;
+    }
+}
+
+// Read a byte of memory which can not be read directly through the page table
+static uint8_t jcv_mem_rd_slow(jcv_ctx_t *ctx, uint16_t addr) {
+    cv_sys_t *cvsys = &ctx->cvsys;
+
+    if (cvsys->sgm_lower && (addr < 0x2000)) {
+        return cvsys->sgmram[addr];
     }
     else if (addr < 0x2000) { // BIOS from 0x0000 to 0x1fff
-        return cvbios[addr];
+        return cvsys->cvbios[addr];
     }
-    else if (sgm_upper && (addr < 0x8000)) {
-        return cvsys.sgmram[addr];
+    else if (cvsys->sgm_upper && (addr < 0x8000)) {
+        return cvsys->sgmram[addr];
     }
     else if (addr < 0x6000) { // Expansion port reads when no SGM is plugged in
         return 0xff; // Return default 0xff if nothing is plugged in
     }
     else if (addr < 0x8000) { // 1K RAM mirrored every 1K for 8K
-        return cvsys.ram[addr & 0x3ff];
+        return cvsys->ram[addr & 0x3ff];
     }
     else { // Cartridge ROM from 0x8000 to 0xffff
-        if (megacart && addr >= 0xffc0) { // Select new 16K bank on Mega Carts
+        if (cvsys->megacart && addr >= 0xffc0) { // Select new 16K bank
             /* Divide the number of pages by 2 because we are dealing with 16K
                banks vs 8K banks. Subtract 1 because page numbers are
                zero-indexed. Shift left 14 to create the offset into ROM data.
             */
-            rompage[2] = (addr & ((rompages >> 1) - 1)) << 14;
-            rompage[3] = rompage[2] + SIZE_8K; // Second half of 16K page
+            cvsys->rompage[2] = (addr & ((cvsys->rompages >> 1) - 1)) << 14;
+            cvsys->rompage[3] = cvsys->rompage[2] + SIZE_8K; // Second half
+            jcv_mem_remap(ctx);
         }
 
         // If there are read attempts beyond the ROM's true size, return padding
-        if (addr >= (romsize + SIZE_32K))
+        if (addr >= (cvsys->romsize + SIZE_32K))
             return 0xff;
 
         uint8_t page = (addr >> 13) - 4; // Find the ROM page to read from
-        return romdata[rompage[page] + (addr & 0x1fff)];
+        return cvsys->romdata[cvsys->rompage[page] + (addr & 0x1fff)];
     }
 }
 
-// Write a byte to a memory location
-void jcv_mem_wr(uint16_t addr, uint8_t data) {
-    /* If the Super Game Module is plugged in and activated, the RAM writes will
-       all be mapped to the SGM RAM. This means writes that would normally go to
-       base system RAM are now going into SGM RAM.
-    */
-    if (sgm_lower && (addr < 0x2000))
-        cvsys.sgmram[addr] = data;
-    else if (sgm_upper && (addr > 0x1fff) && (addr < 0x8000))
-        cvsys.sgmram[addr] = data;
-    else if ((addr > 0x5fff) && (addr < 0x8000)) // Base System RAM writes
-        cvsys.ram[addr & 0x3ff] = data;
+// Read a byte of memory
+uint8_t jcv_mem_rd(jcv_ctx_t *ctx, uint16_t addr) {
+    JCV_STATS_INC(ctx, memrd[ctx->cvsys.rdregion[addr >> 10]]);
+    const uint8_t *page = ctx->cvsys.rdmap[addr >> 10];
+    return page ? page[addr & 0x3ff] : jcv_mem_rd_slow(ctx, addr);
 }
 
-// Load the ColecoVision BIOS
-int jcv_bios_load_file(const char *biospath) {
-    FILE *file;
-    long size;
+/* Write a byte to a memory location
+   If the Super Game Module is plugged in and activated, the RAM writes will
+   all be mapped to the SGM RAM. This means writes that would normally go to
+   base system RAM are now going into SGM RAM. Writes to areas which are not
+   writable land in a scratch page. The 256 byte page written to is flagged
+   for incremental states.
+*/
+void jcv_mem_wr(jcv_ctx_t *ctx, uint16_t addr, uint8_t data) {
+    ctx->cvsys.wrmap[addr >> 10][addr & 0x3ff] = data;
+    ctx->cvsys.dirtymap[addr >> 10][(addr >> 8) & 0x03] = 1;
+}
 
-    if (!(file = fopen(biospath, "rb")))
-        return 0;
+/* Load the ColecoVision BIOS from a file. The file is mapped read-only and
+   shared with any other context which has loaded it.
+*/
+int jcv_bios_load_file(jcv_ctx_t *ctx, const char *biospath) {
+    const uint8_t *data;
+    size_t size;
+    jcv_image_t *img = jcv_image_open(biospath, &data, &size);
 
-    // Find out the file's size
-    fseek(file, 0, SEEK_END);
-    size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    if (img == NULL)
+        return 0;
 
     // Make sure it is the correct size before attempting to load it
     if (size != SIZE_CVBIOS) {
-        fclose(file);
+        jcv_image_close(img);
         return 0;
     }
 
-    // Allocate memory for the BIOS
-    cvbios = (uint8_t*)calloc(SIZE_CVBIOS, sizeof(uint8_t));
-
-    if (!fread(cvbios, SIZE_CVBIOS, 1, file)) {
-        fclose(file);
-        return 0;
-    }
-
-    fclose(file);
-
-    bios_internal = 1;
+    jcv_bios_load(ctx, (void*)data, size);
+    ctx->cvsys.biosimg = img;
     return 1;
 }
 
 // Load the ColecoVision BIOS from a memory buffer
-int jcv_bios_load(void *data, size_t size) {
+int jcv_bios_load(jcv_ctx_t *ctx, void *data, size_t size) {
     if (size) { }
-    cvbios = data;
+
+    // Let go of any BIOS previously loaded from a file
+    jcv_image_close(ctx->cvsys.biosimg);
+    ctx->cvsys.biosimg = NULL;
+
+    ctx->cvsys.cvbios = data;
+    jcv_mem_remap(ctx);
     return 1;
 }
 
 // Load a ColecoVision ROM Image
-int jcv_rom_load(void *data, size_t size) {
-    romdata = (uint8_t*)data; // Assign internal ROM pointer
-    romsize = size; // Record the true size of the ROM data in bytes
+int jcv_rom_load(jcv_ctx_t *ctx, void *data, size_t size) {
+    cv_sys_t *cvsys = &ctx->cvsys;
+
+    // Let go of any ROM previously loaded from a file
+    jcv_image_close(cvsys->romimg);
+    cvsys->romimg = NULL;
+
+    cvsys->romdata = (uint8_t*)data; // Assign internal ROM pointer
+    cvsys->romsize = size; // Record the true size of the ROM data in bytes
 
-    if (romsize > 0x8000) { // ROM image is possibly a Mega Cart
+    if (size > 0x8000) { // ROM image is possibly a Mega Cart
         uint16_t hword = // First, check if this is a valid ROM image
-            romdata[romsize - SIZE_16K] | (romdata[romsize - SIZE_16K+1] << 8);
+            cvsys->romdata[size - SIZE_16K] |
+            (cvsys->romdata[size - SIZE_16K + 1] << 8);
         if (hword != 0xaa55 && hword != 0x55aa)
             return 0; // Fail if this not a valid ColecoVision ROM image
 
-        megacart = 1; // Mark the Mega Cart bit true
-        rompages = (size / SIZE_8K) + (size % SIZE_8K ? 1 : 0); // Count pages
+        cvsys->megacart = 1; // Mark the Mega Cart bit true
+        // Count pages
+        cvsys->rompages = (size / SIZE_8K) + (size % SIZE_8K ? 1 : 0);
 
         // The selectable banks are 16K and mapped to 0xc000 - 0xffff
-        rompage[2] = 0x0000; // Map 0xc000 to the first 8K bank
-        rompage[3] = SIZE_8K; // Map 0xe000 to the second 8K bank
+        cvsys->rompage[2] = 0x0000; // Map 0xc000 to the first 8K bank
+        cvsys->rompage[3] = SIZE_8K; // Map 0xe000 to the second 8K bank
 
         // The final 16K segment of ROM is always mapped to 0x8000 - 0xbfff
-        rompage[0] = romsize - SIZE_16K; // First half of final 16K bank
-        rompage[1] = romsize - SIZE_8K; // Second half of final 16K bank
+        cvsys->rompage[0] = size - SIZE_16K; // First half of final 16K bank
+        cvsys->rompage[1] = size - SIZE_8K; // Second half of final 16K bank
 
+        jcv_mem_remap(ctx);
         return 1;
     }
 
@@ -264,46 +385,110 @@ int jcv_rom_load(void *data, size_t size) {
        0x55, 0xaa: Jump to the code vector (start of game code), bypassing BIOS
                    boot routines
     */
-    uint16_t hword = romdata[1] | (romdata[0] << 8); // Header Word
+    // Header Word
+    uint16_t hword = cvsys->romdata[1] | (cvsys->romdata[0] << 8);
     if (hword != 0xaa55 && hword != 0x55aa)
         return 0; // Fail if this not a valid ColecoVision ROM image
 
     // Find out how many 8K pages of ROM data there are
     // Use modulus to discover if there is a page that is not quite 8K
-    rompages = (size / SIZE_8K) + (size % SIZE_8K ? 1 : 0);
+    cvsys->rompages = (size / SIZE_8K) + (size % SIZE_8K ? 1 : 0);
 
     // Assign ROM page offsets to locations in ROM data
     // Schematic shows 4 lines for 8K ROM pages (EN_80, EN_A0, EN_C0, EN_E0)
-    for (int i = 0; i < rompages; ++i)
-        rompage[i] = i * SIZE_8K;
+    for (int i = 0; i < cvsys->rompages; ++i)
+        cvsys->rompage[i] = i * SIZE_8K;
+
+    jcv_mem_remap(ctx);
+    return 1;
+}
+
+/* Load a ColecoVision ROM Image from a file. The file is mapped read-only and
+   shared with any other context which has loaded it, so Mega Cart images of
+   up to 1M need not be copied for each. If the image is not valid, no ROM is
+   left loaded.
+*/
+int jcv_rom_load_file(jcv_ctx_t *ctx, const char *rompath) {
+    cv_sys_t *cvsys = &ctx->cvsys;
+    const uint8_t *data;
+    size_t size;
+    jcv_image_t *img = jcv_image_open(rompath, &data, &size);
+
+    if (img == NULL)
+        return 0;
 
+    if (!jcv_rom_load(ctx, (void*)data, size)) {
+        jcv_image_close(img);
+        cvsys->romdata = NULL;
+        cvsys->romsize = 0;
+        jcv_mem_remap(ctx);
+        return 0;
+    }
+
+    cvsys->romimg = img;
     return 1;
 }
 
+/* SplitMix64 - a small, fast generator with a full 2^64 period. Each context
+   steps its own copy of the state, so the C library's rand() is not touched.
+*/
+static inline uint64_t jcv_memio_rand(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
 // Initialize memory and set I/O states to default
-void jcv_memio_init(void) {
+void jcv_memio_init(jcv_ctx_t *ctx) {
+    cv_sys_t *cvsys = &ctx->cvsys;
+
     /* Fill RAM with garbage - Some software relies on non-zero data at boot,
        such as Yolk's on You, and possibly more. Every individual console may
-       have its own affinities, but the values are still indeterminate.
+       have its own affinities, but the values are still indeterminate. The
+       garbage is generated from the context's seed, so it is reproducible.
     */
-    srand(time(NULL));
-    for (int i = 0; i < SIZE_CVRAM; ++i)
-        cvsys.ram[i] = rand() % 256; // Random numbers from 0-255
+    uint64_t rng = ctx->seed;
+    for (int i = 0; i < SIZE_CVRAM; i += 8) {
+        uint64_t r = jcv_memio_rand(&rng);
+        for (int j = 0; j < 8; ++j)
+            cvsys->ram[i + j] = r >> (j << 3);
+    }
 
-    memset(cvsys.sgmram, 0xff, 0x6000);
+    memset(cvsys->sgmram, 0xff, 0x6000);
 
-    cvsys.cseg = 0; // Controller Strobe Segment
-    cvsys.ctrl[0] = cvsys.ctrl[1] = 0; // Reset input states to empty
+    // Everything has changed since any previous checkpoint
+    memset(cvsys->ramdirty, 1, sizeof(cvsys->ramdirty));
+    memset(cvsys->sgmramdirty, 1, sizeof(cvsys->sgmramdirty));
+
+    cvsys->cseg = 0; // Controller Strobe Segment
+    cvsys->ctrl[0] = cvsys->ctrl[1] = 0; // Reset input states to empty
 
     // Set SGM RAM to disabled state
-    sgm_upper = 0;
-    sgm_lower = 0;
+    cvsys->sgm_upper = 0;
+    cvsys->sgm_lower = 0;
+
+    // Nothing is mapped to the expansion port
+    memset(cvsys->unmapped, 0xff, SIZE_1K);
+    jcv_mem_remap(ctx);
 }
 
 // Deinitialize any allocated memory
-void jcv_memio_deinit(void) {
-    if (cvbios && bios_internal)
-        free(cvbios);
+void jcv_memio_deinit(jcv_ctx_t *ctx) {
+    cv_sys_t *cvsys = &ctx->cvsys;
+
+    // Let go of images loaded from files, which may be unmapped
+    if (cvsys->biosimg) {
+        jcv_image_close(cvsys->biosimg);
+        cvsys->biosimg = NULL;
+        cvsys->cvbios = NULL;
+    }
+
+    if (cvsys->romimg) {
+        jcv_image_close(cvsys->romimg);
+        cvsys->romimg = NULL;
+        cvsys->romdata = NULL;
+    }
 }
 
 // Return the size of a state
@@ -311,76 +496,164 @@ size_t jcv_state_size(void) {
     return SIZE_STATE;
 }
 
-// Load raw state data into the running system
-void jcv_state_load_raw(const void *sstate) {
-    uint8_t *st = (uint8_t*)sstate;
-    jcv_serial_begin();
-    jcv_serial_popblk(cvsys.ram, st, SIZE_CVRAM);
-    jcv_serial_popblk(cvsys.sgmram, st, SIZE_32K);
-    cvsys.cseg = jcv_serial_pop8(st);
-    cvsys.ctrl[0] = jcv_serial_pop16(st);
-    cvsys.ctrl[1] = jcv_serial_pop16(st);
-    for (int i = 0; i < 4; ++i) rompage[i] = jcv_serial_pop32(st);
-    jcv_psg_state_load(st);
-    jcv_sgmpsg_state_load(st);
-    jcv_vdp_state_load(st);
-    jcv_z80_state_load(st);
-}
-
-// Load a state from a file
-int jcv_state_load(const char *filename) {
-    FILE *file;
-    size_t filesize, result;
-    void *sstatefile;
+/* Restore everything but system RAM/SGM RAM, and VRAM if vram is 0. Versions
+   before 2 did not record the SGM RAM mapping or the cycle counts carried
+   between frames, which are then left as they are and started from zero
+   respectively.
+*/
+static void jcv_state_load_regs(jcv_ctx_t *ctx, jcv_serial_t *st,
+    uint8_t vram, uint32_t ver) {
+    cv_sys_t *cvsys = &ctx->cvsys;
+    cvsys->cseg = jcv_serial_pop8(st);
+    cvsys->ctrl[0] = jcv_serial_pop16(st);
+    cvsys->ctrl[1] = jcv_serial_pop16(st);
+    for (int i = 0; i < 4; ++i) cvsys->rompage[i] = jcv_serial_pop32(st);
+    jcv_psg_state_load(ctx, st);
+    jcv_sgmpsg_state_load(ctx, st);
+    jcv_vdp_state_load(ctx, st, vram);
+    jcv_z80_state_load(ctx, st);
+
+    if (ver >= 2) {
+        cvsys->sgm_upper = jcv_serial_pop8(st);
+        cvsys->sgm_lower = jcv_serial_pop8(st);
+        ctx->extracycs = jcv_serial_pop32(st);
+        ctx->cycs = jcv_serial_pop32(st);
+        ctx->psgcycs = jcv_serial_pop32(st);
+    }
+    else {
+        ctx->extracycs = ctx->cycs = ctx->psgcycs = 0;
+    }
 
-    // Open the file for reading
-    file = fopen(filename, "rb");
-    if (!file)
+    jcv_mem_remap(ctx);
+}
+
+// Serialize everything but system RAM/SGM RAM, and VRAM if vram is 0
+static void jcv_state_save_regs(jcv_ctx_t *ctx, jcv_serial_t *st,
+    uint8_t vram) {
+    cv_sys_t *cvsys = &ctx->cvsys;
+    jcv_serial_push8(st, cvsys->cseg);
+    jcv_serial_push16(st, cvsys->ctrl[0]);
+    jcv_serial_push16(st, cvsys->ctrl[1]);
+    for (int i = 0; i < 4; ++i) jcv_serial_push32(st, cvsys->rompage[i]);
+    jcv_psg_state_save(ctx, st);
+    jcv_sgmpsg_state_save(ctx, st);
+    jcv_vdp_state_save(ctx, st, vram);
+    jcv_z80_state_save(ctx, st);
+
+    /* SGM RAM mapping, and cycles carried over to the next frame or not yet
+       run by the PSGs
+    */
+    jcv_serial_push8(st, cvsys->sgm_upper);
+    jcv_serial_push8(st, cvsys->sgm_lower);
+    jcv_serial_push32(st, ctx->extracycs);
+    jcv_serial_push32(st, ctx->cycs);
+    jcv_serial_push32(st, ctx->psgcycs);
+}
+
+// Restore the system's state from serialized data
+static void jcv_state_load_data(jcv_ctx_t *ctx, jcv_serial_t *st,
+    uint32_t ver) {
+    cv_sys_t *cvsys = &ctx->cvsys;
+    jcv_serial_popblk(st, cvsys->ram, SIZE_CVRAM);
+    jcv_serial_popblk(st, cvsys->sgmram, SIZE_32K);
+    memset(cvsys->ramdirty, 1, sizeof(cvsys->ramdirty));
+    memset(cvsys->sgmramdirty, 1, sizeof(cvsys->sgmramdirty));
+    jcv_state_load_regs(ctx, st, 1, ver);
+}
+
+// Serialize the system's state
+static void jcv_state_save_data(jcv_ctx_t *ctx, jcv_serial_t *st) {
+    cv_sys_t *cvsys = &ctx->cvsys;
+    jcv_serial_pushblk(st, cvsys->ram, SIZE_CVRAM);
+    jcv_serial_pushblk(st, cvsys->sgmram, SIZE_32K);
+    jcv_state_save_regs(ctx, st, 1);
+}
+
+/* Check whether serialized state data of a given length would be accepted by
+   jcv_state_load_mem, without touching any running system. Data with or
+   without a header is accepted. Returns 0 if the data is too short or was
+   written by a newer version of the format.
+*/
+int jcv_state_valid(const void *sstate, size_t len) {
+    jcv_serial_t s;
+    jcv_serial_t *st = &s;
+    jcv_serial_begin(st, (uint8_t*)sstate);
+
+    uint32_t ver = jcv_serial_pop_hdr(st, len, JCV_SERIAL_MAGIC);
+    if (ver > JCV_SERIAL_VERSION)
         return 0;
 
-    // Find out the file's size
-    fseek(file, 0, SEEK_END);
-    filesize = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    // Later versions only add fields at the end, within the version 0 size
+    return len >= st->pos + SIZE_STATE_V0;
+}
 
-    // Allocate memory to read the file into
-    sstatefile = (void*)calloc(filesize, sizeof(uint8_t));
-    if (sstatefile == NULL)
+/* Load serialized state data of a given length into the running system. Data
+   with or without a header is accepted. Returns 0 if the data is too short or
+   was written by a newer version of the format.
+*/
+int jcv_state_load_mem(jcv_ctx_t *ctx, const void *sstate, size_t len) {
+    if (!jcv_state_valid(sstate, len))
         return 0;
 
-    // Read the file into memory and then close it
-    result = fread(sstatefile, sizeof(uint8_t), filesize, file);
-    if (result != filesize)
+    jcv_serial_t s;
+    jcv_serial_t *st = &s;
+    jcv_serial_begin(st, (uint8_t*)sstate);
+
+    uint32_t ver = jcv_serial_pop_hdr(st, len, JCV_SERIAL_MAGIC);
+    jcv_state_load_data(ctx, st, ver);
+    return 1;
+}
+
+// Load raw state data into the running system
+void jcv_state_load_raw(jcv_ctx_t *ctx, const void *sstate) {
+    jcv_state_load_mem(ctx, sstate, SIZE_STATE);
+}
+
+/* Load a state from a file, reading it straight into the context's state
+   buffer. No valid state is larger than the buffer, so a file with data left
+   over once it is full is rejected.
+*/
+int jcv_state_load(jcv_ctx_t *ctx, const char *filename) {
+    // Open the file for reading
+    FILE *file = fopen(filename, "rb");
+    if (!file)
         return 0;
+
+    // Read the file into memory and then close it
+    size_t len = fread(ctx->state, sizeof(uint8_t), SIZE_STATE, file);
+    int oversize = fgetc(file) != EOF;
     fclose(file);
 
+    if (oversize)
+        return 0;
+
     // File has been read, now copy it into the emulator
-    jcv_state_load_raw((const void*)sstatefile);
+    return jcv_state_load_mem(ctx, (const void*)ctx->state, len);
+}
 
-    // Free the allocated memory
-    free(sstatefile);
+/* Snapshot the running state directly into a caller-provided buffer, which
+   must be at least jcv_state_size() bytes long. Returns 0 if it is too small.
+*/
+int jcv_state_save_mem(jcv_ctx_t *ctx, void *buf, size_t len) {
+    if (len < SIZE_STATE)
+        return 0;
 
-    return 1; // Success!
+    jcv_serial_t s;
+    jcv_serial_t *st = &s;
+    jcv_serial_begin(st, (uint8_t*)buf);
+    jcv_serial_push_hdr(st, JCV_SERIAL_MAGIC);
+    jcv_state_save_data(ctx, st);
+    return 1;
 }
 
 // Snapshot the running state and return the address of the raw data
-const void* jcv_state_save_raw(void) {
-    jcv_serial_begin();
-    jcv_serial_pushblk(state, cvsys.ram, SIZE_CVRAM);
-    jcv_serial_pushblk(state, cvsys.sgmram, SIZE_32K);
-    jcv_serial_push8(state, cvsys.cseg);
-    jcv_serial_push16(state, cvsys.ctrl[0]);
-    jcv_serial_push16(state, cvsys.ctrl[1]);
-    for (int i = 0; i < 4; ++i) jcv_serial_push32(state, rompage[i]);
-    jcv_psg_state_save(state);
-    jcv_sgmpsg_state_save(state);
-    jcv_vdp_state_save(state);
-    jcv_z80_state_save(state);
-    return (const void*)state;
+const void* jcv_state_save_raw(jcv_ctx_t *ctx) {
+    jcv_state_save_mem(ctx, ctx->state, SIZE_STATE);
+    return (const void*)ctx->state;
 }
 
 // Save a state to a file
-int jcv_state_save(const char *filename) {
+int jcv_state_save(jcv_ctx_t *ctx, const char *filename) {
     // Open the file for writing
     FILE *file;
     file = fopen(filename, "wb");
@@ -388,11 +661,237 @@ int jcv_state_save(const char *filename) {
         return 0;
 
     // Snapshot the running state and get the memory address
-    uint8_t *sstate = (uint8_t*)jcv_state_save_raw();
+    uint8_t *sstate = (uint8_t*)jcv_state_save_raw(ctx);
 
     // Write and close the file
-    fwrite(sstate, jcv_state_size(), sizeof(uint8_t), file);
-    fclose(file);
+    int ok = fwrite(sstate, sizeof(uint8_t), jcv_state_size(), file) ==
+        jcv_state_size();
+    if (fclose(file))
+        ok = 0;
+
+    return ok;
+}
+
+/* Incremental States
+   System RAM, SGM RAM and VRAM are tracked in 256 byte pages, and each page
+   is flagged when it is written to. An incremental state holds only the pages
+   written since the last checkpoint, along with the full CPU, PSG and VDP
+   register state, and taking one is a checkpoint. Loading an incremental state
+   on top of the state it was taken against reproduces the sender's state.
+
+   Format:
+     Header (magic number "JCVI")
+     Bitmap of dirty pages: System RAM, SGM RAM, then VRAM, MSB first
+     Contents of each dirty page, in the same order
+     All other state data, as in a full state
+*/
+#define NUM_DIRTYPG ((SIZE_CVRAM + SIZE_32K + SIZE_VRAM) / SIZE_DIRTYPG)
+#define SIZE_DIRTYBITS ((NUM_DIRTYPG + 7) / 8)
+
+typedef struct _jcv_dirtyrgn_t {
+    uint8_t *mem; // Memory being tracked
+    uint8_t *dirty; // Dirty flag for each page
+    size_t pages; // Number of pages
+} jcv_dirtyrgn_t;
+
+// Fill in the tracked memory regions in the order they are serialized
+static void jcv_state_dirtyrgns(jcv_ctx_t *ctx, jcv_dirtyrgn_t *rgn) {
+    cv_sys_t *cvsys = &ctx->cvsys;
+    cv_vdp_t *vdp = &ctx->vdp;
+    rgn[0] = (jcv_dirtyrgn_t){ cvsys->ram, cvsys->ramdirty,
+        sizeof(cvsys->ramdirty) };
+    rgn[1] = (jcv_dirtyrgn_t){ cvsys->sgmram, cvsys->sgmramdirty,
+        sizeof(cvsys->sgmramdirty) };
+    rgn[2] = (jcv_dirtyrgn_t){ vdp->vram, vdp->vramdirty,
+        sizeof(vdp->vramdirty) };
+}
+
+/* Return the largest possible size of an incremental state: the header, the
+   bitmap, every page, and the register state. This is the full state size
+   plus the bitmap, as a full state holds the same pages and registers.
+*/
+size_t jcv_state_size_incremental(void) {
+    return (SIZE_STATE - SIZE_STATE_V0) + SIZE_DIRTYBITS +
+        NUM_DIRTYPG * SIZE_DIRTYPG + SIZE_STATE_REGS;
+}
+
+// Clear the dirty page flags without taking an incremental state
+void jcv_state_checkpoint(jcv_ctx_t *ctx) {
+    jcv_dirtyrgn_t rgn[3];
+    jcv_state_dirtyrgns(ctx, rgn);
+    for (int r = 0; r < 3; ++r)
+        memset(rgn[r].dirty, 0, rgn[r].pages);
+}
+
+/* Serialize the pages written since the last checkpoint and the register
+   state into a caller-provided buffer of at least jcv_state_size_incremental()
+   bytes, and make this the new checkpoint. Returns the number of bytes used,
+   or 0 if the buffer is too small.
+*/
+size_t jcv_state_save_incremental(jcv_ctx_t *ctx, void *buf, size_t len) {
+    if (len < jcv_state_size_incremental())
+        return 0;
+
+    jcv_serial_t s;
+    jcv_serial_t *st = &s;
+    jcv_serial_begin(st, (uint8_t*)buf);
+    jcv_serial_push_hdr(st, JCV_SERIAL_MAGIC_INC);
+
+    jcv_dirtyrgn_t rgn[3];
+    jcv_state_dirtyrgns(ctx, rgn);
+
+    uint8_t bits = 0;
+    size_t nbits = 0;
+    for (int r = 0; r < 3; ++r) {
+        for (size_t p = 0; p < rgn[r].pages; ++p) {
+            bits = (bits << 1) | rgn[r].dirty[p];
+            if ((++nbits & 0x07) == 0)
+                jcv_serial_push8(st, bits);
+        }
+    }
+    if (nbits & 0x07)
+        jcv_serial_push8(st, bits << (8 - (nbits & 0x07)));
+
+    for (int r = 0; r < 3; ++r) {
+        for (size_t p = 0; p < rgn[r].pages; ++p) {
+            if (rgn[r].dirty[p]) {
+                jcv_serial_pushblk(st, rgn[r].mem + p * SIZE_DIRTYPG,
+                    SIZE_DIRTYPG);
+                rgn[r].dirty[p] = 0;
+            }
+        }
+    }
+
+    jcv_state_save_regs(ctx, st, 0);
+    return st->pos;
+}
+
+/* Apply an incremental state on top of the running system. Returns 0 if the
+   data is not a valid incremental state, without touching the system.
+*/
+int jcv_state_load_incremental(jcv_ctx_t *ctx, const void *buf, size_t len) {
+    jcv_serial_t s;
+    jcv_serial_t *st = &s;
+    jcv_serial_begin(st, (uint8_t*)buf);
+
+    uint32_t ver = jcv_serial_pop_hdr(st, len, JCV_SERIAL_MAGIC_INC);
+    if (ver == 0 || ver > JCV_SERIAL_VERSION)
+        return 0;
+
+    if (len < st->pos + SIZE_DIRTYBITS)
+        return 0;
+
+    // Count the dirty pages to make sure all of the data is present
+    const uint8_t *bitmap = st->mem + st->pos;
+    size_t pages = 0;
+    for (size_t i = 0; i < NUM_DIRTYPG; ++i)
+        pages += (bitmap[i >> 3] >> (7 - (i & 0x07))) & 0x01;
+
+    size_t datalen = SIZE_DIRTYBITS + pages * SIZE_DIRTYPG +
+        SIZE_STATE_REGS - (ver < 2 ? SIZE_STATE_V2 : 0);
+    if (len < st->pos + datalen)
+        return 0;
+
+    st->pos += SIZE_DIRTYBITS;
 
-    return 1; // Success!
+    jcv_dirtyrgn_t rgn[3];
+    jcv_state_dirtyrgns(ctx, rgn);
+
+    size_t i = 0;
+    for (int r = 0; r < 3; ++r) {
+        for (size_t p = 0; p < rgn[r].pages; ++p, ++i) {
+            if ((bitmap[i >> 3] >> (7 - (i & 0x07))) & 0x01) {
+                jcv_serial_popblk(st, rgn[r].mem + p * SIZE_DIRTYPG,
+                    SIZE_DIRTYPG);
+                rgn[r].dirty[p] = 1;
+            }
+        }
+    }
+
+    jcv_state_load_regs(ctx, st, 0, ver);
+    return 1;
+}
+
+/* State Hash
+   A fast 64-bit hash of the full system state, for comparing the results of
+   two runs (desync detection, or deduplicating replays) without transferring
+   or comparing whole states. Memory is hashed in place, and the remaining
+   register state is serialized first so that the result does not depend on
+   the layout of any structure in memory. Words are read little-endian, so
+   the hash is the same on every platform.
+
+   The hash is in the style of xxHash64: four lanes absorb 32 bytes per round
+   with a multiply and rotate each, and are then merged and mixed. It is not
+   meant to be compatible with xxHash64, and is not cryptographic.
+*/
+#define HASH_PRIME1 0x9e3779b185ebca87ULL
+#define HASH_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define HASH_PRIME3 0x165667b19e3779f9ULL
+
+static inline uint64_t jcv_hash_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t jcv_hash_rd64(const uint8_t *p) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+#else
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) |
+        ((uint64_t)p[3] << 24) | ((uint64_t)p[4] << 32) |
+        ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) |
+        ((uint64_t)p[7] << 56);
+#endif
+}
+
+static inline uint64_t jcv_hash_round(uint64_t acc, uint64_t w) {
+    return jcv_hash_rotl(acc + w * HASH_PRIME2, 31) * HASH_PRIME1;
+}
+
+// Absorb data into the lanes, padding the final round with zeros
+static void jcv_hash_blk(uint64_t *lane, const uint8_t *data, size_t len) {
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        for (int l = 0; l < 4; ++l)
+            lane[l] = jcv_hash_round(lane[l], jcv_hash_rd64(data + i + l * 8));
+    }
+
+    if (i < len) {
+        uint8_t tail[32] = { 0 };
+        memcpy(tail, data + i, len - i);
+        for (int l = 0; l < 4; ++l)
+            lane[l] = jcv_hash_round(lane[l], jcv_hash_rd64(tail + l * 8));
+    }
+}
+
+// Return a hash of the full system state
+uint64_t jcv_state_hash(jcv_ctx_t *ctx) {
+    uint64_t lane[4] = {
+        HASH_PRIME1 + HASH_PRIME2, HASH_PRIME2, 0, 0 - HASH_PRIME1
+    };
+
+    jcv_dirtyrgn_t rgn[3];
+    jcv_state_dirtyrgns(ctx, rgn);
+    for (int r = 0; r < 3; ++r)
+        jcv_hash_blk(lane, rgn[r].mem, rgn[r].pages * SIZE_DIRTYPG);
+
+    /* Serialize the rest of the state into a local buffer, leaving the
+       context's state buffer as the last snapshot left it
+    */
+    uint8_t regs[SIZE_STATE_REGS];
+    jcv_serial_t s;
+    jcv_serial_begin(&s, regs);
+    jcv_state_save_regs(ctx, &s, 0);
+    jcv_hash_blk(lane, regs, s.pos);
+
+    uint64_t h = jcv_hash_rotl(lane[0], 1) + jcv_hash_rotl(lane[1], 7) +
+        jcv_hash_rotl(lane[2], 12) + jcv_hash_rotl(lane[3], 18) + s.pos;
+
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME3;
+    return h ^ (h >> 32);
 }
@@ -39,6 +39,14 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define SIZE_CVBIOS SIZE_8K
 #define SIZE_CVRAM SIZE_1K
 
+#define SIZE_STATE 50400 // Serialized state including the 8 byte header
+#define SIZE_STATE_V0 50392 // Serialized state without a header (version 0)
+#define SIZE_STATE_V2 14 // Fields added to the state in version 2
+#define SIZE_STATE_REGS 187 // State other than System RAM, SGM RAM and VRAM
+
+#define SIZE_MEMMAP 64 // Number of 1K pages in the Z80 address space
+#define SIZE_DIRTYPG 0x100 // Size of the pages tracked for incremental states
+
 // Segment 0: Numpad, FireR
 #define CV_INPUT_FR 0x40 // Right Fire Button
 #define CV_INPUT_1 0x02 // Numpad 1
@@ -67,34 +75,82 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define CV_INPUT_P 0x07 // Purple
 #define CV_INPUT_B 0x0b // Blue
 
+#define CV_INPUT_IDLE 0x8080 // Input state with nothing pressed (bit 7 preset)
+
+#define INPUT_STROBE 0 // Frontend is polled each time a port is strobed
+#define INPUT_LATCHED 1 // Input state is latched once per frame
+
 typedef struct _cv_sys_t {
     uint8_t ram[SIZE_CVRAM]; // System RAM
     uint8_t sgmram[SIZE_32K]; // Super Game Module RAM
     uint8_t cseg; // Controller Strobe Segment
     uint16_t ctrl[2]; // Controller Input state
+
+    uint8_t *cvbios; // BIOS ROM
+    struct _jcv_image_t *biosimg; // Shared image the BIOS was loaded from
+    uint8_t *romdata; // Game ROM
+    struct _jcv_image_t *romimg; // Shared image the ROM was loaded from
+    size_t romsize; // Size of the ROM in bytes
+    uint8_t rompages; // Number of 8K ROM pages
+    uint32_t rompage[4]; // Offsets to the start of 8K ROM pages
+
+    uint8_t megacart; // Mark whether the cart is a Mega Cart or not
+    uint8_t sgm_upper; // Enable upper 24K SGM RAM
+    uint8_t sgm_lower; // Enable lower 8K SGM RAM - replaces BIOS mapping
+
+    const uint8_t *rdmap[SIZE_MEMMAP]; // Page table for reads (NULL = slow)
+    uint8_t *wrmap[SIZE_MEMMAP]; // Page table for writes
+    uint8_t rdregion[SIZE_MEMMAP]; // Region each page reads from (statistics)
+    uint8_t unmapped[SIZE_1K]; // Reads from unmapped pages (all 0xff)
+    uint8_t wrsink[SIZE_1K]; // Writes to read-only or unmapped pages
+
+    // Flags for 256 byte pages written since the last checkpoint
+    uint8_t *dirtymap[SIZE_MEMMAP]; // Flags for each 1K page of the map
+    uint8_t ramdirty[SIZE_CVRAM / SIZE_DIRTYPG]; // System RAM
+    uint8_t sgmramdirty[SIZE_32K / SIZE_DIRTYPG]; // SGM RAM
+    uint8_t sinkdirty[SIZE_1K / SIZE_DIRTYPG]; // Write sink (never saved)
+
+    uint8_t inmode; // Strobed or Latched input
+    uint16_t inlatch[2]; // Input state latched for the current frame
+    uint16_t (*input_cb)(void*, int); // Input poll callback
 } cv_sys_t;
 
-void jcv_input_set_callback(uint16_t (*)(int));
+void jcv_input_set_callback(jcv_ctx_t*, uint16_t (*)(void*, int));
+void jcv_input_set_mode(jcv_ctx_t*, uint8_t);
+void jcv_input_set_state(jcv_ctx_t*, int, uint16_t);
+void jcv_input_frame(jcv_ctx_t*);
+uint16_t jcv_input_rd(jcv_ctx_t*, int);
 
-uint8_t jcv_io_rd(uint8_t);
-void jcv_io_wr(uint8_t, uint8_t);
+uint8_t jcv_io_rd(jcv_ctx_t*, uint8_t);
+void jcv_io_wr(jcv_ctx_t*, uint8_t, uint8_t);
 
-uint8_t jcv_mem_rd(uint16_t);
-void jcv_mem_wr(uint16_t, uint8_t);
+uint8_t jcv_mem_rd(jcv_ctx_t*, uint16_t);
+void jcv_mem_wr(jcv_ctx_t*, uint16_t, uint8_t);
 
-void jcv_memio_init(void);
-void jcv_memio_deinit(void);
+void jcv_memio_init(jcv_ctx_t*);
+void jcv_memio_deinit(jcv_ctx_t*);
 
-int jcv_bios_load_file(const char*);
-int jcv_bios_load(void*, size_t);
-int jcv_rom_load(void*, size_t);
+int jcv_bios_load_file(jcv_ctx_t*, const char*);
+int jcv_bios_load(jcv_ctx_t*, void*, size_t);
+int jcv_rom_load(jcv_ctx_t*, void*, size_t);
+int jcv_rom_load_file(jcv_ctx_t*, const char*);
 
 size_t jcv_state_size(void);
 
-void jcv_state_load_raw(const void*);
-int jcv_state_load(const char*);
+void jcv_state_load_raw(jcv_ctx_t*, const void*);
+int jcv_state_valid(const void*, size_t);
+int jcv_state_load_mem(jcv_ctx_t*, const void*, size_t);
+int jcv_state_load(jcv_ctx_t*, const char*);
+
+const void* jcv_state_save_raw(jcv_ctx_t*);
+int jcv_state_save_mem(jcv_ctx_t*, void*, size_t);
+int jcv_state_save(jcv_ctx_t*, const char*);
+
+size_t jcv_state_size_incremental(void);
+void jcv_state_checkpoint(jcv_ctx_t*);
+size_t jcv_state_save_incremental(jcv_ctx_t*, void*, size_t);
+int jcv_state_load_incremental(jcv_ctx_t*, const void*, size_t);
 
-const void* jcv_state_save_raw(void);
-int jcv_state_save(const char*);
+uint64_t jcv_state_hash(jcv_ctx_t*);
 
 #endif
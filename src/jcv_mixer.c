@@ -33,32 +33,27 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <speex/speex_resampler.h>
 
+#include "jcv.h"
+#include "jcv_blip.h"
+#include "jcv_memio.h"
 #include "jcv_mixer.h"
+#include "jcv_movie.h"
 #include "jcv_psg.h"
+#include "jcv_rewind.h"
 #include "jcv_sgmpsg.h"
+#include "jcv_stats.h"
+#include "jcv_vdp.h"
+#include "jcv_ctx.h"
 
 #define SAMPLERATE_PSG 224010 // Approximate PSG sample rate (Hz)
 #define SIZE_PSGBUF 4600 // Size of the PSG buffers
-
-static int16_t *abuf = NULL; // Buffer to output resampled data into
-static int16_t *psgbuf = NULL; // PSG buffer
-static int16_t *sgmpsgbuf = NULL; // SGM PSG buffer
-static size_t samplerate = 48000; // Default sample rate is 48000Hz
-static uint8_t framerate = 60; // Default to 60 for NTSC
-static uint8_t rsq = 3; // Default resampler quality is 3
-
-// Speex
-static SpeexResamplerState *resampler = NULL;
-static int err;
-
-// Callback to notify the fronted that N samples are ready
-static void (*jcv_mixer_cb)(size_t);
+#define DIV_PSG 16 // PSG Clock Divider
 
 // Set the output sample rate
-void jcv_mixer_set_rate(size_t rate) {
+void jcv_mixer_set_rate(jcv_ctx_t *ctx, size_t rate) {
     switch (rate) {
         case 44100: case 48000: case 96000: case 192000:
-            samplerate = rate;
+            ctx->mixer.samplerate = rate;
             break;
         default:
             break;
@@ -66,65 +61,196 @@ void jcv_mixer_set_rate(size_t rate) {
 }
 
 // Set the region
-void jcv_mixer_set_region(uint8_t region) {
-    framerate = region ? 50 : 60; // 50 for PAL, 60 for NSTC
+void jcv_mixer_set_region(jcv_ctx_t *ctx, uint8_t region) {
+    ctx->mixer.framerate = region ? 50 : 60; // 50 for PAL, 60 for NSTC
 }
 
 // Set the resampler quality
-void jcv_mixer_set_rsqual(uint8_t qual) {
+void jcv_mixer_set_rsqual(jcv_ctx_t *ctx, uint8_t qual) {
     if (qual <= 10)
-        rsq = qual;
+        ctx->mixer.rsq = qual;
+}
+
+// Set the resampler used to convert PSG output to the output sample rate
+void jcv_mixer_set_resampler(jcv_ctx_t *ctx, uint8_t mode) {
+    if (mode <= RESAMPLER_BLIP)
+        ctx->mixer.rsmode = mode;
+}
+
+/* Set the number of scanlines between pushes of audio to the frontend. With 0,
+   audio is pushed once at the end of each frame. Otherwise, audio produced so
+   far is resampled and pushed every N scanlines as well as at the end of the
+   frame, reducing latency by up to one frame. The number of samples in each
+   push varies, and the output buffer is reused for each one.
+*/
+void jcv_mixer_set_stream(jcv_ctx_t *ctx, size_t lines) {
+    ctx->mixer.stream = lines;
+    ctx->mixer.streamline = 0;
+}
+
+/* Set whether audio is muted. Muted audio is discarded at the end of each
+   frame without being resampled, and the callback is not executed, saving the
+   cost of resampling when running frames that will not be heard.
+*/
+void jcv_mixer_set_mute(jcv_ctx_t *ctx, uint8_t mute) {
+    ctx->mixer.mute = mute;
 }
 
 // Set the pointer to the output audio buffer
-void jcv_mixer_set_buffer(int16_t *ptr) {
-    abuf = ptr;
+void jcv_mixer_set_buffer(jcv_ctx_t *ctx, int16_t *ptr) {
+    ctx->mixer.abuf = ptr;
 }
 
 // Set the callback that notifies the frontend that N audio samples are ready
-void jcv_mixer_set_callback(void (*cb)(size_t)) {
-    jcv_mixer_cb = cb;
+void jcv_mixer_set_callback(jcv_ctx_t *ctx, void (*cb)(void*, size_t)) {
+    ctx->mixer.cb = cb;
 }
 
 // Deinitialize the resampler
-void jcv_mixer_deinit(void) {
-    if (resampler) {
-        speex_resampler_destroy(resampler);
-        resampler = NULL;
+void jcv_mixer_deinit(jcv_ctx_t *ctx) {
+    cv_mixer_t *mixer = &ctx->mixer;
+
+    if (mixer->resampler) {
+        speex_resampler_destroy(mixer->resampler);
+        mixer->resampler = NULL;
     }
 
-    if (psgbuf)
-        free(psgbuf);
+    jcv_blip_destroy(mixer->blip);
+    mixer->blip = NULL;
+
+    if (mixer->psgbuf)
+        free(mixer->psgbuf);
 
-    if (sgmpsgbuf)
-        free(sgmpsgbuf);
+    if (mixer->sgmpsgbuf)
+        free(mixer->sgmpsgbuf);
+
+    mixer->psgbuf = mixer->sgmpsgbuf = NULL;
 }
 
 // Bring up the Speex resampler
-void jcv_mixer_init(void) {
-    resampler = speex_resampler_init(1, SAMPLERATE_PSG, samplerate, rsq, &err);
-    psgbuf = (int16_t*)calloc(1, SIZE_PSGBUF * sizeof(int16_t));
-    sgmpsgbuf = (int16_t*)calloc(1, SIZE_PSGBUF * sizeof(int16_t));
-    jcv_psg_set_buffer(psgbuf);
-    jcv_sgmpsg_set_buffer(sgmpsgbuf);
+void jcv_mixer_init(jcv_ctx_t *ctx) {
+    cv_mixer_t *mixer = &ctx->mixer;
+    mixer->resampler = speex_resampler_init(1, SAMPLERATE_PSG,
+        mixer->samplerate, mixer->rsq, &mixer->err);
+    mixer->rsstep = ((uint64_t)SAMPLERATE_PSG << 16) / mixer->samplerate;
+    mixer->blip = jcv_blip_create(SAMPLERATE_PSG, mixer->samplerate,
+        SIZE_PSGBUF);
+    mixer->rspos = 0;
+    mixer->rsacc = 0;
+    mixer->streamline = 0;
+    mixer->psgbuf = (int16_t*)calloc(1, SIZE_PSGBUF * sizeof(int16_t));
+    mixer->sgmpsgbuf = (int16_t*)calloc(1, SIZE_PSGBUF * sizeof(int16_t));
+    jcv_psg_set_buffer(ctx, mixer->psgbuf);
+    jcv_sgmpsg_set_buffer(ctx, mixer->sgmpsgbuf);
+}
+
+/* Run the PSGs to catch up with the CPU. Rather than clocking the sound chips
+   after every instruction, the PSGs render every Z80 cycle run since they
+   were last caught up in one block when the CPU is about to change their
+   state (a register write), or when the frame ends. Any leftover cycles which
+   do not make up a full PSG cycle are carried over to the next catch-up.
+*/
+void jcv_mixer_sync(jcv_ctx_t *ctx) {
+    size_t psgcycs = (ctx->cycs - ctx->psgcycs) / DIV_PSG;
+    ctx->psgcycs += psgcycs * DIV_PSG;
+
+    JCV_STATS_ENTER(ctx, STATS_PSG);
+    jcv_psg_render(ctx, psgcycs);
+    JCV_STATS_SWITCH(ctx, STATS_SGMPSG);
+    jcv_sgmpsg_render(ctx, psgcycs);
+    JCV_STATS_LEAVE(ctx);
+}
+
+// Push audio to the frontend partway through a frame when streaming
+void jcv_mixer_scanline(jcv_ctx_t *ctx) {
+    cv_mixer_t *mixer = &ctx->mixer;
+
+    if (mixer->stream && ++mixer->streamline >= mixer->stream) {
+        jcv_mixer_sync(ctx);
+        jcv_mixer_resamp(ctx, ctx->psg.bufpos, ctx->sgmpsg.bufpos);
+    }
+}
+
+/* Box Filter Resampler
+   Each output sample is the average of the input over the span of time it
+   covers, with input samples straddling the boundary between two outputs split
+   between them by the fraction of their time falling in each. Positions are
+   16.16 fixed-point counts of input samples. As the PSG rate is higher than
+   any output rate, an input sample never spans more than two output samples.
+*/
+static size_t jcv_mixer_resamp_box(cv_mixer_t *mixer, size_t in_psg,
+    size_t in_sgmpsg, size_t maxout) {
+    uint32_t step = mixer->rsstep;
+    size_t outsamps = 0;
+
+    for (size_t i = 0; i < in_psg; ++i) {
+        int32_t samp = mixer->psgbuf[i];
+        if (in_sgmpsg)
+            samp += mixer->sgmpsgbuf[i];
+
+        if (mixer->rspos + 0x10000 < step) {
+            mixer->rsacc += (int64_t)samp << 16;
+            mixer->rspos += 0x10000;
+            continue;
+        }
+
+        // This input sample completes an output sample
+        uint32_t part = step - mixer->rspos;
+        int64_t out = (mixer->rsacc + (int64_t)samp * part) / step;
+
+        if (outsamps < maxout) {
+            mixer->abuf[outsamps++] =
+                out > INT16_MAX ? INT16_MAX : out < INT16_MIN ? INT16_MIN : out;
+        }
+
+        mixer->rspos = 0x10000 - part;
+        mixer->rsacc = (int64_t)samp * mixer->rspos;
+    }
+
+    return outsamps;
 }
 
 // Resample raw audio and execute the callback
-void jcv_mixer_resamp(size_t in_psg, size_t in_sgmpsg) {
+void jcv_mixer_resamp(jcv_ctx_t *ctx, size_t in_psg, size_t in_sgmpsg) {
+    cv_mixer_t *mixer = &ctx->mixer;
+
     // Reset buffer position for both chips
-    jcv_psg_reset_buffer();
-    jcv_sgmpsg_reset_buffer();
+    jcv_psg_reset_buffer(ctx);
+    jcv_sgmpsg_reset_buffer(ctx);
+    mixer->streamline = 0;
+
+    spx_uint32_t outsamps = mixer->samplerate / mixer->framerate;
+
+    // The PSGs have already added their output to the step buffer
+    if (mixer->rsmode == RESAMPLER_BLIP) {
+        outsamps = jcv_blip_read(mixer->blip, in_psg, mixer->abuf,
+            outsamps + 1);
+        if (!mixer->mute)
+            mixer->cb(ctx->udata, outsamps);
+        return;
+    }
+
+    // Raw samples were discarded by resetting the buffer positions
+    if (mixer->mute)
+        return;
+
+    if (mixer->rsmode == RESAMPLER_BOX) {
+        // Rounding may produce one sample more than the nominal frame size
+        outsamps = jcv_mixer_resamp_box(mixer, in_psg, in_sgmpsg, outsamps + 1);
+        mixer->cb(ctx->udata, outsamps);
+        return;
+    }
 
     spx_uint32_t in_len = in_psg;
 
     // If the SGM is active, mix it in
     if (in_sgmpsg) {
         for (size_t i = 0; i < in_len; ++i)
-            psgbuf[i] += sgmpsgbuf[i];
+            mixer->psgbuf[i] += mixer->sgmpsgbuf[i];
     }
 
-    spx_uint32_t outsamps = samplerate / framerate;
-    err = speex_resampler_process_int(resampler, 0, (spx_int16_t*)psgbuf,
-        &in_len, (spx_int16_t*)abuf, &outsamps);
-    jcv_mixer_cb(outsamps);
+    mixer->err = speex_resampler_process_int(mixer->resampler, 0,
+        (spx_int16_t*)mixer->psgbuf, &in_len, (spx_int16_t*)mixer->abuf,
+        &outsamps);
+    mixer->cb(ctx->udata, outsamps);
 }
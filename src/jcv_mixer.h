@@ -31,14 +31,43 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef JCV_MIXER_H
 #define JCV_MIXER_H
 
-void jcv_mixer_deinit(void);
-void jcv_mixer_init(void);
-
-void jcv_mixer_set_buffer(int16_t*);
-void jcv_mixer_set_callback(void (*)(size_t));
-void jcv_mixer_set_rate(size_t);
-void jcv_mixer_set_region(uint8_t);
-void jcv_mixer_set_rsqual(uint8_t);
-void jcv_mixer_resamp(size_t, size_t);
+#define RESAMPLER_SPEEX 0 // Speex Resampler (quality set by rsqual)
+#define RESAMPLER_BOX 1 // Fixed-point box filter: lower cost and quality
+#define RESAMPLER_BLIP 2 // Band-limited steps generated at the output rate
+
+typedef struct _cv_mixer_t {
+    int16_t *abuf; // Buffer to output resampled data into
+    int16_t *psgbuf; // PSG buffer
+    int16_t *sgmpsgbuf; // SGM PSG buffer
+    size_t samplerate; // Output sample rate
+    uint8_t framerate; // 60 for NTSC, 50 for PAL
+    uint8_t rsq; // Resampler quality
+    struct SpeexResamplerState_ *resampler; // Speex Resampler
+    struct _cv_blip_t *blip; // Band-limited step buffer
+    int err; // Speex Resampler error code
+    uint8_t rsmode; // Resampler used to convert to the output sample rate
+    uint32_t rsstep; // Box filter: input samples per output sample (16.16)
+    uint32_t rspos; // Box filter: position within the current output sample
+    int64_t rsacc; // Box filter: weighted sum for the current output sample
+    size_t stream; // Scanlines between audio pushes (0: once per frame)
+    size_t streamline; // Scanlines run since the last audio push
+    uint8_t mute; // Discard audio instead of resampling and pushing it
+    void (*cb)(void*, size_t); // Notify the frontend that N samples are ready
+} cv_mixer_t;
+
+void jcv_mixer_deinit(jcv_ctx_t*);
+void jcv_mixer_init(jcv_ctx_t*);
+
+void jcv_mixer_set_buffer(jcv_ctx_t*, int16_t*);
+void jcv_mixer_set_callback(jcv_ctx_t*, void (*)(void*, size_t));
+void jcv_mixer_set_rate(jcv_ctx_t*, size_t);
+void jcv_mixer_set_region(jcv_ctx_t*, uint8_t);
+void jcv_mixer_set_rsqual(jcv_ctx_t*, uint8_t);
+void jcv_mixer_set_resampler(jcv_ctx_t*, uint8_t);
+void jcv_mixer_set_stream(jcv_ctx_t*, size_t);
+void jcv_mixer_set_mute(jcv_ctx_t*, uint8_t);
+void jcv_mixer_scanline(jcv_ctx_t*);
+void jcv_mixer_sync(jcv_ctx_t*);
+void jcv_mixer_resamp(jcv_ctx_t*, size_t, size_t);
 
 #endif
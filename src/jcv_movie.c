@@ -0,0 +1,291 @@
+/*
+Copyright (c) 2020-2022 Rupert Carmichael
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Input Movies
+   A movie holds the full state of the machine when recording began, followed
+   by the input state of both controller ports for every frame. As nothing
+   else influences emulation once the state is loaded, feeding the recorded
+   input back reproduces the session exactly.
+
+   While recording, each port is read from the frontend the first time the
+   game strobes it in a frame, and the result is kept for the rest of the
+   frame, so that the movie holds exactly what the game saw. While replaying,
+   the frontend's input callback is not called at all. jcv_movie_run replays
+   as fast as possible, without drawing or producing audio except where asked
+   to, for checking recorded sessions against expected frames or states.
+
+   Format:
+     Header (magic number "JCVM")
+     Region (8 bits)
+     Number of frames (32 bits)
+     Length of the starting state (32 bits)
+     Starting state, as written by jcv_state_save_mem
+     Input state of port 0 and then port 1 for each frame (16 bits each)
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "jcv.h"
+#include "jcv_memio.h"
+#include "jcv_mixer.h"
+#include "jcv_movie.h"
+#include "jcv_psg.h"
+#include "jcv_rewind.h"
+#include "jcv_serial.h"
+#include "jcv_sgmpsg.h"
+#include "jcv_stats.h"
+#include "jcv_vdp.h"
+#include "jcv_ctx.h"
+
+#define MOVIE_GROW 3600 // Frames of room added when recording fills the array
+#define SIZE_MOVIE_HDR (SIZE_SERIAL_HDR + 9) // Header, region and two lengths
+
+// Make room for at least the requested number of frames
+static int jcv_movie_reserve(cv_movie_t *movie, size_t frames) {
+    if (frames <= movie->cap)
+        return 1;
+
+    size_t cap = movie->cap + MOVIE_GROW;
+    if (cap < frames)
+        cap = frames;
+
+    uint16_t *input =
+        (uint16_t*)realloc(movie->input, cap * 2 * sizeof(uint16_t));
+    if (input == NULL)
+        return 0;
+
+    movie->input = input;
+    movie->cap = cap;
+    return 1;
+}
+
+// Stop recording or replaying, and free the movie
+void jcv_movie_stop(jcv_ctx_t *ctx) {
+    cv_movie_t *movie = &ctx->movie;
+
+    free(movie->input);
+    free(movie->start);
+
+    movie->input = NULL;
+    movie->start = NULL;
+    movie->frames = movie->cap = movie->pos = 0;
+    movie->polled = 0;
+    movie->mode = MOVIE_OFF;
+}
+
+/* Start recording a movie from the current state, replacing any movie already
+   recorded or loaded. Should be called between frames. Returns 0 on failure.
+*/
+int jcv_movie_record(jcv_ctx_t *ctx) {
+    cv_movie_t *movie = &ctx->movie;
+    jcv_movie_stop(ctx);
+
+    movie->start = (uint8_t*)malloc(SIZE_STATE);
+    if (movie->start == NULL || !jcv_movie_reserve(movie, MOVIE_GROW)) {
+        jcv_movie_stop(ctx);
+        return 0;
+    }
+
+    jcv_state_save_mem(ctx, movie->start, SIZE_STATE);
+    movie->region =
+        ctx->numscanlines == CV_VDP_SCANLINES_PAL ? REGION_PAL : REGION_NTSC;
+    movie->mode = MOVIE_RECORD;
+    return 1;
+}
+
+// Return the number of bytes needed to save the movie
+size_t jcv_movie_size(jcv_ctx_t *ctx) {
+    cv_movie_t *movie = &ctx->movie;
+
+    if (movie->start == NULL)
+        return 0;
+
+    return SIZE_MOVIE_HDR + SIZE_STATE + movie->frames * 2 * sizeof(uint16_t);
+}
+
+/* Write the movie to a buffer of at least jcv_movie_size() bytes. A movie
+   being recorded may be saved at any point, and holds every frame completed
+   so far. Returns the number of bytes written, or 0 on failure.
+*/
+size_t jcv_movie_save(jcv_ctx_t *ctx, void *buf, size_t len) {
+    cv_movie_t *movie = &ctx->movie;
+    size_t size = jcv_movie_size(ctx);
+
+    if (size == 0 || len < size)
+        return 0;
+
+    jcv_serial_t s;
+    jcv_serial_t *st = &s;
+    jcv_serial_begin(st, (uint8_t*)buf);
+    jcv_serial_push_hdr(st, JCV_SERIAL_MAGIC_MOVIE);
+    jcv_serial_push8(st, movie->region);
+    jcv_serial_push32(st, movie->frames);
+    jcv_serial_push32(st, SIZE_STATE);
+    jcv_serial_pushblk(st, movie->start, SIZE_STATE);
+
+    for (size_t i = 0; i < movie->frames * 2; ++i)
+        jcv_serial_push16(st, movie->input[i]);
+
+    return st->pos;
+}
+
+/* Load a movie and start replaying it, replacing any movie already recorded
+   or loaded. The region is set to the one it was recorded in, and the machine
+   is put in its starting state, so the ROM it was recorded with must already
+   be loaded. Returns 0 if the data is not a valid movie, in which case the
+   running system is untouched.
+*/
+int jcv_movie_load(jcv_ctx_t *ctx, const void *buf, size_t len) {
+    cv_movie_t *movie = &ctx->movie;
+
+    jcv_serial_t s;
+    jcv_serial_t *st = &s;
+    jcv_serial_begin(st, (uint8_t*)buf);
+
+    uint32_t ver = jcv_serial_pop_hdr(st, len, JCV_SERIAL_MAGIC_MOVIE);
+    if (ver == 0 || ver > JCV_SERIAL_VERSION || len < SIZE_MOVIE_HDR)
+        return 0;
+
+    uint8_t region = jcv_serial_pop8(st);
+    size_t frames = jcv_serial_pop32(st);
+    size_t statelen = jcv_serial_pop32(st);
+
+    if (statelen > SIZE_STATE || statelen > len - SIZE_MOVIE_HDR ||
+        (len - SIZE_MOVIE_HDR - statelen) / (2 * sizeof(uint16_t)) < frames) {
+        return 0;
+    }
+
+    // Check the embedded state before anything in the running system changes
+    if (!jcv_state_valid((const uint8_t*)buf + st->pos, statelen))
+        return 0;
+
+    // Read into new buffers, so the old movie survives a failed allocation
+    uint8_t *start = (uint8_t*)calloc(1, SIZE_STATE);
+    uint16_t *input = (uint16_t*)malloc((frames ? frames : 1) * 2 *
+        sizeof(uint16_t));
+
+    if (start == NULL || input == NULL) {
+        free(start);
+        free(input);
+        return 0;
+    }
+
+    jcv_serial_popblk(st, start, statelen);
+
+    for (size_t i = 0; i < frames * 2; ++i)
+        input[i] = jcv_serial_pop16(st);
+
+    // The movie is valid, so replace the old one and apply its start state
+    jcv_movie_stop(ctx);
+    jcv_set_region(ctx, region);
+    jcv_state_load_mem(ctx, start, statelen);
+
+    movie->start = start;
+    movie->input = input;
+    movie->cap = frames;
+    movie->region = region;
+    movie->frames = frames;
+    movie->mode = frames ? MOVIE_REPLAY : MOVIE_OFF;
+    return 1;
+}
+
+// Return the number of frames recorded or loaded
+size_t jcv_movie_frames(jcv_ctx_t *ctx) {
+    return ctx->movie.frames;
+}
+
+// Return the number of frames recorded or replayed so far
+size_t jcv_movie_pos(jcv_ctx_t *ctx) {
+    return ctx->movie.pos;
+}
+
+/* Replay up to the requested number of frames of a loaded movie as fast as
+   possible, with audio output muted. If draw is non-zero, the final frame run
+   is drawn to the video output buffer, and no others are. Returns the number
+   of frames run, which is less than requested if the movie ends first.
+*/
+size_t jcv_movie_run(jcv_ctx_t *ctx, size_t frames, int draw) {
+    cv_movie_t *movie = &ctx->movie;
+    uint8_t mute = ctx->mixer.mute;
+    size_t run = 0;
+
+    jcv_mixer_set_mute(ctx, 1);
+
+    for (; run < frames && movie->mode == MOVIE_REPLAY; ++run) {
+        if (draw && (run + 1 == frames || movie->pos + 1 == movie->frames))
+            jcv_exec(ctx);
+        else
+            jcv_exec_noframe(ctx);
+    }
+
+    jcv_mixer_set_mute(ctx, mute);
+    return run;
+}
+
+// Input state for a strobe of a port while recording or replaying
+uint16_t jcv_movie_input(jcv_ctx_t *ctx, int port) {
+    cv_movie_t *movie = &ctx->movie;
+    uint16_t *input = movie->input + movie->pos * 2;
+
+    if (movie->mode == MOVIE_RECORD && !(movie->polled & (1 << port))) {
+        input[port] = jcv_input_rd(ctx, port);
+        movie->polled |= 1 << port;
+    }
+
+    return input[port];
+}
+
+// Move on to the next frame at the end of each frame
+void jcv_movie_frame(jcv_ctx_t *ctx) {
+    cv_movie_t *movie = &ctx->movie;
+
+    if (movie->mode == MOVIE_REPLAY) {
+        if (++movie->pos >= movie->frames)
+            movie->mode = MOVIE_OFF; // Input returns to the frontend
+        return;
+    }
+
+    // Ports which were not polled keep the state last seen by the game
+    uint16_t *input = movie->input + movie->pos * 2;
+    for (int p = 0; p < 2; ++p) {
+        if (!(movie->polled & (1 << p)))
+            input[p] = ctx->cvsys.ctrl[p];
+    }
+
+    movie->polled = 0;
+    ++movie->frames;
+    ++movie->pos;
+
+    // Stop recording rather than lose input if memory runs out
+    if (!jcv_movie_reserve(movie, movie->frames + 1))
+        movie->mode = MOVIE_OFF;
+}
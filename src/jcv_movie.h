@@ -0,0 +1,61 @@
+/*
+Copyright (c) 2020-2022 Rupert Carmichael
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JCV_MOVIE_H
+#define JCV_MOVIE_H
+
+#define MOVIE_OFF 0 // Input comes from the frontend's callback
+#define MOVIE_RECORD 1 // Input from the frontend is recorded
+#define MOVIE_REPLAY 2 // Input comes from a loaded movie
+
+typedef struct _cv_movie_t {
+    uint8_t mode; // Off, recording or replaying
+    uint16_t *input; // Input state of both ports for each frame
+    size_t frames; // Number of frames recorded or loaded
+    size_t cap; // Number of frames there is room for in the input array
+    size_t pos; // Frame currently being run
+    uint8_t polled; // Ports polled so far this frame while recording
+    uint8_t region; // Region the movie was recorded in
+    uint8_t *start; // Full state the movie begins from
+} cv_movie_t;
+
+int jcv_movie_record(jcv_ctx_t*);
+void jcv_movie_stop(jcv_ctx_t*);
+size_t jcv_movie_size(jcv_ctx_t*);
+size_t jcv_movie_save(jcv_ctx_t*, void*, size_t);
+int jcv_movie_load(jcv_ctx_t*, const void*, size_t);
+size_t jcv_movie_frames(jcv_ctx_t*);
+size_t jcv_movie_pos(jcv_ctx_t*);
+size_t jcv_movie_run(jcv_ctx_t*, size_t, int);
+
+uint16_t jcv_movie_input(jcv_ctx_t*, int);
+void jcv_movie_frame(jcv_ctx_t*);
+
+#endif
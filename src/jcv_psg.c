@@ -33,8 +33,18 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stddef.h>
 #include <stdint.h>
 
+#include "jcv.h"
+#include "jcv_blip.h"
+#include "jcv_memio.h"
+#include "jcv_mixer.h"
+#include "jcv_movie.h"
 #include "jcv_psg.h"
+#include "jcv_rewind.h"
 #include "jcv_serial.h"
+#include "jcv_sgmpsg.h"
+#include "jcv_stats.h"
+#include "jcv_vdp.h"
+#include "jcv_ctx.h"
 
 #define LFSRSHIFT 14 // Linear Feedback Shift Register is 15 bits, so shift 14
 #define NOISETAP 0x0003 // Tapped bits for ColecoVision are 0 and 1
@@ -45,38 +55,61 @@ static const int16_t vtable[16] = { // Volume Table
     0x0512, 0x0407, 0x0333, 0x028b, 0x0205, 0x019b, 0x0146, 0x0000,
 };
 
-static cv_psg_t psg; // PSG Context
-static int16_t *psgbuf = NULL; // Buffer for raw PSG output samples
-static size_t bufpos = 0; // Keep track of the position in the PSG output buffer
+/* Output a sample for a run of cycles. When band-limited step synthesis is in
+   use, only changes in the output level are recorded, in the step buffer, and
+   the buffer position is used as the time within the block.
+*/
+static inline void jcv_psg_output(jcv_ctx_t *ctx, int16_t samp, size_t run) {
+    cv_psg_t *psg = &ctx->psg;
+
+    if (ctx->mixer.rsmode == RESAMPLER_BLIP) {
+        if (samp != psg->level) {
+            jcv_blip_delta(ctx->mixer.blip, psg->bufpos, samp - psg->level);
+            psg->level = samp;
+        }
+    }
+    else {
+        int16_t *buf = psg->buf + psg->bufpos;
+        for (size_t i = 0; i < run; ++i)
+            buf[i] = samp;
+    }
+
+    psg->bufpos += run;
+}
 
 // Set the pointer to the sample buffer
-void jcv_psg_set_buffer(int16_t *ptr) {
-    psgbuf = ptr;
+void jcv_psg_set_buffer(jcv_ctx_t *ctx, int16_t *ptr) {
+    ctx->psg.buf = ptr;
 }
 
 // Grab the pointer to the PSG's buffer
-void jcv_psg_reset_buffer(void) {
-    bufpos = 0;
+void jcv_psg_reset_buffer(jcv_ctx_t *ctx) {
+    ctx->psg.bufpos = 0;
 }
 
 // Set initial values
-void jcv_psg_init(void) {
-    psg.clatch = 0x00; // Channel Latch starts at Tone Channel 0
+void jcv_psg_init(jcv_ctx_t *ctx) {
+    cv_psg_t *psg = &ctx->psg;
+
+    psg->clatch = 0x00; // Channel Latch starts at Tone Channel 0
 
     for (int i = 0; i < 4; ++i) {
-        psg.attenuator[i] = 0x0f; // Silence
-        psg.counter[i] = 0x00; // Count starting from 0
+        psg->attenuator[i] = 0x0f; // Silence
+        psg->counter[i] = 0x00; // Count starting from 0
     }
 
     // Set the frequency and noise registers to 0
-    psg.frequency[0] = psg.frequency[1] = psg.frequency[2] = psg.noise = 0x00;
+    psg->frequency[0] = psg->frequency[1] = psg->frequency[2] = 0x00;
+    psg->noise = 0x00;
 
-    psg.lfsr = 1 << LFSRSHIFT; // Seed the noise shift register
-    psg.freqff = 0x00; // Frequency flip-flop bits start at 0 (Positive)
+    psg->lfsr = 1 << LFSRSHIFT; // Seed the noise shift register
+    psg->freqff = 0x00; // Frequency flip-flop bits start at 0 (Positive)
 }
 
 // Write to PSG Control Registers
-void jcv_psg_wr(uint8_t data) {
+void jcv_psg_wr(jcv_ctx_t *ctx, uint8_t data) {
+    cv_psg_t *psg = &ctx->psg;
+
     /* Register Writes
     There are two types of register writes, referred to in the smspower
     documentation as LATCH/DATA and DATA.
@@ -117,28 +150,28 @@ void jcv_psg_wr(uint8_t data) {
     |-------------------------------|  0x02 = N/2048, 0x03 = Tone 2 Freq Counter
     */
     if (data & 0x80) // LATCH/DATA byte - update the latch
-        psg.clatch = data; // Record the data in the channel latch
+        psg->clatch = data; // Record the data in the channel latch
 
     // For convenience, store the channel as a variable
-    uint8_t chan = (psg.clatch & 0x60) >> 5; // Channel (2 bits, 0-3)
+    uint8_t chan = (psg->clatch & 0x60) >> 5; // Channel (2 bits, 0-3)
 
-    if (psg.clatch & 0x10) { // Attenuator Registers for channels 0-3
+    if (psg->clatch & 0x10) { // Attenuator Registers for channels 0-3
         // (DDDDDD)dddd = (--vvvv)vvvv
-        psg.attenuator[chan] = data & 0x0f;
+        psg->attenuator[chan] = data & 0x0f;
     }
     else { // Frequency/Noise Registers
         if (chan < 3) { // Frequency Registers for channels 0-2
             // DDDDDDdddd = cccccccccc
-            psg.frequency[chan] = data & 0x80 ? // Detect byte type
-                (psg.frequency[chan] & 0x03f0) | (data & 0x0f) : // LATCH/DATA
-                ((psg.frequency[chan] & 0x0f) | (data << 4)) & 0x03ff; // DATA
+            psg->frequency[chan] = data & 0x80 ? // Detect byte type
+                (psg->frequency[chan] & 0x03f0) | (data & 0x0f) : // LATCH/DATA
+                ((psg->frequency[chan] & 0x0f) | (data << 4)) & 0x03ff; // DATA
         }
         else if (chan == 3) { // Noise Register for channel 3
             // (DDDDDD)dddd = (---trr)-trr
-            psg.noise = data & 0x07;
+            psg->noise = data & 0x07;
             // Whenever the noise control register is changed, the shift
             // register is cleared/reseeded.
-            psg.lfsr = 1 << LFSRSHIFT;
+            psg->lfsr = 1 << LFSRSHIFT;
         }
     }
 }
@@ -154,14 +187,16 @@ static inline uint16_t parity(uint16_t v) {
 }
 
 // Execute a PSG cycle
-size_t jcv_psg_exec(void) {
+size_t jcv_psg_exec(jcv_ctx_t *ctx) {
+    cv_psg_t *psg = &ctx->psg;
+
     // Tone Generators
     for (size_t i = 0; i < 3; ++i) {
         // Each clock cycle, the counter is decremented (if it is non-zero)
-        if (psg.counter[i] > 0)
-            --psg.counter[i]; // Decrement the period counter
+        if (psg->counter[i] > 0)
+            --psg->counter[i]; // Decrement the period counter
 
-        if (psg.counter[i] == 0) {
+        if (psg->counter[i] == 0) {
             /* When the tone counter decrements to zero, it is reloaded with
                the value of the corresponding frequency register. In order to
                produce a wave, it must oscillate. The value in the frequency
@@ -171,37 +206,37 @@ size_t jcv_psg_exec(void) {
                is set to 1, they output a DC offset value corresponding to the
                volume level. PCM is done by rapidly changing the volume level.
             */
-            psg.counter[i] = psg.frequency[i];
+            psg->counter[i] = psg->frequency[i];
 
             // Update the volume of the output channel
-            psg.output[i] = vtable[psg.attenuator[i]];
+            psg->output[i] = vtable[psg->attenuator[i]];
 
             // Flip the frequency flip-flop for the channel (sign/polarity bit)
-            psg.freqff ^= 1 << i;
+            psg->freqff ^= 1 << i;
 
             // Set the waveform high or low
-            if (psg.freqff & (1 << i))
-                psg.output[i] = 0;
+            if (psg->freqff & (1 << i))
+                psg->output[i] = 0;
         }
     }
 
     // Noise Generator
-    if (psg.counter[3] > 0) // If it is already zero, no need to decrement
-        --psg.counter[3];
+    if (psg->counter[3] > 0) // If it is already zero, no need to decrement
+        --psg->counter[3];
 
     // Update the volume value for the noise output channel
-    psg.output[3] = (psg.lfsr & 0x01) * vtable[psg.attenuator[3]];
+    psg->output[3] = (psg->lfsr & 0x01) * vtable[psg->attenuator[3]];
 
-    if (psg.counter[3] == 0) {
+    if (psg->counter[3] == 0) {
         /* Set the shift rate or use the Tone Generator 2 frequency
            If the value of the lowest two bits of the noise register is 3, then
            use the value of Tone Generator 2's frequency. Otherwise shift 0x10
            left by the value of the register.
         */
-        psg.counter[3] = (psg.noise & 0x03) == 0x03 ?
-            psg.frequency[2] : 0x10 << (psg.noise & 0x03);
+        psg->counter[3] = (psg->noise & 0x03) == 0x03 ?
+            psg->frequency[2] : 0x10 << (psg->noise & 0x03);
 
-        psg.freqff ^= 0x08; // Flip the bit for this channel
+        psg->freqff ^= 0x08; // Flip the bit for this channel
 
         /* White Noise:
         ->|1|0|0|0|0|0|0|0|0|0|0|0|0|0|0|  Bits 0 and 1 are the Tapped Bits.
@@ -224,39 +259,147 @@ size_t jcv_psg_exec(void) {
 
         Bit 14 set, Bit 0 discarded
         */
-        if (psg.freqff & 0x08) { // Adjust if frequency flip-flop bit is set
+        if (psg->freqff & 0x08) { // Adjust if frequency flip-flop bit is set
             // First shift the register, then insert the proper bit at Bit 14
-            psg.lfsr = (psg.lfsr >> 1) | ((psg.noise & 0x04) ?
-                (parity(psg.lfsr & NOISETAP) << LFSRSHIFT) : // White Noise
-                ((psg.lfsr & 0x01) << LFSRSHIFT)); // Periodic Noise
+            psg->lfsr = (psg->lfsr >> 1) | ((psg->noise & 0x04) ?
+                (parity(psg->lfsr & NOISETAP) << LFSRSHIFT) : // White Noise
+                ((psg->lfsr & 0x01) << LFSRSHIFT)); // Periodic Noise
         }
     }
 
     // Mix the channel output volumes into a single sample
-    psgbuf[bufpos++] =
-        psg.output[0] + psg.output[1] + psg.output[2] + psg.output[3];
+    jcv_psg_output(ctx,
+        psg->output[0] + psg->output[1] + psg->output[2] + psg->output[3], 1);
 
     return 1; // Return 1, signifying that a sample has been generated
 }
 
-void jcv_psg_state_load(uint8_t *st) {
-    psg.clatch = jcv_serial_pop8(st);
-    for (size_t i = 0; i < 4; ++i) psg.attenuator[i] = jcv_serial_pop8(st);
-    for (size_t i = 0; i < 3; ++i) psg.frequency[i] = jcv_serial_pop16(st);
-    psg.noise = jcv_serial_pop8(st);
-    psg.lfsr = jcv_serial_pop16(st);
-    for (size_t i = 0; i < 4; ++i) psg.counter[i] = jcv_serial_pop16(st);
-    for (size_t i = 0; i < 4; ++i) psg.output[i] = jcv_serial_pop16(st);
-    psg.freqff = jcv_serial_pop8(st);
+// Number of cycles until a period counter reaches zero and is reloaded
+static inline size_t jcv_psg_cyc_event(uint16_t counter) {
+    return counter ? counter : 1;
+}
+
+/* Advance a period counter by a number of cycles, reloading it with the period
+   each time it reaches zero, and return the number of reloads which occurred
+*/
+static inline size_t jcv_psg_advance(uint16_t *counter, uint16_t period,
+    size_t cycs) {
+    size_t first = jcv_psg_cyc_event(*counter);
+
+    if (cycs < first) {
+        *counter -= cycs;
+        return 0;
+    }
+
+    cycs -= first;
+
+    if (period == 0) { // A period of 0 reloads the counter every cycle
+        *counter = 0;
+        return 1 + cycs;
+    }
+
+    *counter = period - (cycs % period);
+    return 1 + (cycs / period);
+}
+
+/* Render a block of PSG cycles
+   Outside of counter reloads, a cycle does nothing but decrement the counters
+   and output the same sample as the last one. Runs of cycles between reloads
+   are filled directly, and only cycles where a counter reaches zero are run
+   through jcv_psg_exec. Channels which are silent and will remain silent have
+   their counters advanced arithmetically so they never shorten a run.
+*/
+size_t jcv_psg_render(jcv_ctx_t *ctx, size_t n) {
+    cv_psg_t *psg = &ctx->psg;
+    size_t samps = n;
+
+    // A noise counter reload uses either a fixed rate or Tone 2's frequency
+    uint16_t nreload = (psg->noise & 0x03) == 0x03 ?
+        psg->frequency[2] : 0x10 << (psg->noise & 0x03);
+
+    // Determine which channels' counter reloads can affect the output
+    uint8_t audible = 0;
+
+    for (size_t i = 0; i < 3; ++i) {
+        if (psg->attenuator[i] != 0x0f || psg->output[i])
+            audible |= 1 << i;
+    }
+
+    if (psg->attenuator[3] != 0x0f)
+        audible |= 0x08;
+
+    while (n) {
+        // Find the number of cycles until an audible counter reload
+        size_t run = n;
+
+        for (size_t i = 0; i < 4; ++i) {
+            if (audible & (1 << i)) {
+                size_t cycs = jcv_psg_cyc_event(psg->counter[i]) - 1;
+                if (cycs < run)
+                    run = cycs;
+            }
+        }
+
+        if (run) {
+            // The noise output only changes after the shift register does
+            psg->output[3] = (psg->lfsr & 0x01) * vtable[psg->attenuator[3]];
+
+            int16_t samp =
+                psg->output[0] + psg->output[1] + psg->output[2] +
+                psg->output[3];
+
+            jcv_psg_output(ctx, samp, run);
+
+            // Advance the counters, catching up on reloads of silent channels
+            for (size_t i = 0; i < 3; ++i) {
+                size_t reloads = jcv_psg_advance(&psg->counter[i],
+                    psg->frequency[i], run);
+                psg->freqff ^= (reloads & 0x01) << i;
+            }
+
+            size_t reloads = jcv_psg_advance(&psg->counter[3], nreload, run);
+
+            while (reloads--) {
+                psg->freqff ^= 0x08;
+                if (psg->freqff & 0x08) {
+                    psg->lfsr = (psg->lfsr >> 1) | ((psg->noise & 0x04) ?
+                        (parity(psg->lfsr & NOISETAP) << LFSRSHIFT) :
+                        ((psg->lfsr & 0x01) << LFSRSHIFT));
+                }
+            }
+
+            n -= run;
+        }
+
+        if (n) { // Run the cycle where a reload occurs
+            jcv_psg_exec(ctx);
+            --n;
+        }
+    }
+
+    return samps;
+}
+
+void jcv_psg_state_load(jcv_ctx_t *ctx, jcv_serial_t *st) {
+    cv_psg_t *psg = &ctx->psg;
+    psg->clatch = jcv_serial_pop8(st);
+    for (size_t i = 0; i < 4; ++i) psg->attenuator[i] = jcv_serial_pop8(st);
+    for (size_t i = 0; i < 3; ++i) psg->frequency[i] = jcv_serial_pop16(st);
+    psg->noise = jcv_serial_pop8(st);
+    psg->lfsr = jcv_serial_pop16(st);
+    for (size_t i = 0; i < 4; ++i) psg->counter[i] = jcv_serial_pop16(st);
+    for (size_t i = 0; i < 4; ++i) psg->output[i] = jcv_serial_pop16(st);
+    psg->freqff = jcv_serial_pop8(st);
 }
 
-void jcv_psg_state_save(uint8_t *st) {
-    jcv_serial_push8(st, psg.clatch);
-    for (size_t i = 0; i < 4; ++i) jcv_serial_push8(st, psg.attenuator[i]);
-    for (size_t i = 0; i < 3; ++i) jcv_serial_push16(st, psg.frequency[i]);
-    jcv_serial_push8(st, psg.noise);
-    jcv_serial_push16(st, psg.lfsr);
-    for (size_t i = 0; i < 4; ++i) jcv_serial_push16(st, psg.counter[i]);
-    for (size_t i = 0; i < 4; ++i) jcv_serial_push16(st, psg.output[i]);
-    jcv_serial_push8(st, psg.freqff);
+void jcv_psg_state_save(jcv_ctx_t *ctx, jcv_serial_t *st) {
+    cv_psg_t *psg = &ctx->psg;
+    jcv_serial_push8(st, psg->clatch);
+    for (size_t i = 0; i < 4; ++i) jcv_serial_push8(st, psg->attenuator[i]);
+    for (size_t i = 0; i < 3; ++i) jcv_serial_push16(st, psg->frequency[i]);
+    jcv_serial_push8(st, psg->noise);
+    jcv_serial_push16(st, psg->lfsr);
+    for (size_t i = 0; i < 4; ++i) jcv_serial_push16(st, psg->counter[i]);
+    for (size_t i = 0; i < 4; ++i) jcv_serial_push16(st, psg->output[i]);
+    jcv_serial_push8(st, psg->freqff);
 }
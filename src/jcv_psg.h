@@ -40,16 +40,20 @@ typedef struct _cv_psg_t {
     uint16_t counter[4]; // Period Counter
     int16_t output[4]; // Per-channel output volumes for mixing
     uint8_t freqff; // Four bits for four channels, 0 = Positive, 1 = Negative
+    int16_t *buf; // Buffer for raw PSG output samples
+    size_t bufpos; // Keep track of the position in the PSG output buffer
+    int16_t level; // Output level last recorded in the step buffer
 } cv_psg_t;
 
-void jcv_psg_set_buffer(int16_t*);
-void jcv_psg_reset_buffer(void);
+void jcv_psg_set_buffer(jcv_ctx_t*, int16_t*);
+void jcv_psg_reset_buffer(jcv_ctx_t*);
 
-void jcv_psg_init(void);
-void jcv_psg_wr(uint8_t);
-size_t jcv_psg_exec(void);
+void jcv_psg_init(jcv_ctx_t*);
+void jcv_psg_wr(jcv_ctx_t*, uint8_t);
+size_t jcv_psg_exec(jcv_ctx_t*);
+size_t jcv_psg_render(jcv_ctx_t*, size_t);
 
-void jcv_psg_state_load(uint8_t*);
-void jcv_psg_state_save(uint8_t*);
+void jcv_psg_state_load(jcv_ctx_t*, jcv_serial_t*);
+void jcv_psg_state_save(jcv_ctx_t*, jcv_serial_t*);
 
 #endif
@@ -0,0 +1,346 @@
+/*
+Copyright (c) 2020-2022 Rupert Carmichael
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Snapshot Ring
+   Snapshots of the full system state are kept in a ring for rewinding and for
+   rollback. Most of the state (SGM RAM and VRAM in particular) does not change
+   from one frame to the next, so each snapshot is stored as the difference
+   between itself and the most recent keyframe: the two states are XORed, and
+   the result is run-length encoded as alternating runs of unchanged bytes and
+   literal XORed bytes. Keyframes are encoded the same way against a state of
+   all zeros. Restoring any snapshot therefore decodes at most two entries.
+
+   Encoded snapshots are packed into a fixed size pool which acts as the memory
+   budget. When the pool or the ring is full, the oldest snapshots are evicted
+   a whole keyframe group at a time, as deltas are useless without their key.
+
+   Encoded Format:
+     Repeated until the end of the state: a count of unchanged bytes followed
+     by a count of literal bytes (both LEB128 variable length integers), and
+     then the literal bytes themselves.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jcv.h"
+#include "jcv_memio.h"
+#include "jcv_mixer.h"
+#include "jcv_movie.h"
+#include "jcv_psg.h"
+#include "jcv_rewind.h"
+#include "jcv_sgmpsg.h"
+#include "jcv_stats.h"
+#include "jcv_vdp.h"
+#include "jcv_ctx.h"
+
+#define REWIND_MINRUN 4 // Unchanged bytes needed to end a literal run
+
+// Return the byte a state is being compared against, where NULL is all zeros
+static inline uint8_t jcv_rewind_ref(const uint8_t *ref, size_t i) {
+    return ref ? ref[i] : 0;
+}
+
+// Return the offset of the first byte at or after i which has changed
+static inline size_t jcv_rewind_match(const uint8_t *cur, const uint8_t *ref,
+    size_t i) {
+    // Compare a word at a time while possible, as most of the state is equal
+    while (i + 8 <= SIZE_STATE) {
+        uint64_t a, b = 0;
+        memcpy(&a, cur + i, 8);
+        if (ref)
+            memcpy(&b, ref + i, 8);
+        if (a != b)
+            break;
+        i += 8;
+    }
+
+    while (i < SIZE_STATE && cur[i] == jcv_rewind_ref(ref, i))
+        ++i;
+
+    return i;
+}
+
+// Write a variable length integer
+static inline size_t jcv_rewind_putv(uint8_t *out, size_t v) {
+    size_t len = 0;
+    while (v >= 0x80) {
+        out[len++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    out[len++] = v;
+    return len;
+}
+
+// Read a variable length integer
+static inline size_t jcv_rewind_getv(const uint8_t *in, size_t *pos) {
+    size_t v = 0;
+    unsigned shift = 0;
+    uint8_t b;
+    do {
+        b = in[(*pos)++];
+        v |= (size_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return v;
+}
+
+// Encode the difference between two states, returning the encoded length
+static size_t jcv_rewind_encode(const uint8_t *cur, const uint8_t *ref,
+    uint8_t *out) {
+    size_t i = 0;
+    size_t o = 0;
+
+    while (i < SIZE_STATE) {
+        size_t lit = jcv_rewind_match(cur, ref, i);
+        o += jcv_rewind_putv(out + o, lit - i);
+        i = lit;
+
+        /* Extend the literal run until enough unchanged bytes follow it to be
+           worth starting a new run, or the end of the state is reached.
+        */
+        while (lit < SIZE_STATE) {
+            if (cur[lit] != jcv_rewind_ref(ref, lit)) {
+                ++lit;
+                continue;
+            }
+
+            size_t m = lit;
+            while (m < SIZE_STATE && m - lit < REWIND_MINRUN &&
+                cur[m] == jcv_rewind_ref(ref, m))
+                ++m;
+
+            if (m - lit == REWIND_MINRUN || m == SIZE_STATE)
+                break;
+
+            lit = m;
+        }
+
+        o += jcv_rewind_putv(out + o, lit - i);
+        for (; i < lit; ++i)
+            out[o++] = cur[i] ^ jcv_rewind_ref(ref, i);
+    }
+
+    return o;
+}
+
+// Apply an encoded difference to a state
+static void jcv_rewind_decode(const uint8_t *in, size_t len, uint8_t *dst) {
+    size_t pos = 0;
+    size_t i = 0;
+
+    while (pos < len) {
+        i += jcv_rewind_getv(in, &pos);
+        size_t lit = jcv_rewind_getv(in, &pos);
+        for (size_t j = 0; j < lit; ++j)
+            dst[i++] ^= in[pos++];
+    }
+}
+
+// Evict the oldest keyframe group
+static void jcv_rewind_evict(cv_rewind_t *rw) {
+    do {
+        rw->first = (rw->first + 1) % rw->slots;
+        --rw->count;
+    } while (rw->count && rw->ent[rw->first].key != rw->first);
+}
+
+// Make room for a new snapshot and return its ring slot, or -1 on failure
+static long jcv_rewind_alloc(cv_rewind_t *rw, size_t len) {
+    if (len > rw->poolsize)
+        return -1;
+
+    if (rw->count == rw->slots)
+        jcv_rewind_evict(rw);
+
+    /* Wrap around to the start of the pool if the snapshot does not fit at the
+       end. Anything left at the end is older than what is at the start, so
+       it must be evicted first to keep the ring in order.
+    */
+    if (rw->wpos + len > rw->poolsize) {
+        while (rw->count && rw->ent[rw->first].off >= rw->wpos)
+            jcv_rewind_evict(rw);
+        rw->wpos = 0;
+    }
+
+    // Snapshots are packed in order, so only the oldest ones can be in the way
+    while (rw->count) {
+        cv_rewind_ent_t *e = &rw->ent[rw->first];
+        if (e->off >= rw->wpos + len || e->off + e->len <= rw->wpos)
+            break;
+        jcv_rewind_evict(rw);
+    }
+
+    return (rw->first + rw->count) % rw->slots;
+}
+
+/* Initialize the snapshot ring to hold up to a number of snapshots, within a
+   memory budget in bytes for the encoded data. Returns 0 on failure.
+*/
+int jcv_rewind_init(jcv_ctx_t *ctx, size_t frames, size_t budget) {
+    cv_rewind_t *rw = &ctx->rewind;
+    jcv_rewind_deinit(ctx);
+
+    if (!frames || !budget)
+        return 0;
+
+    rw->pool = (uint8_t*)malloc(budget);
+    rw->ent = (cv_rewind_ent_t*)calloc(frames, sizeof(cv_rewind_ent_t));
+    rw->key = (uint8_t*)calloc(1, SIZE_STATE);
+    rw->cur = (uint8_t*)calloc(1, SIZE_STATE);
+    rw->enc = (uint8_t*)calloc(2, SIZE_STATE);
+
+    if (!rw->pool || !rw->ent || !rw->key || !rw->cur || !rw->enc) {
+        jcv_rewind_deinit(ctx);
+        return 0;
+    }
+
+    rw->poolsize = budget;
+    rw->slots = frames;
+    rw->keyint = REWIND_KEYINT;
+    return 1;
+}
+
+// Free the snapshot ring
+void jcv_rewind_deinit(jcv_ctx_t *ctx) {
+    cv_rewind_t *rw = &ctx->rewind;
+    free(rw->pool);
+    free(rw->ent);
+    free(rw->key);
+    free(rw->cur);
+    free(rw->enc);
+    memset(rw, 0, sizeof(cv_rewind_t));
+}
+
+// Set the number of snapshots between keyframes
+void jcv_rewind_set_keyint(jcv_ctx_t *ctx, size_t keyint) {
+    ctx->rewind.keyint = keyint ? keyint : 1;
+}
+
+// Return the number of snapshots currently held
+size_t jcv_rewind_count(jcv_ctx_t *ctx) {
+    return ctx->rewind.count;
+}
+
+// Snapshot the running state into the ring - returns 0 on failure
+int jcv_rewind_push(jcv_ctx_t *ctx) {
+    cv_rewind_t *rw = &ctx->rewind;
+
+    if (rw->pool == NULL)
+        return 0;
+
+    jcv_state_save_mem(ctx, rw->cur, SIZE_STATE);
+
+    /* Keyframe groups are kept to at most half of the ring and of the pool, so
+       that evicting the oldest group never leaves the ring close to empty.
+    */
+    size_t newest = (rw->first + rw->count + rw->slots - 1) % rw->slots;
+    size_t keyint = rw->keyint < rw->slots / 2 ? rw->keyint : rw->slots / 2;
+    int iskey = !rw->count || rw->sincekey >= keyint;
+    size_t len = 0;
+    long slot;
+
+    // A delta larger than its keyframe is better stored as a new keyframe
+    if (!iskey) {
+        len = jcv_rewind_encode(rw->cur, rw->key, rw->enc);
+        iskey = len > rw->ent[rw->ent[newest].key].len ||
+            rw->grouplen + len > rw->poolsize / 2;
+    }
+
+    if (!iskey) {
+        if ((slot = jcv_rewind_alloc(rw, len)) < 0)
+            return 0;
+
+        // Making room may have evicted this delta's keyframe group entirely
+        if (rw->count)
+            rw->ent[slot].key = rw->ent[newest].key;
+        else
+            iskey = 1;
+    }
+
+    if (iskey) {
+        len = jcv_rewind_encode(rw->cur, NULL, rw->enc);
+        if ((slot = jcv_rewind_alloc(rw, len)) < 0)
+            return 0;
+        rw->ent[slot].key = slot;
+        memcpy(rw->key, rw->cur, SIZE_STATE);
+        rw->sincekey = 0;
+        rw->grouplen = 0;
+    }
+
+    rw->ent[slot].off = rw->wpos;
+    rw->ent[slot].len = len;
+    memcpy(rw->pool + rw->wpos, rw->enc, len);
+    rw->wpos += len;
+    rw->grouplen += len;
+    ++rw->count;
+    ++rw->sincekey;
+
+    return 1;
+}
+
+/* Restore the snapshot taken a number of snapshots before the newest one, so
+   that 0 restores the newest. Newer snapshots are discarded, leaving the one
+   restored as the newest, so repeatedly restoring 1 steps backwards through
+   time. Returns 0 if there is no such snapshot.
+*/
+int jcv_rewind_restore(jcv_ctx_t *ctx, size_t back) {
+    cv_rewind_t *rw = &ctx->rewind;
+
+    if (back >= rw->count)
+        return 0;
+
+    size_t slot = (rw->first + rw->count - 1 - back) % rw->slots;
+    cv_rewind_ent_t *e = &rw->ent[slot];
+    cv_rewind_ent_t *k = &rw->ent[e->key];
+
+    // Rebuild the keyframe, then apply the delta on top of it
+    memset(rw->key, 0, SIZE_STATE);
+    jcv_rewind_decode(rw->pool + k->off, k->len, rw->key);
+    memcpy(rw->cur, rw->key, SIZE_STATE);
+    if (e != k)
+        jcv_rewind_decode(rw->pool + e->off, e->len, rw->cur);
+
+    if (!jcv_state_load_mem(ctx, rw->cur, SIZE_STATE))
+        return 0;
+
+    rw->count -= back;
+    rw->wpos = e->off + e->len;
+    rw->sincekey = (slot + rw->slots - e->key) % rw->slots + 1;
+
+    // Recount the encoded length of the group the restored snapshot is in
+    rw->grouplen = 0;
+    for (size_t i = 0; i < rw->sincekey; ++i)
+        rw->grouplen += rw->ent[(e->key + i) % rw->slots].len;
+
+    return 1;
+}
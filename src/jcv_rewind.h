@@ -0,0 +1,65 @@
+/*
+Copyright (c) 2020-2022 Rupert Carmichael
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JCV_REWIND_H
+#define JCV_REWIND_H
+
+#define REWIND_KEYINT 60 // Default number of snapshots between keyframes
+
+typedef struct _cv_rewind_ent_t {
+    size_t off; // Offset of the encoded snapshot in the pool
+    size_t len; // Length of the encoded snapshot
+    size_t key; // Ring slot holding the keyframe this snapshot is relative to
+} cv_rewind_ent_t;
+
+typedef struct _cv_rewind_t {
+    uint8_t *pool; // Encoded snapshot storage
+    size_t poolsize; // Size of the pool (memory budget)
+    size_t wpos; // Offset in the pool following the newest snapshot
+    cv_rewind_ent_t *ent; // Ring of snapshots, oldest first from ent[first]
+    size_t slots; // Maximum number of snapshots held
+    size_t first; // Ring slot holding the oldest snapshot
+    size_t count; // Number of snapshots held
+    size_t keyint; // Number of snapshots between keyframes
+    size_t sincekey; // Number of snapshots since the newest keyframe
+    size_t grouplen; // Encoded length of the newest keyframe group
+    uint8_t *key; // Raw state of the newest keyframe
+    uint8_t *cur; // Raw state being captured or restored
+    uint8_t *enc; // Scratch space for encoding a snapshot
+} cv_rewind_t;
+
+int jcv_rewind_init(jcv_ctx_t*, size_t, size_t);
+void jcv_rewind_deinit(jcv_ctx_t*);
+void jcv_rewind_set_keyint(jcv_ctx_t*, size_t);
+size_t jcv_rewind_count(jcv_ctx_t*);
+int jcv_rewind_push(jcv_ctx_t*);
+int jcv_rewind_restore(jcv_ctx_t*, size_t);
+
+#endif
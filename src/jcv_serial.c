@@ -28,102 +28,31 @@ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
-/* Signed values are pushed and popped unsigned, but will retain their initial
- * value, as these functions simply record the bit pattern.
- */
-
 #include <stddef.h>
 #include <stdint.h>
 
+#include "jcv.h"
 #include "jcv_serial.h"
 
-static size_t pos = 0;
-
-// Begin a Serialize or Deserialize operation
-void jcv_serial_begin(void) {
-    pos = 0;
-}
-
-// Serially push a block of memory, one byte at a time
-void jcv_serial_pushblk(uint8_t *dst, uint8_t *src, size_t len) {
-    for (size_t i = 0; i < len; ++i)
-        dst[pos + i] = src[i];
-    pos += len;
-}
-
-// Serially pop a block of memory, one byte at a time
-void jcv_serial_popblk(uint8_t *dst, uint8_t *src, size_t len) {
-    for (size_t i = 0; i < len; ++i)
-        dst[i] = src[pos + i];
-    pos += len;
+// Push the header identifying the data and the version of its format
+void jcv_serial_push_hdr(jcv_serial_t *s, uint32_t magic) {
+    jcv_serial_push32(s, magic);
+    jcv_serial_push32(s, JCV_SERIAL_VERSION);
 }
 
-// Push an 8-bit integer
-void jcv_serial_push8(uint8_t *mem, uint8_t v) {
-    mem[pos++] = v;
-}
-
-// Push a 16-bit integer
-void jcv_serial_push16(uint8_t *mem, uint16_t v) {
-    mem[pos++] = v >> 8;
-    mem[pos++] = v & 0xff;
-}
-
-// Push a 32-bit integer
-void jcv_serial_push32(uint8_t *mem, uint32_t v) {
-    mem[pos++] = v >> 24;
-    mem[pos++] = (v >> 16) & 0xff;
-    mem[pos++] = (v >> 8) & 0xff;
-    mem[pos++] = v & 0xff;
-}
-
-// Push a 64-bit integer
-void jcv_serial_push64(uint8_t *mem, uint64_t v) {
-    mem[pos++] = v >> 56;
-    mem[pos++] = (v >> 48) & 0xff;
-    mem[pos++] = (v >> 40) & 0xff;
-    mem[pos++] = (v >> 32) & 0xff;
-    mem[pos++] = (v >> 24) & 0xff;
-    mem[pos++] = (v >> 16) & 0xff;
-    mem[pos++] = (v >> 8) & 0xff;
-    mem[pos++] = v & 0xff;
-}
-
-// Pop an 8-bit integer
-uint8_t jcv_serial_pop8(uint8_t *mem) {
-    return mem[pos++];
-}
-
-// Pop a 16-bit integer
-uint16_t jcv_serial_pop16(uint8_t *mem) {
-    uint16_t ret = mem[pos++] << 8;
-    ret |= mem[pos++];
-    return ret;
-}
-
-// Pop a 32-bit integer
-uint32_t jcv_serial_pop32(uint8_t *mem) {
-    uint32_t ret = mem[pos++] << 24;
-    ret |= mem[pos++] << 16;
-    ret |= mem[pos++] << 8;
-    ret |= mem[pos++];
-    return ret;
-}
+/* Pop the header and return the format version of the data, or 0 if there is
+   no header with the expected magic number, in which case the cursor is left
+   at the start of the data.
+*/
+uint32_t jcv_serial_pop_hdr(jcv_serial_t *s, size_t len, uint32_t magic) {
+    if (len < SIZE_SERIAL_HDR)
+        return 0;
 
-// Pop a 64-bit integer
-uint64_t jcv_serial_pop64(uint8_t *mem) {
-    uint64_t ret = (uint64_t)(mem[pos++]) << 56;
-    ret |= (uint64_t)(mem[pos++]) << 48;
-    ret |= (uint64_t)(mem[pos++]) << 40;
-    ret |= (uint64_t)(mem[pos++]) << 32;
-    ret |= (uint64_t)(mem[pos++]) << 24;
-    ret |= (uint64_t)(mem[pos++]) << 16;
-    ret |= (uint64_t)(mem[pos++]) << 8;
-    ret |= (uint64_t)(mem[pos++]);
-    return ret;
-}
+    size_t pos = s->pos;
+    if (jcv_serial_pop32(s) != magic) {
+        s->pos = pos;
+        return 0;
+    }
 
-// Return the size of the serialized data
-size_t jcv_serial_size(void) {
-    return pos + 1;
+    return jcv_serial_pop32(s);
 }
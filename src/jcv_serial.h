@@ -31,17 +31,112 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef JCV_SERIAL_H
 #define JCV_SERIAL_H
 
-void jcv_serial_begin(void);
-void jcv_serial_pushblk(uint8_t*, uint8_t*, size_t);
-void jcv_serial_popblk(uint8_t*, uint8_t*, size_t);
-void jcv_serial_push8(uint8_t*, uint8_t);
-void jcv_serial_push16(uint8_t*, uint16_t);
-void jcv_serial_push32(uint8_t*, uint32_t);
-void jcv_serial_push64(uint8_t*, uint64_t);
-uint8_t jcv_serial_pop8(uint8_t*);
-uint16_t jcv_serial_pop16(uint8_t*);
-uint32_t jcv_serial_pop32(uint8_t*);
-uint64_t jcv_serial_pop64(uint8_t*);
-size_t jcv_serial_size(void);
+#include <string.h>
+
+/* Serialized data begins with a header: a magic number identifying the kind of
+   data followed by the format version, both stored as big-endian 32-bit
+   integers. States written before the header was introduced have no header,
+   and are treated as version 0.
+*/
+#define JCV_SERIAL_MAGIC 0x4a435653 // "JCVS"
+#define JCV_SERIAL_MAGIC_INC 0x4a435649 // "JCVI" - Incremental state
+#define JCV_SERIAL_MAGIC_MOVIE 0x4a43564d // "JCVM" - Input movie
+#define JCV_SERIAL_VERSION 2
+#define SIZE_SERIAL_HDR 8
+
+struct _jcv_serial_t {
+    uint8_t *mem; // Serialized data being read from or written to
+    size_t pos; // Current position in the serialized data
+};
+
+void jcv_serial_push_hdr(jcv_serial_t*, uint32_t);
+uint32_t jcv_serial_pop_hdr(jcv_serial_t*, size_t, uint32_t);
+
+/* The cursor operations are used for every field of every state, so they are
+   defined here to be inlined at each call site. Blocks are copied with memcpy,
+   and integers are stored big-endian so that states remain portable between
+   hosts - compilers reduce the shifts to a byte swap and a single store.
+   Signed values are pushed and popped unsigned, but will retain their initial
+   value, as these functions simply record the bit pattern.
+*/
+
+// Begin a Serialize or Deserialize operation on a block of memory
+static inline void jcv_serial_begin(jcv_serial_t *s, uint8_t *mem) {
+    s->mem = mem;
+    s->pos = 0;
+}
+
+// Push a block of memory
+static inline void jcv_serial_pushblk(jcv_serial_t *s, const void *src,
+    size_t len) {
+    memcpy(s->mem + s->pos, src, len);
+    s->pos += len;
+}
+
+// Pop a block of memory
+static inline void jcv_serial_popblk(jcv_serial_t *s, void *dst, size_t len) {
+    memcpy(dst, s->mem + s->pos, len);
+    s->pos += len;
+}
+
+// Push an 8-bit integer
+static inline void jcv_serial_push8(jcv_serial_t *s, uint8_t v) {
+    s->mem[s->pos++] = v;
+}
+
+// Push a 16-bit integer
+static inline void jcv_serial_push16(jcv_serial_t *s, uint16_t v) {
+    uint8_t *p = s->mem + s->pos;
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+    s->pos += 2;
+}
+
+// Push a 32-bit integer
+static inline void jcv_serial_push32(jcv_serial_t *s, uint32_t v) {
+    uint8_t *p = s->mem + s->pos;
+    p[0] = v >> 24;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+    s->pos += 4;
+}
+
+// Push a 64-bit integer
+static inline void jcv_serial_push64(jcv_serial_t *s, uint64_t v) {
+    jcv_serial_push32(s, v >> 32);
+    jcv_serial_push32(s, v & 0xffffffff);
+}
+
+// Pop an 8-bit integer
+static inline uint8_t jcv_serial_pop8(jcv_serial_t *s) {
+    return s->mem[s->pos++];
+}
+
+// Pop a 16-bit integer
+static inline uint16_t jcv_serial_pop16(jcv_serial_t *s) {
+    const uint8_t *p = s->mem + s->pos;
+    s->pos += 2;
+    return (p[0] << 8) | p[1];
+}
+
+// Pop a 32-bit integer
+static inline uint32_t jcv_serial_pop32(jcv_serial_t *s) {
+    const uint8_t *p = s->mem + s->pos;
+    s->pos += 4;
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+        ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Pop a 64-bit integer
+static inline uint64_t jcv_serial_pop64(jcv_serial_t *s) {
+    uint64_t ret = (uint64_t)jcv_serial_pop32(s) << 32;
+    return ret | jcv_serial_pop32(s);
+}
+
+// Return the size of the serialized data
+static inline size_t jcv_serial_size(jcv_serial_t *s) {
+    return s->pos + 1;
+}
 
 #endif
@@ -33,96 +33,206 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stddef.h>
 #include <stdint.h>
 
+#include "jcv.h"
+#include "jcv_blip.h"
+#include "jcv_memio.h"
+#include "jcv_mixer.h"
+#include "jcv_movie.h"
+#include "jcv_psg.h"
+#include "jcv_rewind.h"
 #include "jcv_serial.h"
 #include "jcv_sgmpsg.h"
+#include "jcv_stats.h"
+#include "jcv_vdp.h"
+#include "jcv_ctx.h"
 
 static const int16_t vtable[16] = { // Volume Table
     0,       40,      60,     86,    124,    186,    264,    440,
     518,    840,    1196,   1526,   2016,   2602,   3300,   4096,
 };
 
-static cv_sgmpsg_t psg; // SGM PSG Context
-static int16_t *psgbuf = NULL; // Buffer for raw PSG output samples
-static size_t bufpos = 0; // Keep track of the position in the PSG output buffer
-
 // Reset the Envelope step and volume depending on the currently selected shape
-static inline void jcv_sgmpsg_env_reset(void) {
-    psg.estep = 0; // Reset the step counter
+static inline void jcv_sgmpsg_env_reset(cv_sgmpsg_t *psg) {
+    psg->estep = 0; // Reset the step counter
 
-    if (psg.eseg) { // Segment 1
-        switch (psg.reg[13]) {
+    if (psg->eseg) { // Segment 1
+        switch (psg->reg[13]) {
             case 8: case 11: case 13: case 14: { // Start from the top
-                psg.evol = 15;
+                psg->evol = 15;
                 break;
             }
             default: { // Start from the bottom
-                psg.evol = 0;
+                psg->evol = 0;
                 break;
             }
         }
     }
     else { // Segment 0
         // If the Attack bit is set, start from the bottom. Otherwise, the top.
-        psg.evol = psg.reg[13] & 0x04 ? 0 : 15;
+        psg->evol = psg->reg[13] & 0x04 ? 0 : 15;
+    }
+}
+
+// Shift the Noise RNG when the Noise Counter reaches its period
+static inline void jcv_sgmpsg_noise_clock(cv_sgmpsg_t *psg) {
+    /* The Noise Random Number Generator is a 17-bit shift register, whose
+       input is bit 0 XOR bit 3. The result of this operation is output at
+       bit 16 as bit 1 becomes the new bit 0, which will determine whether
+       to output noise when a sample is generated.
+    */
+    psg->nshift = (psg->nshift >> 1) |
+        (((psg->nshift ^ (psg->nshift >> 3)) & 0x01) << 16);
+}
+
+// Step the Envelope when the Envelope Counter reaches its period
+static inline void jcv_sgmpsg_env_clock(cv_sgmpsg_t *psg) {
+    /* Envelope Shape
+       The bits from 3 to 0 represent Continue, Attack, Alternate, and Hold.
+       For Continue values of 0, the bottom two bits are irrelevant, meaning
+       there are only 2 possible shapes for the first 8 numerical values.
+       00xx: \____
+       01xx: /|____
+       1000: \|\|\|     1001: \_____     1010: \/\/\/     1011: \|----
+       1100: /|/|/|     1101: /-----     1110: /\/\/\     1111: /|____
+    */
+    if (psg->estep) { // Do not change the envelope volume for the 0th step
+        if (psg->eseg) { // Second half of the envelope shape
+            if ((psg->reg[13] == 10) || (psg->reg[13] == 12))
+                ++psg->evol; // Count Up
+            else if ((psg->reg[13] == 8) || (psg->reg[13] == 14))
+                --psg->evol; // Count Down
+            // Otherwise, simply hold the current value (no else statement)
+        }
+        else { // First half of the envelope shape
+            if (psg->reg[13] & 0x04) // Attack is set - Count Up
+                ++psg->evol;
+            else // Count Down
+                --psg->evol;
+        }
+    }
+
+    // Reset and start the new Segment if this is the last Envelope Step
+    if (++psg->estep >= 16) {
+        if ((psg->reg[13] & 0x09) == 0x08) // Switch Envelope Segment
+            psg->eseg ^= 1;
+        else // Hold the current Segment for 0-7, 9, 11, 13, 15
+            psg->eseg = 1;
+        jcv_sgmpsg_env_reset(psg);
     }
 }
 
+// Mix the current output of all three channels into a single sample
+static inline int16_t jcv_sgmpsg_sample(cv_sgmpsg_t *psg) {
+    int16_t vol = 0; // Initial output volume of this sample
+
+    for (int i = 0; i < 3; ++i) {
+        /* Determine whether to output a volume for this channel. The logic here
+           is unintuitive. From the datasheet:
+             "Disabling noise and tone does _not_ turn off a channel. Turning a
+             channel off can only be accomplished by writing all zeroes into the
+             corresponding Amplitude Control register."
+           If both tone and noise disable bits are set, the output value will
+           effectively be silence because the waveform will not oscillate. If
+           either only the tone or only the noise disable bit is set, it will
+           determine whether tone or noise is output. If neither are set, sound
+           will only be output when both the noise shift register bit 0 is set
+           and the tone is in the second half of the period.
+        */
+        uint8_t out = (psg->tdisable[i] | psg->sign[i]) &
+            (psg->ndisable[i] | (psg->nshift & 0x01));
+
+        /* If the envelope mode bit is set for this channel, output variable
+           level amplitude (envelope step), otherwise output the fixed level
+           amplitude value.
+        */
+        if (out)
+            vol += psg->emode[i] ?
+                vtable[psg->evol] : vtable[psg->amplitude[i]];
+    }
+
+    return vol;
+}
+
+// Output a sample for a run of cycles, as a step when using step synthesis
+static inline void jcv_sgmpsg_output(jcv_ctx_t *ctx, int16_t samp,
+    size_t run) {
+    cv_sgmpsg_t *psg = &ctx->sgmpsg;
+
+    if (ctx->mixer.rsmode == RESAMPLER_BLIP) {
+        if (samp != psg->level) {
+            jcv_blip_delta(ctx->mixer.blip, psg->bufpos, samp - psg->level);
+            psg->level = samp;
+        }
+    }
+    else {
+        int16_t *buf = psg->buf + psg->bufpos;
+        for (size_t i = 0; i < run; ++i)
+            buf[i] = samp;
+    }
+
+    psg->bufpos += run;
+}
+
 // Set the pointer to the sample buffer
-void jcv_sgmpsg_set_buffer(int16_t *ptr) {
-    psgbuf = ptr;
+void jcv_sgmpsg_set_buffer(jcv_ctx_t *ctx, int16_t *ptr) {
+    ctx->sgmpsg.buf = ptr;
 }
 
 // Reset position of the buffer
-void jcv_sgmpsg_reset_buffer(void) {
-    bufpos = 0;
+void jcv_sgmpsg_reset_buffer(jcv_ctx_t *ctx) {
+    ctx->sgmpsg.bufpos = 0;
 }
 
 // Set initial values
-void jcv_sgmpsg_init(void) {
+void jcv_sgmpsg_init(jcv_ctx_t *ctx) {
+    cv_sgmpsg_t *psg = &ctx->sgmpsg;
+
     // Registers
     for (int i = 0; i < 16; ++i)
-        psg.reg[i] = 0x00;
+        psg->reg[i] = 0x00;
 
     // Latched Register
-    psg.rlatch = 0x00;
+    psg->rlatch = 0x00;
 
     // Tone Periods, Tone Counters, Amplitude, Sign bits
     for (int i = 0; i < 3; ++i) {
-        psg.tperiod[i] = 0x0000;
-        psg.tcounter[i] = 0x0000;
-        psg.amplitude[i] = 0x00;
-        psg.sign[i] = 0x00;
+        psg->tperiod[i] = 0x0000;
+        psg->tcounter[i] = 0x0000;
+        psg->amplitude[i] = 0x00;
+        psg->sign[i] = 0x00;
     }
 
     // Noise Period, Noise Counter
-    psg.nperiod = 0x00;
-    psg.ncounter = 0x0000;
+    psg->nperiod = 0x00;
+    psg->ncounter = 0x0000;
 
     // Seed the Noise RNG Shift Register
-    psg.nshift = 1;
+    psg->nshift = 1;
 
     // Envelope Period, Counter, Segment, Step, and Volume
-    psg.eperiod = 0x0000;
-    psg.ecounter = 0x0000;
-    psg.eseg = 0x00;
-    psg.estep = 0x00;
-    psg.evol = 0x00;
+    psg->eperiod = 0x0000;
+    psg->ecounter = 0x0000;
+    psg->eseg = 0x00;
+    psg->estep = 0x00;
+    psg->evol = 0x00;
 
     // Enable bits for Tone, Noise, and Envelope
     for (int i = 0; i < 3; ++i) {
-        psg.tdisable[i] = 0x00;
-        psg.ndisable[i] = 0x00;
-        psg.emode[i] = 0x00;
+        psg->tdisable[i] = 0x00;
+        psg->ndisable[i] = 0x00;
+        psg->emode[i] = 0x00;
     }
 }
 
 // Read from the currently latched Control Register
-uint8_t jcv_sgmpsg_rd(void) {
-    return psg.reg[psg.rlatch];
+uint8_t jcv_sgmpsg_rd(jcv_ctx_t *ctx) {
+    return ctx->sgmpsg.reg[ctx->sgmpsg.rlatch];
 }
 
 // Write to the currently latched Control Register
-void jcv_sgmpsg_wr(uint8_t data) {
+void jcv_sgmpsg_wr(jcv_ctx_t *ctx, uint8_t data) {
+    cv_sgmpsg_t *psg = &ctx->sgmpsg;
+
     /* Registers
     |---|-----------------------------------------------|
     | R |  7  |  6  |  5  |  4  |  3  |  2  |  1  |  0  |
@@ -164,71 +274,71 @@ void jcv_sgmpsg_wr(uint8_t data) {
     };
 
     // Write data to the latched register
-    psg.reg[psg.rlatch] = data & dcmask[psg.rlatch];
+    psg->reg[psg->rlatch] = data & dcmask[psg->rlatch];
 
-    switch (psg.rlatch) {
+    switch (psg->rlatch) {
         /* Tone Periods are 12-bit values comprising 8 bits from the first
            register, 4 bits from the second register. Value is for half period.
            The lowest period for tones is 1, so if 0 is set, change it to 1.
         */
         case 0: case 1: { // Channel A Tone Period
-            psg.tperiod[0] = psg.reg[0] | (psg.reg[1] << 8);
-            if (psg.tperiod[0] == 0)
-                psg.tperiod[0] = 1;
+            psg->tperiod[0] = psg->reg[0] | (psg->reg[1] << 8);
+            if (psg->tperiod[0] == 0)
+                psg->tperiod[0] = 1;
             break;
         }
         case 2: case 3: { // Channel B Tone Period
-            psg.tperiod[1] = psg.reg[2] | (psg.reg[3] << 8);
-            if (psg.tperiod[1] == 0)
-                psg.tperiod[1] = 1;
+            psg->tperiod[1] = psg->reg[2] | (psg->reg[3] << 8);
+            if (psg->tperiod[1] == 0)
+                psg->tperiod[1] = 1;
             break;
         }
         case 4: case 5: { // Channel C Tone Period
-            psg.tperiod[2] = psg.reg[4] | (psg.reg[5] << 8);
-            if (psg.tperiod[2] == 0)
-                psg.tperiod[2] = 1;
+            psg->tperiod[2] = psg->reg[4] | (psg->reg[5] << 8);
+            if (psg->tperiod[2] == 0)
+                psg->tperiod[2] = 1;
             break;
         }
         case 6: { // Noise Period
-            psg.nperiod = psg.reg[6];
-            if (psg.nperiod == 0) // As with Tones, lowest period value is 1.
-                psg.nperiod = 1;
+            psg->nperiod = psg->reg[6];
+            if (psg->nperiod == 0) // As with Tones, lowest period value is 1.
+                psg->nperiod = 1;
             break;
         }
         case 7: { // Enable IO/Noise/Tone
             // Register 7's Enable bits are actually Disable bits.
-            psg.tdisable[0] = (psg.reg[7] >> 0) & 0x01;
-            psg.tdisable[1] = (psg.reg[7] >> 1) & 0x01;
-            psg.tdisable[2] = (psg.reg[7] >> 2) & 0x01;
-            psg.ndisable[0] = (psg.reg[7] >> 3) & 0x01;
-            psg.ndisable[1] = (psg.reg[7] >> 4) & 0x01;
-            psg.ndisable[2] = (psg.reg[7] >> 5) & 0x01;
+            psg->tdisable[0] = (psg->reg[7] >> 0) & 0x01;
+            psg->tdisable[1] = (psg->reg[7] >> 1) & 0x01;
+            psg->tdisable[2] = (psg->reg[7] >> 2) & 0x01;
+            psg->ndisable[0] = (psg->reg[7] >> 3) & 0x01;
+            psg->ndisable[1] = (psg->reg[7] >> 4) & 0x01;
+            psg->ndisable[2] = (psg->reg[7] >> 5) & 0x01;
             break;
         }
         case 8: { // Channel A Amplitude
-            psg.amplitude[0] = data & 0x0f;
-            psg.emode[0] = (data >> 4) & 0x01;
+            psg->amplitude[0] = data & 0x0f;
+            psg->emode[0] = (data >> 4) & 0x01;
             break;
         }
         case 9: { // Channel B Amplitude
-            psg.amplitude[1] = data & 0x0f;
-            psg.emode[1] = (data >> 4) & 0x01;
+            psg->amplitude[1] = data & 0x0f;
+            psg->emode[1] = (data >> 4) & 0x01;
             break;
         }
         case 10: { // Channel C Amplitude
-            psg.amplitude[2] = data & 0x0f;
-            psg.emode[2] = (data >> 4) & 0x01;
+            psg->amplitude[2] = data & 0x0f;
+            psg->emode[2] = (data >> 4) & 0x01;
             break;
         }
         case 11: case 12: { // Envelope Period
-            psg.eperiod = psg.reg[11] | (psg.reg[12] << 8);
+            psg->eperiod = psg->reg[11] | (psg->reg[12] << 8);
             break;
         }
         case 13: { // Envelope Shape
             // Reset all Envelope related variables when Register 13 is written
-            psg.ecounter = 0;
-            psg.eseg = 0;
-            jcv_sgmpsg_env_reset();
+            psg->ecounter = 0;
+            psg->eseg = 0;
+            jcv_sgmpsg_env_reset(psg);
             break;
         }
         /* Nothing really needs to be done for the IO Port Data Store Registers,
@@ -241,139 +351,193 @@ void jcv_sgmpsg_wr(uint8_t data) {
 }
 
 // Set the latched Control Register
-void jcv_sgmpsg_set_reg(uint8_t r) {
-    psg.rlatch = r;
+void jcv_sgmpsg_set_reg(jcv_ctx_t *ctx, uint8_t r) {
+    ctx->sgmpsg.rlatch = r;
 }
 
 // Execute a PSG cycle
-size_t jcv_sgmpsg_exec(void) {
+size_t jcv_sgmpsg_exec(jcv_ctx_t *ctx) {
+    cv_sgmpsg_t *psg = &ctx->sgmpsg;
+
     // Clock Tone Counters for Channels A, B, and C
     for (int i = 0; i < 3; ++i) {
-        if (++psg.tcounter[i] >= psg.tperiod[i]) {
-            psg.tcounter[i] = 0;
-            psg.sign[i] ^= 1;
+        if (++psg->tcounter[i] >= psg->tperiod[i]) {
+            psg->tcounter[i] = 0;
+            psg->sign[i] ^= 1;
         }
     }
 
     // Clock Noise Counter
-    if (++psg.ncounter >= (psg.nperiod << 1)) {
-        psg.ncounter = 0;
-        /* The Noise Random Number Generator is a 17-bit shift register, whose
-           input is bit 0 XOR bit 3. The result of this operation is output at
-           bit 16 as bit 1 becomes the new bit 0, which will determine whether
-           to output noise when a sample is generated.
-        */
-        psg.nshift = (psg.nshift >> 1) |
-            (((psg.nshift ^ (psg.nshift >> 3)) & 0x01) << 16);
+    if (++psg->ncounter >= (psg->nperiod << 1)) {
+        psg->ncounter = 0;
+        jcv_sgmpsg_noise_clock(psg);
     }
 
     // Clock Envelope Counter
-    if (++psg.ecounter >= (psg.eperiod << 1)) {
-        psg.ecounter = 0;
-
-        /* Envelope Shape
-           The bits from 3 to 0 represent Continue, Attack, Alternate, and Hold.
-           For Continue values of 0, the bottom two bits are irrelevant, meaning
-           there are only 2 possible shapes for the first 8 numerical values.
-           00xx: \____
-           01xx: /|____
-           1000: \|\|\|     1001: \_____     1010: \/\/\/     1011: \|----
-           1100: /|/|/|     1101: /-----     1110: /\/\/\     1111: /|____
-        */
-        if (psg.estep) { // Do not change the envelope's volume for the 0th step
-            if (psg.eseg) { // Second half of the envelope shape
-                if ((psg.reg[13] == 10) || (psg.reg[13] == 12))
-                    ++psg.evol; // Count Up
-                else if ((psg.reg[13] == 8) || (psg.reg[13] == 14))
-                    --psg.evol; // Count Down
-                // Otherwise, simply hold the current value (no else statement)
-            }
-            else { // First half of the envelope shape
-                if (psg.reg[13] & 0x04) // Attack is set - Count Up
-                    ++psg.evol;
-                else // Count Down
-                    --psg.evol;
+    if (++psg->ecounter >= (psg->eperiod << 1)) {
+        psg->ecounter = 0;
+        jcv_sgmpsg_env_clock(psg);
+    }
+
+    // Add the mixed sample to the output buffer and increment the position
+    jcv_sgmpsg_output(ctx, jcv_sgmpsg_sample(psg), 1);
+
+    return 1; // Return 1, signifying that a sample has been generated
+}
+
+/* Number of cycles until a counter reaches its period and is reset. Counters
+   are 16-bit, so a period beyond that range is never reached.
+*/
+static inline size_t jcv_sgmpsg_cyc_event(uint16_t counter, uint32_t period) {
+    if (period > 0xffff)
+        return SIZE_MAX;
+    return counter < period ? period - counter : 1;
+}
+
+/* Advance a counter by a number of cycles, resetting it each time it reaches
+   its period, and return the number of resets which occurred
+*/
+static inline size_t jcv_sgmpsg_advance(uint16_t *counter, uint32_t period,
+    size_t cycs) {
+    size_t first = jcv_sgmpsg_cyc_event(*counter, period);
+
+    if (cycs < first) {
+        *counter += cycs;
+        return 0;
+    }
+
+    cycs -= first;
+
+    if (period == 0) // A period of 0 behaves the same as a period of 1
+        period = 1;
+
+    *counter = cycs % period;
+    return 1 + (cycs / period);
+}
+
+/* Render a block of PSG cycles
+   Between counter resets, the tone signs, noise shift register and envelope
+   volume all hold their values, so the output is constant. Runs of cycles
+   between resets are filled directly, and only cycles where a counter reaches
+   its period are run through jcv_sgmpsg_exec. Counters which have no way to
+   affect the output (silent channels, or noise/envelope not used by any
+   audible channel) are advanced arithmetically so they never shorten a run.
+*/
+size_t jcv_sgmpsg_render(jcv_ctx_t *ctx, size_t n) {
+    cv_sgmpsg_t *psg = &ctx->sgmpsg;
+    size_t samps = n;
+
+    uint32_t nperiod = psg->nperiod << 1;
+    uint32_t eperiod = psg->eperiod << 1;
+
+    // Determine which counters' resets can affect the output
+    uint8_t tone = 0; // Bit per channel
+    uint8_t noise = 0;
+    uint8_t env = 0;
+
+    for (int i = 0; i < 3; ++i) {
+        if (psg->emode[i] || psg->amplitude[i]) {
+            tone |= (psg->tdisable[i] ^ 1) << i;
+            noise |= psg->ndisable[i] ^ 1;
+            env |= psg->emode[i];
+        }
+    }
+
+    while (n) {
+        // Find the number of cycles until an audible counter reset
+        size_t run = n;
+        size_t cycs;
+
+        for (int i = 0; i < 3; ++i) {
+            if (tone & (1 << i)) {
+                cycs = jcv_sgmpsg_cyc_event(psg->tcounter[i], psg->tperiod[i]);
+                if (cycs - 1 < run)
+                    run = cycs - 1;
             }
         }
 
-        // Reset and start the new Segment if this is the last Envelope Step
-        if (++psg.estep >= 16) {
-            if ((psg.reg[13] & 0x09) == 0x08) // Switch Envelope Segment
-                psg.eseg ^= 1;
-            else // Hold the current Segment for 0-7, 9, 11, 13, 15
-                psg.eseg = 1;
-            jcv_sgmpsg_env_reset();
+        if (noise) {
+            cycs = jcv_sgmpsg_cyc_event(psg->ncounter, nperiod);
+            if (cycs - 1 < run)
+                run = cycs - 1;
         }
-    }
 
-    int16_t vol = 0; // Initial output volume of this sample
+        if (env) {
+            cycs = jcv_sgmpsg_cyc_event(psg->ecounter, eperiod);
+            if (cycs - 1 < run)
+                run = cycs - 1;
+        }
 
-    for (int i = 0; i < 3; ++i) {
-        /* Determine whether to output a volume for this channel. The logic here
-           is unintuitive. From the datasheet:
-             "Disabling noise and tone does _not_ turn off a channel. Turning a
-             channel off can only be accomplished by writing all zeroes into the
-             corresponding Amplitude Control register."
-           If both tone and noise disable bits are set, the output value will
-           effectively be silence because the waveform will not oscillate. If
-           either only the tone or only the noise disable bit is set, it will
-           determine whether tone or noise is output. If neither are set, sound
-           will only be output when both the noise shift register bit 0 is set
-           and the tone is in the second half of the period.
-        */
-        uint8_t out = (psg.tdisable[i] | psg.sign[i]) &
-            (psg.ndisable[i] | (psg.nshift & 0x01));
+        if (run) {
+            int16_t samp = jcv_sgmpsg_sample(psg);
 
-        /* If the envelope mode bit is set for this channel, output variable
-           level amplitude (envelope step), otherwise output the fixed level
-           amplitude value.
-        */
-        if (out)
-            vol += psg.emode[i] ? vtable[psg.evol] : vtable[psg.amplitude[i]];
-    }
+            jcv_sgmpsg_output(ctx, samp, run);
 
-    // Add the mixed sample to the output buffer and increment the position
-    psgbuf[bufpos++] = vol;
+            // Advance the counters, catching up on resets of silent channels
+            for (int i = 0; i < 3; ++i) {
+                size_t resets = jcv_sgmpsg_advance(&psg->tcounter[i],
+                    psg->tperiod[i], run);
+                psg->sign[i] ^= resets & 0x01;
+            }
 
-    return 1; // Return 1, signifying that a sample has been generated
+            size_t resets = jcv_sgmpsg_advance(&psg->ncounter, nperiod, run);
+            while (resets--)
+                jcv_sgmpsg_noise_clock(psg);
+
+            resets = jcv_sgmpsg_advance(&psg->ecounter, eperiod, run);
+            while (resets--)
+                jcv_sgmpsg_env_clock(psg);
+
+            n -= run;
+        }
+
+        if (n) { // Run the cycle where a reset occurs
+            jcv_sgmpsg_exec(ctx);
+            --n;
+        }
+    }
+
+    return samps;
 }
 
-void jcv_sgmpsg_state_load(uint8_t *st) {
-    for (size_t i = 0; i < 16; ++i) psg.reg[i] = jcv_serial_pop8(st);
-    psg.rlatch = jcv_serial_pop8(st);
-    for (size_t i = 0; i < 3; ++i) psg.tperiod[i] = jcv_serial_pop16(st);
-    for (size_t i = 0; i < 3; ++i) psg.tcounter[i] = jcv_serial_pop16(st);
-    for (size_t i = 0; i < 3; ++i) psg.amplitude[i] = jcv_serial_pop8(st);
-    psg.nperiod = jcv_serial_pop8(st);
-    psg.ncounter = jcv_serial_pop16(st);
-    psg.nshift = jcv_serial_pop32(st);
-    psg.eperiod = jcv_serial_pop16(st);
-    psg.ecounter = jcv_serial_pop16(st);
-    psg.eseg = jcv_serial_pop8(st);
-    psg.estep = jcv_serial_pop8(st);
-    psg.evol = jcv_serial_pop8(st);
-    for (size_t i = 0; i < 3; ++i) psg.tdisable[i] = jcv_serial_pop8(st);
-    for (size_t i = 0; i < 3; ++i) psg.ndisable[i] = jcv_serial_pop8(st);
-    for (size_t i = 0; i < 3; ++i) psg.emode[i] = jcv_serial_pop8(st);
-    for (size_t i = 0; i < 3; ++i) psg.sign[i] = jcv_serial_pop8(st);
+void jcv_sgmpsg_state_load(jcv_ctx_t *ctx, jcv_serial_t *st) {
+    cv_sgmpsg_t *psg = &ctx->sgmpsg;
+    for (size_t i = 0; i < 16; ++i) psg->reg[i] = jcv_serial_pop8(st);
+    psg->rlatch = jcv_serial_pop8(st);
+    for (size_t i = 0; i < 3; ++i) psg->tperiod[i] = jcv_serial_pop16(st);
+    for (size_t i = 0; i < 3; ++i) psg->tcounter[i] = jcv_serial_pop16(st);
+    for (size_t i = 0; i < 3; ++i) psg->amplitude[i] = jcv_serial_pop8(st);
+    psg->nperiod = jcv_serial_pop8(st);
+    psg->ncounter = jcv_serial_pop16(st);
+    psg->nshift = jcv_serial_pop32(st);
+    psg->eperiod = jcv_serial_pop16(st);
+    psg->ecounter = jcv_serial_pop16(st);
+    psg->eseg = jcv_serial_pop8(st);
+    psg->estep = jcv_serial_pop8(st);
+    psg->evol = jcv_serial_pop8(st);
+    for (size_t i = 0; i < 3; ++i) psg->tdisable[i] = jcv_serial_pop8(st);
+    for (size_t i = 0; i < 3; ++i) psg->ndisable[i] = jcv_serial_pop8(st);
+    for (size_t i = 0; i < 3; ++i) psg->emode[i] = jcv_serial_pop8(st);
+    for (size_t i = 0; i < 3; ++i) psg->sign[i] = jcv_serial_pop8(st);
 }
 
-void jcv_sgmpsg_state_save(uint8_t *st) {
-    for (size_t i = 0; i < 16; ++i) jcv_serial_push8(st, psg.reg[i]);
-    jcv_serial_push8(st, psg.rlatch);
-    for (size_t i = 0; i < 3; ++i) jcv_serial_push16(st, psg.tperiod[i]);
-    for (size_t i = 0; i < 3; ++i) jcv_serial_push16(st, psg.tcounter[i]);
-    for (size_t i = 0; i < 3; ++i) jcv_serial_push8(st, psg.amplitude[i]);
-    jcv_serial_push8(st, psg.nperiod);
-    jcv_serial_push16(st, psg.ncounter);
-    jcv_serial_push32(st, psg.nshift);
-    jcv_serial_push16(st, psg.eperiod);
-    jcv_serial_push16(st, psg.ecounter);
-    jcv_serial_push8(st, psg.eseg);
-    jcv_serial_push8(st, psg.estep);
-    jcv_serial_push8(st, psg.evol);
-    for (size_t i = 0; i < 3; ++i) jcv_serial_push8(st, psg.tdisable[i]);
-    for (size_t i = 0; i < 3; ++i) jcv_serial_push8(st, psg.ndisable[i]);
-    for (size_t i = 0; i < 3; ++i) jcv_serial_push8(st, psg.emode[i]);
-    for (size_t i = 0; i < 3; ++i) jcv_serial_push8(st, psg.sign[i]);
+void jcv_sgmpsg_state_save(jcv_ctx_t *ctx, jcv_serial_t *st) {
+    cv_sgmpsg_t *psg = &ctx->sgmpsg;
+    for (size_t i = 0; i < 16; ++i) jcv_serial_push8(st, psg->reg[i]);
+    jcv_serial_push8(st, psg->rlatch);
+    for (size_t i = 0; i < 3; ++i) jcv_serial_push16(st, psg->tperiod[i]);
+    for (size_t i = 0; i < 3; ++i) jcv_serial_push16(st, psg->tcounter[i]);
+    for (size_t i = 0; i < 3; ++i) jcv_serial_push8(st, psg->amplitude[i]);
+    jcv_serial_push8(st, psg->nperiod);
+    jcv_serial_push16(st, psg->ncounter);
+    jcv_serial_push32(st, psg->nshift);
+    jcv_serial_push16(st, psg->eperiod);
+    jcv_serial_push16(st, psg->ecounter);
+    jcv_serial_push8(st, psg->eseg);
+    jcv_serial_push8(st, psg->estep);
+    jcv_serial_push8(st, psg->evol);
+    for (size_t i = 0; i < 3; ++i) jcv_serial_push8(st, psg->tdisable[i]);
+    for (size_t i = 0; i < 3; ++i) jcv_serial_push8(st, psg->ndisable[i]);
+    for (size_t i = 0; i < 3; ++i) jcv_serial_push8(st, psg->emode[i]);
+    for (size_t i = 0; i < 3; ++i) jcv_serial_push8(st, psg->sign[i]);
 }
@@ -54,17 +54,22 @@ typedef struct _cv_sgmpsg_t {
     uint8_t emode[3]; // Envelope Mode Enable bit for Tones A, B, and C
 
     uint8_t sign[3]; // Signify whether the waveform is high or low
+
+    int16_t *buf; // Buffer for raw PSG output samples
+    size_t bufpos; // Keep track of the position in the PSG output buffer
+    int16_t level; // Output level last recorded in the step buffer
 } cv_sgmpsg_t;
 
-void jcv_sgmpsg_set_buffer(int16_t*);
-void jcv_sgmpsg_reset_buffer(void);
-void jcv_sgmpsg_init(void);
-uint8_t jcv_sgmpsg_rd(void);
-void jcv_sgmpsg_wr(uint8_t data);
-void jcv_sgmpsg_set_reg(uint8_t);
-size_t jcv_sgmpsg_exec(void);
+void jcv_sgmpsg_set_buffer(jcv_ctx_t*, int16_t*);
+void jcv_sgmpsg_reset_buffer(jcv_ctx_t*);
+void jcv_sgmpsg_init(jcv_ctx_t*);
+uint8_t jcv_sgmpsg_rd(jcv_ctx_t*);
+void jcv_sgmpsg_wr(jcv_ctx_t*, uint8_t data);
+void jcv_sgmpsg_set_reg(jcv_ctx_t*, uint8_t);
+size_t jcv_sgmpsg_exec(jcv_ctx_t*);
+size_t jcv_sgmpsg_render(jcv_ctx_t*, size_t);
 
-void jcv_sgmpsg_state_load(uint8_t*);
-void jcv_sgmpsg_state_save(uint8_t*);
+void jcv_sgmpsg_state_load(jcv_ctx_t*, jcv_serial_t*);
+void jcv_sgmpsg_state_save(jcv_ctx_t*, jcv_serial_t*);
 
 #endif
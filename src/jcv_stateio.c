@@ -0,0 +1,209 @@
+/*
+Copyright (c) 2020-2022 Rupert Carmichael
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Asynchronous State Files
+   Writing a state file blocks on the file system, which can take long enough
+   on slow storage to cause a visible hitch when a frontend saves often, such
+   as for autosaves. A state writer holds two state buffers and a thread which
+   writes them out. Saving serializes the running state into a free buffer,
+   which takes a few microseconds, and queues it for the writer, which calls
+   the completion callback from its own thread once the file is written. One
+   buffer can be captured while the other is still being written; if both are
+   in use, saving fails immediately rather than waiting.
+
+   Loading waits for any queued saves to finish, so a state saved just before
+   is the one read back, and then reads the file directly into the context's
+   own state buffer. Saves and loads for one writer must be made from a single
+   thread, normally the one running emulation.
+*/
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jcv.h"
+#include "jcv_memio.h"
+#include "jcv_stateio.h"
+
+#define STATEIO_BUFS 2 // Number of state buffers
+
+typedef struct _cv_stateio_buf_t {
+    uint8_t data[SIZE_STATE]; // Serialized state
+    char *path; // File to write the state to
+    void (*cb)(void*, int); // Completion callback, or NULL
+    void *udata; // Frontend data passed to the callback
+} cv_stateio_buf_t;
+
+struct _jcv_stateio_t {
+    cv_stateio_buf_t buf[STATEIO_BUFS]; // State buffers
+    pthread_t thread; // Thread writing the files
+    pthread_mutex_t mtx; // Protects everything below
+    pthread_cond_t start; // Signalled when a buffer is queued or on exit
+    pthread_cond_t done; // Signalled when a buffer has been written
+    size_t head; // Oldest queued buffer, written next
+    size_t queued; // Number of buffers queued, including one being written
+    uint8_t quit; // Writer should exit once the queue is empty
+};
+
+// Write a buffer to a file, returning 1 if all of it was written
+static int jcv_stateio_write(const char *path, const void *data, size_t len) {
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return 0;
+
+    int ok = fwrite(data, sizeof(uint8_t), len, file) == len;
+    if (fclose(file))
+        ok = 0;
+
+    return ok;
+}
+
+// Writer thread - write queued buffers in order until told to exit
+static void* jcv_stateio_writer(void *arg) {
+    jcv_stateio_t *io = (jcv_stateio_t*)arg;
+
+    pthread_mutex_lock(&io->mtx);
+    while (1) {
+        while (!io->queued && !io->quit)
+            pthread_cond_wait(&io->start, &io->mtx);
+
+        if (!io->queued) // Only exit once everything queued has been written
+            break;
+
+        // The emulation thread leaves queued buffers alone
+        cv_stateio_buf_t *b = &io->buf[io->head];
+        pthread_mutex_unlock(&io->mtx);
+
+        int ok = jcv_stateio_write(b->path, b->data, SIZE_STATE);
+        free(b->path);
+        b->path = NULL;
+
+        if (b->cb)
+            b->cb(b->udata, ok);
+
+        pthread_mutex_lock(&io->mtx);
+        io->head = (io->head + 1) % STATEIO_BUFS;
+        --io->queued;
+        pthread_cond_broadcast(&io->done);
+    }
+    pthread_mutex_unlock(&io->mtx);
+
+    return NULL;
+}
+
+// Create a state writer and start its thread, returning NULL on failure
+jcv_stateio_t* jcv_stateio_create(void) {
+    jcv_stateio_t *io = (jcv_stateio_t*)calloc(1, sizeof(jcv_stateio_t));
+    if (io == NULL)
+        return NULL;
+
+    pthread_mutex_init(&io->mtx, NULL);
+    pthread_cond_init(&io->start, NULL);
+    pthread_cond_init(&io->done, NULL);
+
+    if (pthread_create(&io->thread, NULL, jcv_stateio_writer, io)) {
+        pthread_cond_destroy(&io->done);
+        pthread_cond_destroy(&io->start);
+        pthread_mutex_destroy(&io->mtx);
+        free(io);
+        return NULL;
+    }
+
+    return io;
+}
+
+// Finish writing any queued states, then stop the thread and free the writer
+void jcv_stateio_destroy(jcv_stateio_t *io) {
+    if (io == NULL)
+        return;
+
+    pthread_mutex_lock(&io->mtx);
+    io->quit = 1;
+    pthread_cond_signal(&io->start);
+    pthread_mutex_unlock(&io->mtx);
+    pthread_join(io->thread, NULL);
+
+    pthread_cond_destroy(&io->done);
+    pthread_cond_destroy(&io->start);
+    pthread_mutex_destroy(&io->mtx);
+    free(io);
+}
+
+/* Snapshot the running state and queue it to be written to a file. When the
+   file has been written, cb (if not NULL) is called from the writer's thread
+   with udata and 1 on success or 0 on failure. Returns 0 without saving if
+   both buffers are in use, or the path could not be copied.
+*/
+int jcv_stateio_save(jcv_stateio_t *io, jcv_ctx_t *ctx, const char *path,
+    void (*cb)(void*, int), void *udata) {
+    pthread_mutex_lock(&io->mtx);
+    size_t queued = io->queued;
+    size_t i = (io->head + queued) % STATEIO_BUFS;
+    pthread_mutex_unlock(&io->mtx);
+
+    if (queued == STATEIO_BUFS)
+        return 0;
+
+    // The writer does not touch a buffer until it has been queued
+    cv_stateio_buf_t *b = &io->buf[i];
+    size_t len = strlen(path) + 1;
+    b->path = (char*)malloc(len);
+    if (b->path == NULL)
+        return 0;
+
+    memcpy(b->path, path, len);
+    jcv_state_save_mem(ctx, b->data, SIZE_STATE);
+    b->cb = cb;
+    b->udata = udata;
+
+    pthread_mutex_lock(&io->mtx);
+    ++io->queued;
+    pthread_cond_signal(&io->start);
+    pthread_mutex_unlock(&io->mtx);
+
+    return 1;
+}
+
+// Wait until every queued state has been written
+void jcv_stateio_wait(jcv_stateio_t *io) {
+    pthread_mutex_lock(&io->mtx);
+    while (io->queued)
+        pthread_cond_wait(&io->done, &io->mtx);
+    pthread_mutex_unlock(&io->mtx);
+}
+
+// Load a state from a file once any queued saves have been written
+int jcv_stateio_load(jcv_stateio_t *io, jcv_ctx_t *ctx, const char *path) {
+    jcv_stateio_wait(io);
+    return jcv_state_load(ctx, path);
+}
@@ -0,0 +1,111 @@
+/*
+Copyright (c) 2020-2022 Rupert Carmichael
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__APPLE__)
+#include <mach/mach_time.h>
+#endif
+
+#include "jcv.h"
+#include "jcv_memio.h"
+#include "jcv_mixer.h"
+#include "jcv_movie.h"
+#include "jcv_psg.h"
+#include "jcv_rewind.h"
+#include "jcv_sgmpsg.h"
+#include "jcv_stats.h"
+#include "jcv_vdp.h"
+#include "jcv_ctx.h"
+
+// Read the clock - nanoseconds, or Mach absolute time units on macOS
+static inline uint64_t jcv_stats_now(void) {
+#if defined(__APPLE__)
+    return mach_absolute_time();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Charge the time since the last switch to the unit in use, and start timing
+   a new unit. Returns the unit which was in use.
+*/
+uint8_t jcv_stats_switch(jcv_ctx_t *ctx, uint8_t unit) {
+    uint64_t now = jcv_stats_now();
+    uint8_t prev = ctx->statsunit;
+
+    if (prev != STATS_NONE)
+        ctx->stats.time[prev] += now - ctx->statsmark;
+
+    ctx->statsmark = now;
+    ctx->statsunit = unit;
+    return prev;
+}
+
+// Record the number of Z80 cycles run in a scanline
+void jcv_stats_line(jcv_ctx_t *ctx, uint32_t cycs) {
+    cv_stats_t *stats = &ctx->stats;
+    ++stats->lines;
+    stats->linecycs += cycs;
+
+    if (cycs < stats->linecycs_min)
+        stats->linecycs_min = cycs;
+    if (cycs > stats->linecycs_max)
+        stats->linecycs_max = cycs;
+}
+
+// Retrieve the statistics gathered since the last reset
+void jcv_stats_get(jcv_ctx_t *ctx, cv_stats_t *stats) {
+    *stats = ctx->stats;
+
+    if (stats->lines == 0)
+        stats->linecycs_min = 0;
+
+#if defined(__APPLE__)
+    mach_timebase_info_data_t tb;
+    mach_timebase_info(&tb);
+
+    for (size_t i = 0; i < STATS_UNITS; ++i)
+        stats->time[i] = stats->time[i] * tb.numer / tb.denom;
+#endif
+}
+
+// Clear the statistics
+void jcv_stats_reset(jcv_ctx_t *ctx) {
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->stats.linecycs_min = UINT32_MAX;
+    ctx->statsmark = 0;
+    ctx->statsunit = STATS_NONE;
+}
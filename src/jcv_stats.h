@@ -0,0 +1,95 @@
+/*
+Copyright (c) 2020-2022 Rupert Carmichael
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JCV_STATS_H
+#define JCV_STATS_H
+
+/* Units of emulation which time is measured for. Time spent by the PSGs
+   catching up during a register write is counted for the PSGs, not the Z80.
+*/
+#define STATS_Z80 0 // Z80 CPU, including memory and I/O handlers
+#define STATS_VDP 1 // VDP scanline rendering
+#define STATS_PSG 2 // SN76489 rendering
+#define STATS_SGMPSG 3 // AY-3-8910 rendering
+#define STATS_MIXER 4 // Mixing, resampling and pushing audio
+#define STATS_UNITS 5 // Number of units
+#define STATS_NONE STATS_UNITS // Not emulating: time is not counted
+
+// Regions of the memory map which Z80 reads are counted for
+#define STATS_MEM_BIOS 0 // BIOS ROM
+#define STATS_MEM_RAM 1 // System RAM
+#define STATS_MEM_SGM 2 // Super Game Module RAM
+#define STATS_MEM_CART 3 // Cartridge ROM
+#define STATS_MEM_OPEN 4 // Expansion port with nothing plugged in
+#define STATS_MEM_REGIONS 5 // Number of regions
+
+typedef struct _cv_stats_t {
+    uint64_t frames; // Frames run
+    uint64_t time[STATS_UNITS]; // Nanoseconds spent in each unit
+    uint64_t insns; // Z80 instructions executed
+    uint64_t lines; // Scanlines run
+    uint64_t linecycs; // Z80 cycles run over all scanlines
+    uint32_t linecycs_min; // Fewest Z80 cycles run in a scanline
+    uint32_t linecycs_max; // Most Z80 cycles run in a scanline
+    uint64_t memrd[STATS_MEM_REGIONS]; // Z80 memory reads from each region
+    uint64_t iord[256]; // Reads from each I/O port
+    uint64_t iowr[256]; // Writes to each I/O port
+    uint64_t vramwr; // Bytes written to VRAM through the data port
+} cv_stats_t;
+
+void jcv_stats_get(jcv_ctx_t*, cv_stats_t*);
+void jcv_stats_reset(jcv_ctx_t*);
+
+/* Statistics are only gathered when built with JCV_STATS defined, as reading
+   the clock several times per scanline has a noticeable cost. Otherwise the
+   macros compile to nothing, and jcv_stats_get always reports zeros. ENTER
+   and LEAVE bracket code within one scope, restoring the unit in use before.
+   INC increments a counter in the statistics, and ADD adds to one.
+*/
+#ifdef JCV_STATS
+uint8_t jcv_stats_switch(jcv_ctx_t*, uint8_t);
+void jcv_stats_line(jcv_ctx_t*, uint32_t);
+#define JCV_STATS_ENTER(ctx, unit) \
+    uint8_t statsprev = jcv_stats_switch(ctx, unit)
+#define JCV_STATS_SWITCH(ctx, unit) jcv_stats_switch(ctx, unit)
+#define JCV_STATS_LEAVE(ctx) jcv_stats_switch(ctx, statsprev)
+#define JCV_STATS_INC(ctx, counter) ++(ctx)->stats.counter
+#define JCV_STATS_ADD(ctx, counter, n) (ctx)->stats.counter += (n)
+#define JCV_STATS_LINE(ctx, cycs) jcv_stats_line(ctx, cycs)
+#else
+#define JCV_STATS_ENTER(ctx, unit)
+#define JCV_STATS_SWITCH(ctx, unit)
+#define JCV_STATS_LEAVE(ctx)
+#define JCV_STATS_INC(ctx, counter)
+#define JCV_STATS_ADD(ctx, counter, n)
+#define JCV_STATS_LINE(ctx, cycs)
+#endif
+
+#endif
@@ -30,12 +30,63 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 // ColecoVision VDP - Texas Instruments TMS9928A
 
+#include <pthread.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #include <arm_neon.h>
+#endif
+
+#include "jcv.h"
+#include "jcv_memio.h"
+#include "jcv_mixer.h"
+#include "jcv_movie.h"
+#include "jcv_psg.h"
+#include "jcv_rewind.h"
 #include "jcv_serial.h"
+#include "jcv_sgmpsg.h"
+#include "jcv_stats.h"
 #include "jcv_vdp.h"
 #include "jcv_z80.h"
+#include "jcv_ctx.h"
+
+#define SIZE_VDPCMD 0x4000 // Commands in the worker thread's queue
+#define VDPCMD_LINE 0x80000000 // Draw a line, the lower bits give its number
+#define VDP_WAKE_LINES 16 // Lines queued before a sleeping worker is woken
+
+typedef struct _cv_vdp_snap_t {
+    uint8_t ctrl[8]; // Control registers when the line was drawn
+    uint16_t line; // Active display line, or CV_VDP_HEIGHT for backdrop only
+    uint8_t spr; // Sprite palette entries are to be blended over the line
+    uint8_t sprbuf[CV_VDP_WIDTH]; // Sprite palette entries
+} cv_vdp_snap_t;
+
+typedef struct _cv_vdp_thread_t {
+    cv_vdp_t vdp; // Worker's copy of the VDP, which owns the video output
+    cv_vdp_snap_t snap[CV_VDP_HEIGHT_OVERSCAN]; // Snapshot of each line
+    uint32_t cmd[SIZE_VDPCMD]; // Queue of VRAM writes and lines to draw
+    size_t wpos; // Position of the next command to be queued
+    size_t head; // Commands up to here may be run by the worker
+    size_t tail; // Commands up to here have been run by the worker
+    size_t tailseen; // Last known value of tail
+    size_t lines; // Lines queued since the worker was last woken
+    uint8_t sleeping; // Worker is waiting for commands
+    uint8_t waiting; // Emulation thread is waiting for the worker
+    uint8_t quit; // Worker should exit
+    pthread_mutex_t mtx; // Held while waiting or signalling
+    pthread_cond_t start; // Signalled when commands are queued or on exit
+    pthread_cond_t done; // Signalled when the worker has run commands
+    pthread_t id; // Worker thread
+} cv_vdp_thread_t;
+
+static void jcv_vdp_thread_push(cv_vdp_thread_t*, uint32_t);
+static cv_vdp_t* jcv_vdp_thread_wait(cv_vdp_thread_t*, size_t);
+static void jcv_vdp_thread_config(cv_vdp_t*);
+static void jcv_vdp_thread_sync(cv_vdp_t*);
 
 // The Carmichael Experience - Tweaked to Look Nice
 static const uint32_t palette_teatime[16] = {
@@ -53,115 +104,486 @@ static const uint32_t palette_syoung[16] = {
     0xff21b03b, 0xffc95bba, 0xffcccccc, 0xffffffff,
 };
 
-static const uint32_t *palette = palette_teatime;
-
-static cv_vdp_t vdp; // VDP Context
-
-static uint32_t *vbuf = NULL;
-
-static uint16_t numscanlines = CV_VDP_SCANLINES;
+/* Decoded tile rows depend on the screen mode (M1, M2, M3), the Colour and
+   Pattern Generator tables and their Mode 2 masks, and the backdrop colour.
+   These are the bits of each control register which affect them.
+*/
+static const uint8_t bgmask[8] = {
+    0x02, 0x18, 0x00, 0xff, 0x07, 0x00, 0x00, 0x0f
+};
 
 // Increment address with wrap
-static inline void jcv_vdp_addr_inc(void) {
-    vdp.addr = (vdp.addr + 1) & 0x3fff;
+static inline void jcv_vdp_addr_inc(cv_vdp_t *vdp) {
+    vdp->addr = (vdp->addr + 1) & 0x3fff;
 }
 
 // Test if rendering is enabled or disabled (BL bit)
-static inline uint8_t jcv_vdp_rendering(void) {
-    return vdp.ctrl[1] & 0x40;
+static inline uint8_t jcv_vdp_rendering(cv_vdp_t *vdp) {
+    return vdp->ctrl[1] & 0x40;
 }
 
 // Test if the GINT bit is set in control register 1
-static inline uint8_t jcv_vdp_gint(void) {
-    return vdp.ctrl[1] & 0x20;
+static inline uint8_t jcv_vdp_gint(cv_vdp_t *vdp) {
+    return vdp->ctrl[1] & 0x20;
 }
 
 // Test if the INT bit is set in the status register
-static inline uint8_t jcv_vdp_int(void) {
-    return vdp.stat & 0x80;
+static inline uint8_t jcv_vdp_int(cv_vdp_t *vdp) {
+    return vdp->stat & 0x80;
 }
 
 // Retrieve the current backdrop colour
-static inline uint32_t jcv_vdp_bdcol(void) {
-    return palette[vdp.ctrl[7] & 0x0f];
+static inline uint32_t jcv_vdp_bdcol(cv_vdp_t *vdp) {
+    return vdp->pal[vdp->ctrl[7] & 0x0f];
+}
+
+/* Retrieve a pointer to the start of a line to draw into. Lines are drawn as
+   32-bit values taken from the converted palette, straight into the video
+   output buffer for ARGB8888. For the compact formats, lines are drawn into a
+   line buffer instead and packed into the video output buffer afterwards.
+*/
+static inline uint32_t* jcv_vdp_lineptr(cv_vdp_t *vdp, int line) {
+    if (vdp->fmt != CV_VDP_FMT_ARGB8888)
+        return vdp->pxline;
+    return (uint32_t*)vdp->vbuf + (line * CV_VDP_WIDTH_OVERSCAN);
+}
+
+// Pack the line buffer into a line of the video output buffer
+static void jcv_vdp_linepack(cv_vdp_t *vdp, int line) {
+    const uint32_t *src = vdp->pxline;
+
+    switch (vdp->fmt) {
+        case CV_VDP_FMT_RGB565: {
+            uint16_t *dst = (uint16_t*)vdp->vbuf +
+                (line * CV_VDP_WIDTH_OVERSCAN);
+            for (int i = 0; i < CV_VDP_WIDTH_OVERSCAN; ++i)
+                dst[i] = src[i];
+            break;
+        }
+        case CV_VDP_FMT_INDEX8: {
+            uint8_t *dst = (uint8_t*)vdp->vbuf +
+                (line * CV_VDP_WIDTH_OVERSCAN);
+            for (int i = 0; i < CV_VDP_WIDTH_OVERSCAN; ++i)
+                dst[i] = src[i];
+            break;
+        }
+        case CV_VDP_FMT_INDEX4: {
+            uint8_t *dst = (uint8_t*)vdp->vbuf +
+                (line * (CV_VDP_WIDTH_OVERSCAN >> 1));
+            for (int i = 0; i < CV_VDP_WIDTH_OVERSCAN >> 1; ++i)
+                dst[i] = (src[i << 1] << 4) | src[(i << 1) + 1];
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/* Hash a drawn line, two pixels at a time. Each step is invertible, so two
+   lines differing in a single pair of pixels never produce the same hash.
+*/
+static uint64_t jcv_vdp_linehash(const uint32_t *px) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < CV_VDP_WIDTH_OVERSCAN; i += 2) {
+        h ^= px[i] | ((uint64_t)px[i + 1] << 32);
+        h *= 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+/* Finish a drawn line: pack it into the video output buffer for the compact
+   formats, and when tracking changes, mark it dirty if it differs from the
+   same line in the last frame which was drawn.
+*/
+static void jcv_vdp_lineout(cv_vdp_t *vdp, int line) {
+    if (vdp->fmt != CV_VDP_FMT_ARGB8888)
+        jcv_vdp_linepack(vdp, line);
+
+    if (!vdp->track)
+        return;
+
+    uint64_t h = jcv_vdp_linehash(jcv_vdp_lineptr(vdp, line));
+    if (!vdp->hashvalid || h != vdp->linehash[line]) {
+        vdp->linehash[line] = h;
+        vdp->dirty[line >> 5] |= 1u << (line & 31);
+        ++vdp->ndirty;
+    }
+}
+
+// Publish the lines which changed in the frame just drawn, and start another
+static void jcv_vdp_dirty_frame(cv_vdp_t *vdp) {
+    memcpy(vdp->dirtyout, vdp->dirty, sizeof(vdp->dirtyout));
+    memset(vdp->dirty, 0, sizeof(vdp->dirty));
+    vdp->ndirtyout = vdp->ndirty;
+    vdp->ndirty = 0;
+    vdp->hashvalid = 1;
+}
+
+// Draw a run of pixels of a single colour
+static inline void jcv_vdp_fill(uint32_t *px, uint32_t c, int num) {
+    for (int i = 0; i < num; ++i)
+        px[i] = c;
 }
 
 // Draw a line of backdrop colour
-static inline void jcv_vdp_bdline(int line) {
-    for (int i = 0; i < CV_VDP_WIDTH_OVERSCAN; ++i)
-        vbuf[(line * CV_VDP_WIDTH_OVERSCAN) + i] = jcv_vdp_bdcol();
+static inline void jcv_vdp_bdline(cv_vdp_t *vdp, int line) {
+    jcv_vdp_fill(jcv_vdp_lineptr(vdp, line), jcv_vdp_bdcol(vdp),
+        CV_VDP_WIDTH_OVERSCAN);
+    jcv_vdp_lineout(vdp, line);
 }
 
-// Draw a single pixel onto the canvas
-static inline void jcv_vdp_pixel(uint32_t c, int line, int dot) {
-    vbuf[((line + CV_VDP_OVERSCAN) * CV_VDP_WIDTH_OVERSCAN) + dot] = c;
+/* Expand one byte of pattern data into 8 pixels, starting from the leftmost
+   (most significant) bit. Set bits are drawn using the foreground colour, and
+   unset bits using the background colour. A mask is built by testing each
+   pixel's bit in parallel, which then selects between the two colours.
+*/
+static inline void jcv_vdp_expand8(uint32_t *px, uint8_t pat,
+    uint32_t fg, uint32_t bg) {
+#if defined(__SSE2__)
+    const __m128i bits_l = _mm_set_epi32(0x10, 0x20, 0x40, 0x80);
+    const __m128i bits_r = _mm_set_epi32(0x01, 0x02, 0x04, 0x08);
+    __m128i vpat = _mm_set1_epi32(pat);
+    __m128i vfg = _mm_set1_epi32((int32_t)fg);
+    __m128i vbg = _mm_set1_epi32((int32_t)bg);
+
+    __m128i m = _mm_cmpeq_epi32(_mm_and_si128(vpat, bits_l), bits_l);
+    _mm_storeu_si128((__m128i*)px,
+        _mm_or_si128(_mm_and_si128(m, vfg), _mm_andnot_si128(m, vbg)));
+
+    m = _mm_cmpeq_epi32(_mm_and_si128(vpat, bits_r), bits_r);
+    _mm_storeu_si128((__m128i*)(px + 4),
+        _mm_or_si128(_mm_and_si128(m, vfg), _mm_andnot_si128(m, vbg)));
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    static const uint32_t bits[8] = {
+        0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01
+    };
+    uint32x4_t vpat = vdupq_n_u32(pat);
+    uint32x4_t vfg = vdupq_n_u32(fg);
+    uint32x4_t vbg = vdupq_n_u32(bg);
+
+    vst1q_u32(px, vbslq_u32(vtstq_u32(vpat, vld1q_u32(bits)), vfg, vbg));
+    vst1q_u32(px + 4,
+        vbslq_u32(vtstq_u32(vpat, vld1q_u32(bits + 4)), vfg, vbg));
+#else
+    for (int p = 0; p < 8; ++p)
+        px[p] = pat & (0x80 >> p) ? fg : bg;
+#endif
 }
 
-// Set the video output buffer to be written to
-void jcv_vdp_set_buffer(uint32_t *ptr) {
-    vbuf = ptr;
+// Test whether a run of 16 palette entries in a line buffer are all zero
+static inline int jcv_vdp_empty16(const uint8_t *buf) {
+#if defined(__SSE2__)
+    __m128i v = _mm_loadu_si128((const __m128i*)buf);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) == 0xffff;
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && defined(__aarch64__)
+    return vmaxvq_u8(vld1q_u8(buf)) == 0;
+#else
+    uint64_t v[2];
+    memcpy(v, buf, sizeof(v));
+    return (v[0] | v[1]) == 0;
+#endif
+}
+
+/* Blend a line of sprite palette entries over the background, 16 pixels at a
+   time. Palette entry 0 is transparent, and most of a line usually has no
+   sprite pixels, so runs which are entirely transparent are skipped.
+*/
+static inline void jcv_vdp_sprblend(uint32_t *px, const uint8_t *linebuf,
+    const uint32_t *palette) {
+    for (int i = 0; i < CV_VDP_WIDTH; i += 16) {
+        if (jcv_vdp_empty16(linebuf + i))
+            continue;
+
+        for (int p = i; p < i + 16; ++p)
+            if (linebuf[p]) // Draw non-transparent pixels
+                px[p] = palette[linebuf[p]];
+    }
+}
+
+// Retrieve the current screen mode: Bit 0 = M1, Bit 1 = M2, Bit 2 = M3
+static inline uint8_t jcv_vdp_scrmode(cv_vdp_t *vdp) {
+    return ((vdp->ctrl[1] & 0x10) >> 4) | // Bit 0 (M1)
+        (vdp->ctrl[0] & 0x02) | // Bit 1 (M2)
+        ((vdp->ctrl[1] & 0x08) >> 1); // Bit 2 (M3)
+}
+
+/* Control Register 4, which sets the Pattern Generator address offset, has
+   a special function in Mode 2. Only bit 2 (PG13) sets the address of the
+   Pattern Generator, resulting in either 0x0000 or 0x2000. Shift PG13 left
+   11 positions to create the 14-bit address offset.
+*/
+static inline uint16_t jcv_vdp_g2_pgen(cv_vdp_t *vdp) {
+    return (vdp->ctrl[4] & 0x04) << 11;
+}
+
+/* Control Register 4 bits 0 and 1 are an AND mask over the character number.
+   The character number is 0 - 767 (0x2ff) and these two bits are ANDed over
+   the two highest bits of this value (0x2ff is 10 bits, so bit 8 and 9). So in
+   effect, if bit 0 of Control Register 4 is set, the second array of 256
+   patterns in the Pattern Generator table is used for the middle 8 rows of
+   characters, otherwise the first 256 patterns. If bit 1 is set, the third
+   chunk of patterns is used in the Pattern Generator, otherwise the first. OR
+   0xff to fill in the zeros from the shift operation.
+*/
+static inline uint16_t jcv_vdp_g2_pmask(cv_vdp_t *vdp) {
+    return ((vdp->ctrl[4] & 0x03) << 8) | 0xff;
+}
+
+// In Mode 2, only bit 7 (CT13) of Control Register 3 sets the Colour Table
+static inline uint16_t jcv_vdp_g2_col(cv_vdp_t *vdp) {
+    return vdp->tbl_col & 0x2000;
+}
+
+/* Control Register 3 has a different meaning in Mode 2. Somewhat like Control
+   Register 4 for the Pattern Generator, bits 6 - 0 are an AND mask over the
+   top 7 bits of the character number. OR 0x07 to fill in the zeros from the
+   shift operation.
+*/
+static inline uint16_t jcv_vdp_g2_cmask(cv_vdp_t *vdp) {
+    return ((vdp->ctrl[3] & 0x7f) << 3) | 0x07;
+}
+
+// Mark every tile row in the background cache as dirty
+static inline void jcv_vdp_bgcache_flush(cv_vdp_t *vdp) {
+    memset(vdp->bgdirty, 1, SIZE_BGCACHE);
+}
+
+/* Convert the palette to values in the output format. The indexed formats
+   store the palette entry itself, leaving the choice of colours to the
+   frontend.
+*/
+static void jcv_vdp_pal_update(cv_vdp_t *vdp) {
+    for (int i = 0; i < 16; ++i) {
+        uint32_t c = vdp->palette[i];
+
+        switch (vdp->fmt) {
+            case CV_VDP_FMT_RGB565:
+                vdp->pal[i] = ((c >> 8) & 0xf800) | ((c >> 5) & 0x07e0) |
+                    ((c >> 3) & 0x001f);
+                break;
+            case CV_VDP_FMT_INDEX8: case CV_VDP_FMT_INDEX4:
+                vdp->pal[i] = i;
+                break;
+            default:
+                vdp->pal[i] = c;
+                break;
+        }
+    }
+
+    jcv_vdp_bgcache_flush(vdp); // Decoded colours are now stale
+}
+
+/* Set the video output buffer to be written to. It holds 272x208 pixels in
+   the output format, each line taking the number of bytes given by
+   jcv_vdp_get_pitch.
+*/
+static void jcv_vdp_buffer(cv_vdp_t *vdp, void *ptr) {
+    if (ptr != vdp->vbuf) // A new buffer holds none of the last frame
+        vdp->hashvalid = 0;
+    vdp->vbuf = ptr;
+}
+
+void jcv_vdp_set_buffer(jcv_ctx_t *ctx, void *ptr) {
+    jcv_vdp_buffer(&ctx->vdp, ptr);
+    if (ctx->vdp.thread)
+        jcv_vdp_buffer(jcv_vdp_thread_wait(ctx->vdp.thread, 0), ptr);
+}
+
+// Set the video output buffer format
+void jcv_vdp_set_format(jcv_ctx_t *ctx, uint8_t fmt) {
+    if (fmt > CV_VDP_FMT_INDEX4)
+        return;
+
+    ctx->vdp.fmt = fmt;
+    ctx->vdp.hashvalid = 0;
+    jcv_vdp_pal_update(&ctx->vdp);
+    jcv_vdp_thread_config(&ctx->vdp);
+
+    if (ctx->vdp.thread) // The worker is idle after taking the new format
+        ctx->vdp.thread->vdp.hashvalid = 0;
+}
+
+// Retrieve the number of bytes in each line of the video output buffer
+size_t jcv_vdp_get_pitch(jcv_ctx_t *ctx) {
+    switch (ctx->vdp.fmt) {
+        case CV_VDP_FMT_RGB565:
+            return CV_VDP_WIDTH_OVERSCAN * sizeof(uint16_t);
+        case CV_VDP_FMT_INDEX8:
+            return CV_VDP_WIDTH_OVERSCAN;
+        case CV_VDP_FMT_INDEX4:
+            return CV_VDP_WIDTH_OVERSCAN >> 1;
+        default:
+            return CV_VDP_WIDTH_OVERSCAN * sizeof(uint32_t);
+    }
+}
+
+/* Retrieve the number of lines in the video output buffer which changed in
+   the last frame drawn, and optionally a bitmap of them: bit (N & 31) of word
+   (N >> 5) is set if line N changed. Every line of the first frame drawn after
+   tracking is enabled, or the output buffer or format is changed, is marked.
+*/
+size_t jcv_vdp_get_dirty(jcv_ctx_t *ctx, const uint32_t **bitmap) {
+    // The worker owns the video output while it is running
+    cv_vdp_t *vdp = ctx->vdp.thread ? &ctx->vdp.thread->vdp : &ctx->vdp;
+    if (bitmap)
+        *bitmap = vdp->dirtyout;
+    return vdp->ndirtyout;
+}
+
+// Retrieve the ARGB colours of the palette, for use with the indexed formats
+const uint32_t* jcv_vdp_get_palette(jcv_ctx_t *ctx) {
+    return ctx->vdp.palette;
 }
 
 // Set the video palette
-void jcv_vdp_set_palette(uint8_t p) {
+void jcv_vdp_set_palette(jcv_ctx_t *ctx, uint8_t p) {
     switch (p) {
         case 0:
-            palette = palette_teatime; break;
+            ctx->vdp.palette = palette_teatime; break;
         case 1:
-            palette = palette_syoung; break;
+            ctx->vdp.palette = palette_syoung; break;
         default:
             break;
     }
+
+    jcv_vdp_pal_update(&ctx->vdp);
+    jcv_vdp_thread_config(&ctx->vdp);
+}
+
+// Enable or disable drawing pixels to the video output buffer
+void jcv_vdp_set_render(jcv_ctx_t *ctx, uint8_t render) {
+    ctx->vdp.render = render;
+}
+
+/* Enable or disable tracking which lines of the video output buffer change
+   from one drawn frame to the next. Each line is hashed as it is drawn and
+   compared with its hash from the previous frame.
+*/
+static void jcv_vdp_track(cv_vdp_t *vdp, uint8_t track) {
+    vdp->track = track;
+    vdp->hashvalid = 0;
+    vdp->ndirty = vdp->ndirtyout = 0;
+    memset(vdp->dirty, 0, sizeof(vdp->dirty));
+    memset(vdp->dirtyout, 0, sizeof(vdp->dirtyout));
+}
+
+void jcv_vdp_set_track(jcv_ctx_t *ctx, uint8_t track) {
+    jcv_vdp_track(&ctx->vdp, track);
+    if (ctx->vdp.thread)
+        jcv_vdp_track(jcv_vdp_thread_wait(ctx->vdp.thread, 0), track);
 }
 
 // Set the region
-void jcv_vdp_set_region(uint8_t region) {
+void jcv_vdp_set_region(jcv_ctx_t *ctx, uint8_t region) {
     // 313 scanlines for PAL, 262 scanlines for NTSC (192 visible for both)
-    numscanlines = region ? CV_VDP_SCANLINES_PAL : CV_VDP_SCANLINES;
+    ctx->vdp.numscanlines = region ? CV_VDP_SCANLINES_PAL : CV_VDP_SCANLINES;
 }
 
 // Set initial VDP values - also could be called reset
-void jcv_vdp_init(void) {
-    vdp.line = 0;
-    vdp.dot = 0;
+void jcv_vdp_init(jcv_ctx_t *ctx) {
+    cv_vdp_t *vdp = &ctx->vdp;
+
+    vdp->line = 0;
+    vdp->dot = 0;
 
     // Set VDP control register defaults
     for (int i = 0; i < 8; ++i)
-        vdp.ctrl[i] = 0x00;
+        vdp->ctrl[i] = 0x00;
 
-    vdp.stat = 0x00; // Zero the Status register
+    vdp->stat = 0x00; // Zero the Status register
 
-    memset(vdp.vram, 0x00, SIZE_VRAM); // Zero the VRAM
+    memset(vdp->vram, 0x00, SIZE_VRAM); // Zero the VRAM
+    memset(vdp->vramdirty, 1, sizeof(vdp->vramdirty));
 
     // Zero the latches and address register
-    vdp.addr = 0x0000;
-    vdp.dlatch = 0x00;
-    vdp.wlatch = 0x00;
-
-    vdp.tbl_col = vdp.ctrl[3] << 6;
-    vdp.tbl_pname = vdp.ctrl[2] << 10;
-    vdp.tbl_pgen = vdp.ctrl[4] << 11;
-    vdp.tbl_sattr = vdp.ctrl[5] << 7;
-    vdp.tbl_spgen = vdp.ctrl[6] << 11;
-
+    vdp->addr = 0x0000;
+    vdp->dlatch = 0x00;
+    vdp->wlatch = 0x00;
+
+    vdp->tbl_col = vdp->ctrl[3] << 6;
+    vdp->tbl_pname = vdp->ctrl[2] << 10;
+    vdp->tbl_pgen = vdp->ctrl[4] << 11;
+    vdp->tbl_sattr = vdp->ctrl[5] << 7;
+    vdp->tbl_spgen = vdp->ctrl[6] << 11;
+
+    jcv_vdp_bgcache_flush(vdp);
+    vdp->sprdirty = 1;
+    jcv_vdp_thread_sync(vdp);
 }
 
-uint8_t jcv_vdp_rd_data(void) {
-    vdp.wlatch = 0; // Make sure the write latch is clear
-    uint8_t rb = vdp.dlatch; // Store original latch value
-    vdp.dlatch = vdp.vram[vdp.addr]; // Read new data into the latch
-    jcv_vdp_addr_inc(); // Increment address
+uint8_t jcv_vdp_rd_data(jcv_ctx_t *ctx) {
+    cv_vdp_t *vdp = &ctx->vdp;
+    vdp->wlatch = 0; // Make sure the write latch is clear
+    uint8_t rb = vdp->dlatch; // Store original latch value
+    vdp->dlatch = vdp->vram[vdp->addr]; // Read new data into the latch
+    jcv_vdp_addr_inc(vdp); // Increment address
     return rb; // Return the value before the read-ahead
 }
 
-uint8_t jcv_vdp_rd_stat(void) {
-    vdp.wlatch = 0; // Make sure the write latch is clear
-    uint8_t sr = vdp.stat; // Store original register value for return
-    vdp.stat &= 0x1f; // Clear INT, 5S, and C flags on this register
+uint8_t jcv_vdp_rd_stat(jcv_ctx_t *ctx) {
+    cv_vdp_t *vdp = &ctx->vdp;
+    vdp->wlatch = 0; // Make sure the write latch is clear
+    uint8_t sr = vdp->stat; // Store original register value for return
+    vdp->stat &= 0x1f; // Clear INT, 5S, and C flags on this register
     return sr; // Return the old register value
 }
 
-static void jcv_vdp_wr_reg(uint8_t rnum, uint8_t data) {
+// Mark every Mode 2 tile row whose masked character number is chnum as dirty
+static void jcv_vdp_bgcache_mark_g2(cv_vdp_t *vdp, uint16_t chnum,
+    uint8_t prow, uint16_t mask) {
+    /* The AND masks in Control Registers 3 and 4 allow several character
+       numbers to share the same pattern or colour data. Every character number
+       which matches chnum in the bits the mask keeps uses this data, so walk
+       through each combination of the bits the mask clears.
+    */
+    uint16_t free = ~mask & 0x3ff;
+
+    if (chnum & free) // No character number can select this data
+        return;
+
+    uint16_t s = free;
+    while (1) {
+        if ((chnum | s) < 768)
+            vdp->bgdirty[((chnum | s) << 3) | prow] = 1;
+        if (s == 0)
+            break;
+        s = (s - 1) & free;
+    }
+}
+
+// Mark the tile rows which use data at a VRAM address as dirty
+static void jcv_vdp_bgcache_mark(cv_vdp_t *vdp, uint16_t addr) {
+    uint8_t scrmode = jcv_vdp_scrmode(vdp);
+    uint16_t offset;
+
+    if (scrmode == 0x00) { // Mode 0: Graphics 1
+        // Pattern Generator offsets map directly to tile rows
+        offset = addr - vdp->tbl_pgen;
+        if (offset < 0x800)
+            vdp->bgdirty[offset] = 1;
+
+        // Each colour table entry covers 8 characters, all rows of each
+        offset = addr - vdp->tbl_col;
+        if (offset < 32)
+            memset(vdp->bgdirty + (offset << 6), 1, 64);
+    }
+    else if (scrmode == 0x02) { // Mode 2: Graphics 2
+        offset = addr - jcv_vdp_g2_pgen(vdp);
+        if (offset < SIZE_BGCACHE)
+            jcv_vdp_bgcache_mark_g2(vdp, offset >> 3, offset & 0x07,
+                jcv_vdp_g2_pmask(vdp));
+
+        offset = addr - jcv_vdp_g2_col(vdp);
+        if (offset < SIZE_BGCACHE)
+            jcv_vdp_bgcache_mark_g2(vdp, offset >> 3, offset & 0x07,
+                jcv_vdp_g2_cmask(vdp));
+    }
+}
+
+static void jcv_vdp_wr_reg(jcv_ctx_t *ctx, uint8_t rnum, uint8_t data) {
+    cv_vdp_t *vdp = &ctx->vdp;
+
     /*     |----------------------------------------------------------------|
        Bit |7       6       5       4       3       2       1       0       |
     Reg    |----------------------------------------------------------------|
@@ -179,9 +601,23 @@ static void jcv_vdp_wr_reg(uint8_t rnum, uint8_t data) {
     uint8_t dcmask[8] = { 0x03, 0xfb, 0x0f, 0xff, 0x07, 0x7f, 0x07, 0xff };
 
     // Save the GINT bit status before writing to a register
-    const uint8_t old_gint = jcv_vdp_gint();
+    const uint8_t old_gint = jcv_vdp_gint(vdp);
 
-    vdp.ctrl[rnum] = data & dcmask[rnum]; // Write to the register
+    // Save the old value to detect changes which affect decoded tile rows
+    const uint8_t old_val = vdp->ctrl[rnum];
+
+    vdp->ctrl[rnum] = data & dcmask[rnum]; // Write to the register
+
+    // Discard decoded tile rows if anything they depend on has changed
+    if ((old_val ^ vdp->ctrl[rnum]) & bgmask[rnum])
+        jcv_vdp_bgcache_flush(vdp);
+
+    // The sprite index depends on the sprite size, magnification, and table
+    const uint8_t sprmask[8] = {
+        0x00, 0x03, 0x00, 0x00, 0x00, 0x7f, 0x00, 0x00
+    };
+    if ((old_val ^ vdp->ctrl[rnum]) & sprmask[rnum])
+        vdp->sprdirty = 1;
 
     // Bit shifts in cases 2-6 create a 14-bit address offset from the
     // start of VRAM, based on the value written to the register
@@ -193,28 +629,30 @@ static void jcv_vdp_wr_reg(uint8_t rnum, uint8_t data) {
         case 1: { // Mode Control 2
             // Screen mode may have changed - handle in drawing routines
             // Fire NMI if Status INT is set and Register 1 GINT bit was set
-            if (jcv_vdp_int() && jcv_vdp_gint() && !old_gint)
-                jcv_z80_nmi();
+            if (jcv_vdp_int(vdp) && jcv_vdp_gint(vdp) && !old_gint) {
+                jcv_z80_nmi(ctx);
+                jcv_z80_deadline(ctx, 0); // Return once the write completes
+            }
             break;
         }
         case 2: { // Pattern Name Table
-            vdp.tbl_pname = vdp.ctrl[2] << 10;
+            vdp->tbl_pname = vdp->ctrl[2] << 10;
             break;
         }
         case 3: { // Colour Table
-            vdp.tbl_col = vdp.ctrl[3] << 6;
+            vdp->tbl_col = vdp->ctrl[3] << 6;
             break;
         }
         case 4: { // Pattern Generator Table
-            vdp.tbl_pgen = vdp.ctrl[4] << 11;
+            vdp->tbl_pgen = vdp->ctrl[4] << 11;
             break;
         }
         case 5: { // Sprite Attribute Table
-            vdp.tbl_sattr = vdp.ctrl[5] << 7;
+            vdp->tbl_sattr = vdp->ctrl[5] << 7;
             break;
         }
         case 6: { // Sprite Pattern Generator
-            vdp.tbl_spgen = vdp.ctrl[6] << 11;
+            vdp->tbl_spgen = vdp->ctrl[6] << 11;
             break;
         }
         case 7: { // Foreground/Backdrop Colours
@@ -226,21 +664,24 @@ static void jcv_vdp_wr_reg(uint8_t rnum, uint8_t data) {
     }
 }
 
-void jcv_vdp_wr_ctrl(uint8_t data) {
-    if (vdp.wlatch) { // Second Write
-        vdp.wlatch = 0; // Flip the latch back to indicate the write is done
+void jcv_vdp_wr_ctrl(jcv_ctx_t *ctx, uint8_t data) {
+    cv_vdp_t *vdp = &ctx->vdp;
+
+    if (vdp->wlatch) { // Second Write
+        vdp->wlatch = 0; // Flip the latch back to indicate the write is done
 
         uint16_t upper = (data & 0x3f) << 8; // Upper address byte
-        vdp.addr = upper | vdp.dlatch; // OR the full address together
+        vdp->addr = upper | vdp->dlatch; // OR the full address together
 
         switch (data & 0xc0) { // Check if this is a register write or not
             case 0x00: { // Read VRAM data into the latch and increment address
-                vdp.dlatch = vdp.vram[vdp.addr]; // Read data into data latch
-                jcv_vdp_addr_inc(); // Increment address
+                vdp->dlatch = vdp->vram[vdp->addr]; // Read data into data latch
+                jcv_vdp_addr_inc(vdp); // Increment address
                 break;
             }
             case 0x80: { // Write the data latch value into the register
-                jcv_vdp_wr_reg(data & 0x07, vdp.dlatch); // 3 bits for register
+                // 3 bits for register
+                jcv_vdp_wr_reg(ctx, data & 0x07, vdp->dlatch);
                 break;
             }
             default:
@@ -248,43 +689,80 @@ void jcv_vdp_wr_ctrl(uint8_t data) {
         }
     }
     else { // First Write
-        vdp.wlatch = 1; // Set the write latch to indicate one byte was written
-        vdp.addr = (vdp.addr & 0x3f00) | data; // Write lower address byte
-        vdp.dlatch = data; // Store the lower byte in the latch
+        vdp->wlatch = 1; // Set the write latch to indicate one byte was written
+        vdp->addr = (vdp->addr & 0x3f00) | data; // Write lower address byte
+        vdp->dlatch = data; // Store the lower byte in the latch
     }
 }
 
 // Write data to the VDP
-void jcv_vdp_wr_data(uint8_t data) {
-    vdp.wlatch = 0; // Make sure the write latch is clear
-    vdp.dlatch = vdp.vram[vdp.addr] = data; // Write data to the latch and VRAM
-    jcv_vdp_addr_inc(); // Increment Address
+void jcv_vdp_wr_data(jcv_ctx_t *ctx, uint8_t data) {
+    cv_vdp_t *vdp = &ctx->vdp;
+    vdp->wlatch = 0; // Make sure the write latch is clear
+    vdp->dlatch = vdp->vram[vdp->addr] = data; // Write data to latch and VRAM
+    vdp->vramdirty[vdp->addr >> 8] = 1; // Mark the page for incremental states
+    JCV_STATS_INC(ctx, vramwr);
+
+    // Invalidate decoded tile rows, or pass the write on to the worker
+    if (vdp->thread)
+        jcv_vdp_thread_push(vdp->thread, (vdp->addr << 8) | data);
+    else
+        jcv_vdp_bgcache_mark(vdp, vdp->addr);
+
+    // Y positions in the Sprite Attribute Table determine the sprite index
+    if (((vdp->addr - vdp->tbl_sattr) & 0x3fff) < 128 && !(vdp->addr & 0x03))
+        vdp->sprdirty = 1;
+
+    jcv_vdp_addr_inc(vdp); // Increment Address
+}
+
+// Decode a Graphics I/II tile row into palette-resolved pixels in the cache
+static void jcv_vdp_bgcache_decode(cv_vdp_t *vdp, uint8_t scrmode,
+    uint16_t key) {
+    uint16_t chnum = key >> 3; // Character number (0 to 767 in Mode 2)
+    uint8_t prow = key & 0x07; // Pattern row (0 to 7)
+    uint8_t chpat; // One row of pixel data (Character Pattern)
+    uint8_t pindex; // Palette Index (upper 4 bits = fg, lower 4 bits = bg)
+
+    if (scrmode == 0x00) { // Mode 0: Graphics 1
+        chpat = vdp->vram[vdp->tbl_pgen + (chnum << 3) + prow];
+        pindex = vdp->vram[vdp->tbl_col + (chnum >> 3)];
+    }
+    else { // Mode 2: Graphics 2
+        // Use the masks here to select the proper pattern/colour offsets
+        chpat = vdp->vram[jcv_vdp_g2_pgen(vdp) +
+            ((chnum & jcv_vdp_g2_pmask(vdp)) << 3) + prow];
+        pindex = vdp->vram[jcv_vdp_g2_col(vdp) +
+            ((chnum & jcv_vdp_g2_cmask(vdp)) << 3) + prow];
+    }
+
+    // Set foreground and background values, if 0 use the backdrop colour
+    uint32_t bg = pindex & 0x0f ?
+        vdp->pal[pindex & 0x0f] : jcv_vdp_bdcol(vdp);
+    uint32_t fg = pindex >> 4 ? vdp->pal[pindex >> 4] : jcv_vdp_bdcol(vdp);
+
+    // Decode pattern data starting from the leftmost pixel
+    jcv_vdp_expand8(vdp->bgcache[key], chpat, fg, bg);
+
+    vdp->bgdirty[key] = 0;
 }
 
 // Draw a single line of background pixels
-static void jcv_vdp_bgline(void) {
+static void jcv_vdp_bgline(cv_vdp_t *vdp) {
     uint32_t bg, fg; // Colour value of palette entries
     uint8_t pindex = 0; // Palette Index (upper 4 bits = fg, lower 4 bits = bg)
-    uint8_t chpat = 0; // One row of pixel data (Character Pattern)
 
-    uint8_t srow = vdp.line >> 3; // Screen row being drawn (0 to 23, 8 high)
-    uint8_t prow = vdp.line & 0x07; // Pattern row being drawn (0 to 7)
+    uint8_t srow = vdp->line >> 3; // Screen row being drawn (0 to 23, 8 high)
+    uint8_t prow = vdp->line & 0x07; // Pattern row being drawn (0 to 7)
 
     uint16_t offset_col; // Colour offset
-    uint16_t offset_pgen; // Pattern Generator Table address offset
     uint16_t offset_pname; // Pattern Name Table address offset
 
     // Screen mode
-    uint8_t scrmode = ((vdp.ctrl[1] & 0x10) >> 4) | // Bit 0 (M1)
-        (vdp.ctrl[0] & 0x02) | // Bit 1 (M2)
-        ((vdp.ctrl[1] & 0x08) >> 1); // Bit 2 (M3)
-
-    /* Control Register 4, which sets the Pattern Generator address offset, has
-       a special function in Mode 2. Only bit 2 (PG13) sets the address of the
-       Pattern Generator, resulting in either 0x0000 or 0x2000. Shift PG13 left
-       11 positions to create the 14-bit address offset.
-    */
-    offset_pgen = (vdp.ctrl[4] & 0x04) << 11;
+    uint8_t scrmode = jcv_vdp_scrmode(vdp);
+
+    // Start of this line in the video output buffer
+    uint32_t *px = jcv_vdp_lineptr(vdp, vdp->line + CV_VDP_OVERSCAN);
 
     // Special case for Text Mode
     if (scrmode == 0x01) {
@@ -294,75 +772,63 @@ static void jcv_vdp_bgline(void) {
         | Foreground | Background | 4 bits represent the palette entry.
         ---------------------------
         */
-        fg = palette[(vdp.ctrl[7] >> 4) & 0x0f];
-        bg = jcv_vdp_bdcol();
-
-        // Draw 16 pixel left/right borders in text mode, using backdrop colour
-        for (int p = 0; p < CV_VDP_OVERSCAN << 1; ++p) {
-            jcv_vdp_pixel(jcv_vdp_bdcol(), vdp.line, vdp.dot++);
-            jcv_vdp_pixel(jcv_vdp_bdcol(), vdp.line, p + 256);
-        }
+        fg = vdp->pal[(vdp->ctrl[7] >> 4) & 0x0f];
+        bg = jcv_vdp_bdcol(vdp);
 
         // The screen is divided into a grid of 40 text positions aross and 24
         // down. Each of the text positions is 6 pixels wide and 8 pixels high.
         for (int i = 0; i < 40; ++i) {
-            offset_pname = vdp.vram[vdp.tbl_pname + (srow * 40) + i];
-            pindex = vdp.vram[vdp.tbl_pgen + (offset_pname << 3) + prow];
+            offset_pname = vdp->vram[vdp->tbl_pname + (srow * 40) + i];
+            pindex = vdp->vram[vdp->tbl_pgen + (offset_pname << 3) + prow];
 
-            // In Text Mode, the least significant two pixels are ignored (6x8)
-            // All set bits are foreground, unset bits are background
-            for (int p = 0x80; p > 0x02; p >>= 1)
-                jcv_vdp_pixel(pindex & p ? fg : bg, vdp.line, vdp.dot++);
+            /* In Text Mode, the least significant two pixels are ignored (6x8)
+               All set bits are foreground, unset bits are background. All 8
+               pixels are expanded, and the ignored two are overwritten by the
+               next text position, or the right border.
+            */
+            jcv_vdp_expand8(px + (CV_VDP_OVERSCAN << 1) + (i * 6),
+                pindex, fg, bg);
         }
 
-        vdp.dot = 0; // Reset the dot counter
+        // Draw 16 pixel left/right borders in text mode, using backdrop colour
+        jcv_vdp_fill(px, bg, CV_VDP_OVERSCAN << 1);
+        jcv_vdp_fill(px + CV_VDP_WIDTH, bg, CV_VDP_OVERSCAN << 1);
+
         return; // Pixels for Text Mode are now drawn
     }
 
-    // Draw left overscan
-    for (int i = 0; i < CV_VDP_OVERSCAN; ++i)
-        jcv_vdp_pixel(jcv_vdp_bdcol(), vdp.line, vdp.dot++);
+    // Draw left and right overscan
+    jcv_vdp_fill(px, jcv_vdp_bdcol(vdp), CV_VDP_OVERSCAN);
+    jcv_vdp_fill(px + CV_VDP_OVERSCAN + CV_VDP_WIDTH, jcv_vdp_bdcol(vdp),
+        CV_VDP_OVERSCAN);
+
+    px += CV_VDP_OVERSCAN; // Skip to the start of the active display
 
     // Graphics 1/2 and Multicolor Modes - Info on shifts in Datasheet, 3-3
-    for (int i = 0; i < 32; ++i) { // 256 pixels - 32 tiles, 8 pixels wide each
-        if (scrmode == 0x00) { // Mode 0: Graphics 1
-            offset_pname = vdp.vram[vdp.tbl_pname + (srow << 5) + i];
-            chpat = vdp.vram[vdp.tbl_pgen + (offset_pname << 3) + prow];
-            pindex = vdp.vram[vdp.tbl_col + (offset_pname >> 3)];
-        }
-        else if (scrmode == 0x02) { // Mode 2: Graphics 2
-            // In mode 2, offset is incremented by 0, 0x100, and 0x200 for each
-            // 1/3 of the screen. Top = 0, Middle = 0x100, Bottom = 0x200
-            offset_pname = vdp.vram[vdp.tbl_pname + (srow << 5) + i];
-            offset_pname += (srow & 0x18) << 5; // Increment if required
-            offset_col = vdp.tbl_col & 0x2000;
-
-            /* Control Register 4 bits 0 and 1 are an AND mask over the
-               character number. The character number is 0 - 767 (0x2ff) and
-               these two bits are ANDed over the two highest bits of this value
-               (0x2ff is 10 bits, so bit 8 and 9). So in effect, if bit 0 of
-               Control Register 4 is set, the second array of 256 patterns in
-               the Pattern Generator table is used for the middle 8 rows
-               of characters, otherwise the first 256 patterns. If bit 1 is set,
-               the third chunk of patterns is used in the Pattern Generator,
-               otherwise the first. OR 0xff to fill in the zeros from the shift
-               operation.
-            */
-            uint16_t m1 = ((vdp.ctrl[4] & 0x03) << 8) | 0xff;
+    if (scrmode == 0x00 || scrmode == 0x02) { // Graphics 1 and Graphics 2
+        // In mode 2, offset is incremented by 0, 0x100, and 0x200 for each
+        // 1/3 of the screen. Top = 0, Middle = 0x100, Bottom = 0x200
+        uint16_t chbase = scrmode == 0x02 ? (srow & 0x18) << 5 : 0;
 
-            /* Control Register 3 has a different meaning. Only bit 7 (CT13)
-               sets the Colour Table address. Somewhat like Control Register 4
-               for the Pattern Generator, bits 6 - 0 are an AND mask over the
-               top 7 bits of the character number. OR 0x07 to fill in the zeros
-               from the shift operation.
-            */
-            uint16_t m2 = ((vdp.ctrl[3] & 0x7f) << 3) | 0x07;
+        // 256 pixels - 32 tiles, 8 pixels wide each
+        for (int i = 0; i < 32; ++i) {
+            offset_pname = vdp->vram[vdp->tbl_pname + (srow << 5) + i];
 
-            // Use the masks here to select the proper pattern/colour offsets
-            chpat = vdp.vram[offset_pgen + ((offset_pname & m1) << 3) + prow];
-            pindex = vdp.vram[offset_col + ((offset_pname & m2) << 3) + prow];
+            // Only decode the tile row again if its data has changed
+            uint16_t key = ((offset_pname + chbase) << 3) | prow;
+            if (vdp->bgdirty[key])
+                jcv_vdp_bgcache_decode(vdp, scrmode, key);
+
+            memcpy(px + (i << 3), vdp->bgcache[key], sizeof(vdp->bgcache[0]));
         }
-        else if (scrmode == 0x04) { // Mode 3: Multicolor
+    }
+    else if (scrmode == 0x04) { // Mode 3: Multicolor
+        /* Control Register 4 bit 2 (PG13) selects the Pattern Generator
+           address, resulting in either 0x0000 or 0x2000.
+        */
+        uint16_t offset_pgen = jcv_vdp_g2_pgen(vdp);
+
+        for (int i = 0; i < 32; ++i) {
             /* 2 bytes from the Pattern Generator table represent four colours.
             The address for the first byte can be calculated as follows:
             PG + (byte in PN) x 8 + (row AND 3) x 2
@@ -379,53 +845,92 @@ static void jcv_vdp_bgline(void) {
             |  PG Byte 1 >> 4   |  PG Byte 1 & 0xf  |
             -----------------------------------------
             */
-            offset_pname = vdp.vram[vdp.tbl_pname + (srow << 5) + i];
+            offset_pname = vdp->vram[vdp->tbl_pname + (srow << 5) + i];
 
             // Address of the colour offset, incremented by 1 for bottom 4 rows
             offset_col = offset_pgen + (offset_pname << 3) +
-                ((srow & 0x03) << 1) + (vdp.line & 0x04 ? 1 : 0);
+                ((srow & 0x03) << 1) + (vdp->line & 0x04 ? 1 : 0);
 
-            pindex = vdp.vram[offset_col]; // Palette index
+            pindex = vdp->vram[offset_col]; // Palette index
 
             // fg for left, bg for right - reusing variables for convenience
-            fg = pindex >> 4 ? palette[pindex >> 4] : jcv_vdp_bdcol();
-            bg = pindex & 0x0f ? palette[pindex & 0x0f] : jcv_vdp_bdcol();
+            fg = pindex >> 4 ?
+                vdp->pal[pindex >> 4] : jcv_vdp_bdcol(vdp);
+            bg = pindex & 0x0f ?
+                vdp->pal[pindex & 0x0f] : jcv_vdp_bdcol(vdp);
 
             // Draw left and right background data
-            for (int p = 0; p < 4; ++p)
-                jcv_vdp_pixel(fg, vdp.line, vdp.dot++);
+            jcv_vdp_fill(px + (i << 3), fg, 4);
+            jcv_vdp_fill(px + (i << 3) + 4, bg, 4);
+        }
+    }
+    else { // Undefined mode combinations only display the backdrop colour
+        jcv_vdp_fill(px, jcv_vdp_bdcol(vdp), CV_VDP_WIDTH);
+    }
+}
 
-            for (int p = 0; p < 4; ++p)
-                jcv_vdp_pixel(bg, vdp.line, vdp.dot++);
+/* Rebuild the per-scanline sprite index
+   The Sprite Attribute Table is scanned once, and each sprite is added to the
+   bucket of every visible scanline it covers, in table order. Only the first
+   5 sprites on a line matter: 4 are drawn, and the 5th sets the 5S bit. The
+   index is rebuilt lazily when the Y positions, sprite size/magnification, or
+   table address change.
+*/
+static void jcv_vdp_sprindex(cv_vdp_t *vdp) {
+    uint8_t sprmag = vdp->ctrl[1] & 0x01; // Sprites are magnified (doubled)
+    uint8_t sprsize = vdp->ctrl[1] & 0x02 ? 16 : 8; // 16x16 if SI bit set
 
-            continue; // Pixels are already drawn, skip the rest of the loop
+    memset(vdp->sprcount, 0x00, CV_VDP_HEIGHT);
+    vdp->sprterm = 32;
+
+    for (int i = 0; i < 32; ++i) {
+        int y = vdp->vram[vdp->tbl_sattr + (i * 4)]; // "Partially signed"
+
+        // If Y is 208, that sprite and all following sprites in the table are
+        // not displayed. This is a Y value with a special meaning.
+        if (y == 208) {
+            vdp->sprterm = i;
+            break;
         }
 
-        // Set foreground and background values, if 0 use the backdrop colour
-        bg = pindex & 0x0f ? palette[pindex & 0x0f] : jcv_vdp_bdcol();
-        fg = pindex >> 4 ? palette[pindex >> 4] : jcv_vdp_bdcol();
+        /* Wrap Y index if required - Datasheet says that a vertical
+           displacement value of -31 to 0 allows a sprite to bleed in from the
+           top edge of the backdrop. In this case it appears that 224 is equal
+           to -31, in this "partially signed" context. 255 == 0, 254 == -1...
+        */
+        if (y > 224)
+            y -= 256;
 
-        // Draw pattern data starting from the leftmost pixel
-        for (int p = 0x80; p > 0x00; p >>= 1)
-            jcv_vdp_pixel(chpat & p ? fg : bg, vdp.line, vdp.dot++);
-    }
+        /* Y index needs to be offset by 1. Datasheet says a value of -1 puts
+           the sprite "butted up at the top of the screen, touching the backdrop
+           area".
+        */
+        ++y;
 
-    // Draw right overscan
-    for (int i = 0; i < CV_VDP_OVERSCAN; ++i)
-        jcv_vdp_pixel(jcv_vdp_bdcol(), vdp.line, vdp.dot++);
+        // Add the sprite to each visible scanline it has rows on
+        int end = y + (sprsize << sprmag);
+        for (int l = y < 0 ? 0 : y; l < end && l < CV_VDP_HEIGHT; ++l) {
+            if (vdp->sprcount[l] < 5)
+                vdp->sprindex[l][vdp->sprcount[l]++] = i;
+        }
+    }
 
-    vdp.dot = 0; // Reset the dot counter
+    vdp->sprdirty = 0;
 }
 
-// Draw a single line of sprite pixels
-static void jcv_vdp_sprline(void) {
-    uint8_t sprmag = vdp.ctrl[1] & 0x01; // Sprites are magnified (doubled)
-    uint8_t sprsize = vdp.ctrl[1] & 0x02 ? 16 : 8; // 16x16 if SI bit set
+/* Evaluate the sprites on a single line, setting the status bits and filling
+   linebuf with their palette entries. Returns the number of sprites drawn.
+*/
+static int jcv_vdp_sprline(cv_vdp_t *vdp, uint8_t *linebuf) {
+    uint8_t sprmag = vdp->ctrl[1] & 0x01; // Sprites are magnified (doubled)
+    uint8_t sprsize = vdp->ctrl[1] & 0x02 ? 16 : 8; // 16x16 if SI bit set
+
+    if (vdp->sprdirty)
+        jcv_vdp_sprindex(vdp);
 
-    uint8_t numspr = 0;
+    uint8_t numspr = vdp->sprcount[vdp->line];
 
     // Buffer palette entry data for this line
-    uint8_t linebuf[CV_VDP_WIDTH];
     memset(linebuf, 0x00, CV_VDP_WIDTH);
 
     /* Buffer sprite coincidence data (collision)
@@ -436,7 +941,26 @@ static void jcv_vdp_sprline(void) {
     uint8_t cbuf[CV_VDP_WIDTH];
     memset(cbuf, 0x00, CV_VDP_WIDTH);
 
-    for (int i = 0; i < 32; ++i) {
+    /* The FS bits (Fifth Sprite, 0-31) are set to the index of the last sprite
+       the VDP examines for this line. This is the 5th sprite on the line if
+       there is one, otherwise the first sprite with a Y position of 208, or
+       the final sprite in the table. These are only relevant when the 5S bit
+       is also set.
+    */
+    vdp->stat &= ~0x1f;
+
+    if (numspr == 5) { // There can only be 4 sprites per scanline
+        vdp->stat |= 0x40; // Set the 5S bit (Fifth Sprite detected)
+        vdp->stat |= vdp->sprindex[vdp->line][4] & 0x1f;
+        numspr = 4;
+    }
+    else {
+        vdp->stat |= (vdp->sprterm < 32 ? vdp->sprterm : 31) & 0x1f;
+    }
+
+    for (int n = 0; n < numspr; ++n) {
+        int i = vdp->sprindex[vdp->line][n];
+
         /* Sprite Attribute Table Entry - Datasheet 2-25
         -------------------------------------
         |   7   6   5   4   3   2   1   0   | Bit Position
@@ -454,55 +978,26 @@ static void jcv_vdp_sprline(void) {
                Some Y positions have special meanings.
                Position 0,0 is the top left corner of the screen.
         */
-        int y = vdp.vram[vdp.tbl_sattr + (i * 4)]; // "Partially signed"
-        int x = vdp.vram[vdp.tbl_sattr + (i * 4) + 1];
-        uint8_t pname = vdp.vram[vdp.tbl_sattr + (i * 4) + 2];
-        uint8_t c = vdp.vram[vdp.tbl_sattr + (i * 4) + 3];
-
-        // These bits are set every iteration regardless, but are only relevant
-        // when the 5S bit is also set.
-        vdp.stat &= ~0x1f; // Clear the FS bits (Fifth Sprite, 0-31)
-        vdp.stat |= i & 0x1f; // Set FS bits to the current sprite index
+        int y = vdp->vram[vdp->tbl_sattr + (i * 4)]; // "Partially signed"
+        int x = vdp->vram[vdp->tbl_sattr + (i * 4) + 1];
+        uint8_t pname = vdp->vram[vdp->tbl_sattr + (i * 4) + 2];
+        uint8_t c = vdp->vram[vdp->tbl_sattr + (i * 4) + 3];
 
         if (c & 0x80) // EC bit is set, reduce X by 32 pixels (Early Clock)
             x -= 32; // Allows sprites to be partially displayed on the left
 
-        // If Y is 208, that sprite and all following sprites in the table are
-        // not displayed. This is a Y value with a special meaning.
-        if (y == 208)
-            break;
-
-        /* Wrap Y index if required - Datasheet says that a vertical
-           displacement value of -31 to 0 allows a sprite to bleed in from the
-           top edge of the backdrop. In this case it appears that 224 is equal
-           to -31, in this "partially signed" context. 255 == 0, 254 == -1...
-        */
+        // Wrap and offset the Y index the same way as the sprite index does
         if (y > 224)
             y -= 256;
-
-        /* Y index needs to be offset by 1. Datasheet says a value of -1 puts
-           the sprite "butted up at the top of the screen, touching the backdrop
-           area".
-        */
         ++y;
 
-        // If no rows of the sprite are actually on the scanline in question,
-        // this iteration is finished.
-        if ((y > vdp.line) || ((y + (sprsize << sprmag)) <= vdp.line))
-            continue;
-
-        if (++numspr == 5) { // There can only be 4 sprites per scanline
-            vdp.stat |= 0x40; // Set the 5S bit (Fifth Sprite detected)
-            break; // We're done here, so break the loop
-        }
-
         // In the case of 16x16, to calculate the address in the Sprite
         // Generator table: ((pattern name) AND 252) x 8.
         if (sprsize == 16)
             pname &= 0xfc; // Do the masking here and the multiplication below
 
         // Calculate which row of the sprite pattern needs to be drawn
-        int srow = vdp.line - y;
+        int srow = vdp->line - y;
 
         // If it's magnified, divide the row in half so it will be drawn twice
         srow >>= sprmag;
@@ -511,7 +1006,7 @@ static void jcv_vdp_sprline(void) {
            and there are 256 patterns in the sprite generator table.
            So simply multiply the sprite pattern by 8 to get the address.
         */
-        uint8_t sppat = vdp.vram[vdp.tbl_spgen + (pname << 3) + srow];
+        uint8_t sppat = vdp->vram[vdp->tbl_spgen + (pname << 3) + srow];
 
         /* 16x16 Sprites - Datasheet 2-21
         ---------------------------------
@@ -535,13 +1030,14 @@ static void jcv_vdp_sprline(void) {
 
             // Handle the second pattern byte of 16x16 sprites
             if ((sprsize == 16) && (p == (8 << sprmag)))
-                sppat = vdp.vram[(vdp.tbl_spgen + (pname << 3) + srow) | 0x10];
+                sppat = vdp->vram[
+                    (vdp->tbl_spgen + (pname << 3) + srow) | 0x10];
 
             // Check if a pixel needs to be drawn for this bit
             if (sppat & (0x80 >> ((p >> sprmag) & 7))) {
                 // Set the C flag if a pixel has been drawn here already
                 if (cbuf[x + p])
-                    vdp.stat |= 0x20;
+                    vdp->stat |= 0x20;
                 else if (x + p >= 0) { // Otherwise draw a new pixel
                     linebuf[x + p] = c & 0x0f;
 
@@ -552,82 +1048,387 @@ static void jcv_vdp_sprline(void) {
         }
     }
 
-    // Draw values to the line
-    for (int i = 0; i < CV_VDP_WIDTH; ++i)
-        if (linebuf[i]) // Draw non-transparent pixels
-            jcv_vdp_pixel(palette[linebuf[i]], vdp.line, i + CV_VDP_OVERSCAN);
+    return numspr;
+}
+
+/* Threaded Rendering
+   The output for a line depends only on VRAM and the control registers at the
+   time it is drawn, so drawing can be handed to a worker thread while the CPU
+   carries on with the next line. The worker keeps its own copy of the VDP,
+   with its own VRAM, tile row cache, and video output state. The emulation
+   thread passes it a queue of commands: each VRAM write, in order, and each
+   line to draw along with a snapshot of the control registers.
+
+   Sprites are still evaluated on the emulation thread, as games poll the
+   status bits they set, and the palette entries they produce are stored in
+   the snapshot for the worker to blend over the background. At the end of
+   each frame, the emulation thread waits for the worker to finish drawing.
+   Lines are only queued between the start and end of a frame, so each output
+   line has a single snapshot which is never in use when it is filled in.
+*/
+
+// Apply a line's snapshot of the control registers to the worker's VDP
+static void jcv_vdp_thread_ctrl(cv_vdp_t *vdp, const uint8_t *ctrl) {
+    uint8_t flush = 0;
+
+    for (int i = 0; i < 8; ++i)
+        flush |= (vdp->ctrl[i] ^ ctrl[i]) & bgmask[i];
+
+    memcpy(vdp->ctrl, ctrl, sizeof(vdp->ctrl));
+    vdp->tbl_col = vdp->ctrl[3] << 6;
+    vdp->tbl_pname = vdp->ctrl[2] << 10;
+    vdp->tbl_pgen = vdp->ctrl[4] << 11;
+    vdp->tbl_sattr = vdp->ctrl[5] << 7;
+    vdp->tbl_spgen = vdp->ctrl[6] << 11;
+
+    if (flush)
+        jcv_vdp_bgcache_flush(vdp);
+}
+
+// Run a command on the worker thread
+static void jcv_vdp_thread_cmd(cv_vdp_thread_t *t, uint32_t cmd) {
+    cv_vdp_t *vdp = &t->vdp;
+
+    if (!(cmd & VDPCMD_LINE)) { // VRAM write: address and data
+        uint16_t addr = cmd >> 8;
+        vdp->vram[addr] = cmd & 0xff;
+        jcv_vdp_bgcache_mark(vdp, addr);
+        return;
+    }
+
+    int line = cmd & 0xff;
+    cv_vdp_snap_t *snap = &t->snap[line];
+    jcv_vdp_thread_ctrl(vdp, snap->ctrl);
+
+    if (snap->line == CV_VDP_HEIGHT) {
+        jcv_vdp_bdline(vdp, line);
+        return;
+    }
+
+    vdp->line = snap->line;
+    jcv_vdp_bgline(vdp);
+
+    if (snap->spr)
+        jcv_vdp_sprblend(jcv_vdp_lineptr(vdp, line) + CV_VDP_OVERSCAN,
+            snap->sprbuf, vdp->pal);
+
+    jcv_vdp_lineout(vdp, line);
+}
+
+// Worker thread - run queued commands, sleeping while there are none
+static void* jcv_vdp_thread_run(void *arg) {
+    cv_vdp_thread_t *t = (cv_vdp_thread_t*)arg;
+    size_t tail = t->tail;
+
+    while (1) {
+        pthread_mutex_lock(&t->mtx);
+        while (!t->quit) {
+            // Announce sleep before the final check, so no wakeup is missed
+            __atomic_store_n(&t->sleeping, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&t->head, __ATOMIC_SEQ_CST) != tail)
+                break;
+            pthread_cond_wait(&t->start, &t->mtx);
+        }
+        __atomic_store_n(&t->sleeping, 0, __ATOMIC_SEQ_CST);
+
+        if (t->quit) {
+            pthread_mutex_unlock(&t->mtx);
+            return NULL;
+        }
+        pthread_mutex_unlock(&t->mtx);
+
+        size_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+        for (; tail != head; ++tail)
+            jcv_vdp_thread_cmd(t, t->cmd[tail & (SIZE_VDPCMD - 1)]);
+
+        __atomic_store_n(&t->tail, tail, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&t->waiting, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&t->mtx);
+            pthread_cond_signal(&t->done);
+            pthread_mutex_unlock(&t->mtx);
+        }
+    }
+}
+
+// Make every queued command available to the worker, waking it if asked to
+static void jcv_vdp_thread_publish(cv_vdp_thread_t *t, int wake) {
+    __atomic_store_n(&t->head, t->wpos, __ATOMIC_SEQ_CST);
+
+    if (wake && __atomic_load_n(&t->sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&t->mtx);
+        pthread_cond_signal(&t->start);
+        pthread_mutex_unlock(&t->mtx);
+        t->lines = 0;
+    }
+}
+
+/* Wait until no more than pending commands are left for the worker to run,
+   returning the worker's copy of the VDP, which is safe to use while no
+   commands are pending.
+*/
+static cv_vdp_t* jcv_vdp_thread_wait(cv_vdp_thread_t *t, size_t pending) {
+    jcv_vdp_thread_publish(t, 0);
+
+    if (t->wpos - __atomic_load_n(&t->tail, __ATOMIC_SEQ_CST) > pending) {
+        pthread_mutex_lock(&t->mtx);
+        __atomic_store_n(&t->waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_cond_signal(&t->start);
+        while (t->wpos - __atomic_load_n(&t->tail, __ATOMIC_SEQ_CST) > pending)
+            pthread_cond_wait(&t->done, &t->mtx);
+        __atomic_store_n(&t->waiting, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&t->mtx);
+    }
+
+    t->tailseen = __atomic_load_n(&t->tail, __ATOMIC_SEQ_CST);
+    t->lines = 0;
+    return &t->vdp;
+}
+
+// Queue a command for the worker, waiting for room if the queue is full
+static void jcv_vdp_thread_push(cv_vdp_thread_t *t, uint32_t cmd) {
+    if (t->wpos - t->tailseen == SIZE_VDPCMD) {
+        t->tailseen = __atomic_load_n(&t->tail, __ATOMIC_SEQ_CST);
+        if (t->wpos - t->tailseen == SIZE_VDPCMD)
+            jcv_vdp_thread_wait(t, SIZE_VDPCMD >> 1);
+    }
+
+    t->cmd[t->wpos++ & (SIZE_VDPCMD - 1)] = cmd;
+}
+
+// Queue an output line to be drawn, with the given active display line
+static void jcv_vdp_thread_queue(cv_vdp_t *vdp, int out, uint16_t line) {
+    cv_vdp_thread_t *t = vdp->thread;
+    memcpy(t->snap[out].ctrl, vdp->ctrl, sizeof(vdp->ctrl));
+    t->snap[out].line = line;
+    jcv_vdp_thread_push(t, VDPCMD_LINE | out);
+    jcv_vdp_thread_publish(t, ++t->lines >= VDP_WAKE_LINES);
+}
+
+// Evaluate the sprites on an active display line and queue it to be drawn
+static void jcv_vdp_thread_line(cv_vdp_t *vdp) {
+    int out = vdp->line + CV_VDP_OVERSCAN;
+    cv_vdp_snap_t *snap = &vdp->thread->snap[out];
+
+    snap->spr = 0;
+    if (jcv_vdp_rendering(vdp) && !(vdp->ctrl[1] & 0x10))
+        snap->spr = jcv_vdp_sprline(vdp, snap->sprbuf) != 0;
+
+    if (vdp->render)
+        jcv_vdp_thread_queue(vdp, out,
+            jcv_vdp_rendering(vdp) ? vdp->line : CV_VDP_HEIGHT);
+}
+
+// Queue the vertical overscan lines and wait for the frame to be drawn
+static void jcv_vdp_thread_frame(cv_vdp_t *vdp) {
+    for (int i = 0; i < CV_VDP_OVERSCAN && vdp->render; ++i) {
+        jcv_vdp_thread_queue(vdp, i, CV_VDP_HEIGHT);
+        jcv_vdp_thread_queue(vdp, i + CV_VDP_HEIGHT + CV_VDP_OVERSCAN,
+            CV_VDP_HEIGHT);
+    }
+
+    cv_vdp_t *tvdp = jcv_vdp_thread_wait(vdp->thread, 0);
+
+    if (tvdp->track && vdp->render)
+        jcv_vdp_dirty_frame(tvdp);
+}
+
+// Bring the worker's VRAM and registers up to date after they were replaced
+static void jcv_vdp_thread_sync(cv_vdp_t *vdp) {
+    if (vdp->thread == NULL)
+        return;
+
+    cv_vdp_t *tvdp = jcv_vdp_thread_wait(vdp->thread, 0);
+    memcpy(tvdp->vram, vdp->vram, SIZE_VRAM);
+    jcv_vdp_thread_ctrl(tvdp, vdp->ctrl);
+    jcv_vdp_bgcache_flush(tvdp);
+}
+
+// Pass changes to the palette or output format on to the worker
+static void jcv_vdp_thread_config(cv_vdp_t *vdp) {
+    if (vdp->thread == NULL)
+        return;
+
+    cv_vdp_t *tvdp = jcv_vdp_thread_wait(vdp->thread, 0);
+    tvdp->palette = vdp->palette;
+    tvdp->fmt = vdp->fmt;
+    memcpy(tvdp->pal, vdp->pal, sizeof(tvdp->pal));
+    jcv_vdp_bgcache_flush(tvdp);
+}
+
+/* Enable or disable drawing on a worker thread. Returns 1 on success, or 0 if
+   the worker could not be started.
+*/
+int jcv_vdp_set_threaded(jcv_ctx_t *ctx, uint8_t threaded) {
+    cv_vdp_t *vdp = &ctx->vdp;
+    cv_vdp_thread_t *t = vdp->thread;
+
+    if (threaded && t == NULL) {
+        t = (cv_vdp_thread_t*)calloc(1, sizeof(cv_vdp_thread_t));
+        if (t == NULL)
+            return 0;
+
+        t->vdp = *vdp; // Start from the current VRAM and output state
+        t->vdp.thread = NULL;
+        jcv_vdp_bgcache_flush(&t->vdp);
+
+        pthread_mutex_init(&t->mtx, NULL);
+        pthread_cond_init(&t->start, NULL);
+        pthread_cond_init(&t->done, NULL);
+
+        if (pthread_create(&t->id, NULL, jcv_vdp_thread_run, t)) {
+            pthread_cond_destroy(&t->done);
+            pthread_cond_destroy(&t->start);
+            pthread_mutex_destroy(&t->mtx);
+            free(t);
+            return 0;
+        }
+
+        vdp->thread = t;
+    }
+    else if (!threaded && t != NULL) {
+        cv_vdp_t *tvdp = jcv_vdp_thread_wait(t, 0);
+
+        pthread_mutex_lock(&t->mtx);
+        t->quit = 1;
+        pthread_cond_signal(&t->start);
+        pthread_mutex_unlock(&t->mtx);
+        pthread_join(t->id, NULL);
+
+        // Take back the video output state, and decode tile rows again
+        memcpy(vdp->linehash, tvdp->linehash, sizeof(vdp->linehash));
+        memcpy(vdp->dirtyout, tvdp->dirtyout, sizeof(vdp->dirtyout));
+        vdp->ndirtyout = tvdp->ndirtyout;
+        vdp->hashvalid = tvdp->hashvalid;
+        jcv_vdp_bgcache_flush(vdp);
+
+        pthread_cond_destroy(&t->done);
+        pthread_cond_destroy(&t->start);
+        pthread_mutex_destroy(&t->mtx);
+        free(t);
+        vdp->thread = NULL;
+    }
+
+    return 1;
+}
+
+// Stop the worker thread if one is running
+void jcv_vdp_deinit(jcv_ctx_t *ctx) {
+    jcv_vdp_set_threaded(ctx, 0);
 }
 
 // Draw a scanline to the canvas
-void jcv_vdp_exec(void) {
-    if (jcv_vdp_rendering() && vdp.line < CV_VDP_HEIGHT) {
-        jcv_vdp_bgline(); // Draw background
-        if (!(vdp.ctrl[1] & 0x10)) // Do not draw sprites in Text Mode
-            jcv_vdp_sprline(); // Draw sprites
+void jcv_vdp_exec(jcv_ctx_t *ctx) {
+    cv_vdp_t *vdp = &ctx->vdp;
+
+    /* When drawing to the video output buffer is disabled, sprites must still
+       be evaluated because they set the 5S, C, and FS bits in the Status
+       Register, which games poll. Everything else on the line is skipped.
+    */
+    if (vdp->thread) {
+        if (vdp->line < CV_VDP_HEIGHT)
+            jcv_vdp_thread_line(vdp);
     }
-    else if (vdp.line < CV_VDP_HEIGHT) {
-        jcv_vdp_bdline(vdp.line + CV_VDP_OVERSCAN);
+    else if (jcv_vdp_rendering(vdp) && vdp->line < CV_VDP_HEIGHT) {
+        uint8_t sprbuf[CV_VDP_WIDTH]; // Sprite palette entries
+        int numspr = 0;
+
+        if (vdp->render)
+            jcv_vdp_bgline(vdp); // Draw background
+        if (!(vdp->ctrl[1] & 0x10)) // Do not draw sprites in Text Mode
+            numspr = jcv_vdp_sprline(vdp, sprbuf); // Evaluate sprites
+
+        // Draw sprites - status bits are already set if not rendering
+        if (vdp->render) {
+            if (numspr)
+                jcv_vdp_sprblend(jcv_vdp_lineptr(vdp,
+                    vdp->line + CV_VDP_OVERSCAN) + CV_VDP_OVERSCAN, sprbuf,
+                    vdp->pal);
+            jcv_vdp_lineout(vdp, vdp->line + CV_VDP_OVERSCAN);
+        }
+    }
+    else if (vdp->line < CV_VDP_HEIGHT && vdp->render) {
+        jcv_vdp_bdline(vdp, vdp->line + CV_VDP_OVERSCAN);
     }
 
     // Increment the line number
-    ++vdp.line;
+    ++vdp->line;
 
-    if (vdp.line == CV_VDP_HEIGHT) { // Enter VBLANK
+    if (vdp->line == CV_VDP_HEIGHT) { // Enter VBLANK
         // Save the state of the Status Register INT bit
-        uint8_t old_int = jcv_vdp_int();
+        uint8_t old_int = jcv_vdp_int(vdp);
 
         // Set the INT bit on the Status Register
-        vdp.stat |= 0x80;
+        vdp->stat |= 0x80;
 
         /* Fire NMI if Register 1 GINT is set and Status Register INT was clear
            before entering VBLANK. This prevents the NMI from being fired if
            we're already in the interrupt service routine, and a read of the
            status register has not yet been done to clear the bit.
         */
-        if (jcv_vdp_gint() && !old_int)
-            jcv_z80_nmi();
+        if (jcv_vdp_gint(vdp) && !old_int)
+            jcv_z80_nmi(ctx);
     }
 
     // Start on the next frame when the end of this one is reached
-    if (vdp.line == numscanlines) {
-        vdp.line = 0;
+    if (vdp->line == vdp->numscanlines) {
+        vdp->line = 0;
+
+        if (vdp->thread) {
+            jcv_vdp_thread_frame(vdp);
+            return;
+        }
 
         // Draw backdrop colour on the vertical overscan lines
-        for (int i = 0; i < CV_VDP_OVERSCAN; ++i) {
-            jcv_vdp_bdline(i);
-            jcv_vdp_bdline(i + CV_VDP_HEIGHT + CV_VDP_OVERSCAN);
+        for (int i = 0; i < CV_VDP_OVERSCAN && vdp->render; ++i) {
+            jcv_vdp_bdline(vdp, i);
+            jcv_vdp_bdline(vdp, i + CV_VDP_HEIGHT + CV_VDP_OVERSCAN);
         }
+
+        // Frames which were not drawn leave the video output buffer unchanged
+        if (vdp->track && vdp->render)
+            jcv_vdp_dirty_frame(vdp);
+    }
+}
+
+// Restore the VDP's state, leaving VRAM untouched if vram is 0
+void jcv_vdp_state_load(jcv_ctx_t *ctx, jcv_serial_t *st, uint8_t vram) {
+    cv_vdp_t *vdp = &ctx->vdp;
+    vdp->line = jcv_serial_pop16(st);
+    vdp->dot = jcv_serial_pop16(st);
+    if (vram) {
+        jcv_serial_popblk(st, vdp->vram, SIZE_VRAM);
+        memset(vdp->vramdirty, 1, sizeof(vdp->vramdirty));
     }
+    vdp->addr = jcv_serial_pop16(st);
+    vdp->dlatch = jcv_serial_pop8(st);
+    vdp->wlatch = jcv_serial_pop8(st);
+    for (size_t i = 0; i < 8; ++i) vdp->ctrl[i] = jcv_serial_pop8(st);
+    vdp->stat = jcv_serial_pop8(st);
+    vdp->tbl_col = jcv_serial_pop16(st);
+    vdp->tbl_pgen = jcv_serial_pop16(st);
+    vdp->tbl_pname = jcv_serial_pop16(st);
+    vdp->tbl_sattr = jcv_serial_pop16(st);
+    vdp->tbl_spgen = jcv_serial_pop16(st);
+    jcv_vdp_bgcache_flush(vdp);
+    vdp->sprdirty = 1;
+    jcv_vdp_thread_sync(vdp);
 }
 
-void jcv_vdp_state_load(uint8_t *st) {
-    vdp.line = jcv_serial_pop16(st);
-    vdp.dot = jcv_serial_pop16(st);
-    jcv_serial_popblk(vdp.vram, st, SIZE_VRAM);
-    vdp.addr = jcv_serial_pop16(st);
-    vdp.dlatch = jcv_serial_pop8(st);
-    vdp.wlatch = jcv_serial_pop8(st);
-    for (size_t i = 0; i < 8; ++i) vdp.ctrl[i] = jcv_serial_pop8(st);
-    vdp.stat = jcv_serial_pop8(st);
-    vdp.tbl_col = jcv_serial_pop16(st);
-    vdp.tbl_pgen = jcv_serial_pop16(st);
-    vdp.tbl_pname = jcv_serial_pop16(st);
-    vdp.tbl_sattr = jcv_serial_pop16(st);
-    vdp.tbl_spgen = jcv_serial_pop16(st);
-}
-
-void jcv_vdp_state_save(uint8_t *st) {
-    jcv_serial_push16(st, vdp.line);
-    jcv_serial_push16(st, vdp.dot);
-    jcv_serial_pushblk(st, vdp.vram, SIZE_VRAM);
-    jcv_serial_push16(st, vdp.addr);
-    jcv_serial_push8(st, vdp.dlatch);
-    jcv_serial_push8(st, vdp.wlatch);
-    for (size_t i = 0; i < 8; ++i) jcv_serial_push8(st, vdp.ctrl[i]);
-    jcv_serial_push8(st, vdp.stat);
-    jcv_serial_push16(st, vdp.tbl_col);
-    jcv_serial_push16(st, vdp.tbl_pgen);
-    jcv_serial_push16(st, vdp.tbl_pname);
-    jcv_serial_push16(st, vdp.tbl_sattr);
-    jcv_serial_push16(st, vdp.tbl_spgen);
+// Export the VDP's state, leaving out VRAM if vram is 0
+void jcv_vdp_state_save(jcv_ctx_t *ctx, jcv_serial_t *st, uint8_t vram) {
+    cv_vdp_t *vdp = &ctx->vdp;
+    jcv_serial_push16(st, vdp->line);
+    jcv_serial_push16(st, vdp->dot);
+    if (vram)
+        jcv_serial_pushblk(st, vdp->vram, SIZE_VRAM);
+    jcv_serial_push16(st, vdp->addr);
+    jcv_serial_push8(st, vdp->dlatch);
+    jcv_serial_push8(st, vdp->wlatch);
+    for (size_t i = 0; i < 8; ++i) jcv_serial_push8(st, vdp->ctrl[i]);
+    jcv_serial_push8(st, vdp->stat);
+    jcv_serial_push16(st, vdp->tbl_col);
+    jcv_serial_push16(st, vdp->tbl_pgen);
+    jcv_serial_push16(st, vdp->tbl_pname);
+    jcv_serial_push16(st, vdp->tbl_sattr);
+    jcv_serial_push16(st, vdp->tbl_spgen);
 }
@@ -39,12 +39,22 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define CV_VDP_SCANLINES 262
 #define CV_VDP_SCANLINES_PAL 313
 
+// Video output buffer formats
+#define CV_VDP_FMT_ARGB8888 0 // 32-bit ARGB, one pixel per uint32_t
+#define CV_VDP_FMT_RGB565 1 // 16-bit RGB, one pixel per uint16_t
+#define CV_VDP_FMT_INDEX8 2 // Palette index (0-15), one pixel per byte
+#define CV_VDP_FMT_INDEX4 3 // Palette index, two pixels per byte (high first)
+
+#define SIZE_DIRTY ((CV_VDP_HEIGHT_OVERSCAN + 31) >> 5) // Dirty bitmap words
+
 #define SIZE_VRAM 0x4000
+#define SIZE_BGCACHE 0x1800 // 768 characters, 8 rows each
 
 typedef struct _cv_vdp_t {
     uint16_t line; // Line currently being drawn
     uint16_t dot; // Dot currently being drawn
     uint8_t vram[SIZE_VRAM]; // 16K VRAM
+    uint8_t vramdirty[SIZE_VRAM >> 8]; // Pages written since checkpoint
     uint16_t addr; // Memory Address - 14 bit address
     uint8_t dlatch; // Data Latch (general purpose 8-bit data register)
     uint8_t wlatch; // Write Latch
@@ -55,23 +65,58 @@ typedef struct _cv_vdp_t {
     uint16_t tbl_pname; // Address for Pattern Name table
     uint16_t tbl_sattr; // Address for Sprite Attribute table
     uint16_t tbl_spgen; // Addresss for Sprite Generator table
+
+    void *vbuf; // Video output buffer
+    const uint32_t *palette; // Palette used for video output
+    uint32_t pal[16]; // Palette converted to the output format
+    uint32_t pxline[CV_VDP_WIDTH_OVERSCAN]; // Line drawn for compact formats
+    uint8_t fmt; // Video output buffer format
+    uint16_t numscanlines; // Number of scanlines per frame
+    uint8_t render; // Draw pixels to the video output buffer
+
+    uint64_t linehash[CV_VDP_HEIGHT_OVERSCAN]; // Hash of each line last drawn
+    uint32_t dirty[SIZE_DIRTY]; // Lines changed so far this frame
+    uint32_t dirtyout[SIZE_DIRTY]; // Lines changed in the last frame
+    uint16_t ndirty; // Number of lines changed so far this frame
+    uint16_t ndirtyout; // Number of lines changed in the last frame
+    uint8_t track; // Track which lines change between frames
+    uint8_t hashvalid; // Line hashes hold a previous frame's output
+
+    struct _cv_vdp_thread_t *thread; // Worker thread drawing lines, or NULL
+
+    uint32_t bgcache[SIZE_BGCACHE][8]; // Decoded Graphics 1/2 tile rows
+    uint8_t bgdirty[SIZE_BGCACHE]; // Tile rows which need to be decoded
+
+    uint8_t sprcount[CV_VDP_HEIGHT]; // Sprites on each line (maximum 5)
+    uint8_t sprindex[CV_VDP_HEIGHT][5]; // First 5 sprites on each line
+    uint8_t sprterm; // Index of the first sprite with a Y position of 208
+    uint8_t sprdirty; // Sprite index needs to be rebuilt
 } cv_vdp_t;
 
-void jcv_vdp_init(void);
+void jcv_vdp_init(jcv_ctx_t*);
+void jcv_vdp_deinit(jcv_ctx_t*);
+
+void jcv_vdp_set_buffer(jcv_ctx_t*, void*);
+void jcv_vdp_set_format(jcv_ctx_t*, uint8_t);
+void jcv_vdp_set_palette(jcv_ctx_t*, uint8_t);
+void jcv_vdp_set_region(jcv_ctx_t*, uint8_t);
+void jcv_vdp_set_render(jcv_ctx_t*, uint8_t);
+void jcv_vdp_set_track(jcv_ctx_t*, uint8_t);
+int jcv_vdp_set_threaded(jcv_ctx_t*, uint8_t);
 
-void jcv_vdp_set_buffer(uint32_t*);
-void jcv_vdp_set_palette(uint8_t);
-void jcv_vdp_set_region(uint8_t);
+size_t jcv_vdp_get_pitch(jcv_ctx_t*);
+const uint32_t* jcv_vdp_get_palette(jcv_ctx_t*);
+size_t jcv_vdp_get_dirty(jcv_ctx_t*, const uint32_t**);
 
-uint8_t jcv_vdp_rd_data(void);
-uint8_t jcv_vdp_rd_stat(void);
+uint8_t jcv_vdp_rd_data(jcv_ctx_t*);
+uint8_t jcv_vdp_rd_stat(jcv_ctx_t*);
 
-void jcv_vdp_wr_ctrl(uint8_t);
-void jcv_vdp_wr_data(uint8_t);
+void jcv_vdp_wr_ctrl(jcv_ctx_t*, uint8_t);
+void jcv_vdp_wr_data(jcv_ctx_t*, uint8_t);
 
-void jcv_vdp_exec(void);
+void jcv_vdp_exec(jcv_ctx_t*);
 
-void jcv_vdp_state_load(uint8_t*);
-void jcv_vdp_state_save(uint8_t*);
+void jcv_vdp_state_load(jcv_ctx_t*, jcv_serial_t*, uint8_t);
+void jcv_vdp_state_save(jcv_ctx_t*, jcv_serial_t*, uint8_t);
 
 #endif
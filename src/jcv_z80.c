@@ -28,175 +28,243 @@ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+/* By default, the Z80 core is compiled into this file rather than on its own,
+   with memory accesses going straight to the page tables instead of through
+   the read_byte/write_byte function pointers. Defining JCV_Z80_CALLBACKS uses
+   the separately compiled, portable callback version of the core instead.
+*/
+#ifndef JCV_Z80_CALLBACKS
+    #define Z80_EXPORT static inline
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 
+#include "jcv.h"
 #include "jcv_memio.h"
+#include "jcv_mixer.h"
+#include "jcv_movie.h"
+#include "jcv_psg.h"
+#include "jcv_rewind.h"
 #include "jcv_serial.h"
+#include "jcv_sgmpsg.h"
+#include "jcv_stats.h"
+#include "jcv_vdp.h"
 #include "jcv_z80.h"
+#include "jcv_ctx.h"
+
+#ifndef JCV_Z80_CALLBACKS
+// Memory Read - Page table lookup, falling back to the full memory map
+static inline uint8_t jcv_z80_rd(void *userdata, uint16_t addr) {
+    jcv_ctx_t *ctx = (jcv_ctx_t*)userdata;
+    const uint8_t *page = ctx->cvsys.rdmap[addr >> 10];
+
+    if (page == NULL)
+        return jcv_mem_rd(ctx, addr);
+
+    JCV_STATS_INC(ctx, memrd[ctx->cvsys.rdregion[addr >> 10]]);
+    return page[addr & 0x3ff];
+}
+
+// Memory Write - Page table lookup, flagging the page as dirty
+static inline void jcv_z80_wr(void *userdata, uint16_t addr, uint8_t data) {
+    cv_sys_t *cvsys = &((jcv_ctx_t*)userdata)->cvsys;
+    cvsys->wrmap[addr >> 10][addr & 0x3ff] = data;
+    cvsys->dirtymap[addr >> 10][(addr >> 8) & 0x03] = 1;
+}
+
+// Peek at memory for the idle loop detector, if it is safe to read
+static inline int jcv_z80_peek(void *userdata, uint16_t addr, uint8_t *data) {
+    const uint8_t *page = ((jcv_ctx_t*)userdata)->cvsys.rdmap[addr >> 10];
+
+    // Reads through the full memory map may switch banks
+    if (page == NULL)
+        return 0;
 
-#include "z80.h"
+    *data = page[addr & 0x3ff];
+    return 1;
+}
+
+#define Z80_READ_BYTE(U, A) jcv_z80_rd(U, A)
+#define Z80_WRITE_BYTE(U, A, V) jcv_z80_wr(U, A, V)
+#define Z80_PEEK_BYTE(U, A, V) jcv_z80_peek(U, A, V)
+#define Z80_STEP_HOOK(U, N) JCV_STATS_ADD((jcv_ctx_t*)(U), insns, N)
 
-static z80 z80ctx;
-static uint32_t extracycs = 0;
-static uint32_t delaycycs = 0;
+#include "z80/z80.c"
+#endif
 
 // Memory Read
 static uint8_t read_byte(void *userdata, uint16_t addr) {
-    if (userdata) { } // Unused
-    return jcv_mem_rd(addr);
+    return jcv_mem_rd((jcv_ctx_t*)userdata, addr);
 }
 
 // Memory Write
 static void write_byte(void *userdata, uint16_t addr, uint8_t data) {
-    if (userdata) { } // Unused
-    jcv_mem_wr(addr, data);
+    jcv_mem_wr((jcv_ctx_t*)userdata, addr, data);
 }
 
 // IO Port Read
 static uint8_t port_in(z80 *z, uint16_t port) {
-    if (z) { } // Unused
-    return jcv_io_rd(port & 0xff);
+    return jcv_io_rd((jcv_ctx_t*)z->userdata, port & 0xff);
 }
 
 // IO Port Write
 static void port_out(z80 *z, uint16_t port, uint8_t data) {
-    if (z) { } // Unused
-    jcv_io_wr(port & 0xff, data);
+    jcv_io_wr((jcv_ctx_t*)z->userdata, port & 0xff, data);
 }
 
 // Store extra cycle count
-void jcv_z80_cyc_store(uint32_t cycs) {
-    extracycs = cycs;
+void jcv_z80_cyc_store(jcv_ctx_t *ctx, uint32_t cycs) {
+    ctx->extracycs = cycs;
 }
 
 // Retrieve stored extra cycle count
-uint32_t jcv_z80_cyc_restore(void) {
-    uint32_t ret = extracycs;
-    extracycs = 0;
+uint32_t jcv_z80_cyc_restore(jcv_ctx_t *ctx) {
+    uint32_t ret = ctx->extracycs;
+    ctx->extracycs = 0;
     return ret;
 }
 
 // Initialize the Z80
-void jcv_z80_init(void) {
-    z80_init(&z80ctx);
-    z80ctx.read_byte = &read_byte;
-    z80ctx.write_byte = &write_byte;
-    z80ctx.port_in = &port_in;
-    z80ctx.port_out = &port_out;
+void jcv_z80_init(jcv_ctx_t *ctx) {
+    z80_init(&ctx->z80ctx);
+    ctx->z80ctx.read_byte = &read_byte;
+    ctx->z80ctx.write_byte = &write_byte;
+    ctx->z80ctx.port_in = &port_in;
+    ctx->z80ctx.port_out = &port_out;
+    ctx->z80ctx.userdata = ctx;
 }
 
 // Reset the Z80
-void jcv_z80_reset(void) {
-    jcv_z80_init();
+void jcv_z80_reset(jcv_ctx_t *ctx) {
+    jcv_z80_init(ctx);
 }
 
 // Generate an Interrupt
-void jcv_z80_irq(uint8_t data) {
-    z80_pulse_irq(&z80ctx, data);
+void jcv_z80_irq(jcv_ctx_t *ctx, uint8_t data) {
+    z80_pulse_irq(&ctx->z80ctx, data);
 }
 
 // Generate a Non-Maskable Interrupt
-void jcv_z80_nmi(void) {
-    z80_pulse_nmi(&z80ctx);
+void jcv_z80_nmi(jcv_ctx_t *ctx) {
+    z80_pulse_nmi(&ctx->z80ctx);
 }
 
 // Delay the Z80's execution by a requested number of cycles
-void jcv_z80_delay(uint32_t delay) {
-    delaycycs += delay;
+void jcv_z80_delay(jcv_ctx_t *ctx, uint32_t delay) {
+    ctx->cycs += delay;
 }
 
-// Run a single Z80 instruction
-uint32_t jcv_z80_exec(void) {
-    uint32_t retcyc = z80_step(&z80ctx);
-
-    if (delaycycs) {
-        retcyc += delaycycs;
-        delaycycs = 0;
-    }
+/* Scheduler hook: ask for the current run to return to the caller no later
+   than the requested number of cycles after the current instruction began.
+   Devices call this when something happens which the frame loop may need to
+   act on before the original deadline. The deadline is only ever shortened.
+*/
+void jcv_z80_deadline(jcv_ctx_t *ctx, uint32_t cycles) {
+    if (ctx->cycs + cycles < ctx->deadline)
+        ctx->deadline = ctx->cycs + cycles;
+}
 
-    return retcyc;
+// Run a single Z80 instruction
+uint32_t jcv_z80_exec(jcv_ctx_t *ctx) {
+    return jcv_z80_run(ctx, 1);
 }
 
-// Run Z80 instructions until at least the requested number of cycles have run
-uint32_t jcv_z80_run(uint32_t cycles) {
-    uint32_t retcyc = z80_step_n(&z80ctx, cycles);
+/* Run Z80 instructions until at least the requested number of cycles have run,
+   or until a device shortens the deadline. The cycle count is only advanced
+   once each instruction completes, so while an instruction is running the
+   devices see the time at which it began, plus any delays they have added.
+*/
+uint32_t jcv_z80_run(jcv_ctx_t *ctx, uint32_t cycles) {
+    z80 *z = &ctx->z80ctx;
+    uint32_t start = ctx->cycs;
+    ctx->deadline = start + cycles;
 
-    if (delaycycs) {
-        retcyc += delaycycs;
-        delaycycs = 0;
+#if defined(JCV_Z80_CALLBACKS) && defined(JCV_STATS)
+    // The separately compiled core cannot count instructions as they run
+    while (ctx->cycs < ctx->deadline) {
+        ctx->cycs += z80_step(z);
+        JCV_STATS_INC(ctx, insns);
     }
+#else
+    z80_run(z, &ctx->cycs, &ctx->deadline);
+#endif
 
-    return retcyc;
+    return ctx->cycs - start;
 }
 
 // Restore the Z80's state from external data
-void jcv_z80_state_load(uint8_t *st) {
-    z80ctx.pc = jcv_serial_pop16(st);
-    z80ctx.sp = jcv_serial_pop16(st);
-    z80ctx.ix = jcv_serial_pop16(st);
-    z80ctx.iy = jcv_serial_pop16(st);
-    z80ctx.mem_ptr = jcv_serial_pop16(st);
-    z80ctx.a = jcv_serial_pop8(st);
-    z80ctx.f = jcv_serial_pop8(st);
-    z80ctx.b = jcv_serial_pop8(st);
-    z80ctx.c = jcv_serial_pop8(st);
-    z80ctx.d = jcv_serial_pop8(st);
-    z80ctx.e = jcv_serial_pop8(st);
-    z80ctx.h = jcv_serial_pop8(st);
-    z80ctx.l = jcv_serial_pop8(st);
-    z80ctx.a_ = jcv_serial_pop8(st);
-    z80ctx.f_ = jcv_serial_pop8(st);
-    z80ctx.b_ = jcv_serial_pop8(st);
-    z80ctx.c_ = jcv_serial_pop8(st);
-    z80ctx.d_ = jcv_serial_pop8(st);
-    z80ctx.e_ = jcv_serial_pop8(st);
-    z80ctx.h_ = jcv_serial_pop8(st);
-    z80ctx.l_ = jcv_serial_pop8(st);
-    z80ctx.i  = jcv_serial_pop8(st);
-    z80ctx.r  = jcv_serial_pop8(st);
-    z80ctx.iff_delay = jcv_serial_pop8(st);
-    z80ctx.interrupt_mode = jcv_serial_pop8(st);
-    z80ctx.irq_data = jcv_serial_pop8(st);
-    z80ctx.iff1 = jcv_serial_pop8(st);
-    z80ctx.iff2 = jcv_serial_pop8(st);
-    z80ctx.halted = jcv_serial_pop8(st);
-    z80ctx.irq_pending = jcv_serial_pop8(st);
-    z80ctx.nmi_pending = jcv_serial_pop8(st);
+void jcv_z80_state_load(jcv_ctx_t *ctx, jcv_serial_t *st) {
+    z80 *z = &ctx->z80ctx;
+    z->pc = jcv_serial_pop16(st);
+    z->sp = jcv_serial_pop16(st);
+    z->ix = jcv_serial_pop16(st);
+    z->iy = jcv_serial_pop16(st);
+    z->mem_ptr = jcv_serial_pop16(st);
+    z->a = jcv_serial_pop8(st);
+    z->f = jcv_serial_pop8(st);
+    z->b = jcv_serial_pop8(st);
+    z->c = jcv_serial_pop8(st);
+    z->d = jcv_serial_pop8(st);
+    z->e = jcv_serial_pop8(st);
+    z->h = jcv_serial_pop8(st);
+    z->l = jcv_serial_pop8(st);
+    z->a_ = jcv_serial_pop8(st);
+    z->f_ = jcv_serial_pop8(st);
+    z->b_ = jcv_serial_pop8(st);
+    z->c_ = jcv_serial_pop8(st);
+    z->d_ = jcv_serial_pop8(st);
+    z->e_ = jcv_serial_pop8(st);
+    z->h_ = jcv_serial_pop8(st);
+    z->l_ = jcv_serial_pop8(st);
+    z->i  = jcv_serial_pop8(st);
+    z->r  = jcv_serial_pop8(st);
+    z->iff_delay = jcv_serial_pop8(st);
+    z->interrupt_mode = jcv_serial_pop8(st);
+    z->irq_data = jcv_serial_pop8(st);
+    z->iff1 = jcv_serial_pop8(st);
+    z->iff2 = jcv_serial_pop8(st);
+    z->halted = jcv_serial_pop8(st);
+    z->irq_pending = jcv_serial_pop8(st);
+    z->nmi_pending = jcv_serial_pop8(st);
+
+    // Memory may have changed under a loop the CPU was seen idling in
+    z->idle_valid = 0;
 }
 
 // Export the Z80's state
-void jcv_z80_state_save(uint8_t *st) {
-    jcv_serial_push16(st, z80ctx.pc);
-    jcv_serial_push16(st, z80ctx.sp);
-    jcv_serial_push16(st, z80ctx.ix);
-    jcv_serial_push16(st, z80ctx.iy);
-    jcv_serial_push16(st, z80ctx.mem_ptr);
-    jcv_serial_push8(st, z80ctx.a);
-    jcv_serial_push8(st, z80ctx.f);
-    jcv_serial_push8(st, z80ctx.b);
-    jcv_serial_push8(st, z80ctx.c);
-    jcv_serial_push8(st, z80ctx.d);
-    jcv_serial_push8(st, z80ctx.e);
-    jcv_serial_push8(st, z80ctx.h);
-    jcv_serial_push8(st, z80ctx.l);
-    jcv_serial_push8(st, z80ctx.a_);
-    jcv_serial_push8(st, z80ctx.f_);
-    jcv_serial_push8(st, z80ctx.b_);
-    jcv_serial_push8(st, z80ctx.c_);
-    jcv_serial_push8(st, z80ctx.d_);
-    jcv_serial_push8(st, z80ctx.e_);
-    jcv_serial_push8(st, z80ctx.h_);
-    jcv_serial_push8(st, z80ctx.l_);
-    jcv_serial_push8(st, z80ctx.i);
-    jcv_serial_push8(st, z80ctx.r);
-    jcv_serial_push8(st, z80ctx.iff_delay);
-    jcv_serial_push8(st, z80ctx.interrupt_mode);
-    jcv_serial_push8(st, z80ctx.irq_data);
-    jcv_serial_push8(st, z80ctx.iff1);
-    jcv_serial_push8(st, z80ctx.iff2);
-    jcv_serial_push8(st, z80ctx.halted);
-    jcv_serial_push8(st, z80ctx.irq_pending);
-    jcv_serial_push8(st, z80ctx.nmi_pending);
+void jcv_z80_state_save(jcv_ctx_t *ctx, jcv_serial_t *st) {
+    z80 *z = &ctx->z80ctx;
+    jcv_serial_push16(st, z->pc);
+    jcv_serial_push16(st, z->sp);
+    jcv_serial_push16(st, z->ix);
+    jcv_serial_push16(st, z->iy);
+    jcv_serial_push16(st, z->mem_ptr);
+    jcv_serial_push8(st, z->a);
+    jcv_serial_push8(st, z->f);
+    jcv_serial_push8(st, z->b);
+    jcv_serial_push8(st, z->c);
+    jcv_serial_push8(st, z->d);
+    jcv_serial_push8(st, z->e);
+    jcv_serial_push8(st, z->h);
+    jcv_serial_push8(st, z->l);
+    jcv_serial_push8(st, z->a_);
+    jcv_serial_push8(st, z->f_);
+    jcv_serial_push8(st, z->b_);
+    jcv_serial_push8(st, z->c_);
+    jcv_serial_push8(st, z->d_);
+    jcv_serial_push8(st, z->e_);
+    jcv_serial_push8(st, z->h_);
+    jcv_serial_push8(st, z->l_);
+    jcv_serial_push8(st, z->i);
+    jcv_serial_push8(st, z->r);
+    jcv_serial_push8(st, z->iff_delay);
+    jcv_serial_push8(st, z->interrupt_mode);
+    jcv_serial_push8(st, z->irq_data);
+    jcv_serial_push8(st, z->iff1);
+    jcv_serial_push8(st, z->iff2);
+    jcv_serial_push8(st, z->halted);
+    jcv_serial_push8(st, z->irq_pending);
+    jcv_serial_push8(st, z->nmi_pending);
 }
@@ -31,18 +31,19 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef JCV_Z80_H
 #define JCV_Z80_H
 
-void jcv_z80_cyc_store(uint32_t);
-uint32_t jcv_z80_cyc_restore(void);
-void jcv_z80_init(void);
-void jcv_z80_irq_clr(void);
-void jcv_z80_irq(uint8_t data);
-void jcv_z80_nmi(void);
-void jcv_z80_reset(void);
-void jcv_z80_delay(uint32_t);
-uint32_t jcv_z80_exec(void);
-uint32_t jcv_z80_run(uint32_t);
-
-void jcv_z80_state_load(uint8_t*);
-void jcv_z80_state_save(uint8_t*);
+void jcv_z80_cyc_store(jcv_ctx_t*, uint32_t);
+uint32_t jcv_z80_cyc_restore(jcv_ctx_t*);
+void jcv_z80_init(jcv_ctx_t*);
+void jcv_z80_irq_clr(jcv_ctx_t*);
+void jcv_z80_irq(jcv_ctx_t*, uint8_t data);
+void jcv_z80_nmi(jcv_ctx_t*);
+void jcv_z80_reset(jcv_ctx_t*);
+void jcv_z80_delay(jcv_ctx_t*, uint32_t);
+void jcv_z80_deadline(jcv_ctx_t*, uint32_t);
+uint32_t jcv_z80_exec(jcv_ctx_t*);
+uint32_t jcv_z80_run(jcv_ctx_t*, uint32_t);
+
+void jcv_z80_state_load(jcv_ctx_t*, jcv_serial_t*);
+void jcv_z80_state_save(jcv_ctx_t*, jcv_serial_t*);
 
 #endif
@@ -26,11 +26,33 @@ SOFTWARE.
 
 #include "z80.h"
 
+#ifdef Z80_ADDSUB_TABLES
+#include <pthread.h>
+#endif
+
 #ifndef Z80_READ_BYTE
 #define Z80_READ_BYTE(U, A) z->read_byte(U, A)
 #define Z80_WRITE_BYTE(U, A, V) z->write_byte(U, A, V)
 #endif
 
+// called by z80_run with the userdata pointer after every N instructions run
+#ifndef Z80_STEP_HOOK
+#define Z80_STEP_HOOK(U, N)
+#endif
+
+// if defined, Z80_PEEK_BYTE(U, A, V) stores the byte at A in *V and returns 1,
+// or returns 0 if it cannot be read without side effects. z80_run uses it to
+// look for idle loops, which it can skip through when nothing else can happen
+#ifdef Z80_PEEK_BYTE
+#define Z80_IDLE_LOOPS
+#define IDLE_LOOP_MAX 32 // most bytes from the start of a loop to its jump
+#endif
+
+// threaded dispatch uses labels as values, a GCC/Clang extension
+#if defined(__GNUC__) && !defined(Z80_NO_THREADED)
+#define Z80_THREADED
+#endif
+
 enum z80_flagbit {
     cf = 0,
     nf = 1,
@@ -61,6 +83,58 @@ static const uint8_t f_szpxy[] = {
     0xa4, 0xa0, 0xa0, 0xa4, 0xa0, 0xa4, 0xa4, 0xa0, 0xa8, 0xac, 0xac, 0xa8, 0xac, 0xa8, 0xa8, 0xac,
 };
 
+// flags other than cf after "inc" and "dec", indexed by the result
+static const uint8_t f_inc[] = {
+    0x50, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08,
+    0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08,
+    0x30, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28,
+    0x30, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28,
+    0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08,
+    0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08,
+    0x30, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28,
+    0x30, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28, 0x28,
+    0x94, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88,
+    0x90, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88,
+    0xb0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8,
+    0xb0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8,
+    0x90, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88,
+    0x90, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88,
+    0xb0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8,
+    0xb0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa0, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8,
+};
+
+static const uint8_t f_dec[] = {
+    0x42, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x1a,
+    0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x1a,
+    0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x2a, 0x2a, 0x2a, 0x2a, 0x2a, 0x2a, 0x2a, 0x3a,
+    0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x2a, 0x2a, 0x2a, 0x2a, 0x2a, 0x2a, 0x2a, 0x3a,
+    0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x1a,
+    0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x1a,
+    0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x2a, 0x2a, 0x2a, 0x2a, 0x2a, 0x2a, 0x2a, 0x3a,
+    0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x2a, 0x2a, 0x2a, 0x2a, 0x2a, 0x2a, 0x2a, 0x3e,
+    0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x8a, 0x8a, 0x8a, 0x8a, 0x8a, 0x8a, 0x8a, 0x9a,
+    0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x8a, 0x8a, 0x8a, 0x8a, 0x8a, 0x8a, 0x8a, 0x9a,
+    0xa2, 0xa2, 0xa2, 0xa2, 0xa2, 0xa2, 0xa2, 0xa2, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xba,
+    0xa2, 0xa2, 0xa2, 0xa2, 0xa2, 0xa2, 0xa2, 0xa2, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xba,
+    0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x8a, 0x8a, 0x8a, 0x8a, 0x8a, 0x8a, 0x8a, 0x9a,
+    0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x82, 0x8a, 0x8a, 0x8a, 0x8a, 0x8a, 0x8a, 0x8a, 0x9a,
+    0xa2, 0xa2, 0xa2, 0xa2, 0xa2, 0xa2, 0xa2, 0xa2, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xba,
+    0xa2, 0xa2, 0xa2, 0xa2, 0xa2, 0xa2, 0xa2, 0xa2, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xba,
+};
+
+#ifdef Z80_ADDSUB_TABLES
+/* flags after an 8 bit add or subtract, indexed by the carry in, then by the
+   two operands (a << 8 | b). the tables take 256K in total, so they are only
+   worth it where loads are cheaper than the handful of ALU ops in addb/subb,
+   and they are built once, the first time a z80 struct is initialised. the
+   first initialisation may happen on any thread, so building is guarded by
+   pthread_once, which also makes the filled tables visible to every thread
+   that initialises a z80 struct afterwards. */
+static uint8_t f_add[2][0x10000];
+static uint8_t f_sub[2][0x10000];
+static pthread_once_t f_addsub_once = PTHREAD_ONCE_INIT;
+#endif
+
 // MARK: helpers
 
 // get bit "n" of number "val"
@@ -131,11 +205,11 @@ static inline void inc_r(z80* const z) {
 
 // returns the parity of byte: 0 if number of 1 bits in `val` is odd, else 1
 static inline bool parity(uint8_t v) {
-  v ^= v >> 4;
-  v &= 0xf;
-  return !((0x6996 >> v) & 1);
+  return f_szpxy[v] & (1 << pf);
 }
 
+static inline unsigned exec_main(z80* const z, uint8_t opcode,
+    uint32_t* const cycles, const uint32_t* const limit);
 static unsigned exec_opcode(z80* const z, uint8_t opcode);
 static unsigned exec_opcode_cb(z80* const z, uint8_t opcode);
 static unsigned exec_opcode_dcb(
@@ -221,6 +295,10 @@ static inline uint8_t addb(z80* const z, uint32_t a, uint32_t b, bool cy) {
     flag_val(nf, 0);
   return result;
 */
+#ifdef Z80_ADDSUB_TABLES
+  z->f = f_add[cy][(a << 8) | b];
+  return a + b + cy;
+#endif
   int32_t result = a + b + cy;
   int32_t carry = result ^ a ^ b;
   result &= 0xff;
@@ -250,6 +328,10 @@ static inline uint8_t subb(z80* const z, uint32_t a, uint32_t b, bool cy) {
   return val;
   read the comments in addb to see explanations for the below new code.
   */
+#ifdef Z80_ADDSUB_TABLES
+  z->f = f_sub[cy][(a << 8) | b];
+  return a - b - cy;
+#endif
   int32_t result = a - b - cy;
   int32_t carry = result ^ a ^ b;
   result &= 0xff;
@@ -263,79 +345,71 @@ static inline uint8_t subb(z80* const z, uint32_t a, uint32_t b, bool cy) {
 
 // ADD Word: adds two words together
 static inline uint16_t addw(z80* const z, uint16_t a, uint16_t b, bool cy) {
-  uint8_t lsb = addb(z, a, b, cy);
-  uint8_t msb = addb(z, a >> 8, b >> 8, flag_get(z, cf));
-
-  uint16_t result = (msb << 8) | lsb;
-  flag_set(z, zf, result == 0);
+/* the flags are those of adding the high bytes with the carry out of the low
+   bytes, except zf which is set for the whole word. rather than two calls to
+   addb, they are calculated from the 17 bit result the same way addb does. */
+  int32_t result = a + b + cy;
+  int32_t carry = result ^ a ^ b;
+  z->f = (f_szpxy[(result >> 8) & 0xff] & ~((1 << pf) | (1 << zf))) |
+         ((!(result & 0xffff)) << zf);
+  z->f |= (carry >> 8) & (1 << hf);
+  carry >>= 14;
+  z->f |= (carry+2) & 4;
+  z->f |= (carry >> 2);
   z->mem_ptr = a + 1;
   return result;
 }
 
 // SUBstract Word: substracts two words (with optional carry)
 static inline uint16_t subw(z80* const z, uint16_t a, uint16_t b, bool cy) {
-  uint8_t lsb = subb(z, a, b, cy);
-  uint8_t msb = subb(z, a >> 8, b >> 8, flag_get(z, cf));
-
-  uint16_t result = (msb << 8) | lsb;
-  flag_set(z, zf, result == 0);
+  int32_t result = a - b - cy;
+  int32_t carry = result ^ a ^ b;
+  z->f = (1 << nf) |
+         (f_szpxy[(result >> 8) & 0xff] & ~((1 << pf) | (1 << zf))) |
+         ((!(result & 0xffff)) << zf);
+  z->f |= (carry >> 8) & (1 << hf);
+  carry >>= 14;
+  z->f |= ((carry+2) & 4);
+  z->f |= ((carry >> 2) & 1);
   z->mem_ptr = a + 1;
   return result;
 }
 
 // adds a word to HL
 static inline void addhl(z80* const z, uint16_t val) {
-  bool sfc = flag_get(z, sf);
-  bool zfc = flag_get(z, zf);
-  bool pfc = flag_get(z, pf);
-  uint16_t result = addw(z, z->hl, val, 0);
-  z->hl = result;
-  flag_set(z, sf, sfc);
-  flag_set(z, zf, zfc);
-  flag_set(z, pf, pfc);
+  const uint8_t fc = z->f & ((1 << sf) | (1 << zf) | (1 << pf));
+  z->hl = addw(z, z->hl, val, 0);
+  z->f = (z->f & ~((1 << sf) | (1 << zf) | (1 << pf))) | fc;
 }
 
 // adds a word to IX or IY
 static inline void addiz(z80* const z, uint16_t* reg, uint16_t val) {
-  bool sfc = flag_get(z, sf);
-  bool zfc = flag_get(z, zf);
-  bool pfc = flag_get(z, pf);
-  uint16_t result = addw(z, *reg, val, 0);
-  *reg = result;
-  flag_set(z, sf, sfc);
-  flag_set(z, zf, zfc);
-  flag_set(z, pf, pfc);
+  const uint8_t fc = z->f & ((1 << sf) | (1 << zf) | (1 << pf));
+  *reg = addw(z, *reg, val, 0);
+  z->f = (z->f & ~((1 << sf) | (1 << zf) | (1 << pf))) | fc;
 }
 
 // adds a word (+ carry) to HL
 static inline void adchl(z80* const z, uint16_t val) {
-  uint16_t result = addw(z, z->hl, val, flag_get(z, cf));
-  flag_set(z, sf, result >> 15);
-  flag_set(z, zf, result == 0);
-  z->hl = result;
+  z->hl = addw(z, z->hl, val, flag_get(z, cf));
 }
 
 // substracts a word (+ carry) to HL
 static inline void sbchl(z80* const z, uint16_t val) {
-  const uint16_t result = subw(z, z->hl, val, flag_get(z, cf));
-  flag_set(z, sf, result >> 15);
-  flag_set(z, zf, result == 0);
-  z->hl = result;
+  z->hl = subw(z, z->hl, val, flag_get(z, cf));
 }
 
 // increments a byte value
 static inline uint8_t inc(z80* const z, uint8_t a) {
-  bool cfc = flag_get(z, cf);
-  uint8_t result = addb(z, a, 1, 0);
-  flag_set(z, cf, cfc);
+  const uint8_t result = a + 1;
+  z->f = f_inc[result] | (z->f & (1 << cf));
   return result;
 }
 
 // decrements a byte value
 static inline uint8_t dec(z80* const z, uint8_t a) {
-  bool cfc = flag_get(z, cf);
-  uint8_t result = subb(z, a, 1, 0);
-  flag_set(z, cf, cfc);
+  const uint8_t result = a - 1;
+  z->f = f_dec[result] | (z->f & (1 << cf));
   return result;
 }
 
@@ -389,6 +463,11 @@ static inline void cp(z80* const z, const uint32_t val) {
   needed here, we instead calculate all of them from
   scratch. see addb() comments for an explanation.
 */
+#ifdef Z80_ADDSUB_TABLES
+  z->f = (f_sub[0][(z->a << 8) | val] & ~((1 << xf) | (1 << yf))) |
+         (val & ((1 << xf) | (1 << yf)));
+  return;
+#endif
   int32_t result = z->a - val;
   int32_t carry = result ^ z->a ^ val;
   z->f = (1 << nf) | /* nf always set */
@@ -517,12 +596,10 @@ static inline void ldi(z80* const z) {
   // see https://wikiti.brandonw.net/index.php?title=Z80_Instruction_Set
   // for the calculation of xf/yf on LDI
   const uint8_t result = val + z->a;
-  flag_set(z, xf, GET_BIT(3, result));
-  flag_set(z, yf, GET_BIT(1, result));
-
-  flag_set(z, nf, 0);
-  flag_set(z, hf, 0);
-  flag_set(z, pf, z->bc > 0);
+  z->f = (z->f & ((1 << sf) | (1 << zf) | (1 << cf))) |
+    (result & (1 << xf)) |
+    flag_val(yf, GET_BIT(1, result)) |
+    flag_val(pf, z->bc > 0); /* nf and hf are reset */
 }
 
 static inline void ldd(z80* const z) {
@@ -556,11 +633,8 @@ static void in_r_c(z80* const z, uint8_t* r) {
   *r = z->port_in(z, z->bc);
   // FIXME: according to z80 wiki this one should set x/y flags too,
   // in which case we should be able to use f_szpxy.
-  flag_set(z, zf, *r == 0);
-  flag_set(z, sf, *r >> 7);
-  flag_set(z, pf, parity(*r));
-  flag_set(z, nf, 0);
-  flag_set(z, hf, 0);
+  z->f = (z->f & ((1 << cf) | (1 << xf) | (1 << yf))) |
+    (f_szpxy[*r] & ((1 << sf) | (1 << zf) | (1 << pf))); /* nf, hf reset */
 }
 
 static void ini(z80* const z) {
@@ -596,12 +670,12 @@ static void outi(z80* const z) {
   z->port_out(z, z->bc, tmp);
   ++z->hl;
   z->b -= 1;
-  z->f = f_szpxy[z->b];
-  flag_set(z, nf, GET_BIT(7, tmp));
   tmp2 = tmp + z->l;
-  flag_set(z, pf, parity((tmp2 & 7) ^ z->b));
-  flag_set(z, hf, tmp2 > 255);
-  flag_set(z, cf, tmp2 > 255);
+  z->f = (f_szpxy[z->b] & ~(1 << pf)) |
+    flag_val(nf, GET_BIT(7, tmp)) |
+    flag_val(pf, parity((tmp2 & 7) ^ z->b)) |
+    flag_val(hf, tmp2 > 255) |
+    flag_val(cf, tmp2 > 255);
   z->mem_ptr = z->bc + 1;
 }
 
@@ -672,6 +746,7 @@ static inline unsigned process_interrupts(z80* const z) {
     z->nmi_pending &= ~Z80_PULSE;
     z->halted = 0;
     z->iff1 = 0;
+    z->idle_valid = 0;
     inc_r(z);
 
     cyc += 11;
@@ -684,6 +759,7 @@ static inline unsigned process_interrupts(z80* const z) {
     z->halted = 0;
     z->iff1 = 0;
     z->iff2 = 0;
+    z->idle_valid = 0;
     inc_r(z);
 
     switch (z->interrupt_mode) {
@@ -712,10 +788,217 @@ static inline unsigned process_interrupts(z80* const z) {
   return cyc;
 }
 
+#ifdef Z80_ADDSUB_TABLES
+// fills the add/sub flag tables using the same calculation as addb and subb
+static void build_addsub_tables(void) {
+  for (int32_t cy = 0; cy < 2; ++cy) {
+    for (int32_t a = 0; a < 256; ++a) {
+      for (int32_t b = 0; b < 256; ++b) {
+        int32_t result = a + b + cy;
+        int32_t carry = (result ^ a ^ b) >> 6;
+        f_add[cy][(a << 8) | b] = (f_szpxy[result & 0xff] & ~(1 << pf)) |
+          (((result ^ a ^ b) & (1 << hf)) | ((carry+2) & 4) | (carry >> 2));
+
+        result = a - b - cy;
+        carry = (result ^ a ^ b) >> 6;
+        f_sub[cy][(a << 8) | b] = (1 << nf) |
+          (f_szpxy[result & 0xff] & ~(1 << pf)) |
+          (((result ^ a ^ b) & (1 << hf)) | ((carry+2) & 4) |
+          ((carry >> 2) & 1));
+      }
+    }
+  }
+}
+#endif
+
+#ifdef Z80_THREADED
+// kept out of line, as it is reached from the end of every opcode's handler
+static __attribute__((noinline)) unsigned process_interrupts_ool(z80* const z) {
+  return process_interrupts(z);
+}
+#endif
+
+// MARK: idle
+// returns whether an interrupt could be accepted after the next instruction
+static inline bool interrupt_due(z80* const z) {
+  return z->iff_delay | z->nmi_pending | (z->irq_pending && z->iff1);
+}
+
+// adds n passes of "cyc" cycles and "r" refreshes each, run by "insns"
+// instructions, without running them
+static inline void idle_run(z80* const z, uint32_t* const cycles,
+    uint32_t n, unsigned cyc, unsigned r, unsigned insns) {
+  *cycles += n * cyc;
+  z->r = (z->r & 0x80) | ((z->r + n * r) & 0x7f);
+  Z80_STEP_HOOK(z->userdata, n * insns);
+  (void)insns;
+}
+
+// a halted CPU runs NOPs, which change nothing but R, until an interrupt. if
+// none can be accepted before *limit, all the NOPs up to it are run at once
+// and 1 is returned
+static inline bool halt_skip(
+    z80* const z, uint32_t* const cycles, const uint32_t* const limit) {
+  if (interrupt_due(z))
+    return 0;
+  idle_run(z, cycles, (*limit - *cycles + 3) / 4, 4, 1, 1);
+  return 1;
+}
+
+#ifdef Z80_IDLE_LOOPS
+// if the instruction at addr may be part of an idle loop, returns its length
+// and adds its timing and refreshes to *cyc and *r. these are the instructions
+// with a fixed timing which change nothing but registers, and read nothing
+// which cannot be peeked at
+static unsigned idle_insn(
+    z80* const z, uint16_t addr, unsigned* const cyc, unsigned* const r) {
+  uint8_t op = 0, op2 = 0, lo = 0, hi = 0;
+  if (!Z80_PEEK_BYTE(z->userdata, addr, &op))
+    return 0;
+  *r += 1;
+
+  const uint8_t x_ = op >> 6, y_ = (op >> 3) & 7, z_ = op & 7;
+  switch (x_) {
+  case 0:
+    if (op == 0x00 || z_ == 7 || ((z_ == 4 || z_ == 5) && y_ != 6)) {
+      *cyc += 4; // nop, inc r, dec r, rotates and flag operations on a
+      return 1;
+    }
+    if (z_ == 6 && y_ != 6) {
+      *cyc += 7; // ld r,*
+      return 2;
+    }
+    if (op == 0x0A || op == 0x1A) {
+      *cyc += 7; // ld a,(bc), ld a,(de)
+      return Z80_PEEK_BYTE(z->userdata, op == 0x0A ? z->bc : z->de, &lo) ?
+        1 : 0;
+    }
+    if (op == 0x3A) {
+      *cyc += 13; // ld a,(**)
+      if (!Z80_PEEK_BYTE(z->userdata, addr + 1, &lo) ||
+          !Z80_PEEK_BYTE(z->userdata, addr + 2, &hi))
+        return 0;
+      return Z80_PEEK_BYTE(z->userdata, (hi << 8) | lo, &op2) ? 3 : 0;
+    }
+    return 0;
+
+  case 1: // ld r,r and ld r,(hl), but not halt or ld (hl),r
+  case 2: // alu a,r and alu a,(hl)
+    if (x_ == 1 && y_ == 6)
+      return 0;
+    if (z_ != 6) {
+      *cyc += 4;
+      return 1;
+    }
+    *cyc += 7;
+    return Z80_PEEK_BYTE(z->userdata, z->hl, &lo) ? 1 : 0;
+
+  default:
+    if (z_ == 6) {
+      *cyc += 7; // alu a,*
+      return 2;
+    }
+    if (op != 0xCB || !Z80_PEEK_BYTE(z->userdata, addr + 1, &op2))
+      return 0;
+    *r += 1;
+    if ((op2 & 7) != 6) {
+      *cyc += 8; // shifts, rotates and bit operations on registers
+      return 2;
+    }
+    if ((op2 >> 6) != 1)
+      return 0;
+    *cyc += 12; // bit *,(hl)
+    return Z80_PEEK_BYTE(z->userdata, z->hl, &lo) ? 2 : 0;
+  }
+}
+
+// returns the cycles in each pass of the loop from the jump at pc0 back to
+// z->pc, which took "cyc" cycles, or 0 if it cannot be an idle loop
+static unsigned idle_decode(
+    z80* const z, uint16_t pc0, unsigned cyc, unsigned* const r,
+    unsigned* const insns) {
+  uint8_t op = 0, lo = 0, hi = 0;
+  uint16_t target;
+  if (!Z80_PEEK_BYTE(z->userdata, pc0, &op) ||
+      !Z80_PEEK_BYTE(z->userdata, pc0 + 1, &lo))
+    return 0;
+
+  if (op == 0x18 || ((op & 0xE7) == 0x20)) { // jr *, jr cc,*
+    target = pc0 + 2 + (int8_t)lo;
+    if (cyc != 12)
+      return 0;
+  } else if (op == 0xC3 || ((op & 0xC7) == 0xC2)) { // jp **, jp cc,**
+    if (!Z80_PEEK_BYTE(z->userdata, pc0 + 2, &hi))
+      return 0;
+    target = (hi << 8) | lo;
+    if (cyc != 10)
+      return 0;
+  } else {
+    return 0;
+  }
+
+  if (target != z->pc)
+    return 0;
+
+  *r = 1;
+  *insns = 1;
+  for (uint16_t addr = target; addr != pc0; ++*insns) {
+    const unsigned len = idle_insn(z, addr, &cyc, r);
+    if (len == 0 || len > (uint16_t)(pc0 - addr))
+      return 0;
+    addr += len;
+  }
+  return cyc;
+}
+
+/* called after a jump from pc0 back to z->pc, taking "cyc" cycles. a short
+   loop made only of instructions which change nothing but registers repeats
+   itself exactly once a pass leaves the registers as the previous one did, as
+   the memory it reads can only be changed by an interrupt. when that happens,
+   as many passes as will complete before *limit are run at once, leaving the
+   rest of the time to be run as usual. the loop is decoded again before being
+   skipped through, in case its code was changed since it was last seen
+*/
+static void idle_loop(z80* const z, uint16_t pc0, unsigned cyc,
+    uint32_t* const cycles, const uint32_t* const limit) {
+  unsigned r, insns;
+  if (!z->idle_valid || z->idle_pc != pc0 || z->idle_target != z->pc) {
+    z->idle_valid = 1;
+    z->idle_pc = pc0;
+    z->idle_target = z->pc;
+    z->idle_cyc = idle_decode(z, pc0, cyc, &r, &insns);
+    z->idle_r = r;
+    z->idle_n = insns;
+    z->idle_at = *cycles - z->idle_cyc - 1; // no previous pass
+  }
+
+  if (z->idle_cyc == 0)
+    return;
+
+  const uint16_t regs[5] = { z->af, z->bc, z->de, z->hl, z->mem_ptr };
+  bool same = *cycles - z->idle_at == z->idle_cyc;
+  for (int i = 0; i < 5; ++i) {
+    same &= regs[i] == z->idle_regs[i];
+    z->idle_regs[i] = regs[i];
+  }
+
+  if (same && !interrupt_due(z) &&
+      idle_decode(z, pc0, cyc, &r, &insns) == z->idle_cyc) {
+    idle_run(z, cycles, (*limit - *cycles - 1) / z->idle_cyc, z->idle_cyc,
+      z->idle_r, z->idle_n);
+  }
+  z->idle_at = *cycles;
+}
+#endif
+
 // MARK: interface
 // initialises a z80 struct. Note that read_byte, write_byte, port_in, port_out
 // and userdata must be manually set by the user afterwards.
 Z80_EXPORT void z80_init(z80* const z) {
+#ifdef Z80_ADDSUB_TABLES
+  pthread_once(&f_addsub_once, build_addsub_tables);
+#endif
+
   z->read_byte = NULL;
   z->write_byte = NULL;
   z->port_in = NULL;
@@ -751,6 +1034,8 @@ Z80_EXPORT void z80_init(z80* const z) {
   z->irq_pending = 0;
   z->nmi_pending = 0;
   z->irq_data = 0;
+
+  z->idle_valid = 0;
 }
 
 Z80_EXPORT void z80_reset(z80* const z) {
@@ -766,6 +1051,8 @@ Z80_EXPORT void z80_reset(z80* const z) {
   z->iff2 = 0;
   z->halted = 0;
   z->nmi_pending = 0;
+
+  z->idle_valid = 0;
 }
 
 static unsigned z80_step_s(z80* const z) {
@@ -806,6 +1093,32 @@ Z80_EXPORT unsigned z80_step_n(z80* const z, unsigned cycles) {
   return cyc;
 }
 
+// executes instructions + handles interrupts, adding the cycles of each one
+// to *cycles, until *cycles is >= *limit. both are read again after every
+// instruction, so the memory and port handlers may change them.
+Z80_EXPORT void z80_run(z80* const z, uint32_t* const cycles,
+    const uint32_t* const limit) {
+#ifdef Z80_THREADED
+  if (*cycles < *limit && !(z->halted && halt_skip(z, cycles, limit)))
+    exec_main(z, z->halted ? 0x00 : nextb(z), cycles, limit);
+#else
+  while (*cycles < *limit) {
+    if (z->halted && halt_skip(z, cycles, limit))
+      break;
+    const uint16_t pc0 = z->pc;
+    const unsigned cyc = z80_step_s(z);
+    *cycles += cyc;
+    Z80_STEP_HOOK(z->userdata, 1);
+#ifdef Z80_IDLE_LOOPS
+    if ((uint16_t)(pc0 - z->pc) < IDLE_LOOP_MAX && *cycles < *limit)
+      idle_loop(z, pc0, cyc, cycles, limit);
+#else
+    (void)pc0;
+#endif
+  }
+#endif
+}
+
 #ifdef Z80_DEBUG
 static inline uint8_t getpcb(z80* const z, unsigned offset) {
   return rb(z, z->pc+offset);
@@ -1295,281 +1608,365 @@ Z80_EXPORT void z80_clr_irq(z80* const z) {
     z->irq_pending = 0;
 }
 
-// executes a non-prefixed opcode
-static unsigned exec_opcode(z80* const z, uint8_t opcode) {
+/* executes a non-prefixed opcode. the opcodes are written once, as either the
+   cases of a switch or, with threaded dispatch, labels reached through a table
+   of their addresses. in that case, when "cycles" is given, each opcode's
+   handler ends by handling interrupts, adding its cycles to *cycles, and, if
+   *limit has not been reached, fetching the next opcode and jumping straight
+   to its handler. every opcode then has its own indirect jump, which branch
+   predictors can learn the likely successors of, rather than one shared jump
+   at the top of a switch. jumps also look for idle loops, and halt skips the
+   NOPs run while halted, when nothing can interrupt them. */
+#ifdef Z80_THREADED
+#define OPCODE(n) op_##n:
+#define TAIL(IDLE) do { \
+    if (cycles == NULL) \
+      return cyc; \
+    if (z->iff_delay | z->nmi_pending | z->irq_pending) \
+      cyc += process_interrupts_ool(z); \
+    *cycles += cyc; \
+    Z80_STEP_HOOK(z->userdata, 1); \
+    if (*cycles >= *limit) \
+      return 0; \
+    IDLE; \
+    pc0 = z->pc; \
+    opcode = z->halted ? 0x00 : nextb(z); \
+    cyc = 0; \
+    inc_r(z); \
+    goto *ops[opcode]; \
+  } while (0)
+#define NEXT TAIL((void)0)
+#ifdef Z80_IDLE_LOOPS
+#define NEXT_JUMP TAIL(if ((uint16_t)(pc0 - z->pc) < IDLE_LOOP_MAX) \
+    idle_loop(z, pc0, cyc, cycles, limit))
+#else
+#define NEXT_JUMP NEXT
+#endif
+#define NEXT_HALT TAIL(if (z->halted && halt_skip(z, cycles, limit)) return 0)
+#else
+#define OPCODE(n) case n:
+#define NEXT break
+#define NEXT_JUMP break
+#define NEXT_HALT break
+#endif
+
+static inline unsigned exec_main(z80* const z, uint8_t opcode,
+    uint32_t* const cycles, const uint32_t* const limit) {
   unsigned cyc = 0;
+  uint16_t pc0 = z->pc - 1; // where the running instruction began
+  (void)pc0;
   inc_r(z);
 
+#ifdef Z80_THREADED
+  static const void* const ops[256] = {
+    &&op_0x00, &&op_0x01, &&op_0x02, &&op_0x03, &&op_0x04, &&op_0x05, &&op_0x06, &&op_0x07,
+    &&op_0x08, &&op_0x09, &&op_0x0A, &&op_0x0B, &&op_0x0C, &&op_0x0D, &&op_0x0E, &&op_0x0F,
+    &&op_0x10, &&op_0x11, &&op_0x12, &&op_0x13, &&op_0x14, &&op_0x15, &&op_0x16, &&op_0x17,
+    &&op_0x18, &&op_0x19, &&op_0x1A, &&op_0x1B, &&op_0x1C, &&op_0x1D, &&op_0x1E, &&op_0x1F,
+    &&op_0x20, &&op_0x21, &&op_0x22, &&op_0x23, &&op_0x24, &&op_0x25, &&op_0x26, &&op_0x27,
+    &&op_0x28, &&op_0x29, &&op_0x2A, &&op_0x2B, &&op_0x2C, &&op_0x2D, &&op_0x2E, &&op_0x2F,
+    &&op_0x30, &&op_0x31, &&op_0x32, &&op_0x33, &&op_0x34, &&op_0x35, &&op_0x36, &&op_0x37,
+    &&op_0x38, &&op_0x39, &&op_0x3A, &&op_0x3B, &&op_0x3C, &&op_0x3D, &&op_0x3E, &&op_0x3F,
+    &&op_0x40, &&op_0x41, &&op_0x42, &&op_0x43, &&op_0x44, &&op_0x45, &&op_0x46, &&op_0x47,
+    &&op_0x48, &&op_0x49, &&op_0x4A, &&op_0x4B, &&op_0x4C, &&op_0x4D, &&op_0x4E, &&op_0x4F,
+    &&op_0x50, &&op_0x51, &&op_0x52, &&op_0x53, &&op_0x54, &&op_0x55, &&op_0x56, &&op_0x57,
+    &&op_0x58, &&op_0x59, &&op_0x5A, &&op_0x5B, &&op_0x5C, &&op_0x5D, &&op_0x5E, &&op_0x5F,
+    &&op_0x60, &&op_0x61, &&op_0x62, &&op_0x63, &&op_0x64, &&op_0x65, &&op_0x66, &&op_0x67,
+    &&op_0x68, &&op_0x69, &&op_0x6A, &&op_0x6B, &&op_0x6C, &&op_0x6D, &&op_0x6E, &&op_0x6F,
+    &&op_0x70, &&op_0x71, &&op_0x72, &&op_0x73, &&op_0x74, &&op_0x75, &&op_0x76, &&op_0x77,
+    &&op_0x78, &&op_0x79, &&op_0x7A, &&op_0x7B, &&op_0x7C, &&op_0x7D, &&op_0x7E, &&op_0x7F,
+    &&op_0x80, &&op_0x81, &&op_0x82, &&op_0x83, &&op_0x84, &&op_0x85, &&op_0x86, &&op_0x87,
+    &&op_0x88, &&op_0x89, &&op_0x8A, &&op_0x8B, &&op_0x8C, &&op_0x8D, &&op_0x8E, &&op_0x8F,
+    &&op_0x90, &&op_0x91, &&op_0x92, &&op_0x93, &&op_0x94, &&op_0x95, &&op_0x96, &&op_0x97,
+    &&op_0x98, &&op_0x99, &&op_0x9A, &&op_0x9B, &&op_0x9C, &&op_0x9D, &&op_0x9E, &&op_0x9F,
+    &&op_0xA0, &&op_0xA1, &&op_0xA2, &&op_0xA3, &&op_0xA4, &&op_0xA5, &&op_0xA6, &&op_0xA7,
+    &&op_0xA8, &&op_0xA9, &&op_0xAA, &&op_0xAB, &&op_0xAC, &&op_0xAD, &&op_0xAE, &&op_0xAF,
+    &&op_0xB0, &&op_0xB1, &&op_0xB2, &&op_0xB3, &&op_0xB4, &&op_0xB5, &&op_0xB6, &&op_0xB7,
+    &&op_0xB8, &&op_0xB9, &&op_0xBA, &&op_0xBB, &&op_0xBC, &&op_0xBD, &&op_0xBE, &&op_0xBF,
+    &&op_0xC0, &&op_0xC1, &&op_0xC2, &&op_0xC3, &&op_0xC4, &&op_0xC5, &&op_0xC6, &&op_0xC7,
+    &&op_0xC8, &&op_0xC9, &&op_0xCA, &&op_0xCB, &&op_0xCC, &&op_0xCD, &&op_0xCE, &&op_0xCF,
+    &&op_0xD0, &&op_0xD1, &&op_0xD2, &&op_0xD3, &&op_0xD4, &&op_0xD5, &&op_0xD6, &&op_0xD7,
+    &&op_0xD8, &&op_0xD9, &&op_0xDA, &&op_0xDB, &&op_0xDC, &&op_0xDD, &&op_0xDE, &&op_0xDF,
+    &&op_0xE0, &&op_0xE1, &&op_0xE2, &&op_0xE3, &&op_0xE4, &&op_0xE5, &&op_0xE6, &&op_0xE7,
+    &&op_0xE8, &&op_0xE9, &&op_0xEA, &&op_0xEB, &&op_0xEC, &&op_0xED, &&op_0xEE, &&op_0xEF,
+    &&op_0xF0, &&op_0xF1, &&op_0xF2, &&op_0xF3, &&op_0xF4, &&op_0xF5, &&op_0xF6, &&op_0xF7,
+    &&op_0xF8, &&op_0xF9, &&op_0xFA, &&op_0xFB, &&op_0xFC, &&op_0xFD, &&op_0xFE, &&op_0xFF,
+  };
+
+  goto *ops[opcode];
+#else
+  (void)cycles; (void)limit;
   switch (opcode) {
-  case 0x7F: cyc += 4; z->a = z->a; break; // ld a,a
-  case 0x78: cyc += 4; z->a = z->b; break; // ld a,b
-  case 0x79: cyc += 4; z->a = z->c; break; // ld a,c
-  case 0x7A: cyc += 4; z->a = z->d; break; // ld a,d
-  case 0x7B: cyc += 4; z->a = z->e; break; // ld a,e
-  case 0x7C: cyc += 4; z->a = z->h; break; // ld a,h
-  case 0x7D: cyc += 4; z->a = z->l; break; // ld a,l
-
-  case 0x47: cyc += 4; z->b = z->a; break; // ld b,a
-  case 0x40: cyc += 4; z->b = z->b; break; // ld b,b
-  case 0x41: cyc += 4; z->b = z->c; break; // ld b,c
-  case 0x42: cyc += 4; z->b = z->d; break; // ld b,d
-  case 0x43: cyc += 4; z->b = z->e; break; // ld b,e
-  case 0x44: cyc += 4; z->b = z->h; break; // ld b,h
-  case 0x45: cyc += 4; z->b = z->l; break; // ld b,l
-
-  case 0x4F: cyc += 4; z->c = z->a; break; // ld c,a
-  case 0x48: cyc += 4; z->c = z->b; break; // ld c,b
-  case 0x49: cyc += 4; z->c = z->c; break; // ld c,c
-  case 0x4A: cyc += 4; z->c = z->d; break; // ld c,d
-  case 0x4B: cyc += 4; z->c = z->e; break; // ld c,e
-  case 0x4C: cyc += 4; z->c = z->h; break; // ld c,h
-  case 0x4D: cyc += 4; z->c = z->l; break; // ld c,l
-
-  case 0x57: cyc += 4; z->d = z->a; break; // ld d,a
-  case 0x50: cyc += 4; z->d = z->b; break; // ld d,b
-  case 0x51: cyc += 4; z->d = z->c; break; // ld d,c
-  case 0x52: cyc += 4; z->d = z->d; break; // ld d,d
-  case 0x53: cyc += 4; z->d = z->e; break; // ld d,e
-  case 0x54: cyc += 4; z->d = z->h; break; // ld d,h
-  case 0x55: cyc += 4; z->d = z->l; break; // ld d,l
-
-  case 0x5F: cyc += 4; z->e = z->a; break; // ld e,a
-  case 0x58: cyc += 4; z->e = z->b; break; // ld e,b
-  case 0x59: cyc += 4; z->e = z->c; break; // ld e,c
-  case 0x5A: cyc += 4; z->e = z->d; break; // ld e,d
-  case 0x5B: cyc += 4; z->e = z->e; break; // ld e,e
-  case 0x5C: cyc += 4; z->e = z->h; break; // ld e,h
-  case 0x5D: cyc += 4; z->e = z->l; break; // ld e,l
-
-  case 0x67: cyc += 4; z->h = z->a; break; // ld h,a
-  case 0x60: cyc += 4; z->h = z->b; break; // ld h,b
-  case 0x61: cyc += 4; z->h = z->c; break; // ld h,c
-  case 0x62: cyc += 4; z->h = z->d; break; // ld h,d
-  case 0x63: cyc += 4; z->h = z->e; break; // ld h,e
-  case 0x64: cyc += 4; z->h = z->h; break; // ld h,h
-  case 0x65: cyc += 4; z->h = z->l; break; // ld h,l
-
-  case 0x6F: cyc += 4; z->l = z->a; break; // ld l,a
-  case 0x68: cyc += 4; z->l = z->b; break; // ld l,b
-  case 0x69: cyc += 4; z->l = z->c; break; // ld l,c
-  case 0x6A: cyc += 4; z->l = z->d; break; // ld l,d
-  case 0x6B: cyc += 4; z->l = z->e; break; // ld l,e
-  case 0x6C: cyc += 4; z->l = z->h; break; // ld l,h
-  case 0x6D: cyc += 4; z->l = z->l; break; // ld l,l
-
-  case 0x7E: cyc += 7; z->a = rb(z, z->hl); break; // ld a,(hl)
-  case 0x46: cyc += 7; z->b = rb(z, z->hl); break; // ld b,(hl)
-  case 0x4E: cyc += 7; z->c = rb(z, z->hl); break; // ld c,(hl)
-  case 0x56: cyc += 7; z->d = rb(z, z->hl); break; // ld d,(hl)
-  case 0x5E: cyc += 7; z->e = rb(z, z->hl); break; // ld e,(hl)
-  case 0x66: cyc += 7; z->h = rb(z, z->hl); break; // ld h,(hl)
-  case 0x6E: cyc += 7; z->l = rb(z, z->hl); break; // ld l,(hl)
-
-  case 0x77: cyc += 7; wb(z, z->hl, z->a); break; // ld (hl),a
-  case 0x70: cyc += 7; wb(z, z->hl, z->b); break; // ld (hl),b
-  case 0x71: cyc += 7; wb(z, z->hl, z->c); break; // ld (hl),c
-  case 0x72: cyc += 7; wb(z, z->hl, z->d); break; // ld (hl),d
-  case 0x73: cyc += 7; wb(z, z->hl, z->e); break; // ld (hl),e
-  case 0x74: cyc += 7; wb(z, z->hl, z->h); break; // ld (hl),h
-  case 0x75: cyc += 7; wb(z, z->hl, z->l); break; // ld (hl),l
-
-  case 0x3E: cyc += 7; z->a = nextb(z); break; // ld a,*
-  case 0x06: cyc += 7; z->b = nextb(z); break; // ld b,*
-  case 0x0E: cyc += 7; z->c = nextb(z); break; // ld c,*
-  case 0x16: cyc += 7; z->d = nextb(z); break; // ld d,*
-  case 0x1E: cyc += 7; z->e = nextb(z); break; // ld e,*
-  case 0x26: cyc += 7; z->h = nextb(z); break; // ld h,*
-  case 0x2E: cyc += 7; z->l = nextb(z); break; // ld l,*
-  case 0x36: cyc += 10; wb(z, z->hl, nextb(z)); break; // ld (hl),*
-
-  case 0x0A:
+#endif
+  OPCODE(0x7F) cyc += 4; z->a = z->a; NEXT; // ld a,a
+  OPCODE(0x78) cyc += 4; z->a = z->b; NEXT; // ld a,b
+  OPCODE(0x79) cyc += 4; z->a = z->c; NEXT; // ld a,c
+  OPCODE(0x7A) cyc += 4; z->a = z->d; NEXT; // ld a,d
+  OPCODE(0x7B) cyc += 4; z->a = z->e; NEXT; // ld a,e
+  OPCODE(0x7C) cyc += 4; z->a = z->h; NEXT; // ld a,h
+  OPCODE(0x7D) cyc += 4; z->a = z->l; NEXT; // ld a,l
+
+  OPCODE(0x47) cyc += 4; z->b = z->a; NEXT; // ld b,a
+  OPCODE(0x40) cyc += 4; z->b = z->b; NEXT; // ld b,b
+  OPCODE(0x41) cyc += 4; z->b = z->c; NEXT; // ld b,c
+  OPCODE(0x42) cyc += 4; z->b = z->d; NEXT; // ld b,d
+  OPCODE(0x43) cyc += 4; z->b = z->e; NEXT; // ld b,e
+  OPCODE(0x44) cyc += 4; z->b = z->h; NEXT; // ld b,h
+  OPCODE(0x45) cyc += 4; z->b = z->l; NEXT; // ld b,l
+
+  OPCODE(0x4F) cyc += 4; z->c = z->a; NEXT; // ld c,a
+  OPCODE(0x48) cyc += 4; z->c = z->b; NEXT; // ld c,b
+  OPCODE(0x49) cyc += 4; z->c = z->c; NEXT; // ld c,c
+  OPCODE(0x4A) cyc += 4; z->c = z->d; NEXT; // ld c,d
+  OPCODE(0x4B) cyc += 4; z->c = z->e; NEXT; // ld c,e
+  OPCODE(0x4C) cyc += 4; z->c = z->h; NEXT; // ld c,h
+  OPCODE(0x4D) cyc += 4; z->c = z->l; NEXT; // ld c,l
+
+  OPCODE(0x57) cyc += 4; z->d = z->a; NEXT; // ld d,a
+  OPCODE(0x50) cyc += 4; z->d = z->b; NEXT; // ld d,b
+  OPCODE(0x51) cyc += 4; z->d = z->c; NEXT; // ld d,c
+  OPCODE(0x52) cyc += 4; z->d = z->d; NEXT; // ld d,d
+  OPCODE(0x53) cyc += 4; z->d = z->e; NEXT; // ld d,e
+  OPCODE(0x54) cyc += 4; z->d = z->h; NEXT; // ld d,h
+  OPCODE(0x55) cyc += 4; z->d = z->l; NEXT; // ld d,l
+
+  OPCODE(0x5F) cyc += 4; z->e = z->a; NEXT; // ld e,a
+  OPCODE(0x58) cyc += 4; z->e = z->b; NEXT; // ld e,b
+  OPCODE(0x59) cyc += 4; z->e = z->c; NEXT; // ld e,c
+  OPCODE(0x5A) cyc += 4; z->e = z->d; NEXT; // ld e,d
+  OPCODE(0x5B) cyc += 4; z->e = z->e; NEXT; // ld e,e
+  OPCODE(0x5C) cyc += 4; z->e = z->h; NEXT; // ld e,h
+  OPCODE(0x5D) cyc += 4; z->e = z->l; NEXT; // ld e,l
+
+  OPCODE(0x67) cyc += 4; z->h = z->a; NEXT; // ld h,a
+  OPCODE(0x60) cyc += 4; z->h = z->b; NEXT; // ld h,b
+  OPCODE(0x61) cyc += 4; z->h = z->c; NEXT; // ld h,c
+  OPCODE(0x62) cyc += 4; z->h = z->d; NEXT; // ld h,d
+  OPCODE(0x63) cyc += 4; z->h = z->e; NEXT; // ld h,e
+  OPCODE(0x64) cyc += 4; z->h = z->h; NEXT; // ld h,h
+  OPCODE(0x65) cyc += 4; z->h = z->l; NEXT; // ld h,l
+
+  OPCODE(0x6F) cyc += 4; z->l = z->a; NEXT; // ld l,a
+  OPCODE(0x68) cyc += 4; z->l = z->b; NEXT; // ld l,b
+  OPCODE(0x69) cyc += 4; z->l = z->c; NEXT; // ld l,c
+  OPCODE(0x6A) cyc += 4; z->l = z->d; NEXT; // ld l,d
+  OPCODE(0x6B) cyc += 4; z->l = z->e; NEXT; // ld l,e
+  OPCODE(0x6C) cyc += 4; z->l = z->h; NEXT; // ld l,h
+  OPCODE(0x6D) cyc += 4; z->l = z->l; NEXT; // ld l,l
+
+  OPCODE(0x7E) cyc += 7; z->a = rb(z, z->hl); NEXT; // ld a,(hl)
+  OPCODE(0x46) cyc += 7; z->b = rb(z, z->hl); NEXT; // ld b,(hl)
+  OPCODE(0x4E) cyc += 7; z->c = rb(z, z->hl); NEXT; // ld c,(hl)
+  OPCODE(0x56) cyc += 7; z->d = rb(z, z->hl); NEXT; // ld d,(hl)
+  OPCODE(0x5E) cyc += 7; z->e = rb(z, z->hl); NEXT; // ld e,(hl)
+  OPCODE(0x66) cyc += 7; z->h = rb(z, z->hl); NEXT; // ld h,(hl)
+  OPCODE(0x6E) cyc += 7; z->l = rb(z, z->hl); NEXT; // ld l,(hl)
+
+  OPCODE(0x77) cyc += 7; wb(z, z->hl, z->a); NEXT; // ld (hl),a
+  OPCODE(0x70) cyc += 7; wb(z, z->hl, z->b); NEXT; // ld (hl),b
+  OPCODE(0x71) cyc += 7; wb(z, z->hl, z->c); NEXT; // ld (hl),c
+  OPCODE(0x72) cyc += 7; wb(z, z->hl, z->d); NEXT; // ld (hl),d
+  OPCODE(0x73) cyc += 7; wb(z, z->hl, z->e); NEXT; // ld (hl),e
+  OPCODE(0x74) cyc += 7; wb(z, z->hl, z->h); NEXT; // ld (hl),h
+  OPCODE(0x75) cyc += 7; wb(z, z->hl, z->l); NEXT; // ld (hl),l
+
+  OPCODE(0x3E) cyc += 7; z->a = nextb(z); NEXT; // ld a,*
+  OPCODE(0x06) cyc += 7; z->b = nextb(z); NEXT; // ld b,*
+  OPCODE(0x0E) cyc += 7; z->c = nextb(z); NEXT; // ld c,*
+  OPCODE(0x16) cyc += 7; z->d = nextb(z); NEXT; // ld d,*
+  OPCODE(0x1E) cyc += 7; z->e = nextb(z); NEXT; // ld e,*
+  OPCODE(0x26) cyc += 7; z->h = nextb(z); NEXT; // ld h,*
+  OPCODE(0x2E) cyc += 7; z->l = nextb(z); NEXT; // ld l,*
+  OPCODE(0x36) cyc += 10; wb(z, z->hl, nextb(z)); NEXT; // ld (hl),*
+
+  OPCODE(0x0A)
     cyc += 7;
     z->a = rb(z, z->bc);
     z->mem_ptr = z->bc + 1;
-    break; // ld a,(bc)
-  case 0x1A:
+    NEXT; // ld a,(bc)
+  OPCODE(0x1A)
     cyc += 7;
     z->a = rb(z, z->de);
     z->mem_ptr = z->de + 1;
-    break; // ld a,(de)
-  case 0x3A: {
+    NEXT; // ld a,(de)
+  OPCODE(0x3A) {
     cyc += 13;
     const uint16_t addr = nextw(z);
     z->a = rb(z, addr);
     z->mem_ptr = addr + 1;
-  } break; // ld a,(**)
+  } NEXT; // ld a,(**)
 
-  case 0x02:
+  OPCODE(0x02)
     cyc += 7;
     wb(z, z->bc, z->a);
     z->mem_ptr = (z->a << 8) | ((z->bc + 1) & 0xFF);
-    break; // ld (bc),a
+    NEXT; // ld (bc),a
 
-  case 0x12:
+  OPCODE(0x12)
     cyc += 7;
     wb(z, z->de, z->a);
     z->mem_ptr = (z->a << 8) | ((z->de + 1) & 0xFF);
-    break; // ld (de),a
+    NEXT; // ld (de),a
 
-  case 0x32: {
+  OPCODE(0x32) {
     cyc += 13;
     const uint16_t addr = nextw(z);
     wb(z, addr, z->a);
     z->mem_ptr = (z->a << 8) | ((addr + 1) & 0xFF);
-  } break; // ld (**),a
+  } NEXT; // ld (**),a
 
-  case 0x01: cyc += 10; z->bc = nextw(z); break; // ld bc,**
-  case 0x11: cyc += 10; z->de = nextw(z); break; // ld de,**
-  case 0x21: cyc += 10; z->hl = nextw(z); break; // ld hl,**
-  case 0x31: cyc += 10; z->sp = nextw(z); break; // ld sp,**
+  OPCODE(0x01) cyc += 10; z->bc = nextw(z); NEXT; // ld bc,**
+  OPCODE(0x11) cyc += 10; z->de = nextw(z); NEXT; // ld de,**
+  OPCODE(0x21) cyc += 10; z->hl = nextw(z); NEXT; // ld hl,**
+  OPCODE(0x31) cyc += 10; z->sp = nextw(z); NEXT; // ld sp,**
 
-  case 0x2A: {
+  OPCODE(0x2A) {
     cyc += 16;
     const uint16_t addr = nextw(z);
     z->hl = rw(z, addr);
     z->mem_ptr = addr + 1;
-  } break; // ld hl,(**)
+  } NEXT; // ld hl,(**)
 
-  case 0x22: {
+  OPCODE(0x22) {
     cyc += 16;
     const uint16_t addr = nextw(z);
     ww(z, addr, z->hl);
     z->mem_ptr = addr + 1;
-  } break; // ld (**),hl
+  } NEXT; // ld (**),hl
 
-  case 0xF9: cyc += 6; z->sp = z->hl; break; // ld sp,hl
+  OPCODE(0xF9) cyc += 6; z->sp = z->hl; NEXT; // ld sp,hl
 
-  case 0xEB: {
+  OPCODE(0xEB) {
     cyc += 4;
     const uint16_t de = z->de;
     z->de = z->hl;
     z->hl = de;
-  } break; // ex de,hl
+  } NEXT; // ex de,hl
 
-  case 0xE3: {
+  OPCODE(0xE3) {
     cyc += 19;
     const uint16_t val = rw(z, z->sp);
     ww(z, z->sp, z->hl);
     z->hl = val;
     z->mem_ptr = val;
-  } break; // ex (sp),hl
-
-  case 0x87: cyc += 4; z->a = addb(z, z->a, z->a, 0); break; // add a,a
-  case 0x80: cyc += 4; z->a = addb(z, z->a, z->b, 0); break; // add a,b
-  case 0x81: cyc += 4; z->a = addb(z, z->a, z->c, 0); break; // add a,c
-  case 0x82: cyc += 4; z->a = addb(z, z->a, z->d, 0); break; // add a,d
-  case 0x83: cyc += 4; z->a = addb(z, z->a, z->e, 0); break; // add a,e
-  case 0x84: cyc += 4; z->a = addb(z, z->a, z->h, 0); break; // add a,h
-  case 0x85: cyc += 4; z->a = addb(z, z->a, z->l, 0); break; // add a,l
-  case 0x86: cyc += 7; z->a = addb(z, z->a, rb(z, z->hl), 0); break; // add a,(hl)
-  case 0xC6: cyc += 7; z->a = addb(z, z->a, nextb(z), 0); break; // add a,*
-
-  case 0x8F: cyc += 4; z->a = addb(z, z->a, z->a, flag_get(z, cf)); break; // adc a,a
-  case 0x88: cyc += 4; z->a = addb(z, z->a, z->b, flag_get(z, cf)); break; // adc a,b
-  case 0x89: cyc += 4; z->a = addb(z, z->a, z->c, flag_get(z, cf)); break; // adc a,c
-  case 0x8A: cyc += 4; z->a = addb(z, z->a, z->d, flag_get(z, cf)); break; // adc a,d
-  case 0x8B: cyc += 4; z->a = addb(z, z->a, z->e, flag_get(z, cf)); break; // adc a,e
-  case 0x8C: cyc += 4; z->a = addb(z, z->a, z->h, flag_get(z, cf)); break; // adc a,h
-  case 0x8D: cyc += 4; z->a = addb(z, z->a, z->l, flag_get(z, cf)); break; // adc a,l
-  case 0x8E: cyc += 7; z->a = addb(z, z->a, rb(z, z->hl), flag_get(z, cf)); break; // adc a,(hl)
-  case 0xCE: cyc += 7; z->a = addb(z, z->a, nextb(z), flag_get(z, cf)); break; // adc a,*
-
-  case 0x97: cyc += 4; z->a = subb(z, z->a, z->a, 0); break; // sub a,a
-  case 0x90: cyc += 4; z->a = subb(z, z->a, z->b, 0); break; // sub a,b
-  case 0x91: cyc += 4; z->a = subb(z, z->a, z->c, 0); break; // sub a,c
-  case 0x92: cyc += 4; z->a = subb(z, z->a, z->d, 0); break; // sub a,d
-  case 0x93: cyc += 4; z->a = subb(z, z->a, z->e, 0); break; // sub a,e
-  case 0x94: cyc += 4; z->a = subb(z, z->a, z->h, 0); break; // sub a,h
-  case 0x95: cyc += 4; z->a = subb(z, z->a, z->l, 0); break; // sub a,l
-  case 0x96: cyc += 7; z->a = subb(z, z->a, rb(z, z->hl), 0); break; // sub a,(hl)
-  case 0xD6: cyc += 7; z->a = subb(z, z->a, nextb(z), 0); break; // sub a,*
-
-  case 0x9F: cyc += 4; z->a = subb(z, z->a, z->a, flag_get(z, cf)); break; // sbc a,a
-  case 0x98: cyc += 4; z->a = subb(z, z->a, z->b, flag_get(z, cf)); break; // sbc a,b
-  case 0x99: cyc += 4; z->a = subb(z, z->a, z->c, flag_get(z, cf)); break; // sbc a,c
-  case 0x9A: cyc += 4; z->a = subb(z, z->a, z->d, flag_get(z, cf)); break; // sbc a,d
-  case 0x9B: cyc += 4; z->a = subb(z, z->a, z->e, flag_get(z, cf)); break; // sbc a,e
-  case 0x9C: cyc += 4; z->a = subb(z, z->a, z->h, flag_get(z, cf)); break; // sbc a,h
-  case 0x9D: cyc += 4; z->a = subb(z, z->a, z->l, flag_get(z, cf)); break; // sbc a,l
-  case 0x9E: cyc += 7; z->a = subb(z, z->a, rb(z, z->hl), flag_get(z, cf)); break; // sbc a,(hl)
-  case 0xDE: cyc += 7; z->a = subb(z, z->a, nextb(z), flag_get(z, cf)); break; // sbc a,*
-
-  case 0x09: cyc += 11; addhl(z, z->bc); break; // add hl,bc
-  case 0x19: cyc += 11; addhl(z, z->de); break; // add hl,de
-  case 0x29: cyc += 11; addhl(z, z->hl); break; // add hl,hl
-  case 0x39: cyc += 11; addhl(z, z->sp); break; // add hl,sp
-
-  case 0xF3: cyc += 4; z->iff1 = z->iff2 = 0; break; // di
-  case 0xFB: cyc += 4; z->iff_delay = 1; break; // ei
-  case 0x00: cyc += 4; break; // nop
-  case 0x76: cyc += 4; z->halted = 1; break; // halt
-
-  case 0x3C: cyc += 4; z->a = inc(z, z->a); break; // inc a
-  case 0x04: cyc += 4; z->b = inc(z, z->b); break; // inc b
-  case 0x0C: cyc += 4; z->c = inc(z, z->c); break; // inc c
-  case 0x14: cyc += 4; z->d = inc(z, z->d); break; // inc d
-  case 0x1C: cyc += 4; z->e = inc(z, z->e); break; // inc e
-  case 0x24: cyc += 4; z->h = inc(z, z->h); break; // inc h
-  case 0x2C: cyc += 4; z->l = inc(z, z->l); break; // inc l
-  case 0x34: {
+  } NEXT; // ex (sp),hl
+
+  OPCODE(0x87) cyc += 4; z->a = addb(z, z->a, z->a, 0); NEXT; // add a,a
+  OPCODE(0x80) cyc += 4; z->a = addb(z, z->a, z->b, 0); NEXT; // add a,b
+  OPCODE(0x81) cyc += 4; z->a = addb(z, z->a, z->c, 0); NEXT; // add a,c
+  OPCODE(0x82) cyc += 4; z->a = addb(z, z->a, z->d, 0); NEXT; // add a,d
+  OPCODE(0x83) cyc += 4; z->a = addb(z, z->a, z->e, 0); NEXT; // add a,e
+  OPCODE(0x84) cyc += 4; z->a = addb(z, z->a, z->h, 0); NEXT; // add a,h
+  OPCODE(0x85) cyc += 4; z->a = addb(z, z->a, z->l, 0); NEXT; // add a,l
+  OPCODE(0x86) cyc += 7; z->a = addb(z, z->a, rb(z, z->hl), 0); NEXT; // add a,(hl)
+  OPCODE(0xC6) cyc += 7; z->a = addb(z, z->a, nextb(z), 0); NEXT; // add a,*
+
+  OPCODE(0x8F) cyc += 4; z->a = addb(z, z->a, z->a, flag_get(z, cf)); NEXT; // adc a,a
+  OPCODE(0x88) cyc += 4; z->a = addb(z, z->a, z->b, flag_get(z, cf)); NEXT; // adc a,b
+  OPCODE(0x89) cyc += 4; z->a = addb(z, z->a, z->c, flag_get(z, cf)); NEXT; // adc a,c
+  OPCODE(0x8A) cyc += 4; z->a = addb(z, z->a, z->d, flag_get(z, cf)); NEXT; // adc a,d
+  OPCODE(0x8B) cyc += 4; z->a = addb(z, z->a, z->e, flag_get(z, cf)); NEXT; // adc a,e
+  OPCODE(0x8C) cyc += 4; z->a = addb(z, z->a, z->h, flag_get(z, cf)); NEXT; // adc a,h
+  OPCODE(0x8D) cyc += 4; z->a = addb(z, z->a, z->l, flag_get(z, cf)); NEXT; // adc a,l
+  OPCODE(0x8E) cyc += 7; z->a = addb(z, z->a, rb(z, z->hl), flag_get(z, cf)); NEXT; // adc a,(hl)
+  OPCODE(0xCE) cyc += 7; z->a = addb(z, z->a, nextb(z), flag_get(z, cf)); NEXT; // adc a,*
+
+  OPCODE(0x97) cyc += 4; z->a = subb(z, z->a, z->a, 0); NEXT; // sub a,a
+  OPCODE(0x90) cyc += 4; z->a = subb(z, z->a, z->b, 0); NEXT; // sub a,b
+  OPCODE(0x91) cyc += 4; z->a = subb(z, z->a, z->c, 0); NEXT; // sub a,c
+  OPCODE(0x92) cyc += 4; z->a = subb(z, z->a, z->d, 0); NEXT; // sub a,d
+  OPCODE(0x93) cyc += 4; z->a = subb(z, z->a, z->e, 0); NEXT; // sub a,e
+  OPCODE(0x94) cyc += 4; z->a = subb(z, z->a, z->h, 0); NEXT; // sub a,h
+  OPCODE(0x95) cyc += 4; z->a = subb(z, z->a, z->l, 0); NEXT; // sub a,l
+  OPCODE(0x96) cyc += 7; z->a = subb(z, z->a, rb(z, z->hl), 0); NEXT; // sub a,(hl)
+  OPCODE(0xD6) cyc += 7; z->a = subb(z, z->a, nextb(z), 0); NEXT; // sub a,*
+
+  OPCODE(0x9F) cyc += 4; z->a = subb(z, z->a, z->a, flag_get(z, cf)); NEXT; // sbc a,a
+  OPCODE(0x98) cyc += 4; z->a = subb(z, z->a, z->b, flag_get(z, cf)); NEXT; // sbc a,b
+  OPCODE(0x99) cyc += 4; z->a = subb(z, z->a, z->c, flag_get(z, cf)); NEXT; // sbc a,c
+  OPCODE(0x9A) cyc += 4; z->a = subb(z, z->a, z->d, flag_get(z, cf)); NEXT; // sbc a,d
+  OPCODE(0x9B) cyc += 4; z->a = subb(z, z->a, z->e, flag_get(z, cf)); NEXT; // sbc a,e
+  OPCODE(0x9C) cyc += 4; z->a = subb(z, z->a, z->h, flag_get(z, cf)); NEXT; // sbc a,h
+  OPCODE(0x9D) cyc += 4; z->a = subb(z, z->a, z->l, flag_get(z, cf)); NEXT; // sbc a,l
+  OPCODE(0x9E) cyc += 7; z->a = subb(z, z->a, rb(z, z->hl), flag_get(z, cf)); NEXT; // sbc a,(hl)
+  OPCODE(0xDE) cyc += 7; z->a = subb(z, z->a, nextb(z), flag_get(z, cf)); NEXT; // sbc a,*
+
+  OPCODE(0x09) cyc += 11; addhl(z, z->bc); NEXT; // add hl,bc
+  OPCODE(0x19) cyc += 11; addhl(z, z->de); NEXT; // add hl,de
+  OPCODE(0x29) cyc += 11; addhl(z, z->hl); NEXT; // add hl,hl
+  OPCODE(0x39) cyc += 11; addhl(z, z->sp); NEXT; // add hl,sp
+
+  OPCODE(0xF3) cyc += 4; z->iff1 = z->iff2 = 0; NEXT; // di
+  OPCODE(0xFB) cyc += 4; z->iff_delay = 1; NEXT; // ei
+  OPCODE(0x00) cyc += 4; NEXT; // nop
+  OPCODE(0x76) cyc += 4; z->halted = 1; NEXT_HALT; // halt
+
+  OPCODE(0x3C) cyc += 4; z->a = inc(z, z->a); NEXT; // inc a
+  OPCODE(0x04) cyc += 4; z->b = inc(z, z->b); NEXT; // inc b
+  OPCODE(0x0C) cyc += 4; z->c = inc(z, z->c); NEXT; // inc c
+  OPCODE(0x14) cyc += 4; z->d = inc(z, z->d); NEXT; // inc d
+  OPCODE(0x1C) cyc += 4; z->e = inc(z, z->e); NEXT; // inc e
+  OPCODE(0x24) cyc += 4; z->h = inc(z, z->h); NEXT; // inc h
+  OPCODE(0x2C) cyc += 4; z->l = inc(z, z->l); NEXT; // inc l
+  OPCODE(0x34) {
     cyc += 11;
     uint8_t result = inc(z, rb(z, z->hl));
     wb(z, z->hl, result);
-  } break; // inc (hl)
-
-  case 0x3D: cyc += 4; z->a = dec(z, z->a); break; // dec a
-  case 0x05: cyc += 4; z->b = dec(z, z->b); break; // dec b
-  case 0x0D: cyc += 4; z->c = dec(z, z->c); break; // dec c
-  case 0x15: cyc += 4; z->d = dec(z, z->d); break; // dec d
-  case 0x1D: cyc += 4; z->e = dec(z, z->e); break; // dec e
-  case 0x25: cyc += 4; z->h = dec(z, z->h); break; // dec h
-  case 0x2D: cyc += 4; z->l = dec(z, z->l); break; // dec l
-  case 0x35: {
+  } NEXT; // inc (hl)
+
+  OPCODE(0x3D) cyc += 4; z->a = dec(z, z->a); NEXT; // dec a
+  OPCODE(0x05) cyc += 4; z->b = dec(z, z->b); NEXT; // dec b
+  OPCODE(0x0D) cyc += 4; z->c = dec(z, z->c); NEXT; // dec c
+  OPCODE(0x15) cyc += 4; z->d = dec(z, z->d); NEXT; // dec d
+  OPCODE(0x1D) cyc += 4; z->e = dec(z, z->e); NEXT; // dec e
+  OPCODE(0x25) cyc += 4; z->h = dec(z, z->h); NEXT; // dec h
+  OPCODE(0x2D) cyc += 4; z->l = dec(z, z->l); NEXT; // dec l
+  OPCODE(0x35) {
     cyc += 11;
     uint8_t result = dec(z, rb(z, z->hl));
     wb(z, z->hl, result);
-  } break; // dec (hl)
+  } NEXT; // dec (hl)
 
-  case 0x03: cyc += 6; ++z->bc; break; // inc bc
-  case 0x13: cyc += 6; ++z->de; break; // inc de
-  case 0x23: cyc += 6; ++z->hl; break; // inc hl
-  case 0x33: cyc += 6; ++z->sp; break; // inc sp
+  OPCODE(0x03) cyc += 6; ++z->bc; NEXT; // inc bc
+  OPCODE(0x13) cyc += 6; ++z->de; NEXT; // inc de
+  OPCODE(0x23) cyc += 6; ++z->hl; NEXT; // inc hl
+  OPCODE(0x33) cyc += 6; ++z->sp; NEXT; // inc sp
 
-  case 0x0B: cyc += 6; --z->bc; break; // dec bc
-  case 0x1B: cyc += 6; --z->de; break; // dec de
-  case 0x2B: cyc += 6; --z->hl; break; // dec hl
-  case 0x3B: cyc += 6; --z->sp; break; // dec sp
+  OPCODE(0x0B) cyc += 6; --z->bc; NEXT; // dec bc
+  OPCODE(0x1B) cyc += 6; --z->de; NEXT; // dec de
+  OPCODE(0x2B) cyc += 6; --z->hl; NEXT; // dec hl
+  OPCODE(0x3B) cyc += 6; --z->sp; NEXT; // dec sp
 
-  case 0x27: cyc += 4; daa(z); break; // daa
+  OPCODE(0x27) cyc += 4; daa(z); NEXT; // daa
 
-  case 0x2F:
+  OPCODE(0x2F)
     cyc += 4;
     z->a = ~z->a;
     flag_set(z, nf, 1);
     flag_set(z, hf, 1);
     flag_set(z, xf, GET_BIT(3, z->a));
     flag_set(z, yf, GET_BIT(5, z->a));
-    break; // cpl
+    NEXT; // cpl
 
-  case 0x37:
+  OPCODE(0x37)
     cyc += 4;
     flag_set(z, cf, 1);
     flag_set(z, nf, 0);
     flag_set(z, hf, 0);
     flag_set(z, xf, GET_BIT(3, z->a));
     flag_set(z, yf, GET_BIT(5, z->a));
-    break; // scf
+    NEXT; // scf
 
-  case 0x3F:
+  OPCODE(0x3F)
     cyc += 4;
     flag_set(z, hf, flag_get(z, cf));
     flag_set(z, cf, !flag_get(z, cf));
     flag_set(z, nf, 0);
     flag_set(z, xf, GET_BIT(3, z->a));
     flag_set(z, yf, GET_BIT(5, z->a));
-    break; // ccf
+    NEXT; // ccf
 
-  case 0x07:
+  OPCODE(0x07)
     cyc += 4; {
     flag_set(z, cf, z->a >> 7);
     z->a = (z->a << 1) | flag_get(z, cf);
@@ -1577,9 +1974,9 @@ static unsigned exec_opcode(z80* const z, uint8_t opcode) {
     flag_set(z, hf, 0);
     flag_set(z, xf, GET_BIT(3, z->a));
     flag_set(z, yf, GET_BIT(5, z->a));
-  } break; // rlca (rotate left)
+  } NEXT; // rlca (rotate left)
 
-  case 0x0F: {
+  OPCODE(0x0F) {
     cyc += 4;
     flag_set(z, cf, z->a & 1);
     z->a = (z->a >> 1) | (flag_get(z, cf) << 7);
@@ -1587,9 +1984,9 @@ static unsigned exec_opcode(z80* const z, uint8_t opcode) {
     flag_set(z, hf, 0);
     flag_set(z, xf, GET_BIT(3, z->a));
     flag_set(z, yf, GET_BIT(5, z->a));
-  } break; // rrca (rotate right)
+  } NEXT; // rrca (rotate right)
 
-  case 0x17: {
+  OPCODE(0x17) {
     cyc += 4;
     const bool cy = flag_get(z, cf);
     flag_set(z, cf, z->a >> 7);
@@ -1598,9 +1995,9 @@ static unsigned exec_opcode(z80* const z, uint8_t opcode) {
     flag_set(z, hf, 0);
     flag_set(z, xf, GET_BIT(3, z->a));
     flag_set(z, yf, GET_BIT(5, z->a));
-  } break; // rla
+  } NEXT; // rla
 
-  case 0x1F: {
+  OPCODE(0x1F) {
     cyc += 4;
     const bool cy = flag_get(z, cf);
     flag_set(z, cf, z->a & 1);
@@ -1609,127 +2006,127 @@ static unsigned exec_opcode(z80* const z, uint8_t opcode) {
     flag_set(z, hf, 0);
     flag_set(z, xf, GET_BIT(3, z->a));
     flag_set(z, yf, GET_BIT(5, z->a));
-  } break; // rra
-
-  case 0xA7: cyc += 4; land(z, z->a); break; // and a
-  case 0xA0: cyc += 4; land(z, z->b); break; // and b
-  case 0xA1: cyc += 4; land(z, z->c); break; // and c
-  case 0xA2: cyc += 4; land(z, z->d); break; // and d
-  case 0xA3: cyc += 4; land(z, z->e); break; // and e
-  case 0xA4: cyc += 4; land(z, z->h); break; // and h
-  case 0xA5: cyc += 4; land(z, z->l); break; // and l
-  case 0xA6: cyc += 7; land(z, rb(z, z->hl)); break; // and (hl)
-  case 0xE6: cyc += 7; land(z, nextb(z)); break; // and *
-
-  case 0xAF: cyc += 4; lxor(z, z->a); break; // xor a
-  case 0xA8: cyc += 4; lxor(z, z->b); break; // xor b
-  case 0xA9: cyc += 4; lxor(z, z->c); break; // xor c
-  case 0xAA: cyc += 4; lxor(z, z->d); break; // xor d
-  case 0xAB: cyc += 4; lxor(z, z->e); break; // xor e
-  case 0xAC: cyc += 4; lxor(z, z->h); break; // xor h
-  case 0xAD: cyc += 4; lxor(z, z->l); break; // xor l
-  case 0xAE: cyc += 7; lxor(z, rb(z, z->hl)); break; // xor (hl)
-  case 0xEE: cyc += 7; lxor(z, nextb(z)); break; // xor *
-
-  case 0xB7: cyc += 4; lor(z, z->a); break; // or a
-  case 0xB0: cyc += 4; lor(z, z->b); break; // or b
-  case 0xB1: cyc += 4; lor(z, z->c); break; // or c
-  case 0xB2: cyc += 4; lor(z, z->d); break; // or d
-  case 0xB3: cyc += 4; lor(z, z->e); break; // or e
-  case 0xB4: cyc += 4; lor(z, z->h); break; // or h
-  case 0xB5: cyc += 4; lor(z, z->l); break; // or l
-  case 0xB6: cyc += 7; lor(z, rb(z, z->hl)); break; // or (hl)
-  case 0xF6: cyc += 7; lor(z, nextb(z)); break; // or *
-
-  case 0xBF: cyc += 4; cp(z, z->a); break; // cp a
-  case 0xB8: cyc += 4; cp(z, z->b); break; // cp b
-  case 0xB9: cyc += 4; cp(z, z->c); break; // cp c
-  case 0xBA: cyc += 4; cp(z, z->d); break; // cp d
-  case 0xBB: cyc += 4; cp(z, z->e); break; // cp e
-  case 0xBC: cyc += 4; cp(z, z->h); break; // cp h
-  case 0xBD: cyc += 4; cp(z, z->l); break; // cp l
-  case 0xBE: cyc += 7; cp(z, rb(z, z->hl)); break; // cp (hl)
-  case 0xFE: cyc += 7; cp(z, nextb(z)); break; // cp *
-
-  case 0xC3: cyc += 10; jump(z, nextw(z)); break; // jm **
-  case 0xC2: cyc += 10; cond_jump(z, flag_get(z, zf) == 0); break; // jp nz, **
-  case 0xCA: cyc += 10; cond_jump(z, flag_get(z, zf) == 1); break; // jp z, **
-  case 0xD2: cyc += 10; cond_jump(z, flag_get(z, cf) == 0); break; // jp nc, **
-  case 0xDA: cyc += 10; cond_jump(z, flag_get(z, cf) == 1); break; // jp c, **
-  case 0xE2: cyc += 10; cond_jump(z, flag_get(z, pf) == 0); break; // jp po, **
-  case 0xEA: cyc += 10; cond_jump(z, flag_get(z, pf) == 1); break; // jp pe, **
-  case 0xF2: cyc += 10; cond_jump(z, flag_get(z, sf) == 0); break; // jp p, **
-  case 0xFA: cyc += 10; cond_jump(z, flag_get(z, sf) == 1); break; // jp m, **
-
-  case 0x10: cyc += 8; cyc += cond_jr(z, --z->b != 0); break; // djnz *
-  case 0x18: cyc += 12; jr(z, nextb(z)); break; // jr *
-  case 0x20: cyc += 7; cyc += cond_jr(z, flag_get(z, zf) == 0); break; // jr nz, *
-  case 0x28: cyc += 7; cyc += cond_jr(z, flag_get(z, zf) == 1); break; // jr z, *
-  case 0x30: cyc += 7; cyc += cond_jr(z, flag_get(z, cf) == 0); break; // jr nc, *
-  case 0x38: cyc += 7; cyc += cond_jr(z, flag_get(z, cf) == 1); break; // jr c, *
-
-  case 0xE9: cyc += 4; z->pc = z->hl; break; // jp (hl)
-  case 0xCD: cyc += 17; call(z, nextw(z)); break; // call
-
-  case 0xC4: cyc += 10; cyc += cond_call(z, flag_get(z, zf) == 0); break; // cnz
-  case 0xCC: cyc += 10; cyc += cond_call(z, flag_get(z, zf) == 1); break; // cz
-  case 0xD4: cyc += 10; cyc += cond_call(z, flag_get(z, cf) == 0); break; // cnc
-  case 0xDC: cyc += 10; cyc += cond_call(z, flag_get(z, cf) == 1); break; // cc
-  case 0xE4: cyc += 10; cyc += cond_call(z, flag_get(z, pf) == 0); break; // cpo
-  case 0xEC: cyc += 10; cyc += cond_call(z, flag_get(z, pf) == 1); break; // cpe
-  case 0xF4: cyc += 10; cyc += cond_call(z, flag_get(z, sf) == 0); break; // cp
-  case 0xFC: cyc += 10; cyc += cond_call(z, flag_get(z, sf) == 1); break; // cm
-
-  case 0xC9: cyc += 10; ret(z); break; // ret
-  case 0xC0: cyc += 5; cyc += cond_ret(z, flag_get(z, zf) == 0); break; // ret nz
-  case 0xC8: cyc += 5; cyc += cond_ret(z, flag_get(z, zf) == 1); break; // ret z
-  case 0xD0: cyc += 5; cyc += cond_ret(z, flag_get(z, cf) == 0); break; // ret nc
-  case 0xD8: cyc += 5; cyc += cond_ret(z, flag_get(z, cf) == 1); break; // ret c
-  case 0xE0: cyc += 5; cyc += cond_ret(z, flag_get(z, pf) == 0); break; // ret po
-  case 0xE8: cyc += 5; cyc += cond_ret(z, flag_get(z, pf) == 1); break; // ret pe
-  case 0xF0: cyc += 5; cyc += cond_ret(z, flag_get(z, sf) == 0); break; // ret p
-  case 0xF8: cyc += 5; cyc += cond_ret(z, flag_get(z, sf) == 1); break; // ret m
-
-  case 0xC7: cyc += 11; call(z, 0x00); break; // rst 0
-  case 0xCF: cyc += 11; call(z, 0x08); break; // rst 1
-  case 0xD7: cyc += 11; call(z, 0x10); break; // rst 2
-  case 0xDF: cyc += 11; call(z, 0x18); break; // rst 3
-  case 0xE7: cyc += 11; call(z, 0x20); break; // rst 4
-  case 0xEF: cyc += 11; call(z, 0x28); break; // rst 5
-  case 0xF7: cyc += 11; call(z, 0x30); break; // rst 6
-  case 0xFF: cyc += 11; call(z, 0x38); break; // rst 7
-
-  case 0xC5: cyc += 11; pushw(z, z->bc); break; // push bc
-  case 0xD5: cyc += 11; pushw(z, z->de); break; // push de
-  case 0xE5: cyc += 11; pushw(z, z->hl); break; // push hl
-  case 0xF5: cyc += 11; pushw(z, z->af); break; // push af
-
-  case 0xC1: cyc += 10; z->bc = popw(z); break; // pop bc
-  case 0xD1: cyc += 10; z->de = popw(z); break; // pop de
-  case 0xE1: cyc += 10; z->hl = popw(z); break; // pop hl
-  case 0xF1: cyc += 10; z->af = popw(z); break; // pop af
-
-  case 0xDB: {
+  } NEXT; // rra
+
+  OPCODE(0xA7) cyc += 4; land(z, z->a); NEXT; // and a
+  OPCODE(0xA0) cyc += 4; land(z, z->b); NEXT; // and b
+  OPCODE(0xA1) cyc += 4; land(z, z->c); NEXT; // and c
+  OPCODE(0xA2) cyc += 4; land(z, z->d); NEXT; // and d
+  OPCODE(0xA3) cyc += 4; land(z, z->e); NEXT; // and e
+  OPCODE(0xA4) cyc += 4; land(z, z->h); NEXT; // and h
+  OPCODE(0xA5) cyc += 4; land(z, z->l); NEXT; // and l
+  OPCODE(0xA6) cyc += 7; land(z, rb(z, z->hl)); NEXT; // and (hl)
+  OPCODE(0xE6) cyc += 7; land(z, nextb(z)); NEXT; // and *
+
+  OPCODE(0xAF) cyc += 4; lxor(z, z->a); NEXT; // xor a
+  OPCODE(0xA8) cyc += 4; lxor(z, z->b); NEXT; // xor b
+  OPCODE(0xA9) cyc += 4; lxor(z, z->c); NEXT; // xor c
+  OPCODE(0xAA) cyc += 4; lxor(z, z->d); NEXT; // xor d
+  OPCODE(0xAB) cyc += 4; lxor(z, z->e); NEXT; // xor e
+  OPCODE(0xAC) cyc += 4; lxor(z, z->h); NEXT; // xor h
+  OPCODE(0xAD) cyc += 4; lxor(z, z->l); NEXT; // xor l
+  OPCODE(0xAE) cyc += 7; lxor(z, rb(z, z->hl)); NEXT; // xor (hl)
+  OPCODE(0xEE) cyc += 7; lxor(z, nextb(z)); NEXT; // xor *
+
+  OPCODE(0xB7) cyc += 4; lor(z, z->a); NEXT; // or a
+  OPCODE(0xB0) cyc += 4; lor(z, z->b); NEXT; // or b
+  OPCODE(0xB1) cyc += 4; lor(z, z->c); NEXT; // or c
+  OPCODE(0xB2) cyc += 4; lor(z, z->d); NEXT; // or d
+  OPCODE(0xB3) cyc += 4; lor(z, z->e); NEXT; // or e
+  OPCODE(0xB4) cyc += 4; lor(z, z->h); NEXT; // or h
+  OPCODE(0xB5) cyc += 4; lor(z, z->l); NEXT; // or l
+  OPCODE(0xB6) cyc += 7; lor(z, rb(z, z->hl)); NEXT; // or (hl)
+  OPCODE(0xF6) cyc += 7; lor(z, nextb(z)); NEXT; // or *
+
+  OPCODE(0xBF) cyc += 4; cp(z, z->a); NEXT; // cp a
+  OPCODE(0xB8) cyc += 4; cp(z, z->b); NEXT; // cp b
+  OPCODE(0xB9) cyc += 4; cp(z, z->c); NEXT; // cp c
+  OPCODE(0xBA) cyc += 4; cp(z, z->d); NEXT; // cp d
+  OPCODE(0xBB) cyc += 4; cp(z, z->e); NEXT; // cp e
+  OPCODE(0xBC) cyc += 4; cp(z, z->h); NEXT; // cp h
+  OPCODE(0xBD) cyc += 4; cp(z, z->l); NEXT; // cp l
+  OPCODE(0xBE) cyc += 7; cp(z, rb(z, z->hl)); NEXT; // cp (hl)
+  OPCODE(0xFE) cyc += 7; cp(z, nextb(z)); NEXT; // cp *
+
+  OPCODE(0xC3) cyc += 10; jump(z, nextw(z)); NEXT_JUMP; // jm **
+  OPCODE(0xC2) cyc += 10; cond_jump(z, flag_get(z, zf) == 0); NEXT_JUMP; // jp nz, **
+  OPCODE(0xCA) cyc += 10; cond_jump(z, flag_get(z, zf) == 1); NEXT_JUMP; // jp z, **
+  OPCODE(0xD2) cyc += 10; cond_jump(z, flag_get(z, cf) == 0); NEXT_JUMP; // jp nc, **
+  OPCODE(0xDA) cyc += 10; cond_jump(z, flag_get(z, cf) == 1); NEXT_JUMP; // jp c, **
+  OPCODE(0xE2) cyc += 10; cond_jump(z, flag_get(z, pf) == 0); NEXT_JUMP; // jp po, **
+  OPCODE(0xEA) cyc += 10; cond_jump(z, flag_get(z, pf) == 1); NEXT_JUMP; // jp pe, **
+  OPCODE(0xF2) cyc += 10; cond_jump(z, flag_get(z, sf) == 0); NEXT_JUMP; // jp p, **
+  OPCODE(0xFA) cyc += 10; cond_jump(z, flag_get(z, sf) == 1); NEXT_JUMP; // jp m, **
+
+  OPCODE(0x10) cyc += 8; cyc += cond_jr(z, --z->b != 0); NEXT; // djnz *
+  OPCODE(0x18) cyc += 12; jr(z, nextb(z)); NEXT_JUMP; // jr *
+  OPCODE(0x20) cyc += 7; cyc += cond_jr(z, flag_get(z, zf) == 0); NEXT_JUMP; // jr nz, *
+  OPCODE(0x28) cyc += 7; cyc += cond_jr(z, flag_get(z, zf) == 1); NEXT_JUMP; // jr z, *
+  OPCODE(0x30) cyc += 7; cyc += cond_jr(z, flag_get(z, cf) == 0); NEXT_JUMP; // jr nc, *
+  OPCODE(0x38) cyc += 7; cyc += cond_jr(z, flag_get(z, cf) == 1); NEXT_JUMP; // jr c, *
+
+  OPCODE(0xE9) cyc += 4; z->pc = z->hl; NEXT; // jp (hl)
+  OPCODE(0xCD) cyc += 17; call(z, nextw(z)); NEXT; // call
+
+  OPCODE(0xC4) cyc += 10; cyc += cond_call(z, flag_get(z, zf) == 0); NEXT; // cnz
+  OPCODE(0xCC) cyc += 10; cyc += cond_call(z, flag_get(z, zf) == 1); NEXT; // cz
+  OPCODE(0xD4) cyc += 10; cyc += cond_call(z, flag_get(z, cf) == 0); NEXT; // cnc
+  OPCODE(0xDC) cyc += 10; cyc += cond_call(z, flag_get(z, cf) == 1); NEXT; // cc
+  OPCODE(0xE4) cyc += 10; cyc += cond_call(z, flag_get(z, pf) == 0); NEXT; // cpo
+  OPCODE(0xEC) cyc += 10; cyc += cond_call(z, flag_get(z, pf) == 1); NEXT; // cpe
+  OPCODE(0xF4) cyc += 10; cyc += cond_call(z, flag_get(z, sf) == 0); NEXT; // cp
+  OPCODE(0xFC) cyc += 10; cyc += cond_call(z, flag_get(z, sf) == 1); NEXT; // cm
+
+  OPCODE(0xC9) cyc += 10; ret(z); NEXT; // ret
+  OPCODE(0xC0) cyc += 5; cyc += cond_ret(z, flag_get(z, zf) == 0); NEXT; // ret nz
+  OPCODE(0xC8) cyc += 5; cyc += cond_ret(z, flag_get(z, zf) == 1); NEXT; // ret z
+  OPCODE(0xD0) cyc += 5; cyc += cond_ret(z, flag_get(z, cf) == 0); NEXT; // ret nc
+  OPCODE(0xD8) cyc += 5; cyc += cond_ret(z, flag_get(z, cf) == 1); NEXT; // ret c
+  OPCODE(0xE0) cyc += 5; cyc += cond_ret(z, flag_get(z, pf) == 0); NEXT; // ret po
+  OPCODE(0xE8) cyc += 5; cyc += cond_ret(z, flag_get(z, pf) == 1); NEXT; // ret pe
+  OPCODE(0xF0) cyc += 5; cyc += cond_ret(z, flag_get(z, sf) == 0); NEXT; // ret p
+  OPCODE(0xF8) cyc += 5; cyc += cond_ret(z, flag_get(z, sf) == 1); NEXT; // ret m
+
+  OPCODE(0xC7) cyc += 11; call(z, 0x00); NEXT; // rst 0
+  OPCODE(0xCF) cyc += 11; call(z, 0x08); NEXT; // rst 1
+  OPCODE(0xD7) cyc += 11; call(z, 0x10); NEXT; // rst 2
+  OPCODE(0xDF) cyc += 11; call(z, 0x18); NEXT; // rst 3
+  OPCODE(0xE7) cyc += 11; call(z, 0x20); NEXT; // rst 4
+  OPCODE(0xEF) cyc += 11; call(z, 0x28); NEXT; // rst 5
+  OPCODE(0xF7) cyc += 11; call(z, 0x30); NEXT; // rst 6
+  OPCODE(0xFF) cyc += 11; call(z, 0x38); NEXT; // rst 7
+
+  OPCODE(0xC5) cyc += 11; pushw(z, z->bc); NEXT; // push bc
+  OPCODE(0xD5) cyc += 11; pushw(z, z->de); NEXT; // push de
+  OPCODE(0xE5) cyc += 11; pushw(z, z->hl); NEXT; // push hl
+  OPCODE(0xF5) cyc += 11; pushw(z, z->af); NEXT; // push af
+
+  OPCODE(0xC1) cyc += 10; z->bc = popw(z); NEXT; // pop bc
+  OPCODE(0xD1) cyc += 10; z->de = popw(z); NEXT; // pop de
+  OPCODE(0xE1) cyc += 10; z->hl = popw(z); NEXT; // pop hl
+  OPCODE(0xF1) cyc += 10; z->af = popw(z); NEXT; // pop af
+
+  OPCODE(0xDB) {
     cyc += 11;
     const uint16_t port = nextb(z) | (z->a << 8);
     z->a = z->port_in(z, port);
     z->mem_ptr = port + 1;
-  } break; // in a,(n)
+  } NEXT; // in a,(n)
 
-  case 0xD3: {
+  OPCODE(0xD3) {
     cyc += 11;
     const uint16_t port = nextb(z) | (z->a << 8);
     z->port_out(z, port, z->a);
     z->mem_ptr = ((port + 1) & 0xff) | (z->a << 8);
-  } break; // out (n), a
+  } NEXT; // out (n), a
 
-  case 0x08: {
+  OPCODE(0x08) {
     cyc += 4;
     uint16_t af = z->af;
     z->af = z->a_f_;
     z->a_f_ = af;
-  } break; // ex af,af'
-  case 0xD9: {
+  } NEXT; // ex af,af'
+  OPCODE(0xD9) {
     cyc += 4;
     uint16_t bc = z->bc, de = z->de, hl = z->hl;
 
@@ -1740,18 +2137,28 @@ static unsigned exec_opcode(z80* const z, uint8_t opcode) {
     z->b_c_ = bc;
     z->d_e_ = de;
     z->h_l_ = hl;
-  } break; // exx
+  } NEXT; // exx
 
-  case 0xCB: cyc += 0; cyc += exec_opcode_cb(z, nextb(z)); break;
-  case 0xED: cyc += 0; cyc += exec_opcode_ed(z, nextb(z)); break;
-  case 0xDD: cyc += 0; cyc += exec_opcode_ddfd(z, nextb(z), &z->ix); break;
-  case 0xFD: cyc += 0; cyc += exec_opcode_ddfd(z, nextb(z), &z->iy); break;
-
-  default: break; // fprintf(stderr, "unknown opcode %02X\n", opcode); break;
+  OPCODE(0xCB) cyc += 0; cyc += exec_opcode_cb(z, nextb(z)); NEXT;
+  OPCODE(0xED) cyc += 0; cyc += exec_opcode_ed(z, nextb(z)); NEXT;
+  OPCODE(0xDD) cyc += 0; cyc += exec_opcode_ddfd(z, nextb(z), &z->ix); NEXT;
+  OPCODE(0xFD) cyc += 0; cyc += exec_opcode_ddfd(z, nextb(z), &z->iy); NEXT;
+#ifndef Z80_THREADED
   }
+#endif
   return cyc;
 }
 
+#undef OPCODE
+#undef TAIL
+#undef NEXT
+#undef NEXT_JUMP
+#undef NEXT_HALT
+
+static unsigned exec_opcode(z80* const z, uint8_t opcode) {
+  return exec_main(z, opcode, NULL, NULL);
+}
+
 // executes a DD/FD opcode (IZ = IX or IY)
 static unsigned exec_opcode_ddfd(z80* const z, uint8_t opcode, uint16_t* const iz) {
   unsigned cyc = 0;
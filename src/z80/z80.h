@@ -50,6 +50,14 @@ struct z80 {
   uint8_t nmi_pending;
   bool iff1 : 1, iff2 : 1;
   bool halted : 1;
+
+  // idle loop detection in z80_run, which is not part of the machine state
+  bool idle_valid : 1;
+  uint8_t idle_r, idle_n; // R increments and instructions in each pass
+  uint16_t idle_pc, idle_target; // the loop's jump, and where it jumps to
+  uint16_t idle_cyc; // cycles in each pass, or 0 if the loop is not idle
+  uint16_t idle_regs[5]; // registers when the last pass completed
+  uint32_t idle_at; // cycle count when the last pass completed
 };
 
 Z80_EXPORT void z80_init(z80* const z);
@@ -58,6 +66,8 @@ Z80_EXPORT void z80_set_pc(z80* const z, uint16_t pc);
 Z80_EXPORT void z80_set_sp(z80* const z, uint16_t sp);
 Z80_EXPORT unsigned z80_step(z80* const z); /* return cycles used */
 Z80_EXPORT unsigned z80_step_n(z80* const z, unsigned cycles);
+Z80_EXPORT void z80_run(z80* const z, uint32_t* const cycles,
+    const uint32_t* const limit);
 Z80_EXPORT void z80_debug_output(z80* const z);
 Z80_EXPORT void z80_assert_nmi(z80* const z);
 Z80_EXPORT void z80_pulse_nmi(z80* const z);